@@ -0,0 +1,650 @@
+
+
+#ifndef ASSET_LOADER_H
+#define ASSET_LOADER_H
+
+#include <glad/glad.h>
+
+#include <job_system.h>
+#include <texture_upload.h>
+#include <heightmap_file.h>
+#include <ktx_file.h>
+#include <pixel_cache.h>
+#include <png_stream.h>
+#include <process_memory.h>
+#include <tile_fetch.h>
+
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// bytes per channel of the pixel types images are decoded to
+inline size_t dataTypeBytes(GLenum type)
+{
+    if (type == GL_UNSIGNED_SHORT)
+        return 2;
+    if (type == GL_FLOAT)
+        return 4;
+    return 1;
+}
+
+// An image decoded on a worker thread, handed to the GL thread for upload. The pixels either sit in the
+// staging ring of an UploadService (staging is valid, pixels is null) or in client memory.
+struct DecodedImage {
+    std::string path;
+    int width;
+    int height;
+    int channels;           // channels in pixels, after conversion to the requested count
+    unsigned int levels;    // mip levels stored back to back, 1 = base level only
+    GLenum compressedFormat; // 0 for uncompressed pixels, else the block compressed format of a .ktx file
+    GLenum dataType;        // of uncompressed pixels, 16 bit and float only come from heightmap containers
+    const unsigned char *pixels; // client memory, kept alive by storage
+    std::shared_ptr<const void> storage; // stb_image result, heap buffer or mapped cache file
+    StagingBlock staging;
+    std::shared_ptr<const void> stagingLease; // releases staging with the last copy of the image
+    bool cached;            // came from the pixel cache
+    bool heightmap;         // came from a heightmap container
+
+    DecodedImage() : width(0), height(0), channels(0), levels(1), compressedFormat(0), dataType(GL_UNSIGNED_BYTE),
+                     pixels(0), cached(false), heightmap(false)
+    {
+    }
+
+    // false if decoding failed
+    bool Valid() const { return pixels != 0 || staging.Valid(); }
+
+    size_t LevelSize(unsigned int level) const
+    {
+        int levelWidth = std::max(width >> level, 1);
+        int levelHeight = std::max(height >> level, 1);
+        if (compressedFormat)
+            return compressedLevelSize(compressedFormat, levelWidth, levelHeight);
+        return (size_t)levelWidth * levelHeight * channels * dataTypeBytes(dataType);
+    }
+
+    // where level starts in pixels or staging
+    size_t LevelOffset(unsigned int level) const
+    {
+        size_t offset = 0;
+        for (unsigned int l = 0; l < level; l++)
+            offset += LevelSize(l);
+        return offset;
+    }
+
+    size_t Size() const { return LevelOffset(levels); }
+
+    // drops this copy's hold on the pixels, the staging block is released once no copy holds it
+    void Free()
+    {
+        storage.reset();
+        pixels = 0;
+        stagingLease.reset();
+        staging = StagingBlock();
+    }
+};
+
+// heap buffer for pixels, freed with the last copy of the image
+inline unsigned char *allocatePixels(DecodedImage &image, size_t size)
+{
+    unsigned char *data = new unsigned char[size];
+    image.storage.reset(data, std::default_delete<unsigned char[]>());
+    image.pixels = data;
+    return data;
+}
+
+// hands a staging block to an image, the block goes back to the ring with the image's last copy
+inline void setStaging(DecodedImage &image, const StagingBlock &block)
+{
+    image.staging = block;
+    image.stagingLease.reset(block.ptr, [block](const void *) { block.service->Release(block); });
+}
+
+// moves the client memory levels of an image into the staging ring, if it has room
+inline void stageImage(DecodedImage &image, UploadService *uploads)
+{
+    if (!uploads || !uploads->Enabled() || !image.pixels)
+        return;
+    size_t size = image.Size();
+    StagingBlock block = uploads->Allocate(size);
+    if (!block.Valid())
+    {
+        uploads->CountFallback(size);
+        return;
+    }
+    memcpy(block.ptr, image.pixels, size);
+    image.storage.reset();
+    image.pixels = 0;
+    setStaging(image, block);
+}
+
+// Reads the compressed levels of a .ktx file, straight into the staging ring if there is room for them.
+// Fails if the file does not exist or the driver does not support its format.
+inline bool readCompressedImage(const std::string &path, UploadService *uploads, DecodedImage &image)
+{
+    KtxReader reader;
+    if (!reader.Open(path) || !CompressedFormats::Supports(reader.Info().internalFormat))
+        return false;
+    const KtxInfo &info = reader.Info();
+    StagingBlock block = uploads ? uploads->Allocate(info.dataSize) : StagingBlock();
+    unsigned char *data = block.Valid() ? block.ptr : allocatePixels(image, info.dataSize);
+    if (!reader.ReadLevels(data))
+    {
+        image.Free();
+        if (block.Valid())
+            uploads->Release(block);
+        return false;
+    }
+    if (uploads && !block.Valid())
+        uploads->CountFallback(info.dataSize);
+
+    image.width = info.width;
+    image.height = info.height;
+    image.channels = compressedChannels(info.internalFormat);
+    image.levels = info.levels;
+    image.compressedFormat = info.internalFormat;
+    if (block.Valid())
+        setStaging(image, block);
+    return true;
+}
+
+// Decodes the heightmap container at path (see heightmap_file.h) to one channel, straight into the staging
+// ring if there is room, tiles in parallel on jobs when given. 8 bit maps get their mip chain from a
+// MipChainWriter fed one row of tiles at a time, 16 bit and float maps come as their base level only and are
+// mipped by the driver. Fails if the file does not exist or more than one channel is requested.
+inline bool readHeightmapImage(const std::string &path, int desiredChannels, bool mipmaps, UploadService *uploads,
+                               JobSystem *jobs, DecodedImage &image)
+{
+    HeightmapReader reader;
+    if (desiredChannels > 1 || !reader.Open(path))
+        return false;
+    const HeightmapInfo &info = reader.Info();
+    DecodedImage decoded;
+    decoded.path = image.path;
+    decoded.width = info.width;
+    decoded.height = info.height;
+    decoded.channels = 1;
+    decoded.dataType = info.format == HEIGHT_U8 ? GL_UNSIGNED_BYTE : (info.format == HEIGHT_U16 ? GL_UNSIGNED_SHORT : GL_FLOAT);
+    decoded.levels = mipmaps && info.format == HEIGHT_U8 ? mipLevelCount(info.width, info.height) : 1;
+    decoded.heightmap = true;
+
+    size_t size = decoded.Size();
+    bool staging = uploads && uploads->Enabled();
+    StagingBlock block = staging ? uploads->Allocate(size) : StagingBlock();
+    if (staging && !block.Valid())
+        uploads->CountFallback(size);
+    unsigned char *dst = block.Valid() ? block.ptr : allocatePixels(decoded, size);
+
+    bool ok = true;
+    if (decoded.levels == 1)
+        ok = reader.Decode(dst, jobs);
+    else
+    {
+        std::vector<unsigned char> band((size_t)info.tileSize * info.width);
+        MipChainWriter chain(info.width, info.height, 1, decoded.levels, dst);
+        for (int ty = 0; ok && ty < info.tilesY; ty++)
+        {
+            ok = reader.DecodeTileRows(ty, ty + 1, &band[0], info.width, jobs);
+            int rows = std::min(info.tileSize, info.height - ty * info.tileSize);
+            for (int y = 0; ok && y < rows; y++)
+                chain.AddRow(&band[(size_t)y * info.width]);
+        }
+    }
+    if (!ok)
+    {
+        if (block.Valid())
+            uploads->Release(block);
+        return false;
+    }
+    if (block.Valid())
+        setStaging(decoded, block);
+    image = decoded;
+    return true;
+}
+
+// Decodes a PNG row by row with PngStreamDecoder. Rows are converted to the requested channel count as they
+// come out of the decoder and go, together with the mip chain built from them, straight into staging memory
+// (a heap buffer only if the ring is full or off) and, with an enabled cache, into the file of its new entry.
+// Neither the decoded image nor the inflated data ever exist as a whole in client memory beyond that.
+// False for files the decoder does not handle.
+inline bool decodePngRows(const std::string &path, int desiredChannels, bool mipmaps, UploadService *uploads,
+                          PixelCache *cache, const PixelCacheKey &key, DecodedImage &image)
+{
+    PngStreamDecoder png;
+    if (!png.Open(path) || !png.Supported())
+        return false;
+    const PngInfo &info = png.Info();
+    int channels = desiredChannels != 0 ? desiredChannels : info.channels;
+    unsigned int levels = mipmaps ? mipLevelCount(info.width, info.height) : 1;
+    size_t size = mipChainSize(info.width, info.height, channels, levels);
+
+    bool staging = uploads && uploads->Enabled();
+    StagingBlock block = staging ? uploads->Allocate(size) : StagingBlock();
+    if (staging && !block.Valid())
+        uploads->CountFallback(size);
+    DecodedImage decoded;
+    decoded.path = path;
+    unsigned char *dst = block.Valid() ? block.ptr : allocatePixels(decoded, size);
+
+    PixelCacheWriter entry;
+    MipChainWriter::RowFn written;
+    if (cache && cache->Begin(key, info.width, info.height, channels, levels, size, entry))
+        written = [&entry](size_t offset, const unsigned char *row, size_t bytes) { entry.Write(offset, row, bytes); };
+    MipChainWriter chain(info.width, info.height, channels, levels, dst, written);
+    if (!png.Decode(desiredChannels, [&chain](const unsigned char *row, int) { chain.AddRow(row); }))
+    {
+        if (block.Valid())
+            uploads->Release(block);
+        return false;
+    }
+    decoded.width = info.width;
+    decoded.height = info.height;
+    decoded.channels = channels;
+    decoded.levels = levels;
+    if (block.Valid())
+        setStaging(decoded, block);
+    if (written)
+        cache->Finish(entry);
+    image = decoded;
+    return true;
+}
+
+// Decodes an image with stbi_load (desiredChannels = 0 keeps the file's channel count). If uploads is given
+// and its ring has room, the image is copied into staging memory together with its mip chain when mipmaps
+// is set, so that the GL thread only has to issue the uploads. Safe to call from any thread.
+// With allowCompressed a block compressed .ktx file next to the image (see ktxPathFor()) is used instead,
+// with the levels it was written with and the channel count of its format, and so is a heightmap container
+// (see heightmapPathFor()) for single channel requests, decoded on jobs when given.
+// With a cache the decoded levels are taken from, or written to, the pixel cache; hits are copied from the
+// mapped cache file into staging memory (or uploaded from the mapping directly) without decoding.
+// PNGs are streamed row by row with decodePngRows(), stb_image only handles the files it does not support.
+inline DecodedImage decodeImage(const std::string &path, int desiredChannels, bool mipmaps, UploadService *uploads,
+                                bool allowCompressed = true, PixelCache *cache = nullptr, JobSystem *jobs = nullptr)
+{
+    DecodedImage image;
+    image.path = path;
+    if (allowCompressed && readCompressedImage(ktxPathFor(path), uploads, image))
+        return image;
+    if (allowCompressed && readHeightmapImage(heightmapPathFor(path), desiredChannels, mipmaps, uploads, jobs, image))
+        return image;
+
+    PixelCacheKey key;
+    key.path = path;
+    key.channels = desiredChannels;
+    key.mipmaps = mipmaps;
+    CachedPixels cached;
+    if (cache && cache->Lookup(key, cached))
+    {
+        image.width = cached.width;
+        image.height = cached.height;
+        image.channels = cached.channels;
+        image.levels = cached.levels;
+        image.pixels = cached.pixels;
+        image.storage = cached.mapping;
+        image.cached = true;
+        stageImage(image, uploads);
+        return image;
+    }
+
+    if (decodePngRows(path, desiredChannels, mipmaps, uploads, cache, key, image))
+        return image;
+
+    unsigned char *decoded = stbi_load(path.c_str(), &image.width, &image.height, &image.channels, desiredChannels);
+    if (!decoded)
+        return image;
+    image.storage.reset(decoded, stbi_image_free);
+    image.pixels = decoded;
+    if (desiredChannels != 0)
+        image.channels = desiredChannels;
+    unsigned int levels = mipmaps ? mipLevelCount(image.width, image.height) : 1;
+
+    if (cache && cache->Enabled())
+    {
+        // the cache gets the whole chain, the image then continues as if it had been a hit
+        DecodedImage chain = image;
+        unsigned char *data = allocatePixels(chain, mipChainSize(image.width, image.height, image.channels, levels));
+        writeMipChain(decoded, image.width, image.height, image.channels, levels, data);
+        chain.levels = levels;
+        cache->Store(key, chain.width, chain.height, chain.channels, levels, data, chain.Size());
+        stageImage(chain, uploads);
+        return chain;
+    }
+    if (!uploads || !uploads->Enabled())
+        return image;
+
+    // stb_image only decodes into memory it allocates itself, so the staging copy is made here on the
+    // decoding thread instead of by the driver on the GL thread
+    size_t size = mipChainSize(image.width, image.height, image.channels, levels);
+    StagingBlock block = uploads->Allocate(size);
+    if (!block.Valid())
+    {
+        uploads->CountFallback(size);
+        return image;
+    }
+    writeMipChain(decoded, image.width, image.height, image.channels, levels, block.ptr);
+    image.storage.reset();
+    image.pixels = 0;
+    image.levels = levels;
+    setStaging(image, block);
+    return image;
+}
+
+// pixel format matching a channel count
+inline GLenum formatForChannels(int channels)
+{
+    if (channels == 1)
+        return GL_RED;
+    if (channels == 2)
+        return GL_RG;
+    if (channels == 3)
+        return GL_RGB;
+    return GL_RGBA;
+}
+
+// sized internal format of 16 bit normalised or float pixels
+inline GLint sizedFormatFor(int channels, GLenum dataType)
+{
+    static const GLint shorts[4] = { GL_R16, GL_RG16, GL_RGB16, GL_RGBA16 };
+    static const GLint floats[4] = { GL_R32F, GL_RG32F, GL_RGB32F, GL_RGBA32F };
+    int index = std::min(std::max(channels, 1), 4) - 1;
+    return dataType == GL_FLOAT ? floats[index] : shorts[index];
+}
+
+// specifies levels [first, last) of a decoded image on the bound texture, straight from the staging ring
+// when the image is staged. internalFormat = 0 picks the format matching the channel count, compressed
+// images always keep their own format.
+inline void texImageLevelRange(GLenum target, GLint internalFormat, const DecodedImage &image, unsigned int first,
+                               unsigned int last)
+{
+    GLenum format = formatForChannels(image.channels);
+    if (internalFormat == 0)
+        internalFormat = image.dataType == GL_UNSIGNED_BYTE ? format : sizedFormatFor(image.channels, image.dataType);
+    const unsigned char *data = image.staging.Valid() ? (const unsigned char*)image.staging.service->Begin(image.staging)
+                                                      : image.pixels;
+    data += image.LevelOffset(first);
+    size_t bytes = 0;
+    for (unsigned int level = first; level < last; level++)
+    {
+        int width = std::max(image.width >> level, 1);
+        int height = std::max(image.height >> level, 1);
+        size_t size = image.LevelSize(level);
+        if (image.compressedFormat)
+            glCompressedTexImage2D(target, level, image.compressedFormat, width, height, 0, (GLsizei)size, data);
+        else
+            glTexImage2D(target, level, internalFormat, width, height, 0, format, image.dataType, data);
+        data += size;
+        bytes += size;
+    }
+    if (image.staging.Valid())
+        image.staging.service->End(image.staging, bytes);
+
+    // single channel data (heights, specular) reads the same in all of rgb, like the greyscale originals
+    if (target == GL_TEXTURE_2D && image.compressedFormat == GL_COMPRESSED_RED_RGTC1)
+    {
+        GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    }
+}
+
+// specifies every level stored in a decoded image on the bound texture
+inline void texImageLevels(GLenum target, GLint internalFormat, const DecodedImage &image)
+{
+    texImageLevelRange(target, internalFormat, image, 0, image.levels);
+}
+
+// cube map faces must all have the same format, so compressed faces are only used if every face has one
+inline bool allCompressed(const std::vector<std::string> &faces)
+{
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        KtxReader reader;
+        if (!reader.Open(ktxPathFor(faces[i])) || !CompressedFormats::Supports(reader.Info().internalFormat))
+            return false;
+    }
+    return true;
+}
+
+// Decodes images on the job system and uploads them on the GL thread as soon as each one is ready.
+// TextureRegistry hands out texture names when a load is requested, so they can be wired up before the data
+// arrives; Wait() blocks the GL thread until every requested image has been uploaded. With an UploadService the
+// decoding jobs also fill the staging ring, so the GL thread work per image is a few unsynchronised
+// glTexImage2D calls that can be spread over frames.
+//
+// With a remote source (a TileFetcher on a server) images and their .ktx and .hmap files are fetched into a
+// mirror directory first, at the same relative paths, and decoded from there. A mirrored file is only rewritten
+// when its bytes changed so the pixel cache keeps hitting, and one the server does not answer for is left as
+// it is, which keeps the last copies usable offline.
+class AssetLoader
+{
+public:
+    typedef std::function<void(const DecodedImage &)> UploadFn;
+
+    explicit AssetLoader(JobSystem &jobs, UploadService *uploads = nullptr, PixelCache *cache = nullptr)
+        : jobs(jobs), uploads(uploads), cache(cache), source(nullptr), outstanding(0), start(Clock::now())
+    {
+    }
+
+    // images are read from the local files unless source is remote
+    void SetSource(TileFetcher *fetcher, const std::string &mirrorDirectory)
+    {
+        source = fetcher;
+        mirror = mirrorDirectory;
+    }
+
+    // decodes path with decodeImage() and calls upload with the result on the GL thread. upload is also
+    // called if decoding failed, with an image that is not Valid().
+    void Load(const std::string &path, int desiredChannels, bool mipmaps, UploadFn upload, bool allowCompressed = true)
+    {
+        timeline.push_back(TimelineEntry());
+        TimelineEntry *entry = &timeline.back();
+        entry->path = path;
+        outstanding++;
+
+        if (!source || !source->Remote())
+        {
+            decode(entry, path, desiredChannels, mipmaps, upload, allowCompressed);
+            return;
+        }
+        std::shared_ptr<std::vector<std::string> > files(new std::vector<std::string>());
+        if (allowCompressed)
+        {
+            files->push_back(ktxPathFor(path));
+            files->push_back(heightmapPathFor(path));
+        }
+        files->push_back(path);
+        AssetLoader *loader = this;
+        std::string local = mirrorPath(path);
+        fetchMirrored(files, 0, [loader, entry, local, desiredChannels, mipmaps, upload, allowCompressed]()
+        {
+            loader->decode(entry, local, desiredChannels, mipmaps, upload, allowCompressed);
+        });
+    }
+
+    // true once every requested image has been handed to its upload function
+    bool Idle() const { return outstanding == 0; }
+
+    // GL thread only. Uploads images as they finish decoding and helps decoding while nothing is ready.
+    void Wait()
+    {
+        while (outstanding > 0)
+        {
+            if (uploads)
+                uploads->Retire();
+            if (jobs.MainThread().Drain() == 0 && !jobs.RunOne())
+                std::this_thread::yield();
+        }
+    }
+
+    // prints when every image was decoded and uploaded, relative to the creation of the loader
+    void PrintTimeline(std::ostream &out) const
+    {
+        const int barWidth = 40;
+        double end = 0.0;
+        double decodeSum = 0.0;
+        double longestDecode = 0.0;
+        for (size_t i = 0; i < timeline.size(); i++)
+        {
+            end = std::max(end, timeline[i].uploadEnd);
+            decodeSum += timeline[i].decodeEnd - timeline[i].decodeStart;
+            longestDecode = std::max(longestDecode, timeline[i].decodeEnd - timeline[i].decodeStart);
+        }
+        out << "Asset loading timeline (ms, " << jobs.NumThreads() << " threads)" << std::endl;
+        for (size_t i = 0; i < timeline.size(); i++)
+        {
+            const TimelineEntry &entry = timeline[i];
+            std::string bar(barWidth, ' ');
+            int first = end > 0.0 ? (int)(entry.decodeStart / end * barWidth) : 0;
+            int last = end > 0.0 ? (int)(entry.decodeEnd / end * barWidth) : 0;
+            int upload = end > 0.0 ? (int)(entry.uploadStart / end * barWidth) : 0;
+            for (int c = first; c <= last && c < barWidth; c++)
+                bar[c] = '=';
+            if (upload < barWidth)
+                bar[upload] = 'U';
+            out << std::fixed << std::setprecision(1)
+                << "  [" << bar << "] decode " << std::setw(7) << entry.decodeStart << " - " << std::setw(7) << entry.decodeEnd
+                << "  upload " << std::setw(6) << entry.uploadEnd - entry.uploadStart << (entry.staged ? " pbo" : "    ")
+                << (entry.compressed ? " ktx" : (entry.heightmap ? " hmp" : (entry.cached ? " hit" : "    ")))
+                << "  " << entry.bytes / 1024 << " KiB  " << entry.path << std::endl;
+        }
+        out << "  sum of decodes " << decodeSum << " ms, longest decode " << longestDecode
+            << " ms, wall clock " << end << " ms" << std::endl;
+        if (source && source->Remote())
+            out << "  fetched " << source->bytesTransferred / 1024 << " KiB in " << source->requests << " requests, "
+                << source->failures << " failed, latency p50 " << source->LatencyPercentile(0.5) << " ms, p95 "
+                << source->LatencyPercentile(0.95) << " ms" << std::endl;
+        if (uploads)
+            out << "  staged " << uploads->bytesStaged / 1024 << " KiB through a " << uploads->Capacity() / 1024
+                << " KiB ring (peak " << uploads->peakInFlight / 1024 << " KiB in flight), "
+                << uploads->bytesFallback / 1024 << " KiB from client memory" << std::endl;
+        if (cache && cache->Enabled())
+            out << "  pixel cache " << cache->hits << " hits, " << cache->misses << " misses, "
+                << cache->bytesRead / (1024 * 1024) << " MiB mapped, " << cache->bytesWritten / (1024 * 1024)
+                << " MiB written, " << cache->TotalBytes() / (1024 * 1024) << " of "
+                << cache->MaxBytes() / (1024 * 1024) << " MiB used" << std::endl;
+        out << "  peak resident memory " << peakResidentBytes() / (1024 * 1024) << " MiB" << std::endl;
+    }
+
+private:
+    typedef std::chrono::high_resolution_clock Clock;
+
+    struct TimelineEntry {
+        std::string path;
+        double decodeStart;
+        double decodeEnd;
+        double uploadStart;
+        double uploadEnd;
+        size_t bytes;
+        bool staged;
+        bool compressed;
+        bool cached;
+        bool heightmap;
+
+        TimelineEntry() : decodeStart(0.0), decodeEnd(0.0), uploadStart(0.0), uploadEnd(0.0), bytes(0),
+                          staged(false), compressed(false), cached(false), heightmap(false)
+        {
+        }
+    };
+
+    JobSystem &jobs;
+    UploadService *uploads;
+    PixelCache *cache;
+    TileFetcher *source;
+    std::string mirror;
+    // only touched on the GL thread
+    size_t outstanding;
+    // deque so that entries stay put while workers write their timings
+    std::deque<TimelineEntry> timeline;
+    Clock::time_point start;
+
+    double elapsedMs() const
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    std::string mirrorPath(const std::string &path) const
+    {
+        size_t first = 0;
+        while (path.compare(first, 2, "./") == 0)
+            first += 2;
+        return mirror + "/" + path.substr(first);
+    }
+
+    // fetches files[index] onwards into the mirror one after another, then calls done on the fetcher's thread
+    void fetchMirrored(std::shared_ptr<std::vector<std::string> > files, size_t index, std::function<void()> done)
+    {
+        if (index == files->size())
+        {
+            done();
+            return;
+        }
+        AssetLoader *loader = this;
+        source->Fetch((*files)[index], 0, 0, [loader, files, index, done](const unsigned char *data, size_t size)
+        {
+            if (data)
+                writeIfChanged(loader->mirrorPath((*files)[index]), data, size);
+            loader->fetchMirrored(files, index + 1, done);
+        });
+    }
+
+    static void writeIfChanged(const std::string &path, const unsigned char *data, size_t size)
+    {
+        {
+            MappedFile existing;
+            if (existing.Open(path) && existing.Size() == size && memcmp(existing.Data(), data, size) == 0)
+                return;
+        }
+        // the directories on the way, one level at a time
+        for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+            makeDirectory(path.substr(0, slash));
+        std::string temporary = path + ".part";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file)
+            return;
+        bool ok = (size == 0 || fwrite(data, size, 1, file) == 1);
+        ok = fclose(file) == 0 && ok;
+        remove(path.c_str());
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+            remove(temporary.c_str());
+    }
+
+    void decode(TimelineEntry *entry, const std::string &path, int desiredChannels, bool mipmaps, UploadFn upload,
+                bool allowCompressed)
+    {
+        MainThreadQueue *mainThread = &jobs.MainThread();
+        AssetLoader *loader = this;
+        UploadService *service = uploads;
+        PixelCache *pixelCache = cache;
+        jobs.Run([loader, entry, mainThread, service, pixelCache, path, desiredChannels, mipmaps, upload, allowCompressed]()
+        {
+            entry->decodeStart = loader->elapsedMs();
+            DecodedImage image = decodeImage(path, desiredChannels, mipmaps, service, allowCompressed, pixelCache,
+                                             &loader->jobs);
+            entry->decodeEnd = loader->elapsedMs();
+            entry->bytes = image.Valid() ? image.LevelSize(0) : 0;
+            entry->staged = image.staging.Valid();
+            entry->compressed = image.compressedFormat != 0;
+            entry->cached = image.cached;
+            entry->heightmap = image.heightmap;
+
+            mainThread->Push([loader, entry, image, upload]()
+            {
+                entry->uploadStart = loader->elapsedMs();
+                upload(image);
+                entry->uploadEnd = loader->elapsedMs();
+                // the staging block goes back to the ring unless upload kept a copy of the image
+                DecodedImage used = image;
+                used.Free();
+                loader->outstanding--;
+            });
+        });
+    }
+};
+#endif
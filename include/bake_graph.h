@@ -0,0 +1,360 @@
+
+
+#ifndef BAKE_GRAPH_H
+#define BAKE_GRAPH_H
+
+#include <content_hash.h>
+#include <job_system.h>
+#include <mapped_file.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// One derivation of the bake: reads the files in inputs and writes the files in outputs. parameters holds
+// everything else the outputs depend on (settings, format versions), run() returns false when it failed.
+struct BakeStep {
+    std::string name;
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    std::string parameters;
+    std::function<bool()> run;
+};
+
+enum BakeState {
+    BAKE_PENDING,
+    BAKE_UP_TO_DATE,  // key unchanged and the outputs are the ones it wrote
+    BAKE_BUILT,
+    BAKE_FAILED,
+    BAKE_SKIPPED      // an input comes from a step that failed or was skipped
+};
+
+struct BakeResult {
+    BakeState state;
+    double ms;
+    std::string reason;  // why the step was built, failed or skipped
+
+    BakeResult() : state(BAKE_PENDING), ms(0.0)
+    {
+    }
+};
+
+// Runs bake steps in dependency order and only where their inputs changed.
+//
+// A step depends on the steps that write its inputs. Its key is the hash of its name, its parameters and the
+// content hashes of its inputs; a step is up to date when its key is the one of its last build and its outputs
+// still have the content that build left. Keys are computed once the producers of the inputs are done, so a
+// producer that rebuilds to the same bytes leaves its dependents alone (early cutoff). The manifest, a text file
+// like the PixelCache index, records the keys and outputs of every step and the modification time, size and
+// hash of every file, so files that were not touched are not hashed again.
+//
+// Steps with no dependencies left run as jobs on the job system, each runs its dependents once it is done, and a
+// step may use the job system itself.
+class BakeGraph
+{
+public:
+    // statistics, of the last Run()
+    unsigned int built;
+    unsigned int upToDate;
+    unsigned int failed;
+    unsigned int skipped;
+    double runMs;
+
+    explicit BakeGraph(const std::string &manifest)
+        : built(0), upToDate(0), failed(0), skipped(0), runMs(0.0), manifest(manifest)
+    {
+        loadManifest();
+    }
+
+    void Add(const BakeStep &step)
+    {
+        steps.push_back(step);
+    }
+
+    // runs what is out of date, or every step with force, and saves the manifest. False if a step failed.
+    bool Run(JobSystem &jobs, bool force = false)
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        built = upToDate = failed = skipped = 0;
+        results.assign(steps.size(), BakeResult());
+        this->force = force;
+
+        // the producer of every output, then the steps waiting on each step
+        std::map<std::string, size_t> producers;
+        for (size_t i = 0; i < steps.size(); i++)
+            for (size_t o = 0; o < steps[i].outputs.size(); o++)
+                producers[steps[i].outputs[o]] = i;
+        dependents.assign(steps.size(), std::vector<size_t>());
+        waiting.reset(new std::atomic<int>[steps.size()]);
+        blocked.reset(new std::atomic<bool>[steps.size()]);
+        for (size_t i = 0; i < steps.size(); i++)
+        {
+            waiting[i] = 0;
+            blocked[i] = false;
+            for (size_t n = 0; n < steps[i].inputs.size(); n++)
+            {
+                std::map<std::string, size_t>::const_iterator producer = producers.find(steps[i].inputs[n]);
+                if (producer != producers.end() && producer->second != i)
+                {
+                    dependents[producer->second].push_back(i);
+                    waiting[i]++;
+                }
+            }
+        }
+
+        JobCounter counter;
+        for (size_t i = 0; i < steps.size(); i++)
+            if (waiting[i] == 0)
+                launch(jobs, i, counter);
+        jobs.Wait(counter);
+
+        // steps that never became ready are part of a cycle
+        for (size_t i = 0; i < steps.size(); i++)
+            if (results[i].state == BAKE_PENDING)
+            {
+                results[i].state = BAKE_FAILED;
+                results[i].reason = "dependency cycle";
+            }
+        for (size_t i = 0; i < steps.size(); i++)
+        {
+            built += results[i].state == BAKE_BUILT;
+            upToDate += results[i].state == BAKE_UP_TO_DATE;
+            failed += results[i].state == BAKE_FAILED;
+            skipped += results[i].state == BAKE_SKIPPED;
+        }
+        saveManifest();
+        runMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        return failed == 0 && skipped == 0;
+    }
+
+    size_t Steps() const { return steps.size(); }
+    const BakeStep &Step(size_t i) const { return steps[i]; }
+    const BakeResult &Result(size_t i) const { return results[i]; }
+
+    const std::string &ManifestPath() const { return manifest; }
+
+private:
+    struct FileRecord {
+        int64_t modified;
+        int64_t size;
+        uint64_t hash;
+    };
+
+    struct StepRecord {
+        uint64_t key;
+        std::map<std::string, uint64_t> outputs;  // content hash of each output after the build
+    };
+
+    std::string manifest;
+    std::vector<BakeStep> steps;
+    std::vector<BakeResult> results;
+    std::vector<std::vector<size_t> > dependents;
+    std::unique_ptr<std::atomic<int>[]> waiting;   // producers of the inputs that are not done yet
+    std::unique_ptr<std::atomic<bool>[]> blocked;  // a producer failed or was skipped
+    bool force;
+
+    std::mutex mutex;  // guards files and records
+    std::map<std::string, FileRecord> files;
+    std::map<std::string, StepRecord> records;  // by step name
+
+    BakeGraph(const BakeGraph &);
+    BakeGraph &operator=(const BakeGraph &);
+
+    void launch(JobSystem &jobs, size_t i, JobCounter &counter)
+    {
+        jobs.Run([this, &jobs, i, &counter]()
+        {
+            if (blocked[i])
+            {
+                results[i].state = BAKE_SKIPPED;
+                results[i].reason = "an input was not baked";
+            }
+            else
+                runStep(i);
+            bool ok = results[i].state == BAKE_BUILT || results[i].state == BAKE_UP_TO_DATE;
+            for (size_t d = 0; d < dependents[i].size(); d++)
+            {
+                size_t next = dependents[i][d];
+                if (!ok)
+                    blocked[next] = true;
+                if (--waiting[next] == 0)
+                    launch(jobs, next, counter);
+            }
+        }, &counter);
+    }
+
+    void runStep(size_t i)
+    {
+        const BakeStep &step = steps[i];
+        BakeResult &result = results[i];
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+        uint64_t key = hashBytes((const unsigned char*)step.name.data(), step.name.size());
+        key = hashBytes((const unsigned char*)step.parameters.data(), step.parameters.size(), key);
+        for (size_t n = 0; n < step.inputs.size(); n++)
+        {
+            uint64_t hash;
+            if (!hashOf(step.inputs[n], hash))
+            {
+                result.state = BAKE_FAILED;
+                result.reason = "cannot read " + step.inputs[n];
+                return;
+            }
+            key = hashBytes((const unsigned char*)&hash, sizeof(hash), key);
+        }
+
+        result.reason = outOfDate(step, key);
+        if (result.reason.empty())
+        {
+            result.state = BAKE_UP_TO_DATE;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            records.erase(step.name);
+        }
+        if (!step.run())
+        {
+            result.state = BAKE_FAILED;
+            result.reason = "failed";
+            return;
+        }
+
+        StepRecord record;
+        record.key = key;
+        for (size_t o = 0; o < step.outputs.size(); o++)
+        {
+            uint64_t hash;
+            if (!hashOf(step.outputs[o], hash))
+            {
+                result.state = BAKE_FAILED;
+                result.reason = "did not write " + step.outputs[o];
+                return;
+            }
+            record.outputs[step.outputs[o]] = hash;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            records[step.name] = record;
+        }
+        result.state = BAKE_BUILT;
+        result.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    // empty when the last build of step had this key and left outputs that are still there, else why not
+    std::string outOfDate(const BakeStep &step, uint64_t key)
+    {
+        if (force)
+            return "forced";
+        StepRecord record;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, StepRecord>::const_iterator it = records.find(step.name);
+            if (it == records.end())
+                return "never built";
+            record = it->second;
+        }
+        if (record.key != key)
+            return "inputs changed";
+        for (size_t o = 0; o < step.outputs.size(); o++)
+        {
+            uint64_t hash;
+            std::map<std::string, uint64_t>::const_iterator recorded = record.outputs.find(step.outputs[o]);
+            if (!hashOf(step.outputs[o], hash))
+                return step.outputs[o] + " is missing";
+            if (recorded == record.outputs.end() || recorded->second != hash)
+                return step.outputs[o] + " changed";
+        }
+        return std::string();
+    }
+
+    // content hash of path, hashed again only when its modification time or size differ from the manifest
+    bool hashOf(const std::string &path, uint64_t &hash)
+    {
+        FileRecord file;
+        if (!fileStatus(path, file.modified, file.size))
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, FileRecord>::const_iterator it = files.find(path);
+            if (it != files.end() && it->second.modified == file.modified && it->second.size == file.size)
+            {
+                hash = it->second.hash;
+                return true;
+            }
+        }
+        if (!hashFile(path, file.hash))
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        files[path] = file;
+        hash = file.hash;
+        return true;
+    }
+
+    void loadManifest()
+    {
+        std::ifstream in(manifest.c_str());
+        std::string line;
+        StepRecord *step = 0;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string type, name;
+            fields >> type;
+            if (type == "file")
+            {
+                FileRecord file;
+                if (fields >> file.modified >> file.size >> file.hash && readName(fields, name))
+                    files[name] = file;
+            }
+            else if (type == "step")
+            {
+                uint64_t key;
+                step = fields >> key && readName(fields, name) ? &records[name] : 0;
+                if (step)
+                    step->key = key;
+            }
+            else if (type == "output" && step)
+            {
+                uint64_t hash;
+                if (fields >> hash && readName(fields, name))
+                    step->outputs[name] = hash;
+            }
+        }
+    }
+
+    void saveManifest()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(manifest.c_str());
+        for (std::map<std::string, FileRecord>::const_iterator it = files.begin(); it != files.end(); ++it)
+            out << "file " << it->second.modified << " " << it->second.size << " " << it->second.hash << " "
+                << it->first << "\n";
+        for (std::map<std::string, StepRecord>::const_iterator it = records.begin(); it != records.end(); ++it)
+        {
+            out << "step " << it->second.key << " " << it->first << "\n";
+            for (std::map<std::string, uint64_t>::const_iterator o = it->second.outputs.begin();
+                 o != it->second.outputs.end(); ++o)
+                out << "output " << o->second << " " << o->first << "\n";
+        }
+    }
+
+    // the rest of the line without the separating space, names may contain spaces
+    static bool readName(std::istringstream &fields, std::string &name)
+    {
+        if (!std::getline(fields, name) || name.find_first_not_of(' ') == std::string::npos)
+            return false;
+        name = name.substr(name.find_first_not_of(' '));
+        return true;
+    }
+};
+#endif
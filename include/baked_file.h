@@ -0,0 +1,157 @@
+
+
+#ifndef BAKED_FILE_H
+#define BAKED_FILE_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Files of derived data, written by tools/terrain_bake or by whoever had to derive the data themselves.
+//
+// A 32 byte header (magic, the kind of data as a four character code, its version and the key of what it was
+// derived from, usually a content hash) is followed by arrays of plain values, each as a byte count and the
+// bytes. Readers name the kind, version and key they expect, so data derived from other inputs, or by an older
+// version of the code, reads as missing and is derived again.
+static const uint32_t BAKED_FILE_MAGIC = 0x454B4142; // "BAKE"
+
+// four character code of a kind of baked data
+inline uint32_t bakedKind(const char *name)
+{
+    return (uint32_t)name[0] | ((uint32_t)name[1] << 8) | ((uint32_t)name[2] << 16) | ((uint32_t)name[3] << 24);
+}
+
+// where the baked data called name that derives from path goes: next to it, "./cache/terrain.terrain" and
+// "normals" give "./cache/terrain_normals.bake"
+inline std::string bakedPathFor(const std::string &path, const std::string &name, const std::string &extension = ".bake")
+{
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    std::string base = dot == std::string::npos || (slash != std::string::npos && dot < slash) ? path : path.substr(0, dot);
+    return base + "_" + name + extension;
+}
+
+class BakedFileWriter
+{
+public:
+    BakedFileWriter() : file(0), ok(false)
+    {
+    }
+
+    ~BakedFileWriter()
+    {
+        if (file)
+        {
+            fclose(file);
+            remove(temporary.c_str());
+        }
+    }
+
+    // written under a temporary name until Finish() so that a crash never leaves a truncated file behind
+    bool Create(const std::string &path, uint32_t kind, uint32_t version, uint64_t key)
+    {
+        this->path = path;
+        temporary = path + ".tmp";
+        file = fopen(temporary.c_str(), "wb");
+        if (!file)
+            return false;
+        uint32_t header[8] = { BAKED_FILE_MAGIC, kind, version, 0, (uint32_t)(key & 0xFFFFFFFFu),
+                               (uint32_t)(key >> 32), 0, 0 };
+        ok = fwrite(header, sizeof(header), 1, file) == 1;
+        return ok;
+    }
+
+    template <typename T>
+    void Put(const T *values, size_t count)
+    {
+        uint64_t bytes = (uint64_t)count * sizeof(T);
+        ok = ok && fwrite(&bytes, sizeof(bytes), 1, file) == 1 && (count == 0 || fwrite(values, sizeof(T), count, file) == count);
+    }
+
+    template <typename T>
+    void Put(const std::vector<T> &values)
+    {
+        Put(values.empty() ? (const T*)0 : &values[0], values.size());
+    }
+
+    template <typename T>
+    void PutValue(const T &value)
+    {
+        Put(&value, 1);
+    }
+
+    bool Finish()
+    {
+        if (!file)
+            return false;
+        ok = fclose(file) == 0 && ok;
+        file = 0;
+        remove(path.c_str());
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    FILE *file;
+    bool ok;
+    std::string path, temporary;
+
+    BakedFileWriter(const BakedFileWriter &);
+    BakedFileWriter &operator=(const BakedFileWriter &);
+};
+
+class BakedFileReader
+{
+public:
+    BakedFileReader() : file(0)
+    {
+    }
+
+    ~BakedFileReader()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    // false unless path holds data of this kind and version derived from key
+    bool Open(const std::string &path, uint32_t kind, uint32_t version, uint64_t key)
+    {
+        file = fopen(path.c_str(), "rb");
+        uint32_t header[8];
+        return file && fread(header, sizeof(header), 1, file) == 1 && header[0] == BAKED_FILE_MAGIC &&
+               header[1] == kind && header[2] == version && header[4] == (uint32_t)(key & 0xFFFFFFFFu) &&
+               header[5] == (uint32_t)(key >> 32);
+    }
+
+    // the next array, which has to hold whole values of T
+    template <typename T>
+    bool Get(std::vector<T> &values)
+    {
+        uint64_t bytes;
+        if (!file || fread(&bytes, sizeof(bytes), 1, file) != 1 || bytes % sizeof(T) != 0)
+            return false;
+        values.resize((size_t)(bytes / sizeof(T)));
+        return values.empty() || fread(&values[0], sizeof(T), values.size(), file) == values.size();
+    }
+
+    // the next array, which has to hold a single T
+    template <typename T>
+    bool GetValue(T &value)
+    {
+        uint64_t bytes;
+        return file && fread(&bytes, sizeof(bytes), 1, file) == 1 && bytes == sizeof(T) &&
+               fread(&value, sizeof(T), 1, file) == 1;
+    }
+
+private:
+    FILE *file;
+
+    BakedFileReader(const BakedFileReader &);
+    BakedFileReader &operator=(const BakedFileReader &);
+};
+#endif
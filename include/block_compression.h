@@ -0,0 +1,563 @@
+
+
+#ifndef BLOCK_COMPRESSION_H
+#define BLOCK_COMPRESSION_H
+
+#include <cmath>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLOCK_COMPRESSION_SSE2 1
+#endif
+
+// CPU encoders (and matching decoders, for measuring the error) for the block compressed formats the terrain
+// textures are stored in. Every encoder works on one 4x4 block at a time, so images are compressed by
+// running them over independent rows of blocks in parallel.
+//
+//   BC1            8 bytes, RGB 5:6:5 endpoints with 2 bit indices      albedo and sky without alpha
+//   BC4            8 bytes, one channel, 8 bit endpoints, 3 bit indices heights and specular
+//   BC5           16 bytes, two BC4 blocks                               normals (x and z)
+//   BC7 (mode 6)  16 bytes, RGBA 7:7:7:7 + p-bit endpoints, 4 bit indices  albedo with higher quality
+
+// 4x4 pixels, four channels, structure of arrays so that four pixels can be processed at once
+struct PixelBlock {
+    float c[4][16];
+};
+
+// reads the 4x4 block (bx, by) of an 8 bit RGBA image, pixels past the right or bottom edge repeat the last ones
+inline void fetchBlock(const unsigned char *rgba, int width, int height, int bx, int by, PixelBlock &block)
+{
+    for (int y = 0; y < 4; y++)
+    {
+        int sy = by * 4 + y < height ? by * 4 + y : height - 1;
+        for (int x = 0; x < 4; x++)
+        {
+            int sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+            const unsigned char *p = rgba + ((size_t)sy * width + sx) * 4;
+            for (int ch = 0; ch < 4; ch++)
+                block.c[ch][y * 4 + x] = p[ch];
+        }
+    }
+}
+
+// For every pixel picks the closest palette entry over the first channels channels and returns the summed
+// squared error. palette holds paletteSize colours of four floats.
+inline float selectIndices(const PixelBlock &block, const float (*palette)[4], int paletteSize, int channels,
+                           unsigned char indices[16])
+{
+    float error = 0.0f;
+#ifdef BLOCK_COMPRESSION_SSE2
+    for (int i = 0; i < 16; i += 4)
+    {
+        __m128 best = _mm_set1_ps(1e30f);
+        __m128 bestIndex = _mm_setzero_ps();
+        for (int p = 0; p < paletteSize; p++)
+        {
+            __m128 distance = _mm_setzero_ps();
+            for (int ch = 0; ch < channels; ch++)
+            {
+                __m128 d = _mm_sub_ps(_mm_loadu_ps(&block.c[ch][i]), _mm_set1_ps(palette[p][ch]));
+                distance = _mm_add_ps(distance, _mm_mul_ps(d, d));
+            }
+            __m128 closer = _mm_cmplt_ps(distance, best);
+            best = _mm_or_ps(_mm_and_ps(closer, distance), _mm_andnot_ps(closer, best));
+            bestIndex = _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps((float)p)), _mm_andnot_ps(closer, bestIndex));
+        }
+        float bests[4];
+        float bestIndices[4];
+        _mm_storeu_ps(bests, best);
+        _mm_storeu_ps(bestIndices, bestIndex);
+        for (int k = 0; k < 4; k++)
+        {
+            indices[i + k] = (unsigned char)bestIndices[k];
+            error += bests[k];
+        }
+    }
+#else
+    for (int i = 0; i < 16; i++)
+    {
+        float best = 1e30f;
+        int bestIndex = 0;
+        for (int p = 0; p < paletteSize; p++)
+        {
+            float distance = 0.0f;
+            for (int ch = 0; ch < channels; ch++)
+            {
+                float d = block.c[ch][i] - palette[p][ch];
+                distance += d * d;
+            }
+            if (distance < best)
+            {
+                best = distance;
+                bestIndex = p;
+            }
+        }
+        indices[i] = (unsigned char)bestIndex;
+        error += best;
+    }
+#endif
+    return error;
+}
+
+// Endpoints along the principal axis of the block's colours: the axis comes from a few power iterations on
+// the covariance matrix, the endpoints are the extreme projections onto it.
+inline void principalEndpoints(const PixelBlock &block, int channels, float e0[4], float e1[4])
+{
+    float mean[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float lo[4] = { 255.0f, 255.0f, 255.0f, 255.0f };
+    float hi[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int ch = 0; ch < channels; ch++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            mean[ch] += block.c[ch][i];
+            lo[ch] = block.c[ch][i] < lo[ch] ? block.c[ch][i] : lo[ch];
+            hi[ch] = block.c[ch][i] > hi[ch] ? block.c[ch][i] : hi[ch];
+        }
+        mean[ch] /= 16.0f;
+    }
+    float covariance[4][4] = { { 0.0f } };
+    for (int i = 0; i < 16; i++)
+        for (int a = 0; a < channels; a++)
+            for (int b = a; b < channels; b++)
+                covariance[a][b] += (block.c[a][i] - mean[a]) * (block.c[b][i] - mean[b]);
+    for (int a = 0; a < channels; a++)
+        for (int b = 0; b < a; b++)
+            covariance[a][b] = covariance[b][a];
+
+    float axis[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int ch = 0; ch < channels; ch++)
+        axis[ch] = hi[ch] - lo[ch];
+    for (int iteration = 0; iteration < 8; iteration++)
+    {
+        float next[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        float length = 0.0f;
+        for (int a = 0; a < channels; a++)
+        {
+            for (int b = 0; b < channels; b++)
+                next[a] += covariance[a][b] * axis[b];
+            length += next[a] * next[a];
+        }
+        if (length < 1e-12f)
+            break;
+        length = 1.0f / std::sqrt(length);
+        for (int a = 0; a < channels; a++)
+            axis[a] = next[a] * length;
+    }
+
+    float minT = 0.0f;
+    float maxT = 0.0f;
+    for (int i = 0; i < 16; i++)
+    {
+        float t = 0.0f;
+        for (int ch = 0; ch < channels; ch++)
+            t += (block.c[ch][i] - mean[ch]) * axis[ch];
+        minT = t < minT ? t : minT;
+        maxT = t > maxT ? t : maxT;
+    }
+    for (int ch = 0; ch < 4; ch++)
+    {
+        e0[ch] = ch < channels ? mean[ch] + axis[ch] * maxT : 255.0f;
+        e1[ch] = ch < channels ? mean[ch] + axis[ch] * minT : 255.0f;
+    }
+}
+
+// Least squares endpoints for fixed indices: every pixel is modelled as (1 - w) * e0 + w * e1 with the
+// weight of its index. Returns false if the system is degenerate (all pixels on one weight).
+inline bool refineEndpoints(const PixelBlock &block, int channels, const unsigned char indices[16],
+                            const float *weights, float e0[4], float e1[4])
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float bx[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; i++)
+    {
+        float w = weights[indices[i]];
+        float a = 1.0f - w;
+        aa += a * a;
+        ab += a * w;
+        bb += w * w;
+        for (int ch = 0; ch < channels; ch++)
+        {
+            ax[ch] += a * block.c[ch][i];
+            bx[ch] += w * block.c[ch][i];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) < 1e-6f)
+        return false;
+    float inverse = 1.0f / determinant;
+    for (int ch = 0; ch < channels; ch++)
+    {
+        float v0 = (ax[ch] * bb - bx[ch] * ab) * inverse;
+        float v1 = (bx[ch] * aa - ax[ch] * ab) * inverse;
+        e0[ch] = v0 < 0.0f ? 0.0f : (v0 > 255.0f ? 255.0f : v0);
+        e1[ch] = v1 < 0.0f ? 0.0f : (v1 > 255.0f ? 255.0f : v1);
+    }
+    return true;
+}
+
+inline int quantize(float value, int maximum)
+{
+    int q = (int)(value * maximum / 255.0f + 0.5f);
+    return q < 0 ? 0 : (q > maximum ? maximum : q);
+}
+
+// BC1 ------------------------------------------------------------------------------------------------
+
+inline uint16_t packColor565(const float color[3])
+{
+    return (uint16_t)((quantize(color[0], 31) << 11) | (quantize(color[1], 63) << 5) | quantize(color[2], 31));
+}
+
+inline void unpackColor565(uint16_t packed, float color[4])
+{
+    int r = (packed >> 11) & 31;
+    int g = (packed >> 5) & 63;
+    int b = packed & 31;
+    color[0] = (float)((r << 3) | (r >> 2));
+    color[1] = (float)((g << 2) | (g >> 4));
+    color[2] = (float)((b << 3) | (b >> 2));
+    color[3] = 255.0f;
+}
+
+// palette of a 4 colour BC1 block, index order as stored: c0, c1, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1
+inline void bc1Palette(uint16_t c0, uint16_t c1, float palette[4][4])
+{
+    unpackColor565(c0, palette[0]);
+    unpackColor565(c1, palette[1]);
+    for (int ch = 0; ch < 4; ch++)
+    {
+        palette[2][ch] = (2.0f * palette[0][ch] + palette[1][ch]) / 3.0f;
+        palette[3][ch] = (palette[0][ch] + 2.0f * palette[1][ch]) / 3.0f;
+    }
+}
+
+inline float bc1Try(const PixelBlock &block, const float e0[4], const float e1[4],
+                    uint16_t &c0, uint16_t &c1, unsigned char indices[16])
+{
+    c0 = packColor565(e0);
+    c1 = packColor565(e1);
+    // c0 > c1 selects the 4 colour mode
+    if (c0 < c1)
+    {
+        uint16_t swap = c0;
+        c0 = c1;
+        c1 = swap;
+    }
+    float palette[4][4];
+    bc1Palette(c0, c1, palette);
+    return selectIndices(block, palette, c0 == c1 ? 1 : 4, 3, indices);
+}
+
+// encodes the RGB channels of a block, alpha is ignored
+inline void encodeBC1(const PixelBlock &block, unsigned char out[8])
+{
+    static const float weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+    float e0[4], e1[4];
+    principalEndpoints(block, 3, e0, e1);
+
+    uint16_t c0, c1;
+    unsigned char indices[16];
+    float error = bc1Try(block, e0, e1, c0, c1, indices);
+    if (c0 != c1 && refineEndpoints(block, 3, indices, weights, e0, e1))
+    {
+        uint16_t r0, r1;
+        unsigned char refined[16];
+        if (bc1Try(block, e0, e1, r0, r1, refined) < error)
+        {
+            c0 = r0;
+            c1 = r1;
+            for (int i = 0; i < 16; i++)
+                indices[i] = refined[i];
+        }
+    }
+
+    uint32_t bits = 0;
+    for (int i = 0; i < 16; i++)
+        bits |= (uint32_t)(c0 == c1 ? 0 : indices[i]) << (2 * i);
+    out[0] = (unsigned char)(c0 & 0xFF);
+    out[1] = (unsigned char)(c0 >> 8);
+    out[2] = (unsigned char)(c1 & 0xFF);
+    out[3] = (unsigned char)(c1 >> 8);
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = (unsigned char)(bits >> (8 * i));
+}
+
+inline void decodeBC1(const unsigned char in[8], unsigned char rgba[16][4])
+{
+    uint16_t c0 = (uint16_t)(in[0] | (in[1] << 8));
+    uint16_t c1 = (uint16_t)(in[2] | (in[3] << 8));
+    float palette[4][4];
+    bc1Palette(c0, c1, palette);
+    if (c0 <= c1)
+    {
+        // 3 colour mode, only written by other encoders
+        for (int ch = 0; ch < 3; ch++)
+            palette[2][ch] = (palette[0][ch] + palette[1][ch]) * 0.5f;
+        palette[3][0] = palette[3][1] = palette[3][2] = palette[3][3] = 0.0f;
+    }
+    uint32_t bits = (uint32_t)in[4] | ((uint32_t)in[5] << 8) | ((uint32_t)in[6] << 16) | ((uint32_t)in[7] << 24);
+    for (int i = 0; i < 16; i++)
+    {
+        int index = (bits >> (2 * i)) & 3;
+        for (int ch = 0; ch < 4; ch++)
+            rgba[i][ch] = (unsigned char)(palette[index][ch] + 0.5f);
+    }
+}
+
+// BC4 ------------------------------------------------------------------------------------------------
+
+// palette of an 8 value BC4 block, r0 > r1
+inline void bc4Palette(int r0, int r1, float palette[8][4])
+{
+    palette[0][0] = (float)r0;
+    palette[1][0] = (float)r1;
+    for (int i = 2; i < 8; i++)
+        palette[i][0] = (float)(((8 - i) * r0 + (i - 1) * r1) / 7);
+}
+
+// encodes channel ch of a block
+inline void encodeBC4(const PixelBlock &block, int ch, unsigned char out[8])
+{
+    float lo = 255.0f;
+    float hi = 0.0f;
+    for (int i = 0; i < 16; i++)
+    {
+        lo = block.c[ch][i] < lo ? block.c[ch][i] : lo;
+        hi = block.c[ch][i] > hi ? block.c[ch][i] : hi;
+    }
+    int r0 = (int)(hi + 0.5f);
+    int r1 = (int)(lo + 0.5f);
+    unsigned char indices[16] = { 0 };
+    if (r0 > r1)
+    {
+        PixelBlock single;
+        for (int i = 0; i < 16; i++)
+            single.c[0][i] = block.c[ch][i];
+        float palette[8][4];
+        bc4Palette(r0, r1, palette);
+        selectIndices(single, palette, 8, 1, indices);
+    }
+
+    out[0] = (unsigned char)r0;
+    out[1] = (unsigned char)r1;
+    uint64_t bits = 0;
+    for (int i = 0; i < 16; i++)
+        bits |= (uint64_t)indices[i] << (3 * i);
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (unsigned char)(bits >> (8 * i));
+}
+
+// decodes into channel ch of rgba
+inline void decodeBC4(const unsigned char in[8], int ch, unsigned char rgba[16][4])
+{
+    int r0 = in[0];
+    int r1 = in[1];
+    float palette[8][4];
+    if (r0 > r1)
+        bc4Palette(r0, r1, palette);
+    else
+    {
+        // 6 value mode with explicit 0 and 255, only written by other encoders
+        palette[0][0] = (float)r0;
+        palette[1][0] = (float)r1;
+        for (int i = 2; i < 6; i++)
+            palette[i][0] = (float)(((6 - i) * r0 + (i - 1) * r1) / 5);
+        palette[6][0] = 0.0f;
+        palette[7][0] = 255.0f;
+    }
+    uint64_t bits = 0;
+    for (int i = 0; i < 6; i++)
+        bits |= (uint64_t)in[2 + i] << (8 * i);
+    for (int i = 0; i < 16; i++)
+        rgba[i][ch] = (unsigned char)palette[(bits >> (3 * i)) & 7][0];
+}
+
+// BC5 ------------------------------------------------------------------------------------------------
+
+// encodes channels ch0 and ch1 of a block, they decode as red and green
+inline void encodeBC5(const PixelBlock &block, int ch0, int ch1, unsigned char out[16])
+{
+    encodeBC4(block, ch0, out);
+    encodeBC4(block, ch1, out + 8);
+}
+
+inline void decodeBC5(const unsigned char in[16], unsigned char rgba[16][4])
+{
+    decodeBC4(in, 0, rgba);
+    decodeBC4(in + 8, 1, rgba);
+    for (int i = 0; i < 16; i++)
+    {
+        rgba[i][2] = 0;
+        rgba[i][3] = 255;
+    }
+}
+
+// BC7 mode 6 -----------------------------------------------------------------------------------------
+
+static const float bc7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// 8 bit value of a 7 bit endpoint component with its p-bit
+inline void bc7Palette(const int q0[4], const int q1[4], int p0, int p1, float palette[16][4])
+{
+    for (int ch = 0; ch < 4; ch++)
+    {
+        int v0 = (q0[ch] << 1) | p0;
+        int v1 = (q1[ch] << 1) | p1;
+        for (int i = 0; i < 16; i++)
+        {
+            int w = (int)bc7Weights4[i];
+            palette[i][ch] = (float)(((64 - w) * v0 + w * v1 + 32) >> 6);
+        }
+    }
+}
+
+// quantizes the endpoints for every p-bit combination and keeps the one with the least error
+inline float bc7Try(const PixelBlock &block, const float e0[4], const float e1[4],
+                    int q0[4], int q1[4], int &p0, int &p1, unsigned char indices[16])
+{
+    float best = 1e30f;
+    for (int pb = 0; pb < 4; pb++)
+    {
+        int t0[4], t1[4];
+        int tp0 = pb & 1;
+        int tp1 = pb >> 1;
+        for (int ch = 0; ch < 4; ch++)
+        {
+            t0[ch] = quantize((e0[ch] - tp0) * 255.0f / 254.0f, 127);
+            t1[ch] = quantize((e1[ch] - tp1) * 255.0f / 254.0f, 127);
+        }
+        float palette[16][4];
+        bc7Palette(t0, t1, tp0, tp1, palette);
+        unsigned char candidate[16];
+        float error = selectIndices(block, palette, 16, 4, candidate);
+        if (error < best)
+        {
+            best = error;
+            p0 = tp0;
+            p1 = tp1;
+            for (int ch = 0; ch < 4; ch++)
+            {
+                q0[ch] = t0[ch];
+                q1[ch] = t1[ch];
+            }
+            for (int i = 0; i < 16; i++)
+                indices[i] = candidate[i];
+        }
+    }
+    return best;
+}
+
+// appends count bits of value to a 128 bit little endian block
+inline void putBits(unsigned char out[16], int &position, uint32_t value, int count)
+{
+    for (int i = 0; i < count; i++, position++)
+        if (value & (1u << i))
+            out[position >> 3] |= (unsigned char)(1 << (position & 7));
+}
+
+inline uint32_t getBits(const unsigned char in[16], int &position, int count)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < count; i++, position++)
+        value |= (uint32_t)((in[position >> 3] >> (position & 7)) & 1) << i;
+    return value;
+}
+
+// encodes all four channels of a block with the single subset RGBA mode 6
+inline void encodeBC7(const PixelBlock &block, unsigned char out[16])
+{
+    float weights[16];
+    for (int i = 0; i < 16; i++)
+        weights[i] = bc7Weights4[i] / 64.0f;
+
+    float e0[4], e1[4];
+    principalEndpoints(block, 4, e0, e1);
+
+    int q0[4], q1[4], p0 = 0, p1 = 0;
+    unsigned char indices[16];
+    float error = bc7Try(block, e0, e1, q0, q1, p0, p1, indices);
+    if (refineEndpoints(block, 4, indices, weights, e0, e1))
+    {
+        int r0[4], r1[4], rp0 = 0, rp1 = 0;
+        unsigned char refined[16];
+        if (bc7Try(block, e0, e1, r0, r1, rp0, rp1, refined) < error)
+        {
+            for (int ch = 0; ch < 4; ch++)
+            {
+                q0[ch] = r0[ch];
+                q1[ch] = r1[ch];
+            }
+            p0 = rp0;
+            p1 = rp1;
+            for (int i = 0; i < 16; i++)
+                indices[i] = refined[i];
+        }
+    }
+
+    // the most significant index bit of the first pixel is implicit zero, swap the endpoints if needed
+    if (indices[0] & 8)
+    {
+        for (int ch = 0; ch < 4; ch++)
+        {
+            int swap = q0[ch];
+            q0[ch] = q1[ch];
+            q1[ch] = swap;
+        }
+        int swap = p0;
+        p0 = p1;
+        p1 = swap;
+        for (int i = 0; i < 16; i++)
+            indices[i] = (unsigned char)(15 - indices[i]);
+    }
+
+    for (int i = 0; i < 16; i++)
+        out[i] = 0;
+    int position = 0;
+    putBits(out, position, 1u << 6, 7);
+    for (int ch = 0; ch < 4; ch++)
+    {
+        putBits(out, position, (uint32_t)q0[ch], 7);
+        putBits(out, position, (uint32_t)q1[ch], 7);
+    }
+    putBits(out, position, (uint32_t)p0, 1);
+    putBits(out, position, (uint32_t)p1, 1);
+    putBits(out, position, indices[0], 3);
+    for (int i = 1; i < 16; i++)
+        putBits(out, position, indices[i], 4);
+}
+
+// decodes mode 6 blocks, other modes (not written by encodeBC7) decode as magenta
+inline bool decodeBC7(const unsigned char in[16], unsigned char rgba[16][4])
+{
+    int position = 0;
+    if (getBits(in, position, 7) != (1u << 6))
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            rgba[i][0] = rgba[i][2] = rgba[i][3] = 255;
+            rgba[i][1] = 0;
+        }
+        return false;
+    }
+    int q0[4], q1[4];
+    for (int ch = 0; ch < 4; ch++)
+    {
+        q0[ch] = (int)getBits(in, position, 7);
+        q1[ch] = (int)getBits(in, position, 7);
+    }
+    int p0 = (int)getBits(in, position, 1);
+    int p1 = (int)getBits(in, position, 1);
+    float palette[16][4];
+    bc7Palette(q0, q1, p0, p1, palette);
+    for (int i = 0; i < 16; i++)
+    {
+        int index = (int)getBits(in, position, i == 0 ? 3 : 4);
+        for (int ch = 0; ch < 4; ch++)
+            rgba[i][ch] = (unsigned char)palette[index][ch];
+    }
+    return true;
+}
+#endif
@@ -7,6 +7,7 @@
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
+#include <cmath>
 #include <vector>
 
 // Defines several possible options for camera movement. Used as abstraction to stay away from window-system specific input methods
@@ -27,13 +28,20 @@ const float PITCH       =  0.0f;
 const float SPEED       =  2.5f;
 const float SENSITIVITY =  0.1f;
 const float ZOOM        =  45.0f;
+const float REBASE      =  1024.0f;
 
 
 // An abstract camera class that processes input and calculates the corresponding Euler Angles, Vectors and Matrices for use in OpenGL
+//
+// The camera keeps a floating origin: Position is relative to Origin, which is held in double precision and moved
+// in whole units whenever Position gets further than RebaseDistance from it, so Position never grows large
+// enough for small movements to be lost to float rounding. Rendering is camera relative: GetRelativeViewMatrix()
+// has the camera at the origin and model matrices are built from world positions minus WorldPosition() in double.
 class Camera
 {
 public:
     // camera Attributes
+    glm::dvec3 Origin;
     glm::vec3 Position;
     glm::vec3 Front;
     glm::vec3 Up;
@@ -46,10 +54,12 @@ public:
     float MovementSpeed;
     float MouseSensitivity;
     float Zoom;
+    float RebaseDistance;
 
     // constructor with vectors
-    Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f), float yaw = YAW, float pitch = PITCH) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM)
+    Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f), float yaw = YAW, float pitch = PITCH) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM), RebaseDistance(REBASE)
     {
+        Origin = glm::dvec3(0.0);
         Position = position;
         WorldUp = up;
         Yaw = yaw;
@@ -57,8 +67,9 @@ public:
         updateCameraVectors();
     }
     // constructor with scalar values
-    Camera(float posX, float posY, float posZ, float upX, float upY, float upZ, float yaw, float pitch) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM)
+    Camera(float posX, float posY, float posZ, float upX, float upY, float upZ, float yaw, float pitch) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM), RebaseDistance(REBASE)
     {
+        Origin = glm::dvec3(0.0);
         Position = glm::vec3(posX, posY, posZ);
         WorldUp = glm::vec3(upX, upY, upZ);
         Yaw = yaw;
@@ -66,10 +77,38 @@ public:
         updateCameraVectors();
     }
 
-    // returns the view matrix calculated using Euler Angles and the LookAt Matrix
+    // position in the world, origin included
+    glm::dvec3 WorldPosition() const
+    {
+        return Origin + glm::dvec3(Position);
+    }
+
+    // returns the view matrix calculated using Euler Angles and the LookAt Matrix, in world coordinates rounded to
+    // float. Good enough for culling and streaming decisions on the CPU, not for rendering a large world.
     glm::mat4 GetViewMatrix()
     {
-        return glm::lookAt(Position, Position + Front, Up);
+        glm::vec3 world = glm::vec3(WorldPosition());
+        return glm::lookAt(world, world + Front, Up);
+    }
+
+    // the view matrix of camera relative rendering, rotation only with the camera at the origin
+    glm::mat4 GetRelativeViewMatrix()
+    {
+        return glm::lookAt(glm::vec3(0.0f), Front, Up);
+    }
+
+    // moves the origin to the camera once it is further than RebaseDistance away, returns true if it did. Called
+    // after every move, the world position does not change.
+    bool Rebase()
+    {
+        if (std::abs(Position.x) <= RebaseDistance && std::abs(Position.y) <= RebaseDistance &&
+            std::abs(Position.z) <= RebaseDistance)
+            return false;
+        // whole units, so that the float part loses nothing when the shift is taken off it
+        glm::vec3 shift(std::floor(Position.x), std::floor(Position.y), std::floor(Position.z));
+        Origin += glm::dvec3(shift);
+        Position -= shift;
+        return true;
     }
 
     // processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
@@ -84,6 +123,7 @@ public:
             Position -= Right * 50.0f*velocity;
         if (direction == RIGHT)
             Position += Right * 50.0f*velocity;
+        Rebase();
 
 
         //mrdanje pogled so tastatura    
@@ -0,0 +1,44 @@
+
+
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <mapped_file.h>
+
+#include <cstring>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// 64 bit hash of a byte range, eight bytes per step. Not cryptographic, only meant to tell file contents apart.
+inline uint64_t hashBytes(const unsigned char *data, size_t size, uint64_t seed = 0)
+{
+    const uint64_t prime = 0x100000001B3ull;
+    uint64_t hash = 0xCBF29CE484222325ull ^ (seed * prime);
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++)
+    {
+        uint64_t word;
+        memcpy(&word, data + i * 8, 8);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (size_t i = words * 8; i < size; i++)
+        hash = (hash ^ data[i]) * prime;
+    hash ^= (uint64_t)size;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// hash of a file's contents, false if the file cannot be read
+inline bool hashFile(const std::string &path, uint64_t &hash)
+{
+    MappedFile file;
+    if (!file.Open(path))
+        return false;
+    hash = hashBytes(file.Data(), file.Size());
+    return true;
+}
+#endif
@@ -0,0 +1,365 @@
+
+
+#ifndef DRAW_LIST_H
+#define DRAW_LIST_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include <shader_t.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+// Render passes in the order they are submitted. Opaque geometry goes first so the sky only shades
+// the pixels the terrain and models left uncovered, blended geometry goes last.
+enum DrawPass {
+    PASS_OPAQUE      = 0,
+    PASS_SKY         = 1,
+    PASS_TRANSPARENT = 2
+};
+
+#define MAX_DRAW_TEXTURES 12
+#define MAX_TEXTURE_UNITS 16
+
+struct TextureBinding {
+    GLuint unit;    // texture unit index, 0 = GL_TEXTURE0
+    GLenum target;  // GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP ...
+    GLuint id;
+};
+
+// Everything about a draw that stays the same from frame to frame: program, vertex array, primitive,
+// textures and fixed function state. States are registered once with the DrawList and referenced by
+// index from the per-frame packets.
+struct DrawState {
+    GLuint       program;
+    GLuint       vao;
+    GLenum       mode;       // GL_TRIANGLES, GL_PATCHES ...
+    GLint        first;      // default range, first vertex or first index for indexed draws
+    GLsizei      count;
+    GLenum       indexType;  // 0 for glDrawArrays, GL_UNSIGNED_INT etc. for glDrawElements
+    GLenum       depthFunc;
+    unsigned int numTextures;
+    TextureBinding textures[MAX_DRAW_TEXTURES];
+
+    DrawState() : program(0), vao(0), mode(GL_TRIANGLES), first(0), count(0), indexType(0),
+                  depthFunc(GL_LESS), numTextures(0)
+    {
+    }
+
+    void AddTexture(GLuint unit, GLenum target, GLuint id)
+    {
+        if (numTextures < MAX_DRAW_TEXTURES)
+        {
+            TextureBinding binding = { unit, target, id };
+            textures[numTextures++] = binding;
+        }
+    }
+};
+
+// A recorded draw: sort key, state index, index of its model matrix in the owning command list and
+// the vertex range. Small enough that sorting a few thousand of them is cheap.
+struct DrawPacket {
+    uint64_t key;
+    uint32_t state;
+    uint32_t matrix;
+    GLint    first;
+    GLsizei  count;
+};
+
+// Per-frame counters, reset at the start of DrawList::Submit().
+struct DrawStats {
+    unsigned int drawCalls;
+    unsigned int programSwitches;
+    unsigned int textureBinds;
+    unsigned int vaoBinds;
+    unsigned int stateChanges;
+};
+
+class DrawList;
+
+// Packets and model matrices recorded by one producer. A command list only reads from its DrawList
+// (states and key layout), so any number of them can be filled on different threads at once.
+class CommandList
+{
+public:
+    std::vector<DrawPacket> packets;
+    std::vector<glm::mat4>  matrices;
+
+    CommandList() : list(0)
+    {
+    }
+
+    void Begin(const DrawList &drawList)
+    {
+        list = &drawList;
+        packets.clear();
+        matrices.clear();
+    }
+
+    // records a draw of a registered state. A negative count draws the state's default range.
+    inline void Add(DrawPass pass, unsigned int state, const glm::mat4 &model, float depth,
+                    GLint first = 0, GLsizei count = -1);
+
+private:
+    const DrawList *list;
+};
+
+// Collects command lists for a frame and submits them sorted by a 64 bit key, so that program and
+// texture switches are minimised and depth ordering is correct for each pass.
+//
+// Key layout, most significant bits first:
+//   opaque/sky:  pass(4) | program(8) | material(16) | depth(24)          | sequence(12)
+//   transparent: pass(4) | ~depth(24) | program(8)   | material(16)       | sequence(12)
+// Opaque geometry is therefore grouped by state and drawn front to back inside a group, while blended
+// geometry is drawn strictly back to front.
+class DrawList
+{
+public:
+    DrawList(float farPlane = 100000.0f) : farPlane(farPlane)
+    {
+        resetStats();
+    }
+
+    // registers a program with the list. setup is called right after the program is bound for the first
+    // time in a frame, that is where per-frame uniforms (view, projection, GUI values) should be set.
+    // Programs and states have to be registered before any command list is recorded.
+    void RegisterProgram(const Shader &shader, std::function<void()> setup = std::function<void()>())
+    {
+        ProgramState state;
+        state.program = shader.ID;
+        state.modelLocation = glGetUniformLocation(shader.ID, "model");
+        state.setup = setup;
+        programs.push_back(state);
+    }
+
+    // registers a draw state and returns the index packets refer to it by
+    unsigned int AddState(const DrawState &state)
+    {
+        StateInfo info;
+        info.state = state;
+        info.program = programIndex(state.program);
+        info.material = materialId(state);
+        states.push_back(info);
+        return (unsigned int)(states.size() - 1);
+    }
+
+    const DrawState &State(unsigned int index) const
+    {
+        return states[index].state;
+    }
+
+    // merges the command lists, sorts the packets and issues them. Has to run on the GL thread.
+    void Submit(CommandList *const *lists, unsigned int numLists)
+    {
+        resetStats();
+        merged.clear();
+        matrices.clear();
+        usedTextures.clear();
+        for (unsigned int l = 0; l < numLists; l++)
+        {
+            const CommandList &commands = *lists[l];
+            uint32_t base = (uint32_t)matrices.size();
+            matrices.insert(matrices.end(), commands.matrices.begin(), commands.matrices.end());
+            for (size_t i = 0; i < commands.packets.size(); i++)
+            {
+                merged.push_back(commands.packets[i]);
+                merged.back().matrix += base;
+            }
+        }
+        // stable, so packets with equal keys keep the order of the lists they were recorded in
+        std::stable_sort(merged.begin(), merged.end(), compareKeys);
+
+        GLuint currentProgram = 0;
+        GLuint currentVao = 0;
+        GLenum currentDepthFunc = GL_LESS;
+        GLint modelLocation = -1;
+        GLuint boundTextures[MAX_TEXTURE_UNITS] = { 0 };
+        GLenum boundTargets[MAX_TEXTURE_UNITS] = { 0 };
+        std::vector<bool> programSetUp(programs.size(), false);
+
+        for (size_t i = 0; i < merged.size(); i++)
+        {
+            const DrawPacket &packet = merged[i];
+            const StateInfo &info = states[packet.state];
+            const DrawState &state = info.state;
+            if (state.program != currentProgram)
+            {
+                glUseProgram(state.program);
+                currentProgram = state.program;
+                stats.programSwitches++;
+
+                modelLocation = info.program < programs.size() ? programs[info.program].modelLocation : -1;
+                if (info.program < programs.size() && !programSetUp[info.program])
+                {
+                    programSetUp[info.program] = true;
+                    if (programs[info.program].setup)
+                        programs[info.program].setup();
+                }
+            }
+            if (state.vao != currentVao)
+            {
+                glBindVertexArray(state.vao);
+                currentVao = state.vao;
+                stats.vaoBinds++;
+            }
+            if (state.depthFunc != currentDepthFunc)
+            {
+                glDepthFunc(state.depthFunc);
+                currentDepthFunc = state.depthFunc;
+                stats.stateChanges++;
+            }
+            for (unsigned int t = 0; t < state.numTextures; t++)
+            {
+                const TextureBinding &binding = state.textures[t];
+                if (binding.unit < MAX_TEXTURE_UNITS &&
+                    boundTextures[binding.unit] == binding.id && boundTargets[binding.unit] == binding.target)
+                    continue;
+                glActiveTexture(GL_TEXTURE0 + binding.unit);
+                glBindTexture(binding.target, binding.id);
+                usedTextures.push_back(binding.id);
+                if (binding.unit < MAX_TEXTURE_UNITS)
+                {
+                    boundTextures[binding.unit] = binding.id;
+                    boundTargets[binding.unit] = binding.target;
+                }
+                stats.textureBinds++;
+            }
+            if (modelLocation >= 0)
+                glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &matrices[packet.matrix][0][0]);
+
+            if (state.indexType == 0)
+                glDrawArrays(state.mode, packet.first, packet.count);
+            else
+                glDrawElements(state.mode, packet.count, state.indexType,
+                               (void*)(size_t)(packet.first * indexSize(state.indexType)));
+            stats.drawCalls++;
+        }
+
+        if (currentDepthFunc != GL_LESS)
+            glDepthFunc(GL_LESS);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    const DrawStats &Stats() const { return stats; }
+    // textures bound by the last Submit(), may contain repeats
+    const std::vector<GLuint> &UsedTextures() const { return usedTextures; }
+    size_t Size() const { return merged.size(); }
+
+    // builds the sort key of a packet for a registered state
+    uint64_t MakeKey(DrawPass pass, unsigned int state, float depth, unsigned int sequence) const
+    {
+        const StateInfo &info = states[state];
+        uint64_t d = quantizeDepth(depth);
+        uint64_t key = (uint64_t)(pass & 0xF) << 60;
+        if (pass == PASS_TRANSPARENT)
+        {
+            key |= ((~d) & 0xFFFFFF) << 36;
+            key |= (uint64_t)(info.program & 0xFF) << 28;
+            key |= (uint64_t)(info.material & 0xFFFF) << 12;
+        }
+        else
+        {
+            key |= (uint64_t)(info.program & 0xFF) << 52;
+            key |= (uint64_t)(info.material & 0xFFFF) << 36;
+            key |= d << 12;
+        }
+        return key | (sequence & 0xFFF);
+    }
+
+private:
+    struct ProgramState {
+        GLuint program;
+        GLint modelLocation;
+        std::function<void()> setup;
+    };
+
+    struct StateInfo {
+        DrawState state;
+        unsigned int program;   // index into programs
+        unsigned int material;
+    };
+
+    std::vector<StateInfo> states;
+    std::vector<ProgramState> programs;
+    std::vector<DrawPacket> merged;
+    std::vector<glm::mat4> matrices;
+    std::vector<GLuint> usedTextures;
+    DrawStats stats;
+    float farPlane;
+
+    static bool compareKeys(const DrawPacket &a, const DrawPacket &b)
+    {
+        return a.key < b.key;
+    }
+
+    static unsigned int indexSize(GLenum type)
+    {
+        if (type == GL_UNSIGNED_BYTE)
+            return 1;
+        if (type == GL_UNSIGNED_SHORT)
+            return 2;
+        return 4;
+    }
+
+    void resetStats()
+    {
+        stats.drawCalls = 0;
+        stats.programSwitches = 0;
+        stats.textureBinds = 0;
+        stats.vaoBinds = 0;
+        stats.stateChanges = 0;
+    }
+
+    // programs are numbered in registration order, unknown programs sort last
+    unsigned int programIndex(GLuint program) const
+    {
+        for (unsigned int i = 0; i < programs.size(); i++)
+            if (programs[i].program == program)
+                return i;
+        return 0xFF;
+    }
+
+    // states sharing the same set of bound textures get the same material id
+    static unsigned int materialId(const DrawState &state)
+    {
+        uint32_t hash = 2166136261u;
+        for (unsigned int i = 0; i < state.numTextures; i++)
+        {
+            hash = (hash ^ state.textures[i].unit) * 16777619u;
+            hash = (hash ^ state.textures[i].id) * 16777619u;
+        }
+        return (hash ^ (hash >> 16)) & 0xFFFF;
+    }
+
+    uint64_t quantizeDepth(float depth) const
+    {
+        float d = depth / farPlane;
+        if (d < 0.0f)
+            d = 0.0f;
+        if (d > 1.0f)
+            d = 1.0f;
+        return (uint64_t)(d * (float)0xFFFFFF);
+    }
+};
+
+void CommandList::Add(DrawPass pass, unsigned int state, const glm::mat4 &model, float depth, GLint first, GLsizei count)
+{
+    if (count < 0)
+    {
+        first = list->State(state).first;
+        count = list->State(state).count;
+    }
+    DrawPacket packet;
+    packet.key = list->MakeKey(pass, state, depth, (unsigned int)packets.size());
+    packet.state = state;
+    packet.matrix = (uint32_t)matrices.size();
+    packet.first = first;
+    packet.count = count;
+    matrices.push_back(model);
+    packets.push_back(packet);
+}
+#endif
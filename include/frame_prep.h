@@ -0,0 +1,222 @@
+
+
+#ifndef FRAME_PREP_H
+#define FRAME_PREP_H
+
+#include <glm/glm.hpp>
+
+#include <draw_list.h>
+#include <job_system.h>
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+// View frustum as six planes (xyz = normal pointing inside, w = distance), extracted from a view-projection matrix.
+struct Frustum {
+    glm::vec4 planes[6];
+
+    Frustum()
+    {
+    }
+
+    explicit Frustum(const glm::mat4 &viewProjection)
+    {
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; i++)
+            rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+        planes[0] = rows[3] + rows[0]; // left
+        planes[1] = rows[3] - rows[0]; // right
+        planes[2] = rows[3] + rows[1]; // bottom
+        planes[3] = rows[3] - rows[1]; // top
+        planes[4] = rows[3] + rows[2]; // near
+        planes[5] = rows[3] - rows[2]; // far
+        for (int i = 0; i < 6; i++)
+            planes[i] = planes[i] / glm::length(glm::vec3(planes[i]));
+    }
+
+    // conservative test, returns false only if the box is completely outside one of the planes
+    bool IntersectsBox(const glm::vec3 &boxMin, const glm::vec3 &boxMax) const
+    {
+        for (int i = 0; i < 6; i++)
+        {
+            // corner of the box furthest along the plane normal
+            glm::vec3 p(planes[i].x >= 0.0f ? boxMax.x : boxMin.x,
+                        planes[i].y >= 0.0f ? boxMax.y : boxMin.y,
+                        planes[i].z >= 0.0f ? boxMax.z : boxMin.z);
+            if (glm::dot(glm::vec3(planes[i]), p) + planes[i].w < 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+    bool IntersectsSphere(const glm::vec3 &center, float radius) const
+    {
+        for (int i = 0; i < 6; i++)
+            if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius)
+                return false;
+        return true;
+    }
+};
+
+// Everything a frame job may read. Filled on the GL thread before the jobs start and never written while they run.
+// Rendering is camera relative: view has the camera at the origin, the frustum is in that space, and model
+// matrices are recorded relative to cameraWorld (see relativeModel()).
+struct FrameContext {
+    glm::mat4  view;
+    glm::mat4  projection;
+    glm::mat4  viewProjection;
+    glm::dvec3 cameraWorld;
+    Frustum    frustum;
+    float      time;
+};
+
+// local placed at a world position, relative to the camera. The difference is taken in double precision and
+// only the offset is rounded to float, which is small wherever the precision is visible.
+inline glm::mat4 relativeModel(const FrameContext &context, const glm::dvec3 &origin,
+                               const glm::mat4 &local = glm::mat4(1.0f))
+{
+    glm::mat4 model = local;
+    model[3] = local[3] + glm::vec4(glm::vec3(origin - context.cameraWorld), 0.0f);
+    return model;
+}
+
+// the same for a model matrix that already holds its world position
+inline glm::mat4 relativeModel(const FrameContext &context, const glm::mat4 &world)
+{
+    glm::mat4 model = world;
+    model[3] = glm::vec4(glm::vec3(glm::dvec3(glm::vec3(world[3])) - context.cameraWorld), 1.0f);
+    return model;
+}
+
+// Splits frame preparation into a job phase and a submission phase. Jobs are registered once and run every
+// frame on the job system, each one recording culled, keyed draws with their packed matrices into its
+// own command list. The GL thread then merges the lists and replays them through the DrawList.
+class FramePrep
+{
+public:
+    typedef std::function<void(const FrameContext &, CommandList &)> Job;
+
+    // per-frame timings in milliseconds
+    double prepareMs;
+    double submitMs;
+
+    FramePrep(DrawList &drawList, JobSystem &jobs) : prepareMs(0.0), submitMs(0.0), drawList(drawList), jobs(jobs)
+    {
+    }
+
+    ~FramePrep()
+    {
+        for (size_t i = 0; i < lists.size(); i++)
+            delete lists[i];
+    }
+
+    void AddJob(Job job)
+    {
+        frameJobs.push_back(job);
+        lists.push_back(new CommandList());
+    }
+
+    // runs every job for this frame, blocks until all command lists are recorded
+    void Prepare(const FrameContext &context)
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        JobCounter counter;
+        for (size_t i = 0; i < frameJobs.size(); i++)
+        {
+            CommandList *commands = lists[i];
+            commands->Begin(drawList);
+            Job *job = &frameJobs[i];
+            const FrameContext *ctx = &context;
+            jobs.Run([job, ctx, commands]() { (*job)(*ctx, *commands); }, &counter);
+        }
+        jobs.Wait(counter);
+        prepareMs = millisecondsSince(start);
+    }
+
+    // replays the recorded command lists, GL thread only
+    void Submit()
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        if (!lists.empty())
+            drawList.Submit(&lists[0], (unsigned int)lists.size());
+        submitMs = millisecondsSince(start);
+    }
+
+    unsigned int NumWorkers() const { return jobs.NumWorkers(); }
+
+private:
+    DrawList &drawList;
+    JobSystem &jobs;
+    std::vector<Job> frameJobs;
+    std::vector<CommandList*> lists;
+
+    static double millisecondsSince(std::chrono::high_resolution_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+};
+
+// Records the terrain patch grid built in main() (rez x rez patches of NUM_PATCH_PTS control points, patch
+// (i, j) starting at vertex 4 * (i * rez + j)) centred on origin, with every patch outside the frustum culled.
+// Control points are relative to their patch's corner and every patch is its own packet, placed relative to the
+// camera, so that no vertex ever holds a large coordinate.
+inline void recordTerrainPatches(const FrameContext &context, CommandList &commands, unsigned int state,
+                                 const glm::dvec3 &origin, double width, double height, unsigned int rez,
+                                 float minHeight, float maxHeight)
+{
+    const GLsizei patchPoints = 4;
+    glm::vec3 patchSize((float)(width / rez), 0.0f, (float)(height / rez));
+    for (unsigned int i = 0; i < rez; i++)
+    {
+        for (unsigned int j = 0; j < rez; j++)
+        {
+            glm::dvec3 corner = origin + glm::dvec3(-width / 2.0 + width * i / rez, 0.0, -height / 2.0 + height * j / rez);
+            glm::mat4 model = relativeModel(context, corner);
+            glm::vec3 boxMin = glm::vec3(model[3]) + glm::vec3(0.0f, minHeight, 0.0f);
+            glm::vec3 boxMax = glm::vec3(model[3]) + patchSize + glm::vec3(0.0f, maxHeight, 0.0f);
+            if (!context.frustum.IntersectsBox(boxMin, boxMax))
+                continue;
+            float depth = glm::length((boxMin + boxMax) * 0.5f);
+            commands.Add(PASS_OPAQUE, state, model, depth, (GLint)(patchPoints * (i * rez + j)), patchPoints);
+        }
+    }
+}
+
+// A placed copy of a model. The bounding sphere is derived from the object space bounds and the model matrix,
+// instances further away than drawDistance are dropped (the only level of detail there is for now).
+struct ModelInstance {
+    glm::mat4 model;
+    glm::vec3 center;
+    float     radius;
+    float     drawDistance;
+
+    ModelInstance(const glm::mat4 &model, const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, float drawDistance)
+        : model(model), drawDistance(drawDistance)
+    {
+        glm::vec3 localCenter = (boundsMin + boundsMax) * 0.5f;
+        center = glm::vec3(model * glm::vec4(localCenter, 1.0f));
+        glm::vec3 corner = glm::vec3(model * glm::vec4(boundsMax, 1.0f));
+        radius = glm::distance(center, corner);
+    }
+};
+
+// Culls and records a list of instances of one model, placed relative to the camera. Works with anything that has
+// Submit(CommandList &, const glm::mat4 &, float), in practice Model.
+template <typename M>
+void recordModelInstances(const FrameContext &context, CommandList &commands, const M &model,
+                          const std::vector<ModelInstance> &instances)
+{
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        const ModelInstance &instance = instances[i];
+        glm::vec3 center = glm::vec3(glm::dvec3(instance.center) - context.cameraWorld);
+        float depth = glm::length(center);
+        if (depth - instance.radius > instance.drawDistance)
+            continue;
+        if (!context.frustum.IntersectsSphere(center, instance.radius))
+            continue;
+        model.Submit(commands, relativeModel(context, instance.model), depth);
+    }
+}
+#endif
@@ -0,0 +1,407 @@
+
+
+#ifndef HEIGHT_FIELD_H
+#define HEIGHT_FIELD_H
+
+#include <glm/glm.hpp>
+
+#include <content_hash.h>
+#include <terrain_dataset.h>
+#include <tile_fetch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HEIGHT_FIELD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HEIGHT_FIELD_SSE2 1
+#endif
+
+// The terrain heights on the CPU, for ground following, placing objects and gameplay queries.
+//
+// Samples are kept in 32x32 tiles of 2 KiB, row major tile by tile and in Z order (Morton order) inside a tile, so
+// the four samples of a bilinear lookup are almost always in the same cache line and queries that wander in any
+// direction touch few lines. Heights are filtered the way the tessellation evaluation shader samples the height
+// layer with linear filtering: level 0 texel centres at i + 0.5, edges clamped, the 16 bit samples normalised and
+// scaled by the dataset's heightScale and heightOffset. The terrain is centred on the world origin like the
+// patches in main().
+//
+// HeightsAt() and NormalsAt() answer batches, eight queries at a time with AVX2 (built with -mavx2) or four with
+// SSE2, and one at a time otherwise; they return what HeightAt() and NormalAt() return for the same points.
+class HeightField
+{
+public:
+    HeightField() : width(0), height(0), tilesX(0), tilesY(0), texelSize(1.0f), heightOffset(0.0f), heightScale(1.0f)
+    {
+        configure();
+    }
+
+    // width x height samples, row major, texelSize world units apart
+    void Assign(const uint16_t *samples, int width, int height, float texelSize, float heightOffset, float heightScale)
+    {
+        resize(width, height, texelSize, heightOffset, heightScale);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                store[address(x, y)] = samples[(size_t)y * width + x];
+        padEdges();
+    }
+
+    // level 0 of layer, read in place from a mapped dataset and fetched through source from any other
+    bool Load(const TerrainDataset &dataset, int layer, TileFetcher *source = 0, const std::string &resource = "")
+    {
+        const TerrainFileHeader &header = dataset.Header();
+        if (!dataset.IsOpen() || layer < 0 || layer >= dataset.Layers() || header.layer[layer].format != TERRAIN_R16 ||
+            (!dataset.IsMapped() && !source))
+            return false;
+        resize((int)header.width, (int)header.height, header.texelSize, header.heightOffset, header.heightScale);
+        const TerrainLevelRecord &level = dataset.Level(0);
+
+        std::mutex mutex;
+        std::condition_variable done;
+        unsigned int pending = 0;
+        bool ok = true;
+        for (uint32_t ty = 0; ty < level.tilesY; ty++)
+            for (uint32_t tx = 0; tx < level.tilesX; tx++)
+            {
+                if (dataset.IsMapped())
+                {
+                    copyTile(header, (int)tx, (int)ty, (const uint16_t*)dataset.Tile(0, (int)tx, (int)ty, layer));
+                    continue;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    pending++;
+                }
+                source->Fetch(resource, dataset.RecordOffset(0, (int)tx, (int)ty) + header.layer[layer].offset,
+                              header.TileBytes(layer), [&, tx, ty](const unsigned char *data, size_t)
+                {
+                    // tiles do not overlap, so they are copied in without the lock
+                    if (data)
+                        copyTile(header, (int)tx, (int)ty, (const uint16_t*)data);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ok = ok && data != 0;
+                    pending--;
+                    done.notify_all();
+                });
+            }
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pending > 0)
+            done.wait(lock);
+        if (!ok)
+        {
+            resize(0, 0, texelSize, heightOffset, heightScale);
+            return false;
+        }
+        padEdges();
+        return true;
+    }
+
+    // replaces samples [x0, x1) x [y0, y1), clipped to the field, from rows of x1 - x0 samples
+    void Write(int x0, int y0, int x1, int y1, const uint16_t *samples)
+    {
+        int left = std::max(x0, 0), top = std::max(y0, 0), right = std::min(x1, width), bottom = std::min(y1, height);
+        if (left >= right || top >= bottom)
+            return;
+        for (int y = top; y < bottom; y++)
+            for (int x = left; x < right; x++)
+                store[address(x, y)] = samples[(size_t)(y - y0) * (x1 - x0) + (x - x0)];
+        if (right == width || bottom == height)
+            padEdges(left, top, right, bottom);
+    }
+
+    bool Empty() const { return width == 0; }
+    int Width() const { return width; }
+    int Height() const { return height; }
+    float TexelSize() const { return texelSize; }
+    float HeightOffset() const { return heightOffset; }
+    float HeightScale() const { return heightScale; }
+    size_t Bytes() const { return store.size() * sizeof(uint16_t); }
+
+    // hash of the samples and of how they are scaled, for caches of what is derived from the heights
+    uint64_t ContentHash() const
+    {
+        float scales[3] = { texelSize, heightOffset, heightScale };
+        uint64_t hash = hashBytes((const unsigned char*)scales, sizeof(scales), ((uint64_t)width << 32) | (uint32_t)height);
+        return store.empty() ? hash : hashBytes((const unsigned char*)&store[0], store.size() * sizeof(uint16_t), hash);
+    }
+
+    static const char *SimdPath()
+    {
+#if defined(HEIGHT_FIELD_AVX2)
+        return "AVX2";
+#elif defined(HEIGHT_FIELD_SSE2)
+        return "SSE2";
+#else
+        return "scalar";
+#endif
+    }
+
+    // sample (x, y), clamped to the field
+    uint16_t Sample(int x, int y) const
+    {
+        return store[address(std::min(std::max(x, 0), width - 1), std::min(std::max(y, 0), height - 1))];
+    }
+
+    // world height at (x, z), 0 on an empty field
+    float HeightAt(float x, float z) const
+    {
+        if (width == 0)
+            return 0.0f;
+        // continuous sample coordinates, kept a texel outside the field so that the conversions stay in range
+        float sx = std::min(std::max(x * invTexelSize + centreX, -1.0f), limitX);
+        float sz = std::min(std::max(z * invTexelSize + centreZ, -1.0f), limitZ);
+        float x0 = std::floor(sx), z0 = std::floor(sz);
+        float fx = sx - x0, fz = sz - z0;
+        int ix0 = (int)std::min(std::max(x0, 0.0f), lastX), ix1 = (int)std::max(std::min(x0 + 1.0f, lastX), 0.0f);
+        int iz0 = (int)std::min(std::max(z0, 0.0f), lastZ), iz1 = (int)std::max(std::min(z0 + 1.0f, lastZ), 0.0f);
+        float h00 = store[address(ix0, iz0)], h10 = store[address(ix1, iz0)];
+        float h01 = store[address(ix0, iz1)], h11 = store[address(ix1, iz1)];
+        float top = h00 + (h10 - h00) * fx;
+        float bottom = h01 + (h11 - h01) * fx;
+        return heightOffset + (top + (bottom - top) * fz) * sampleScale;
+    }
+
+    // up facing unit normal at (x, z), from central differences one texel to either side
+    glm::vec3 NormalAt(float x, float z) const
+    {
+        float left = HeightAt(x - texelSize, z), right = HeightAt(x + texelSize, z);
+        float back = HeightAt(x, z - texelSize), front = HeightAt(x, z + texelSize);
+        return normalFrom(left, right, back, front);
+    }
+
+    void HeightsAt(const float *x, const float *z, float *out, size_t count) const
+    {
+        if (width == 0)
+        {
+            std::fill(out, out + count, 0.0f);
+            return;
+        }
+        size_t i = 0;
+#if defined(HEIGHT_FIELD_AVX2)
+        for (; i + 8 <= count; i += 8)
+            heights8(x + i, z + i, out + i);
+#elif defined(HEIGHT_FIELD_SSE2)
+        for (; i + 4 <= count; i += 4)
+            heights4(x + i, z + i, out + i);
+#endif
+        for (; i < count; i++)
+            out[i] = HeightAt(x[i], z[i]);
+    }
+
+    void NormalsAt(const float *x, const float *z, glm::vec3 *out, size_t count) const
+    {
+        // the four neighbours of a block of queries are looked up as batches of their own
+        const size_t block = 64;
+        float px[block], pz[block], left[block], right[block], back[block], front[block];
+        for (size_t first = 0; first < count; first += block)
+        {
+            size_t n = std::min(block, count - first);
+            for (size_t i = 0; i < n; i++)
+            {
+                px[i] = x[first + i] - texelSize;
+                pz[i] = z[first + i];
+            }
+            HeightsAt(px, pz, left, n);
+            for (size_t i = 0; i < n; i++)
+                px[i] = x[first + i] + texelSize;
+            HeightsAt(px, pz, right, n);
+            for (size_t i = 0; i < n; i++)
+            {
+                px[i] = x[first + i];
+                pz[i] = z[first + i] - texelSize;
+            }
+            HeightsAt(px, pz, back, n);
+            for (size_t i = 0; i < n; i++)
+                pz[i] = z[first + i] + texelSize;
+            HeightsAt(px, pz, front, n);
+            for (size_t i = 0; i < n; i++)
+                out[first + i] = normalFrom(left[i], right[i], back[i], front[i]);
+        }
+    }
+
+private:
+    static const int TILE_SHIFT = 5;    // 32x32 samples per tile
+    static const int TILE = 1 << TILE_SHIFT;
+
+    int width, height;
+    int tilesX, tilesY;
+    float texelSize;
+    float heightOffset, heightScale;
+    // derived from the above by configure()
+    float invTexelSize, sampleScale;
+    float centreX, centreZ;     // sample coordinate of the world origin, minus the half texel to the centres
+    float limitX, limitZ;       // furthest sample coordinate kept, a texel past the last sample
+    float lastX, lastZ;
+    std::vector<uint16_t> store;
+
+    void resize(int width, int height, float texelSize, float heightOffset, float heightScale)
+    {
+        this->width = std::max(width, 0);
+        this->height = std::max(height, 0);
+        this->texelSize = texelSize > 0.0f ? texelSize : 1.0f;
+        this->heightOffset = heightOffset;
+        this->heightScale = heightScale;
+        tilesX = (this->width + TILE - 1) >> TILE_SHIFT;
+        tilesY = (this->height + TILE - 1) >> TILE_SHIFT;
+        // one sample more, the AVX2 path reads two samples at a time
+        store.assign(this->width ? (size_t)tilesX * tilesY * TILE * TILE + 1 : 0, 0);
+        configure();
+    }
+
+    void configure()
+    {
+        invTexelSize = 1.0f / texelSize;
+        sampleScale = heightScale / 65535.0f;
+        centreX = width * 0.5f - 0.5f;
+        centreZ = height * 0.5f - 0.5f;
+        limitX = (float)width;
+        limitZ = (float)height;
+        lastX = (float)(width - 1);
+        lastZ = (float)(height - 1);
+    }
+
+    // the bits of a 5 bit value spread to the even bits
+    static uint32_t spread(uint32_t v)
+    {
+        v = (v | (v << 4)) & 0x0F0Fu;
+        v = (v | (v << 2)) & 0x3333u;
+        return (v | (v << 1)) & 0x5555u;
+    }
+
+    size_t address(int x, int y) const
+    {
+        size_t tile = (size_t)(y >> TILE_SHIFT) * tilesX + (size_t)(x >> TILE_SHIFT);
+        return (tile << (2 * TILE_SHIFT)) | spread((uint32_t)x & (TILE - 1)) | (spread((uint32_t)y & (TILE - 1)) << 1);
+    }
+
+    // level 0 tile (tx, ty) of the dataset without its borders
+    void copyTile(const TerrainFileHeader &header, int tx, int ty, const uint16_t *texels)
+    {
+        if (!texels)
+            return;
+        uint32_t dim = header.TileDim();
+        int x0 = tx * (int)header.tileSize, y0 = ty * (int)header.tileSize;
+        int x1 = std::min(x0 + (int)header.tileSize, width), y1 = std::min(y0 + (int)header.tileSize, height);
+        for (int y = y0; y < y1; y++)
+        {
+            const uint16_t *row = texels + (size_t)(y - y0 + header.border) * dim + header.border;
+            for (int x = x0; x < x1; x++)
+                store[address(x, y)] = row[x - x0];
+        }
+    }
+
+    // the padding of the partial tiles on the right and bottom repeats the edge, nothing reads it but it keeps
+    // the store the same whichever way it was filled. Only the padding next to samples [x0, x1) x [y0, y1).
+    void padEdges(int x0, int y0, int x1, int y1)
+    {
+        int right = x1 == width ? tilesX * TILE : x1, bottom = y1 == height ? tilesY * TILE : y1;
+        for (int y = y0; y < bottom; y++)
+            for (int x = x0; x < right; x++)
+                if (x >= width || y >= height)
+                    store[address(x, y)] = Sample(x, y);
+    }
+
+    void padEdges()
+    {
+        padEdges(0, 0, width, height);
+    }
+
+    glm::vec3 normalFrom(float left, float right, float back, float front) const
+    {
+        return glm::normalize(glm::vec3(left - right, 2.0f * texelSize, back - front));
+    }
+
+#if defined(HEIGHT_FIELD_AVX2)
+    static __m256i spread8(__m256i v)
+    {
+        v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 4)), _mm256_set1_epi32(0x0F0F));
+        v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 2)), _mm256_set1_epi32(0x3333));
+        return _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 1)), _mm256_set1_epi32(0x5555));
+    }
+
+    __m256i address8(__m256i x, __m256i y) const
+    {
+        __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y, TILE_SHIFT), _mm256_set1_epi32(tilesX)),
+                                        _mm256_srli_epi32(x, TILE_SHIFT));
+        __m256i mask = _mm256_set1_epi32(TILE - 1);
+        __m256i inside = _mm256_or_si256(spread8(_mm256_and_si256(x, mask)),
+                                         _mm256_slli_epi32(spread8(_mm256_and_si256(y, mask)), 1));
+        return _mm256_or_si256(_mm256_slli_epi32(tile, 2 * TILE_SHIFT), inside);
+    }
+
+    // 32 bit gathers of the 16 bit samples, the upper half is the next sample and masked off
+    __m256 gather8(__m256i address) const
+    {
+        __m256i samples = _mm256_i32gather_epi32((const int*)&store[0], address, 2);
+        return _mm256_cvtepi32_ps(_mm256_and_si256(samples, _mm256_set1_epi32(0xFFFF)));
+    }
+
+    void heights8(const float *x, const float *z, float *out) const
+    {
+        __m256 sx = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x), _mm256_set1_ps(invTexelSize)), _mm256_set1_ps(centreX));
+        __m256 sz = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(z), _mm256_set1_ps(invTexelSize)), _mm256_set1_ps(centreZ));
+        sx = _mm256_min_ps(_mm256_max_ps(sx, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(limitX));
+        sz = _mm256_min_ps(_mm256_max_ps(sz, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(limitZ));
+        __m256 x0 = _mm256_floor_ps(sx), z0 = _mm256_floor_ps(sz);
+        __m256 fx = _mm256_sub_ps(sx, x0), fz = _mm256_sub_ps(sz, z0);
+        __m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+        __m256i ix0 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(x0, zero), _mm256_set1_ps(lastX)));
+        __m256i iz0 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(z0, zero), _mm256_set1_ps(lastZ)));
+        __m256i ix1 = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(_mm256_add_ps(x0, one), _mm256_set1_ps(lastX)), zero));
+        __m256i iz1 = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(_mm256_add_ps(z0, one), _mm256_set1_ps(lastZ)), zero));
+        __m256 h00 = gather8(address8(ix0, iz0)), h10 = gather8(address8(ix1, iz0));
+        __m256 h01 = gather8(address8(ix0, iz1)), h11 = gather8(address8(ix1, iz1));
+        __m256 top = _mm256_add_ps(h00, _mm256_mul_ps(_mm256_sub_ps(h10, h00), fx));
+        __m256 bottom = _mm256_add_ps(h01, _mm256_mul_ps(_mm256_sub_ps(h11, h01), fx));
+        __m256 blend = _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bottom, top), fz));
+        _mm256_storeu_ps(out, _mm256_add_ps(_mm256_set1_ps(heightOffset), _mm256_mul_ps(blend, _mm256_set1_ps(sampleScale))));
+    }
+#elif defined(HEIGHT_FIELD_SSE2)
+    // SSE2 has neither floor nor gathers: floor is truncation corrected for negative values and the samples
+    // are fetched one by one, the filtering around them is four wide
+    static __m128 floor4(__m128 v)
+    {
+        __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+        return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, v), _mm_set1_ps(1.0f)));
+    }
+
+    void heights4(const float *x, const float *z, float *out) const
+    {
+        __m128 sx = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x), _mm_set1_ps(invTexelSize)), _mm_set1_ps(centreX));
+        __m128 sz = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(z), _mm_set1_ps(invTexelSize)), _mm_set1_ps(centreZ));
+        sx = _mm_min_ps(_mm_max_ps(sx, _mm_set1_ps(-1.0f)), _mm_set1_ps(limitX));
+        sz = _mm_min_ps(_mm_max_ps(sz, _mm_set1_ps(-1.0f)), _mm_set1_ps(limitZ));
+        __m128 x0 = floor4(sx), z0 = floor4(sz);
+        __m128 fx = _mm_sub_ps(sx, x0), fz = _mm_sub_ps(sz, z0);
+        __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+        int ix0[4], iz0[4], ix1[4], iz1[4];
+        _mm_storeu_si128((__m128i*)ix0, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(x0, zero), _mm_set1_ps(lastX))));
+        _mm_storeu_si128((__m128i*)iz0, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z0, zero), _mm_set1_ps(lastZ))));
+        _mm_storeu_si128((__m128i*)ix1, _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_add_ps(x0, one), _mm_set1_ps(lastX)), zero)));
+        _mm_storeu_si128((__m128i*)iz1, _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_add_ps(z0, one), _mm_set1_ps(lastZ)), zero)));
+        float s00[4], s10[4], s01[4], s11[4];
+        for (int i = 0; i < 4; i++)
+        {
+            s00[i] = store[address(ix0[i], iz0[i])];
+            s10[i] = store[address(ix1[i], iz0[i])];
+            s01[i] = store[address(ix0[i], iz1[i])];
+            s11[i] = store[address(ix1[i], iz1[i])];
+        }
+        __m128 h00 = _mm_loadu_ps(s00), h10 = _mm_loadu_ps(s10), h01 = _mm_loadu_ps(s01), h11 = _mm_loadu_ps(s11);
+        __m128 top = _mm_add_ps(h00, _mm_mul_ps(_mm_sub_ps(h10, h00), fx));
+        __m128 bottom = _mm_add_ps(h01, _mm_mul_ps(_mm_sub_ps(h11, h01), fx));
+        __m128 blend = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), fz));
+        _mm_storeu_ps(out, _mm_add_ps(_mm_set1_ps(heightOffset), _mm_mul_ps(blend, _mm_set1_ps(sampleScale))));
+    }
+#endif
+};
+#endif
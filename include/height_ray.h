@@ -0,0 +1,343 @@
+
+
+#ifndef HEIGHT_RAY_H
+#define HEIGHT_RAY_H
+
+#include <glm/glm.hpp>
+
+#include <baked_file.h>
+#include <height_field.h>
+#include <job_system.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Where a ray met the terrain
+struct HeightRayHit {
+    float     distance;     // along the ray in lengths of its direction, negative if it missed
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texCoord;     // terrain uv, the texCoord of the shaders
+};
+
+// Ray casting against a HeightField for picking, line of sight and shadow tests, through a maximum mipmap.
+//
+// The surface is the one HeightField::HeightAt() filters, bilinear between the sample centres, and rays are
+// tested against the part of it between the outermost centres. Cell (x, y) of level 0 spans samples x..x+1 and
+// y..y+1 and holds the highest of the four, every coarser level the highest of the 2x2 cells below. A ray walks
+// the cells of the coarsest level first: a cell it passes entirely above is stepped over in one go, one it may
+// touch is opened into its four children, and on level 0 the ray is intersected with the bilinear patch exactly
+// (a quadratic). After every step over a cell the walk goes back up a level, so open terrain is crossed in
+// large steps and only the cells close to the surface are visited at full resolution.
+//
+// The pyramid is built from the field once; after the heights change Update() the cells over them, or Build()
+// again. Given a baked file (see baked_file.h, tools/terrain_bake writes one next to the dataset) it is read from
+// there while it was built from the same heights, and built and written there otherwise.
+class HeightRayCaster
+{
+public:
+    static const uint32_t VERSION = 1;  // of the baked file
+
+    explicit HeightRayCaster(const HeightField &field, JobSystem *jobs = nullptr, const std::string &baked = std::string())
+        : field(field)
+    {
+        if (!baked.empty() && Read(baked))
+            return;
+        Build(jobs);
+        if (!baked.empty())
+            Write(baked);
+    }
+
+    void Build(JobSystem *jobs = nullptr)
+    {
+        levels.clear();
+        if (field.Empty())
+            return;
+        Level base;
+        base.width = std::max(field.Width() - 1, 1);
+        base.height = std::max(field.Height() - 1, 1);
+        base.cells.resize((size_t)base.width * base.height);
+        parallelFor(jobs, 0, (size_t)base.height, 16, [&](size_t begin, size_t end)
+        {
+            for (int y = (int)begin; y < (int)end; y++)
+                for (int x = 0; x < base.width; x++)
+                    base.cells[(size_t)y * base.width + x] = std::max(std::max(field.Sample(x, y), field.Sample(x + 1, y)),
+                                                                      std::max(field.Sample(x, y + 1), field.Sample(x + 1, y + 1)));
+        });
+        levels.push_back(base);
+        while (levels.back().width > 1 || levels.back().height > 1)
+        {
+            const Level &finer = levels.back();
+            Level level;
+            level.width = (finer.width + 1) / 2;
+            level.height = (finer.height + 1) / 2;
+            level.cells.resize((size_t)level.width * level.height);
+            for (int y = 0; y < level.height; y++)
+                for (int x = 0; x < level.width; x++)
+                {
+                    int x1 = std::min(x * 2 + 1, finer.width - 1), y1 = std::min(y * 2 + 1, finer.height - 1);
+                    level.cells[(size_t)y * level.width + x] = std::max(std::max(finer.At(x * 2, y * 2), finer.At(x1, y * 2)),
+                                                                        std::max(finer.At(x * 2, y1), finer.At(x1, y1)));
+                }
+            levels.push_back(level);
+        }
+    }
+
+    // after samples [x0, x1) x [y0, y1) of the field changed: the cells over them and the cells above those
+    void Update(int x0, int y0, int x1, int y1)
+    {
+        if (levels.empty())
+            return;
+        // a cell spans its sample and the next, so the cell before the rectangle changes with it
+        x0 = std::max(x0 - 1, 0);
+        y0 = std::max(y0 - 1, 0);
+        x1 = std::min(x1, levels[0].width);
+        y1 = std::min(y1, levels[0].height);
+        if (x0 >= x1 || y0 >= y1)
+            return;
+        Level &base = levels[0];
+        for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x++)
+                base.cells[(size_t)y * base.width + x] = std::max(std::max(field.Sample(x, y), field.Sample(x + 1, y)),
+                                                                  std::max(field.Sample(x, y + 1), field.Sample(x + 1, y + 1)));
+        for (size_t l = 1; l < levels.size(); l++)
+        {
+            const Level &finer = levels[l - 1];
+            Level &level = levels[l];
+            x0 >>= 1;
+            y0 >>= 1;
+            x1 = ((x1 - 1) >> 1) + 1;
+            y1 = ((y1 - 1) >> 1) + 1;
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                {
+                    int cx1 = std::min(x * 2 + 1, finer.width - 1), cy1 = std::min(y * 2 + 1, finer.height - 1);
+                    level.cells[(size_t)y * level.width + x] = std::max(std::max(finer.At(x * 2, y * 2), finer.At(cx1, y * 2)),
+                                                                        std::max(finer.At(x * 2, cy1), finer.At(cx1, cy1)));
+                }
+        }
+    }
+
+    // the pyramid of a baked file, false if it was built from other heights
+    bool Read(const std::string &path)
+    {
+        BakedFileReader reader;
+        uint32_t count = 0;
+        if (!reader.Open(path, bakedKind("MAXM"), VERSION, field.ContentHash()) || !reader.GetValue(count))
+            return false;
+        std::vector<Level> read(count);
+        for (uint32_t i = 0; i < count; i++)
+            if (!reader.GetValue(read[i].width) || !reader.GetValue(read[i].height) || !reader.Get(read[i].cells) ||
+                read[i].cells.size() != (size_t)read[i].width * read[i].height)
+                return false;
+        if (read.empty() || read[0].width != std::max(field.Width() - 1, 1) ||
+            read[0].height != std::max(field.Height() - 1, 1))
+            return false;
+        levels.swap(read);
+        return true;
+    }
+
+    bool Write(const std::string &path) const
+    {
+        BakedFileWriter writer;
+        if (!writer.Create(path, bakedKind("MAXM"), VERSION, field.ContentHash()))
+            return false;
+        writer.PutValue((uint32_t)levels.size());
+        for (size_t i = 0; i < levels.size(); i++)
+        {
+            writer.PutValue(levels[i].width);
+            writer.PutValue(levels[i].height);
+            writer.Put(levels[i].cells);
+        }
+        return writer.Finish();
+    }
+
+    int Levels() const { return (int)levels.size(); }
+
+    size_t Bytes() const
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < levels.size(); i++)
+            bytes += levels[i].cells.size() * sizeof(uint16_t);
+        return bytes;
+    }
+
+    // the first point of the terrain on origin + direction * t, 0 <= t <= maxDistance
+    bool Cast(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, HeightRayHit &hit) const
+    {
+        hit.distance = -1.0f;
+        double t;
+        if (levels.empty() || !walk(origin, direction, maxDistance, t))
+            return false;
+        hit.distance = (float)t;
+        hit.position = origin + direction * (float)t;
+        hit.normal = field.NormalAt(hit.position.x, hit.position.z);
+        hit.texCoord = glm::vec2((hit.position.x / field.TexelSize()) / field.Width() + 0.5f,
+                                 (hit.position.z / field.TexelSize()) / field.Height() + 0.5f);
+        return true;
+    }
+
+    // true if the terrain is between from and to, for line of sight and shadow rays
+    bool Occluded(const glm::vec3 &from, const glm::vec3 &to) const
+    {
+        double t;
+        return !levels.empty() && walk(from, to - from, 1.0f, t) && t < 1.0;
+    }
+
+    // hits[i] for the ray from origins[i] along directions[i], spread over the job system if there is one
+    void CastBatch(const glm::vec3 *origins, const glm::vec3 *directions, size_t count, float maxDistance,
+                   HeightRayHit *hits, JobSystem *jobs = nullptr) const
+    {
+        parallelFor(jobs, 0, count, 64, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                Cast(origins[i], directions[i], maxDistance, hits[i]);
+        });
+    }
+
+private:
+    struct Level {
+        int width, height;
+        std::vector<uint16_t> cells;
+
+        uint16_t At(int x, int y) const { return cells[(size_t)y * width + x]; }
+    };
+
+    const HeightField &field;
+    std::vector<Level> levels;
+
+    HeightRayCaster(const HeightRayCaster &);
+    HeightRayCaster &operator=(const HeightRayCaster &);
+
+    template <typename F>
+    static void parallelFor(JobSystem *jobs, size_t begin, size_t end, size_t grain, const F &fn)
+    {
+        if (jobs)
+            jobs->ParallelFor(begin, end, grain, fn);
+        else
+            fn(begin, end);
+    }
+
+    // narrows [t0, t1] to where o + d * t is within [low, high]
+    static bool clip(double o, double d, double low, double high, double &t0, double &t1)
+    {
+        if (std::fabs(d) < 1e-12)
+            return o >= low && o <= high;
+        double a = (low - o) / d, b = (high - o) / d;
+        t0 = std::max(t0, std::min(a, b));
+        t1 = std::min(t1, std::max(a, b));
+        return t0 <= t1;
+    }
+
+    // the walk is done in sample space: x and z in samples from the first sample centre, y in sample values, with
+    // the ray parameter unchanged
+    bool walk(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, double &hitT) const
+    {
+        double invTexel = 1.0 / field.TexelSize();
+        double sampleScale = field.HeightScale() / 65535.0;
+        if (sampleScale <= 0.0)
+            return false;
+        double ox = origin.x * invTexel + field.Width() * 0.5 - 0.5;
+        double oz = origin.z * invTexel + field.Height() * 0.5 - 0.5;
+        double oy = (origin.y - field.HeightOffset()) / sampleScale;
+        double dx = direction.x * invTexel, dz = direction.z * invTexel, dy = direction.y / sampleScale;
+
+        const Level &base = levels[0];
+        int top = (int)levels.size() - 1;
+        double t0 = 0.0, t1 = maxDistance;
+        if (!clip(ox, dx, 0.0, base.width, t0, t1) || !clip(oz, dz, 0.0, base.height, t0, t1) ||
+            !clip(oy, dy, -std::numeric_limits<double>::max(), levels[top].At(0, 0), t0, t1))
+            return false;
+
+        // cells are found a hair ahead of t so that a ray on a cell edge lands in the cell it is entering
+        double nudge = 1e-9 * std::max(1.0, std::fabs(t1));
+        double infinity = std::numeric_limits<double>::max();
+        double invDx = dx != 0.0 ? 1.0 / dx : 0.0, invDz = dz != 0.0 ? 1.0 / dz : 0.0;
+        int stepX = dx > 0.0 ? 1 : 0, stepZ = dz > 0.0 ? 1 : 0;
+        int level = top;
+        double t = t0;
+        while (t <= t1)
+        {
+            double size = (double)(1 << level), invSize = 1.0 / size;
+            double px = ox + dx * (t + nudge), pz = oz + dz * (t + nudge);
+            const Level &cells = levels[level];
+            int cx = std::min(std::max((int)std::floor(px * invSize), 0), cells.width - 1);
+            int cz = std::min(std::max((int)std::floor(pz * invSize), 0), cells.height - 1);
+            double exitX = dx != 0.0 ? ((cx + stepX) * size - ox) * invDx : infinity;
+            double exitZ = dz != 0.0 ? ((cz + stepZ) * size - oz) * invDz : infinity;
+            double exit = std::max(std::min(std::min(exitX, exitZ), t1), t);
+            double lowest = std::min(oy + dy * t, oy + dy * exit);
+            if (lowest <= cells.At(cx, cz))
+            {
+                if (level > 0)
+                {
+                    level--;
+                    continue;
+                }
+                if (intersectCell(cx, cz, ox, oy, oz, dx, dy, dz, t, exit, hitT))
+                    return true;
+            }
+            if (exit >= t1)
+                break;
+            t = exit > t ? exit : t + nudge;
+            level = std::min(level + 1, top);
+        }
+        return false;
+    }
+
+    // the bilinear patch of level 0 cell (cx, cz) against the ray between t and exit
+    bool intersectCell(int cx, int cz, double ox, double oy, double oz, double dx, double dy, double dz, double t,
+                       double exit, double &hitT) const
+    {
+        double h00 = field.Sample(cx, cz), h10 = field.Sample(cx + 1, cz);
+        double h01 = field.Sample(cx, cz + 1), h11 = field.Sample(cx + 1, cz + 1);
+        double u = ox + dx * t - cx, v = oz + dz * t - cz;
+        double a = h10 - h00, b = h01 - h00, c = h00 - h10 - h01 + h11;
+        // height above the surface along the ray, f(s) = f0 + f1 s + f2 s^2 for s = 0 .. exit - t
+        double f0 = oy + dy * t - (h00 + a * u + b * v + c * u * v);
+        double f1 = dy - (a * dx + b * dz + c * (u * dz + v * dx));
+        double f2 = -c * dx * dz;
+        double end = exit - t;
+        if (f0 <= 0.0)
+        {
+            hitT = t;
+            return true;
+        }
+        double s = -1.0;
+        if (std::fabs(f2) < 1e-12 * (std::fabs(f1) + std::fabs(f0)))
+        {
+            if (f1 < 0.0)
+                s = -f0 / f1;
+        }
+        else
+        {
+            double discriminant = f1 * f1 - 4.0 * f2 * f0;
+            if (discriminant >= 0.0)
+            {
+                // the numerically stable pair of roots, the smaller non-negative one is the entry
+                double q = -0.5 * (f1 + (f1 >= 0.0 ? 1.0 : -1.0) * std::sqrt(discriminant));
+                double r0 = q / f2, r1 = q != 0.0 ? f0 / q : -1.0;
+                if (r0 > r1)
+                    std::swap(r0, r1);
+                s = r0 >= 0.0 ? r0 : r1;
+            }
+        }
+        if (s >= 0.0 && s <= end)
+        {
+            hitT = t + s;
+            return true;
+        }
+        // rounding may miss a root right at the exit
+        if (f0 + f1 * end + f2 * end * end <= 0.0)
+        {
+            hitT = exit;
+            return true;
+        }
+        return false;
+    }
+};
+#endif
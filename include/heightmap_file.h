@@ -0,0 +1,648 @@
+
+
+#ifndef HEIGHTMAP_FILE_H
+#define HEIGHTMAP_FILE_H
+
+#include <job_system.h>
+#include <mapped_file.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HEIGHTMAP_FILE_SSE2 1
+#endif
+
+// Heightmap container (.hmap), a lossless format for height data that decodes many times faster than PNG.
+//
+// The map is cut into square tiles that are coded independently, so they decode in parallel and can be read
+// on their own. Every tile uses the predictor that codes it smallest: the left neighbour, the sample above, or
+// the gradient left + above - above left, which leaves mostly 0 and +-1 on smooth terrain. Residuals are
+// zigzag mapped and packed in groups of 8 at the bit width of the largest one. The widths, 0 for most groups,
+// are entropy coded with rANS over a frequency table per tile, so flat areas cost a fraction of a bit per
+// sample and decoding takes one rANS step per group. Decoding undoes the predictors a row at a time with
+// SSE2: the left predictor is a prefix sum along the row, the one above adds the previous row.
+//
+// Samples are 8 or 16 bit unsigned or 32 bit float. Arithmetic wraps at the sample width and floats are coded
+// as integers that sort like them, so every format round trips exactly.
+//
+// Layout, little endian:
+//   header     16 x uint32: magic, version, width, height, format, tile size, tiles x, tiles y, zeros
+//   directory  tiles + 1 uint64 file offsets, tile i (row major) is [offset i, offset i + 1)
+//   tiles      predictor byte, width count n, n uint16 frequencies of widths 0 to n - 1 summing to 4096,
+//              uint32 size of the rANS data, the two rANS states and 16 bit words,
+//              packed residuals row by row, least significant bit first
+//   padding    8 zero bytes, the raw bits are read 8 bytes at a time
+
+enum HeightFormat {
+    HEIGHT_U8,
+    HEIGHT_U16,
+    HEIGHT_F32
+};
+
+inline size_t heightSampleBytes(HeightFormat format)
+{
+    return format == HEIGHT_U8 ? 1 : (format == HEIGHT_U16 ? 2 : 4);
+}
+
+struct HeightmapInfo {
+    int width;
+    int height;
+    HeightFormat format;
+    int tileSize;
+    int tilesX;
+    int tilesY;
+
+    size_t SampleBytes() const { return heightSampleBytes(format); }
+    size_t Tiles() const { return (size_t)tilesX * tilesY; }
+    size_t DecodedSize() const { return (size_t)width * height * SampleBytes(); }
+};
+
+// container version of a heightmap image: same path with the extension replaced by .hmap
+inline std::string heightmapPathFor(const std::string &path)
+{
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + ".hmap";
+    return path.substr(0, dot) + ".hmap";
+}
+
+static const uint32_t HEIGHTMAP_MAGIC = 0x50414D48; // "HMAP"
+static const int HEIGHTMAP_MAX_TILE = 256;
+static const int HEIGHTMAP_GROUP = 8;           // samples sharing a bit width
+static const int HEIGHTMAP_WIDTHS = 33;         // bit widths 0 to 32
+static const int HEIGHTMAP_PROB_BITS = 12;
+static const uint32_t HEIGHTMAP_RANS_LOW = 1u << 16; // rANS states renormalise 16 bits at a time
+
+enum HeightPredictor {
+    PREDICT_NONE = 0,
+    PREDICT_LEFT = 1,
+    PREDICT_UP = 2,
+    PREDICT_GRADIENT = 3    // both of the above: left + up - up left
+};
+
+// float bits to an unsigned integer of the same order, and back
+inline uint32_t orderedFromFloatBits(uint32_t bits)
+{
+    return bits ^ ((uint32_t)((int32_t)bits >> 31) | 0x80000000u);
+}
+
+inline uint32_t floatBitsFromOrdered(uint32_t ordered)
+{
+    return ordered ^ (((ordered >> 31) - 1u) | 0x80000000u);
+}
+
+// residual of sample width T to unsigned, small magnitudes of either sign first
+template <typename T>
+inline uint32_t zigzagResidual(T residual)
+{
+    T negative = (T)(0 - (residual >> (sizeof(T) * 8 - 1)));
+    return (uint32_t)(T)((T)(residual << 1) ^ negative);
+}
+
+template <typename T>
+inline T unzigzagResidual(uint32_t value)
+{
+    return (T)((value >> 1) ^ (0u - (value & 1u)));
+}
+
+#ifdef HEIGHTMAP_FILE_SSE2
+// prefix sums and broadcasts over the lanes of one register, per sample width
+template <typename T> struct HeightLanes;
+
+template <> struct HeightLanes<uint8_t> {
+    static __m128i add(__m128i a, __m128i b) { return _mm_add_epi8(a, b); }
+    static __m128i prefixSum(__m128i x)
+    {
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    }
+    static __m128i broadcastLast(__m128i x)
+    {
+        x = _mm_shufflehi_epi16(_mm_unpackhi_epi8(x, x), 0xFF);
+        return _mm_unpackhi_epi64(x, x);
+    }
+};
+
+template <> struct HeightLanes<uint16_t> {
+    static __m128i add(__m128i a, __m128i b) { return _mm_add_epi16(a, b); }
+    static __m128i prefixSum(__m128i x)
+    {
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+        return _mm_add_epi16(x, _mm_slli_si128(x, 8));
+    }
+    static __m128i broadcastLast(__m128i x)
+    {
+        x = _mm_shufflehi_epi16(x, 0xFF);
+        return _mm_unpackhi_epi64(x, x);
+    }
+};
+
+template <> struct HeightLanes<uint32_t> {
+    static __m128i add(__m128i a, __m128i b) { return _mm_add_epi32(a, b); }
+    static __m128i prefixSum(__m128i x)
+    {
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    }
+    static __m128i broadcastLast(__m128i x) { return _mm_shuffle_epi32(x, 0xFF); }
+};
+#endif
+
+// Undoes a predictor on one row: out = prefix sum of residual (left) + up (above). count has to be a multiple
+// of 16 bytes worth of samples; up and out may not overlap.
+template <typename T>
+inline void reconstructHeightRow(const T *residual, const T *up, T *out, int count, int predictor)
+{
+#ifdef HEIGHTMAP_FILE_SSE2
+    __m128i carry = _mm_setzero_si128();
+    const int lanes = 16 / sizeof(T);
+    for (int i = 0; i < count; i += lanes)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(residual + i));
+        if (predictor & PREDICT_LEFT)
+        {
+            v = HeightLanes<T>::add(HeightLanes<T>::prefixSum(v), carry);
+            carry = HeightLanes<T>::broadcastLast(v);
+        }
+        if (predictor & PREDICT_UP)
+            v = HeightLanes<T>::add(v, _mm_loadu_si128((const __m128i*)(up + i)));
+        _mm_storeu_si128((__m128i*)(out + i), v);
+    }
+#else
+    T sum = 0;
+    for (int i = 0; i < count; i++)
+    {
+        T v = residual[i];
+        if (predictor & PREDICT_LEFT)
+            v = sum = (T)(sum + v);
+        if (predictor & PREDICT_UP)
+            v = (T)(v + up[i]);
+        out[i] = v;
+    }
+#endif
+}
+
+// frequencies of one tile's widths, decoded by searching the cumulative starts, tiles use only a few widths
+struct HeightWidthTable {
+    int count;
+    uint32_t freq[HEIGHTMAP_WIDTHS];
+    uint32_t start[HEIGHTMAP_WIDTHS];
+};
+
+// Decodes count residuals of one group: the bit width from rANS state s, renormalised from the 16 bit words at
+// rans, then the zigzagged residuals packed at that width. Groups of width 0, most of them on terrain, skip
+// the unpacking. rANS reads stay within the rANS data, which the caller checks for overruns after every row,
+// raw reads stay before bitLimit.
+template <typename T>
+inline bool decodeHeightGroup(uint32_t &s, const HeightWidthTable &table, const unsigned char *&rans,
+                              const unsigned char *ransEnd, const unsigned char *bits, uint64_t &bitPos,
+                              uint64_t bitLimit, int count, T *residual)
+{
+    uint32_t slot = s & ((1u << HEIGHTMAP_PROB_BITS) - 1);
+    int width = 0;
+    for (int t = 1; t < table.count; t++)
+        width += slot >= table.start[t];
+    s = table.freq[width] * (s >> HEIGHTMAP_PROB_BITS) + slot - table.start[width];
+    uint16_t word;
+    memcpy(&word, std::min(rans, ransEnd - 2), 2);
+    bool refill = s < HEIGHTMAP_RANS_LOW;
+    s = refill ? (s << 16) | word : s;
+    rans += refill ? 2 : 0;
+
+    uint64_t end = bitPos + (uint64_t)width * count;
+    if (end > bitLimit)
+        return false;
+    if (width == 0)
+    {
+        memset(residual, 0, count * sizeof(T));
+        return true;
+    }
+    uint64_t mask = (1ull << width) - 1;
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t pos = bitPos + (uint64_t)i * width;
+        uint64_t raw;
+        memcpy(&raw, bits + (pos >> 3), 8);
+        residual[i] = unzigzagResidual<T>((uint32_t)((raw >> (pos & 7)) & mask));
+    }
+    bitPos = end;
+    return true;
+}
+
+// Decodes one tile of w x h samples into dst, rows stride bytes apart. data is the tile's bytes, at least 8
+// readable bytes have to follow end. floats turns the ordered integers back into float bits.
+template <typename T>
+inline bool decodeHeightTile(const unsigned char *data, const unsigned char *end, int w, int h, bool floats,
+                             unsigned char *dst, size_t stride)
+{
+    if (end - data < 2)
+        return false;
+    int predictor = data[0];
+    HeightWidthTable table;
+    table.count = data[1];
+    data += 2;
+    if (predictor > PREDICT_GRADIENT || table.count < 1 || table.count > HEIGHTMAP_WIDTHS ||
+        end - data < 2 * table.count + 4)
+        return false;
+    uint32_t total = 0;
+    for (int t = 0; t < table.count; t++)
+    {
+        table.freq[t] = (uint32_t)data[0] | ((uint32_t)data[1] << 8);
+        table.start[t] = total;
+        total += table.freq[t];
+        data += 2;
+    }
+    if (total != (1u << HEIGHTMAP_PROB_BITS))
+        return false;
+
+    uint32_t ransBytes;
+    memcpy(&ransBytes, data, 4);
+    data += 4;
+    if (ransBytes < 8 || (size_t)(end - data) < ransBytes)
+        return false;
+    uint32_t state[2];
+    memcpy(state, data, 8);
+    const unsigned char *rans = data + 8;
+    const unsigned char *ransEnd = data + ransBytes;
+    const unsigned char *bits = ransEnd;
+    uint64_t bitLimit = (uint64_t)(end - bits) * 8;
+    uint64_t bitPos = 0;
+
+    // rows are padded to whole registers, the padding decodes to garbage that is never stored
+    const int lanes = 16 / sizeof(T);
+    int count = (w + lanes - 1) / lanes * lanes;
+    T residual[HEIGHTMAP_MAX_TILE] = {};
+    T rows[2][HEIGHTMAP_MAX_TILE] = {};
+    for (int y = 0; y < h; y++)
+    {
+        // even and odd groups alternate between the two states, which form independent dependency chains
+        uint32_t s0 = state[0];
+        uint32_t s1 = state[1];
+        int x = 0;
+        for (; x + 2 * HEIGHTMAP_GROUP <= w; x += 2 * HEIGHTMAP_GROUP)
+            if (!decodeHeightGroup(s0, table, rans, ransEnd, bits, bitPos, bitLimit, HEIGHTMAP_GROUP, residual + x) ||
+                !decodeHeightGroup(s1, table, rans, ransEnd, bits, bitPos, bitLimit, HEIGHTMAP_GROUP,
+                                   residual + x + HEIGHTMAP_GROUP))
+                return false;
+        for (int g = 0; x < w; x += HEIGHTMAP_GROUP, g++)
+            if (!decodeHeightGroup(g == 0 ? s0 : s1, table, rans, ransEnd, bits, bitPos, bitLimit,
+                                   std::min(HEIGHTMAP_GROUP, w - x), residual + x))
+                return false;
+        state[0] = s0;
+        state[1] = s1;
+        if (rans > ransEnd)
+            return false;
+
+        const T *up = rows[(y + 1) & 1];
+        T *out = rows[y & 1];
+        reconstructHeightRow(residual, up, out, count, predictor);
+        T *row = (T*)(dst + (size_t)y * stride);
+        if (floats)
+            for (int x = 0; x < w; x++)
+                row[x] = (T)floatBitsFromOrdered(out[x]);
+        else
+            memcpy(row, out, (size_t)w * sizeof(T));
+    }
+    return true;
+}
+
+// Reads heightmap containers, any number of threads can decode tiles of one reader at the same time.
+class HeightmapReader
+{
+public:
+    HeightmapReader() : directory(0)
+    {
+    }
+
+    bool Open(const std::string &path)
+    {
+        if (!file.Open(path) || file.Size() < 64)
+            return false;
+        uint32_t header[16];
+        memcpy(header, file.Data(), sizeof(header));
+        info.width = (int)header[2];
+        info.height = (int)header[3];
+        info.format = (HeightFormat)header[4];
+        info.tileSize = (int)header[5];
+        info.tilesX = (int)header[6];
+        info.tilesY = (int)header[7];
+        if (header[0] != HEIGHTMAP_MAGIC || header[1] != 1 || header[4] > HEIGHT_F32 || info.width <= 0 ||
+            info.height <= 0 || info.tileSize <= 0 || info.tileSize > HEIGHTMAP_MAX_TILE ||
+            (uint64_t)info.tilesX != ((uint64_t)header[2] + header[5] - 1) / header[5] ||
+            (uint64_t)info.tilesY != ((uint64_t)header[3] + header[5] - 1) / header[5])
+            return false;
+
+        size_t directorySize = (info.Tiles() + 1) * 8;
+        if (file.Size() < 64 + directorySize)
+            return false;
+        directory = file.Data() + 64;
+        // offsets have to be ascending and leave the padding at the end of the file
+        uint64_t previous = 64 + directorySize;
+        for (size_t i = 0; i <= info.Tiles(); i++)
+        {
+            uint64_t current = offset(i);
+            if (current < previous)
+                return false;
+            previous = current;
+        }
+        return previous + 8 <= file.Size();
+    }
+
+    const HeightmapInfo &Info() const { return info; }
+    size_t FileSize() const { return file.Size(); }
+
+    // decodes tile (tx, ty) to dst, which points at the tile's first sample; rows are stride bytes apart
+    bool DecodeTile(int tx, int ty, unsigned char *dst, size_t stride) const
+    {
+        size_t tile = (size_t)ty * info.tilesX + tx;
+        const unsigned char *data = file.Data() + offset(tile);
+        const unsigned char *end = file.Data() + offset(tile + 1);
+        int w = std::min(info.tileSize, info.width - tx * info.tileSize);
+        int h = std::min(info.tileSize, info.height - ty * info.tileSize);
+        if (info.format == HEIGHT_U8)
+            return decodeHeightTile<uint8_t>(data, end, w, h, false, dst, stride);
+        if (info.format == HEIGHT_U16)
+            return decodeHeightTile<uint16_t>(data, end, w, h, false, dst, stride);
+        return decodeHeightTile<uint32_t>(data, end, w, h, true, dst, stride);
+    }
+
+    // Decodes the tile rows [first, last), that is samples from row first * tile size down, to dst with rows
+    // stride bytes apart. Tiles are decoded in parallel on jobs when given.
+    bool DecodeTileRows(int first, int last, unsigned char *dst, size_t stride, JobSystem *jobs = nullptr) const
+    {
+        std::atomic<bool> ok(true);
+        size_t begin = (size_t)first * info.tilesX;
+        size_t end = (size_t)last * info.tilesX;
+        auto decode = [this, first, dst, stride, &ok](size_t from, size_t to)
+        {
+            for (size_t tile = from; tile < to; tile++)
+            {
+                int tx = (int)(tile % info.tilesX);
+                int ty = (int)(tile / info.tilesX);
+                unsigned char *tileDst = dst + (size_t)(ty - first) * info.tileSize * stride +
+                                         (size_t)tx * info.tileSize * info.SampleBytes();
+                if (!DecodeTile(tx, ty, tileDst, stride))
+                    ok = false;
+            }
+        };
+        if (jobs)
+            jobs->ParallelFor(begin, end, 4, decode);
+        else
+            decode(begin, end);
+        return ok;
+    }
+
+    // decodes the whole map to dst, rows tightly packed
+    bool Decode(unsigned char *dst, JobSystem *jobs = nullptr) const
+    {
+        return DecodeTileRows(0, info.tilesY, dst, (size_t)info.width * info.SampleBytes(), jobs);
+    }
+
+private:
+    MappedFile file;
+    HeightmapInfo info;
+    const unsigned char *directory;
+
+    uint64_t offset(size_t tile) const
+    {
+        uint64_t value;
+        memcpy(&value, directory + tile * 8, 8);
+        return value;
+    }
+
+    HeightmapReader(const HeightmapReader &);
+    HeightmapReader &operator=(const HeightmapReader &);
+};
+
+// raw bits, least significant first
+class HeightBitWriter
+{
+public:
+    explicit HeightBitWriter(std::vector<unsigned char> &out) : out(out), bits(0), count(0)
+    {
+    }
+
+    void Write(uint32_t value, int n)
+    {
+        bits |= (uint64_t)value << count;
+        count += n;
+        while (count >= 8)
+        {
+            out.push_back((unsigned char)bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void Flush()
+    {
+        if (count > 0)
+            out.push_back((unsigned char)bits);
+        bits = 0;
+        count = 0;
+    }
+
+private:
+    std::vector<unsigned char> &out;
+    uint64_t bits;
+    int count;
+};
+
+// Encodes one tile of w x h samples, rows stride samples apart, with the predictor that codes it smallest.
+template <typename T>
+inline void encodeHeightTile(const T *samples, size_t stride, int w, int h, std::vector<unsigned char> &out)
+{
+    size_t n = (size_t)w * h;
+    int groupsPerRow = (w + HEIGHTMAP_GROUP - 1) / HEIGHTMAP_GROUP;
+    size_t groups = (size_t)groupsPerRow * h;
+    std::vector<uint32_t> values(n);
+    std::vector<unsigned char> widths(groups);
+    std::vector<uint32_t> best;
+    std::vector<unsigned char> bestWidths;
+    int bestPredictor = PREDICT_NONE;
+    double bestBits = 0.0;
+    for (int predictor = PREDICT_NONE; predictor <= PREDICT_GRADIENT; predictor++)
+    {
+        uint32_t counts[HEIGHTMAP_WIDTHS] = {};
+        double rawBits = 0.0;
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+            {
+                const T *s = samples + (size_t)y * stride + x;
+                T left = (predictor & PREDICT_LEFT) && x > 0 ? s[-1] : 0;
+                T up = (predictor & PREDICT_UP) && y > 0 ? s[-(ptrdiff_t)stride] : 0;
+                T upLeft = predictor == PREDICT_GRADIENT && x > 0 && y > 0 ? s[-(ptrdiff_t)stride - 1] : 0;
+                values[(size_t)y * w + x] = zigzagResidual<T>((T)(*s - left - up + upLeft));
+            }
+        for (int y = 0; y < h; y++)
+            for (int g = 0; g < groupsPerRow; g++)
+            {
+                int x = g * HEIGHTMAP_GROUP;
+                int count = std::min(HEIGHTMAP_GROUP, w - x);
+                uint32_t all = 0;
+                for (int i = 0; i < count; i++)
+                    all |= values[(size_t)y * w + x + i];
+                int width = 0;
+                while (width < 32 && (all >> width) != 0)
+                    width++;
+                widths[(size_t)y * groupsPerRow + g] = (unsigned char)width;
+                counts[width]++;
+                rawBits += (double)width * count;
+            }
+        // order 0 entropy of the widths plus the packed residuals
+        double bits = rawBits;
+        for (int t = 0; t < HEIGHTMAP_WIDTHS; t++)
+            if (counts[t])
+                bits += counts[t] * std::log2((double)groups / counts[t]);
+        if (predictor == PREDICT_NONE || bits < bestBits)
+        {
+            bestBits = bits;
+            bestPredictor = predictor;
+            best.swap(values);
+            bestWidths.swap(widths);
+            values.resize(n);
+            widths.resize(groups);
+        }
+    }
+
+    // frequencies normalised to 4096, every width that occurs keeps at least 1
+    uint32_t counts[HEIGHTMAP_WIDTHS] = {};
+    int widthCount = 1;
+    for (size_t i = 0; i < groups; i++)
+    {
+        counts[bestWidths[i]]++;
+        widthCount = std::max(widthCount, bestWidths[i] + 1);
+    }
+    const int probScale = 1 << HEIGHTMAP_PROB_BITS;
+    int freq[HEIGHTMAP_WIDTHS] = {};
+    int start[HEIGHTMAP_WIDTHS] = {};
+    int sum = 0;
+    int largest = 0;
+    for (int t = 0; t < widthCount; t++)
+    {
+        if (counts[t])
+            freq[t] = std::max(1, (int)((uint64_t)counts[t] * probScale / groups));
+        sum += freq[t];
+        if (counts[t] > counts[largest])
+            largest = t;
+    }
+    freq[largest] += probScale - sum;
+    for (int t = 1; t < widthCount; t++)
+        start[t] = start[t - 1] + freq[t - 1];
+
+    out.push_back((unsigned char)bestPredictor);
+    out.push_back((unsigned char)widthCount);
+    for (int t = 0; t < widthCount; t++)
+    {
+        out.push_back((unsigned char)(freq[t] & 0xFF));
+        out.push_back((unsigned char)(freq[t] >> 8));
+    }
+
+    // rANS runs backwards; even and odd groups of a row use separate states, so that decoding has two
+    // independent chains
+    std::vector<unsigned char> rans(groups * 2 + 8);
+    unsigned char *ptr = &rans[0] + rans.size();
+    uint32_t state[2] = { HEIGHTMAP_RANS_LOW, HEIGHTMAP_RANS_LOW };
+    for (size_t i = groups; i-- > 0;)
+    {
+        uint32_t &s = state[(i % groupsPerRow) & 1];
+        uint32_t f = (uint32_t)freq[bestWidths[i]];
+        if ((uint64_t)s >= ((uint64_t)f << (32 - HEIGHTMAP_PROB_BITS)))
+        {
+            ptr -= 2;
+            ptr[0] = (unsigned char)(s & 0xFF);
+            ptr[1] = (unsigned char)((s >> 8) & 0xFF);
+            s >>= 16;
+        }
+        s = ((s / f) << HEIGHTMAP_PROB_BITS) + (s % f) + (uint32_t)start[bestWidths[i]];
+    }
+    ptr -= 8;
+    memcpy(ptr, state, 8);
+    uint32_t ransBytes = (uint32_t)(&rans[0] + rans.size() - ptr);
+    const unsigned char *sizeBytes = (const unsigned char*)&ransBytes;
+    out.insert(out.end(), sizeBytes, sizeBytes + 4);
+    out.insert(out.end(), ptr, ptr + ransBytes);
+
+    HeightBitWriter writer(out);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            writer.Write(best[(size_t)y * w + x], bestWidths[(size_t)y * groupsPerRow + x / HEIGHTMAP_GROUP]);
+    writer.Flush();
+}
+
+// Writes width x height samples of format, rows tightly packed, as a heightmap container. Tiles are encoded
+// in parallel on jobs when given. tileSize has to be a multiple of 16 up to 256.
+inline bool writeHeightmap(const std::string &path, const void *samples, int width, int height, HeightFormat format,
+                           JobSystem *jobs = nullptr, int tileSize = 64)
+{
+    if (width <= 0 || height <= 0 || tileSize <= 0 || tileSize % 16 != 0 || tileSize > HEIGHTMAP_MAX_TILE)
+        return false;
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    size_t tileCount = (size_t)tilesX * tilesY;
+
+    std::vector<uint32_t> ordered;
+    if (format == HEIGHT_F32)
+    {
+        ordered.resize((size_t)width * height);
+        memcpy(&ordered[0], samples, ordered.size() * 4);
+        for (size_t i = 0; i < ordered.size(); i++)
+            ordered[i] = orderedFromFloatBits(ordered[i]);
+        samples = &ordered[0];
+    }
+
+    std::vector<std::vector<unsigned char> > tiles(tileCount);
+    auto encode = [&](size_t from, size_t to)
+    {
+        for (size_t tile = from; tile < to; tile++)
+        {
+            int tx = (int)(tile % tilesX);
+            int ty = (int)(tile / tilesX);
+            int w = std::min(tileSize, width - tx * tileSize);
+            int h = std::min(tileSize, height - ty * tileSize);
+            size_t first = (size_t)ty * tileSize * width + (size_t)tx * tileSize;
+            if (format == HEIGHT_U8)
+                encodeHeightTile((const uint8_t*)samples + first, width, w, h, tiles[tile]);
+            else if (format == HEIGHT_U16)
+                encodeHeightTile((const uint16_t*)samples + first, width, w, h, tiles[tile]);
+            else
+                encodeHeightTile((const uint32_t*)samples + first, width, w, h, tiles[tile]);
+        }
+    };
+    if (jobs)
+        jobs->ParallelFor(0, tileCount, 8, encode);
+    else
+        encode(0, tileCount);
+
+    uint32_t header[16] = { HEIGHTMAP_MAGIC, 1, (uint32_t)width, (uint32_t)height, (uint32_t)format,
+                            (uint32_t)tileSize, (uint32_t)tilesX, (uint32_t)tilesY };
+    std::vector<uint64_t> offsets(tileCount + 1);
+    offsets[0] = sizeof(header) + offsets.size() * 8;
+    for (size_t i = 0; i < tileCount; i++)
+        offsets[i + 1] = offsets[i] + tiles[i].size();
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    const unsigned char padding[8] = {};
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+              fwrite(&offsets[0], 8, offsets.size(), file) == offsets.size();
+    for (size_t i = 0; ok && i < tileCount; i++)
+        ok = fwrite(tiles[i].data(), 1, tiles[i].size(), file) == tiles[i].size();
+    ok = ok && fwrite(padding, 1, 8, file) == 8;
+    return fclose(file) == 0 && ok;
+}
+#endif
@@ -0,0 +1,450 @@
+
+
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class JobSystem;
+
+// Counts outstanding jobs. A counter is incremented when a job that reports to it is scheduled and decremented
+// when the job finishes; jobs scheduled with RunAfter() start once their dependency counter drops to zero.
+class JobCounter
+{
+public:
+    JobCounter() : value(0)
+    {
+    }
+
+    bool Done() const { return value.load() == 0; }
+
+private:
+    friend class JobSystem;
+
+    std::atomic<int> value;
+    std::mutex mutex;
+    std::vector<std::pair<std::function<void()>, JobCounter*> > continuations;
+
+    JobCounter(const JobCounter &);
+    JobCounter &operator=(const JobCounter &);
+};
+
+// Multi producer, single consumer queue used to hand work back to the GL thread. Producers never block or take a
+// lock (Vyukov's intrusive MPSC queue), the consumer calls Drain() once per frame or while waiting for uploads.
+class MainThreadQueue
+{
+public:
+    MainThreadQueue() : head(&stub), tail(&stub)
+    {
+        stub.next.store(0);
+    }
+
+    ~MainThreadQueue()
+    {
+        std::function<void()> task;
+        while (pop(task))
+            ;
+        if (tail != &stub)
+            delete tail;
+    }
+
+    // any thread
+    void Push(std::function<void()> task)
+    {
+        Node *node = new Node();
+        node->task.swap(task);
+        node->next.store(0, std::memory_order_relaxed);
+        Node *previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // consumer thread only, runs up to maxTasks queued tasks and returns how many ran
+    size_t Drain(size_t maxTasks = (size_t)-1)
+    {
+        size_t count = 0;
+        std::function<void()> task;
+        while (count < maxTasks && pop(task))
+        {
+            task();
+            count++;
+        }
+        return count;
+    }
+
+    bool Empty() const
+    {
+        return tail->next.load(std::memory_order_acquire) == 0;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node*> next;
+        std::function<void()> task;
+    };
+
+    Node stub;
+    std::atomic<Node*> head;
+    Node *tail;
+
+    bool pop(std::function<void()> &task)
+    {
+        Node *current = tail;
+        Node *next = current->next.load(std::memory_order_acquire);
+        if (next == 0)
+            return false;
+        task.swap(next->task);
+        next->task = std::function<void()>();
+        tail = next;
+        if (current != &stub)
+            delete current;
+        return true;
+    }
+
+    MainThreadQueue(const MainThreadQueue &);
+    MainThreadQueue &operator=(const MainThreadQueue &);
+};
+
+// Work stealing job scheduler. Every worker, and the thread that created the system, owns a fixed size
+// Chase-Lev deque: the owner pushes and pops at the bottom, idle threads steal from the top. Threads that
+// are not part of the system push into a shared injection queue instead. Waiting on a counter never blocks,
+// the waiting thread runs other jobs until the counter reaches zero.
+class JobSystem
+{
+public:
+    // numWorkers threads are started in addition to the calling thread
+    explicit JobSystem(unsigned int numWorkers) : stop(false), injectedCount(0), pending(0), sleepers(0)
+    {
+        for (unsigned int i = 0; i < numWorkers + 1; i++)
+            queues.push_back(new WorkQueue());
+        threadOwner() = this;
+        threadIndex() = 0;
+        for (unsigned int i = 0; i < numWorkers; i++)
+            threads.push_back(std::thread(&JobSystem::workerLoop, this, i + 1));
+    }
+
+    ~JobSystem()
+    {
+        stop.store(true);
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < threads.size(); i++)
+            threads[i].join();
+        // drop anything that was never run
+        for (size_t i = 0; i < queues.size(); i++)
+        {
+            while (Job *job = queues[i]->Pop())
+                delete job;
+            delete queues[i];
+        }
+        for (size_t i = 0; i < injected.size(); i++)
+            delete injected[i];
+        if (threadOwner() == this)
+            threadOwner() = 0;
+    }
+
+    // schedules fn, counter (optional) is incremented now and decremented when fn returns
+    void Run(std::function<void()> fn, JobCounter *counter = 0)
+    {
+        if (counter)
+            counter->value.fetch_add(1);
+        Job *job = new Job();
+        job->fn.swap(fn);
+        job->counter = counter;
+        push(job);
+    }
+
+    // schedules fn once dependency reaches zero, counter (optional) is incremented right away
+    void RunAfter(JobCounter &dependency, std::function<void()> fn, JobCounter *counter = 0)
+    {
+        if (counter)
+            counter->value.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(dependency.mutex);
+            if (dependency.value.load() != 0)
+            {
+                dependency.continuations.push_back(std::make_pair(fn, counter));
+                return;
+            }
+        }
+        Job *job = new Job();
+        job->fn.swap(fn);
+        job->counter = counter;
+        push(job);
+    }
+
+    // runs other jobs on the calling thread until counter reaches zero
+    void Wait(JobCounter &counter)
+    {
+        int index = threadOwner() == this ? threadIndex() : -1;
+        unsigned int spins = 0;
+        while (counter.value.load() != 0)
+        {
+            Job *job = findJob(index);
+            if (job)
+            {
+                execute(job);
+                spins = 0;
+            }
+            else if (++spins > 64)
+                std::this_thread::yield();
+        }
+        std::lock_guard<std::mutex> lock(counter.mutex);
+    }
+
+    // runs at most one pending job on the calling thread, returns false if there was nothing to run
+    bool RunOne()
+    {
+        Job *job = findJob(threadOwner() == this ? threadIndex() : -1);
+        if (!job)
+            return false;
+        execute(job);
+        return true;
+    }
+
+    // calls fn(first, last) for consecutive ranges of at most grain elements of [begin, end) in parallel and
+    // returns when all of them are done
+    template <typename F>
+    void ParallelFor(size_t begin, size_t end, size_t grain, const F &fn)
+    {
+        if (end <= begin)
+            return;
+        if (grain == 0)
+            grain = 1;
+        if (end - begin <= grain)
+        {
+            fn(begin, end);
+            return;
+        }
+        JobCounter counter;
+        for (size_t first = begin; first < end; first += grain)
+        {
+            size_t last = std::min(first + grain, end);
+            Run([&fn, first, last]() { fn(first, last); }, &counter);
+        }
+        Wait(counter);
+    }
+
+    // queue of tasks that have to run on the GL thread, see MainThreadQueue
+    MainThreadQueue &MainThread() { return mainThread; }
+
+    unsigned int NumWorkers() const { return (unsigned int)threads.size(); }
+    unsigned int NumThreads() const { return (unsigned int)queues.size(); }
+
+    // worker count that leaves one hardware thread for the GL thread
+    static unsigned int DefaultWorkerCount()
+    {
+        unsigned int hardwareThreads = std::thread::hardware_concurrency();
+        return hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+    }
+
+private:
+    struct Job {
+        std::function<void()> fn;
+        JobCounter *counter;
+    };
+
+    // Chase-Lev deque with a fixed capacity, see "Correct and Efficient Work-Stealing for Weak Memory Models"
+    class WorkQueue
+    {
+    public:
+        WorkQueue() : top(0), bottom(0)
+        {
+            for (long i = 0; i < CAPACITY; i++)
+                buffer[i].store(0, std::memory_order_relaxed);
+        }
+
+        // owner only, returns false when full
+        bool Push(Job *job)
+        {
+            long b = bottom.load(std::memory_order_relaxed);
+            long t = top.load(std::memory_order_acquire);
+            if (b - t >= CAPACITY)
+                return false;
+            buffer[b & (CAPACITY - 1)].store(job, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // owner only
+        Job *Pop()
+        {
+            long b = bottom.load(std::memory_order_relaxed) - 1;
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long t = top.load(std::memory_order_relaxed);
+            if (t > b)
+            {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return 0;
+            }
+            Job *job = buffer[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if (t == b)
+            {
+                // last element, race against thieves for it
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    job = 0;
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return job;
+        }
+
+        // any thread
+        Job *Steal()
+        {
+            long t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long b = bottom.load(std::memory_order_acquire);
+            if (t >= b)
+                return 0;
+            Job *job = buffer[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return 0;
+            return job;
+        }
+
+    private:
+        static const long CAPACITY = 4096;
+        std::atomic<long> top;
+        std::atomic<long> bottom;
+        std::atomic<Job*> buffer[CAPACITY];
+    };
+
+    std::vector<WorkQueue*> queues;
+    std::vector<std::thread> threads;
+    std::deque<Job*> injected;
+    std::mutex injectMutex;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<bool> stop;
+    std::atomic<int> injectedCount;
+    std::atomic<int> pending;
+    std::atomic<int> sleepers;
+    MainThreadQueue mainThread;
+
+    static JobSystem *&threadOwner()
+    {
+        static thread_local JobSystem *owner = 0;
+        return owner;
+    }
+
+    static int &threadIndex()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    void push(Job *job)
+    {
+        pending.fetch_add(1);
+        int index = threadOwner() == this ? threadIndex() : -1;
+        if (index < 0 || !queues[index]->Push(job))
+        {
+            std::lock_guard<std::mutex> lock(injectMutex);
+            injected.push_back(job);
+            injectedCount.fetch_add(1);
+        }
+        if (sleepers.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wake.notify_one();
+        }
+    }
+
+    Job *findJob(int index)
+    {
+        Job *job = 0;
+        if (index >= 0)
+            job = queues[index]->Pop();
+        if (!job && injectedCount.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(injectMutex);
+            if (!injected.empty())
+            {
+                job = injected.front();
+                injected.pop_front();
+                injectedCount.fetch_sub(1);
+            }
+        }
+        if (!job)
+        {
+            // start stealing at the next queue so that thieves spread out
+            size_t count = queues.size();
+            size_t start = index >= 0 ? (size_t)index + 1 : 0;
+            for (size_t i = 0; i < count && !job; i++)
+            {
+                size_t victim = (start + i) % count;
+                if ((int)victim != index)
+                    job = queues[victim]->Steal();
+            }
+        }
+        if (job)
+            pending.fetch_sub(1);
+        return job;
+    }
+
+    void execute(Job *job)
+    {
+        job->fn();
+        if (job->counter)
+            finish(*job->counter);
+        delete job;
+    }
+
+    void finish(JobCounter &counter)
+    {
+        // counters often live on the stack of a waiting thread, so the last decrement happens under the
+        // counter's lock and Wait() takes that lock before returning
+        int value = counter.value.load();
+        while (value > 1)
+            if (counter.value.compare_exchange_weak(value, value - 1))
+                return;
+        std::vector<std::pair<std::function<void()>, JobCounter*> > ready;
+        {
+            std::lock_guard<std::mutex> lock(counter.mutex);
+            if (counter.value.fetch_sub(1) == 1)
+                ready.swap(counter.continuations);
+        }
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+            Job *job = new Job();
+            job->fn.swap(ready[i].first);
+            job->counter = ready[i].second;
+            push(job);
+        }
+    }
+
+    void workerLoop(int index)
+    {
+        threadOwner() = this;
+        threadIndex() = index;
+        while (!stop.load())
+        {
+            Job *job = findJob(index);
+            if (job)
+            {
+                execute(job);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepers.fetch_add(1);
+            while (!stop.load() && pending.load() == 0)
+                wake.wait(lock);
+            sleepers.fetch_sub(1);
+        }
+    }
+
+    JobSystem(const JobSystem &);
+    JobSystem &operator=(const JobSystem &);
+};
+#endif
@@ -0,0 +1,236 @@
+
+
+#ifndef KTX_FILE_H
+#define KTX_FILE_H
+
+#include <glad/glad.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// block compressed formats, not every glad configuration carries the extension enums
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
+// bytes per 4x4 block of a compressed format, 0 if the format is not one of ours
+inline unsigned int compressedBlockBytes(GLenum format)
+{
+    switch (format)
+    {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RED_RGTC1:
+        return 8;
+    case GL_COMPRESSED_RG_RGTC2:
+    case GL_COMPRESSED_RGBA_BPTC_UNORM:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+inline size_t compressedLevelSize(GLenum format, int width, int height)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * compressedBlockBytes(format);
+}
+
+// channels a compressed format decodes to
+inline int compressedChannels(GLenum format)
+{
+    switch (format)
+    {
+    case GL_COMPRESSED_RED_RGTC1:
+        return 1;
+    case GL_COMPRESSED_RG_RGTC2:
+        return 2;
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+// compressed version of an image file: same path with the extension replaced by .ktx
+inline std::string ktxPathFor(const std::string &path)
+{
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + ".ktx";
+    return path.substr(0, dot) + ".ktx";
+}
+
+inline bool fileExists(const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    fclose(file);
+    return true;
+}
+
+// Header of a KTX 1.1 file holding a single 2D image (one face, no array) with its mip levels.
+struct KtxInfo {
+    GLenum internalFormat;
+    int width;
+    int height;
+    unsigned int levels;
+    size_t dataSize;    // all levels tightly packed, without the per level size fields
+};
+
+static const unsigned char KTX_IDENTIFIER[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+// Reads compressed KTX files written by texture_compress. Only what the tool writes is supported:
+// little endian, a block compressed internal format, 2D, one face.
+class KtxReader
+{
+public:
+    KtxReader() : file(0)
+    {
+    }
+
+    ~KtxReader()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    bool Open(const std::string &path)
+    {
+        file = fopen(path.c_str(), "rb");
+        if (!file)
+            return false;
+        unsigned char identifier[12];
+        uint32_t header[13];
+        if (fread(identifier, 1, 12, file) != 12 || memcmp(identifier, KTX_IDENTIFIER, 12) != 0 ||
+            fread(header, 4, 13, file) != 13 || header[0] != 0x04030201)
+            return false;
+        // glType, glFormat = 0 for compressed data; pixelDepth, numberOfArrayElements = 0; one face
+        info.internalFormat = header[4];
+        info.width = (int)header[6];
+        info.height = (int)header[7];
+        info.levels = header[11] > 0 ? header[11] : 1;
+        if (header[1] != 0 || header[3] != 0 || header[8] != 0 || header[9] != 0 || header[10] != 1 ||
+            compressedBlockBytes(info.internalFormat) == 0 || info.width <= 0 || info.height <= 0)
+            return false;
+        if (fseek(file, (long)header[12], SEEK_CUR) != 0)
+            return false;
+
+        info.dataSize = 0;
+        int width = info.width;
+        int height = info.height;
+        for (unsigned int level = 0; level < info.levels; level++)
+        {
+            info.dataSize += compressedLevelSize(info.internalFormat, width, height);
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+        return true;
+    }
+
+    const KtxInfo &Info() const { return info; }
+
+    // reads every level back to back into data, which has to hold Info().dataSize bytes
+    bool ReadLevels(unsigned char *data)
+    {
+        int width = info.width;
+        int height = info.height;
+        for (unsigned int level = 0; level < info.levels; level++)
+        {
+            uint32_t imageSize;
+            size_t size = compressedLevelSize(info.internalFormat, width, height);
+            if (fread(&imageSize, 4, 1, file) != 1 || imageSize != size || fread(data, 1, size, file) != size)
+                return false;
+            // compressed levels are multiples of 8 bytes, so there is never any mip padding
+            data += size;
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+        return true;
+    }
+
+private:
+    FILE *file;
+    KtxInfo info;
+
+    KtxReader(const KtxReader &);
+    KtxReader &operator=(const KtxReader &);
+};
+
+// writes a single face 2D KTX file with levels.size() mip levels
+inline bool writeKtx(const std::string &path, GLenum internalFormat, int width, int height,
+                     const std::vector<std::vector<unsigned char> > &levels)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+    GLenum baseFormat = GL_RGBA;
+    if (compressedChannels(internalFormat) == 1)
+        baseFormat = GL_RED;
+    else if (compressedChannels(internalFormat) == 2)
+        baseFormat = GL_RG;
+    else if (compressedChannels(internalFormat) == 3)
+        baseFormat = GL_RGB;
+    uint32_t header[13] = { 0x04030201, 0, 1, 0, internalFormat, baseFormat,
+                            (uint32_t)width, (uint32_t)height, 0, 0, 1, (uint32_t)levels.size(), 0 };
+    bool ok = fwrite(KTX_IDENTIFIER, 1, 12, file) == 12 && fwrite(header, 4, 13, file) == 13;
+    for (size_t level = 0; ok && level < levels.size(); level++)
+    {
+        uint32_t imageSize = (uint32_t)levels[level].size();
+        ok = fwrite(&imageSize, 4, 1, file) == 1 &&
+             fwrite(levels[level].data(), 1, levels[level].size(), file) == levels[level].size();
+    }
+    return fclose(file) == 0 && ok;
+}
+
+// Compressed formats the driver accepts. Query() has to run once on the GL thread after glad is loaded;
+// Supports() is safe from any thread afterwards and reports nothing as supported before that.
+class CompressedFormats
+{
+public:
+    static void Query()
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+        std::vector<GLint> &formats = list();
+        formats.resize(count > 0 ? count : 0);
+        if (count > 0)
+            glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, &formats[0]);
+        // RGTC is core since 3.0 but drivers do not have to list it
+        formats.push_back(GL_COMPRESSED_RED_RGTC1);
+        formats.push_back(GL_COMPRESSED_RG_RGTC2);
+        ready().store(true);
+    }
+
+    static bool Supports(GLenum format)
+    {
+        if (!ready().load())
+            return false;
+        const std::vector<GLint> &formats = list();
+        for (size_t i = 0; i < formats.size(); i++)
+            if ((GLenum)formats[i] == format)
+                return true;
+        return false;
+    }
+
+private:
+    static std::vector<GLint> &list()
+    {
+        static std::vector<GLint> formats;
+        return formats;
+    }
+
+    static std::atomic<bool> &ready()
+    {
+        static std::atomic<bool> queried(false);
+        return queried;
+    }
+};
+#endif
@@ -0,0 +1,180 @@
+
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstdio>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped read-only into memory. Pages are loaded on first access, so mapping a large file
+// costs nothing until it is read.
+class MappedFile
+{
+public:
+    MappedFile() : data(0), size(0)
+#ifdef _WIN32
+        , file(INVALID_HANDLE_VALUE), mapping(0)
+#endif
+    {
+    }
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const std::string &path)
+    {
+        Close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        if (!mapping)
+        {
+            Close();
+            return false;
+        }
+        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data)
+        {
+            Close();
+            return false;
+        }
+        size = (size_t)fileSize.QuadPart;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        void *address = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // the mapping stays valid after the descriptor is closed
+        close(fd);
+        if (address == MAP_FAILED)
+            return false;
+        data = (const unsigned char*)address;
+        size = (size_t)info.st_size;
+#endif
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = 0;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap((void*)data, size);
+#endif
+        data = 0;
+        size = 0;
+    }
+
+    const unsigned char *Data() const { return data; }
+    size_t Size() const { return size; }
+    bool IsOpen() const { return data != 0; }
+
+    // asks the OS to start reading [offset, offset + bytes) in the background, so a later access does not
+    // block on the disk. A hint only: Windows pages the range in on first access as before.
+    void Prefetch(size_t offset, size_t bytes) const
+    {
+        if (!data || offset >= size)
+            return;
+        bytes = bytes < size - offset ? bytes : size - offset;
+#ifndef _WIN32
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = offset / page * page;
+        posix_madvise((void*)(data + start), offset + bytes - start, POSIX_MADV_WILLNEED);
+#endif
+    }
+
+private:
+    const unsigned char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+// modification time (seconds) and size of a file, false if it does not exist
+inline bool fileStatus(const std::string &path, int64_t &modified, int64_t &size)
+{
+#ifdef _WIN32
+    struct _stat64 info;
+    if (_stat64(path.c_str(), &info) != 0)
+        return false;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+#endif
+    modified = (int64_t)info.st_mtime;
+    size = (int64_t)info.st_size;
+    return true;
+}
+
+// seeks to a 64 bit offset, files of several GiB are common for terrain
+inline bool seekFile(FILE *file, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// creates a single directory level, succeeds if it already exists
+inline bool makeDirectory(const std::string &path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFDIR) != 0;
+}
+#endif
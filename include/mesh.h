@@ -9,6 +9,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <shader_t.h>
+#include <draw_list.h>
+#include <residency_manager.h>
 
 #include <string>
 #include <vector>
@@ -46,6 +48,11 @@ public:
     vector<unsigned int> indices;
     vector<Texture>      textures;
     unsigned int VAO;
+    // object space bounds, used for culling
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    // index of the state registered with a DrawList
+    unsigned int drawState;
 
     // constructor
     Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
@@ -53,6 +60,17 @@ public:
         this->vertices = vertices;
         this->indices = indices;
         this->textures = textures;
+        this->drawState = 0;
+
+        boundsMin = glm::vec3(0.0f);
+        boundsMax = glm::vec3(0.0f);
+        for(unsigned int i = 0; i < vertices.size(); i++)
+        {
+            if(i == 0)
+                boundsMin = boundsMax = vertices[i].Position;
+            boundsMin = glm::min(boundsMin, vertices[i].Position);
+            boundsMax = glm::max(boundsMax, vertices[i].Position);
+        }
 
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
@@ -96,6 +114,29 @@ public:
         glActiveTexture(GL_TEXTURE0);
     }
 
+    // registers the mesh state (VAO, index range, textures) with a draw list. The mesh textures are bound to
+    // units 0..n-1 in the same order as Draw() does, extra bindings (e.g. a shared material) are added after them.
+    void RegisterDrawState(DrawList &list, const Shader &shader, const vector<TextureBinding> &extra = vector<TextureBinding>())
+    {
+        DrawState state;
+        state.program = shader.ID;
+        state.vao = VAO;
+        state.mode = GL_TRIANGLES;
+        state.count = static_cast<GLsizei>(indices.size());
+        state.indexType = GL_UNSIGNED_INT;
+        for(unsigned int i = 0; i < textures.size(); i++)
+            state.AddTexture(i, GL_TEXTURE_2D, textures[i].id);
+        for(unsigned int i = 0; i < extra.size(); i++)
+            state.AddTexture(extra[i].unit, extra[i].target, extra[i].id);
+        drawState = list.AddState(state);
+    }
+
+    // records the mesh into a command list instead of drawing it immediately, safe to call from worker threads
+    void Submit(CommandList &commands, const glm::mat4 &model, DrawPass pass, float depth) const
+    {
+        commands.Add(pass, drawState, model, depth);
+    }
+
 private:
     // render data 
     unsigned int VBO, EBO;
@@ -118,6 +159,8 @@ private:
 
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        ResidencyManager::Global().TrackBuffer(VBO, vertices.size() * sizeof(Vertex), "mesh vertices");
+        ResidencyManager::Global().TrackBuffer(EBO, indices.size() * sizeof(unsigned int), "mesh indices");
 
         // set the vertex attribute pointers
         // vertex Positions
@@ -13,6 +13,8 @@
 
 #include <mesh.h>
 #include <shader_t.h>
+#include <job_system.h>
+#include <texture_registry.h>
 
 #include "stb_image.h"
 
@@ -24,21 +26,22 @@
 #include <vector>
 using namespace std;
 
-unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false);
-
 class Model 
 {
 public:
     // model data 
-    vector<Texture> textures_loaded;	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
+    vector<TextureRef> textureRefs;	// keeps the model's textures registered, the registry shares them with everyone else using the same image
     vector<Mesh>    meshes;
     string directory;
     bool gammaCorrection;
 
-    // constructor, expects a filepath to a 3D model.
-    Model(string const &path, bool gamma = false) : gammaCorrection(gamma)
+    // constructor, expects a filepath to a 3D model. With a job system the vertex and index data of the
+    // meshes is extracted in parallel, textures and GL buffers are always created on the calling thread.
+    // Textures come from TextureRegistry::Global(), so they load the way the registry is set up to.
+    Model(string const &path, bool gamma = false, JobSystem *jobs = nullptr)
+        : gammaCorrection(gamma)
     {
-        loadModel(path);
+        loadModel(path, jobs);
     }
 
     // draws the model, and thus all its meshes
@@ -47,10 +50,41 @@ public:
         for(unsigned int i = 0; i < meshes.size(); i++)
             meshes[i].Draw(shader);
     }
+
+    // registers the draw states of all meshes with a draw list, see Mesh::RegisterDrawState
+    void RegisterDrawStates(DrawList &list, const Shader &shader, const vector<TextureBinding> &extra = vector<TextureBinding>())
+    {
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            meshes[i].RegisterDrawState(list, shader, extra);
+    }
+
+    // records all meshes of the model into a command list, safe to call from worker threads
+    void Submit(CommandList &commands, const glm::mat4 &model, float depth) const
+    {
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            meshes[i].Submit(commands, model, PASS_OPAQUE, depth);
+    }
+
+    // object space bounds of all meshes
+    void GetBounds(glm::vec3 &boundsMin, glm::vec3 &boundsMax) const
+    {
+        boundsMin = boundsMax = glm::vec3(0.0f);
+        for(unsigned int i = 0; i < meshes.size(); i++)
+        {
+            boundsMin = i == 0 ? meshes[i].boundsMin : glm::min(boundsMin, meshes[i].boundsMin);
+            boundsMax = i == 0 ? meshes[i].boundsMax : glm::max(boundsMax, meshes[i].boundsMax);
+        }
+    }
     
 private:
+    // CPU side data of a mesh, filled by processMesh()
+    struct MeshData {
+        vector<Vertex>       vertices;
+        vector<unsigned int> indices;
+    };
+
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
-    void loadModel(string const &path)
+    void loadModel(string const &path, JobSystem *jobs)
     {
         // read file via ASSIMP
         Assimp::Importer importer;
@@ -64,35 +98,56 @@ private:
         // retrieve the directory path of the filepath
         directory = path.substr(0, path.find_last_of('/'));
 
-        // process ASSIMP's root node recursively
-        processNode(scene->mRootNode, scene);
+        // process ASSIMP's root node recursively, collecting the meshes in node order
+        vector<aiMesh*> sceneMeshes;
+        processNode(scene->mRootNode, scene, sceneMeshes);
+
+        // extract vertices and indices, this only reads the scene so the meshes can be processed in parallel
+        vector<MeshData> data(sceneMeshes.size());
+        auto extract = [&](size_t first, size_t last)
+        {
+            for(size_t i = first; i < last; i++)
+                processMesh(sceneMeshes[i], data[i]);
+        };
+        if(jobs)
+            jobs->ParallelFor(0, sceneMeshes.size(), 1, extract);
+        else
+            extract(0, sceneMeshes.size());
+
+        // materials and GL buffers need the GL context, so they are created here in order
+        for(unsigned int i = 0; i < sceneMeshes.size(); i++)
+        {
+            aiMaterial* material = scene->mMaterials[sceneMeshes[i]->mMaterialIndex];
+            meshes.push_back(Mesh(data[i].vertices, data[i].indices, processMaterial(material)));
+        }
     }
 
-    // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode *node, const aiScene *scene)
+    // processes a node in a recursive fashion. Collects each individual mesh located at the node and repeats this process on its children nodes (if any).
+    void processNode(aiNode *node, const aiScene *scene, vector<aiMesh*> &sceneMeshes)
     {
-        // process each mesh located at the current node
+        // collect each mesh located at the current node
         for(unsigned int i = 0; i < node->mNumMeshes; i++)
         {
             // the node object only contains indices to index the actual objects in the scene. 
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
-            aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            sceneMeshes.push_back(scene->mMeshes[node->mMeshes[i]]);
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for(unsigned int i = 0; i < node->mNumChildren; i++)
         {
-            processNode(node->mChildren[i], scene);
+            processNode(node->mChildren[i], scene, sceneMeshes);
         }
 
     }
 
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene)
+    // extracts the vertex and index data of a mesh. Does not touch GL or the model, safe to run on worker threads.
+    static void processMesh(aiMesh *mesh, MeshData &data)
     {
         // data to fill
-        vector<Vertex> vertices;
-        vector<unsigned int> indices;
-        vector<Texture> textures;
+        vector<Vertex> &vertices = data.vertices;
+        vector<unsigned int> &indices = data.indices;
+        vertices.reserve(mesh->mNumVertices);
+        indices.reserve(mesh->mNumFaces * 3);
 
         // walk through each of the mesh's vertices
         for(unsigned int i = 0; i < mesh->mNumVertices; i++)
@@ -145,8 +200,12 @@ private:
             for(unsigned int j = 0; j < face.mNumIndices; j++)
                 indices.push_back(face.mIndices[j]);        
         }
-        // process materials
-        aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];    
+    }
+
+    // loads the textures of a material, GL thread only
+    vector<Texture> processMaterial(aiMaterial *material)
+    {
+        vector<Texture> textures;
         // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
         // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER. 
         // Same applies to other texture as the following list summarizes:
@@ -167,8 +226,7 @@ private:
         std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
         textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
         
-        // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        return textures;
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
@@ -180,70 +238,16 @@ private:
         {
             aiString str;
             mat->GetTexture(type, i, &str);
-            // check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-            bool skip = false;
-            for(unsigned int j = 0; j < textures_loaded.size(); j++)
-            {
-                if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-                {
-                    textures.push_back(textures_loaded[j]);
-                    skip = true; // a texture with the same filepath has already been loaded, continue to next one. (optimization)
-                    break;
-                }
-            }
-            if(!skip)
-            {   // if texture hasn't been loaded already, load it
-                Texture texture;
-                texture.id = TextureFromFile(str.C_Str(), this->directory);
-                texture.type = typeName;
-                texture.path = str.C_Str();
-                textures.push_back(texture);
-                textures_loaded.push_back(texture);  // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
-            }
+            // the registry only loads images it does not have yet, in this model or anywhere else
+            TextureRef ref = TextureRegistry::Global().Texture2D(this->directory + '/' + str.C_Str());
+            Texture texture;
+            texture.id = ref->id;
+            texture.type = typeName;
+            texture.path = str.C_Str();
+            textures.push_back(texture);
+            textureRefs.push_back(ref);
         }
         return textures;
     }
 };
-
-
-unsigned int TextureFromFile(const char *path, const string &directory, bool gamma)
-{
-    string filename = string(path);
-    filename = directory + '/' + filename;
-
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data)
-    {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
-    }
-    else
-    {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
-    }
-
-    return textureID;
-}
 #endif
-
@@ -0,0 +1,407 @@
+
+
+#ifndef PIXEL_CACHE_H
+#define PIXEL_CACHE_H
+
+#include <content_hash.h>
+#include <mapped_file.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+enum PixelCacheMode {
+    CACHE_ENABLED,  // use and fill the cache
+    CACHE_BYPASS,   // decode everything, leave the cache alone (--no-cache)
+    CACHE_REBUILD   // throw the cache away and fill it again (--rebuild-cache)
+};
+
+// Pixels found in the cache. pixels points into mapping, which has to be kept alive while they are used.
+struct CachedPixels {
+    int width;
+    int height;
+    int channels;
+    unsigned int levels;
+    size_t size;
+    const unsigned char *pixels;
+    std::shared_ptr<MappedFile> mapping;
+};
+
+// What a cache entry is looked up by. Lookup() fills in the content hash, Store() needs it.
+struct PixelCacheKey {
+    std::string path;
+    int channels;       // requested channel count, 0 = as in the file
+    bool mipmaps;
+    int64_t modified;
+    int64_t fileSize;
+    uint64_t hash;
+
+    PixelCacheKey() : channels(0), mipmaps(false), modified(0), fileSize(0), hash(0)
+    {
+    }
+};
+
+// A cache entry written while its pixels are produced, for images that never exist as a whole in client memory:
+// PixelCache::Begin() creates it, Write() puts bytes anywhere in the pixels and PixelCache::Finish() adds it to
+// the cache. An entry that is not finished is removed again.
+class PixelCacheWriter
+{
+public:
+    PixelCacheWriter() : file(0), start(0), size(0), position(0), written(0), ok(false)
+    {
+    }
+
+    ~PixelCacheWriter()
+    {
+        if (file)
+        {
+            fclose(file);
+            remove(temporary.c_str());
+        }
+    }
+
+    // count bytes at offset of the pixels, levels back to back as PixelCache::Store() takes them
+    void Write(size_t offset, const unsigned char *bytes, size_t count)
+    {
+        if (!file || !ok)
+            return;
+        if (offset != position)
+            ok = seekFile(file, start + (uint64_t)offset);
+        ok = ok && offset + count <= size && fwrite(bytes, 1, count, file) == count;
+        position = offset + count;
+        written += count;
+    }
+
+private:
+    friend class PixelCache;
+
+    FILE *file;
+    PixelCacheKey key;
+    std::string name, path, temporary;
+    size_t start;       // of the pixels in the file
+    size_t size;
+    size_t position;    // in the pixels
+    size_t written;
+    bool ok;
+
+    PixelCacheWriter(const PixelCacheWriter &);
+    PixelCacheWriter &operator=(const PixelCacheWriter &);
+};
+
+// Persistent cache of decoded images, including their mip chains, so that warm starts skip decoding.
+//
+// Every decoded image is one file named after the content hash of its source and the decode parameters, so
+// identical images under different names share an entry. Files hold a 4 KiB header followed by the levels
+// packed back to back, ready to be mapped and uploaded as they are. Only the start of the pixels is page
+// aligned, the levels after the first are not padded. An index file remembers the modification time, size and
+// hash of each source path, so unchanged sources are not even hashed, plus when each entry was last used. Once
+// the cache grows past its size cap the least recently used entries go.
+//
+// Lookup(), Store(), Begin() and Finish() can be called from any thread.
+class PixelCache
+{
+public:
+    static const uint32_t MAGIC = 0x31435850; // "PXC1"
+    static const size_t DATA_OFFSET = 4096;
+
+    // statistics of this run
+    unsigned int hits;
+    unsigned int misses;
+    size_t bytesRead;
+    size_t bytesWritten;
+
+    PixelCache(const std::string &directory, size_t maxBytes, PixelCacheMode mode)
+        : hits(0), misses(0), bytesRead(0), bytesWritten(0), directory(directory), maxBytes(maxBytes),
+          mode(mode), clock(0), writes(0), dirty(false)
+    {
+        if (mode == CACHE_BYPASS)
+            return;
+        if (!makeDirectory(directory))
+        {
+            std::cout << "Pixel cache disabled, cannot create " << directory << std::endl;
+            this->mode = CACHE_BYPASS;
+            return;
+        }
+        loadIndex();
+        if (mode == CACHE_REBUILD)
+        {
+            for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+                remove(filePath(it->first).c_str());
+            entries.clear();
+            sources.clear();
+            dirty = true;
+            this->mode = CACHE_ENABLED;
+        }
+    }
+
+    ~PixelCache()
+    {
+        Save();
+    }
+
+    bool Enabled() const { return mode != CACHE_BYPASS; }
+
+    // looks for decoded pixels of key.path, filling in the rest of the key for a later Store()
+    bool Lookup(PixelCacheKey &key, CachedPixels &result)
+    {
+        if (!Enabled() || !fileStatus(key.path, key.modified, key.fileSize))
+            return false;
+
+        bool known = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, Source>::iterator it = sources.find(sourceName(key));
+            if (it != sources.end() && it->second.modified == key.modified && it->second.fileSize == key.fileSize)
+            {
+                key.hash = it->second.hash;
+                known = true;
+            }
+        }
+        // sources that changed on disk, or were never seen, are hashed again; the hash decides
+        if (!known && !hashFile(key.path, key.hash))
+            return false;
+
+        std::string name = entryName(key);
+        std::shared_ptr<MappedFile> mapping(new MappedFile());
+        if (!mapping->Open(filePath(name)) || !readHeader(*mapping, result))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            misses++;
+            return false;
+        }
+        result.mapping = mapping;
+        result.pixels = mapping->Data() + DATA_OFFSET;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        hits++;
+        bytesRead += result.size;
+        remember(key, name, mapping->Size());
+        return true;
+    }
+
+    // writes decoded pixels (levels back to back) for a key that Lookup() did not find
+    void Store(const PixelCacheKey &key, int width, int height, int channels, unsigned int levels,
+               const unsigned char *pixels, size_t size)
+    {
+        PixelCacheWriter writer;
+        if (!Begin(key, width, height, channels, levels, size, writer))
+            return;
+        writer.Write(0, pixels, size);
+        Finish(writer);
+    }
+
+    // starts an entry of size bytes of pixels for a key that Lookup() did not find, see PixelCacheWriter
+    bool Begin(const PixelCacheKey &key, int width, int height, int channels, unsigned int levels, size_t size,
+               PixelCacheWriter &writer)
+    {
+        if (!Enabled() || key.hash == 0 || writer.file)
+            return false;
+        writer.key = key;
+        writer.name = entryName(key);
+        writer.path = filePath(writer.name);
+        writer.start = DATA_OFFSET;
+        writer.size = size;
+        writer.position = 0;
+        writer.written = 0;
+        // two jobs can miss on the same content at once, each writes its own temporary file
+        std::ostringstream temporary;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            temporary << writer.path << "." << ++writes << ".tmp";
+        }
+        writer.temporary = temporary.str();
+
+        uint32_t header[8] = { MAGIC, 1, (uint32_t)width, (uint32_t)height, (uint32_t)channels, levels,
+                               (uint32_t)(size & 0xFFFFFFFFu), (uint32_t)((uint64_t)size >> 32) };
+        std::vector<unsigned char> padding(DATA_OFFSET - sizeof(header), 0);
+        writer.file = fopen(writer.temporary.c_str(), "wb");
+        if (!writer.file)
+            return false;
+        writer.ok = fwrite(header, sizeof(header), 1, writer.file) == 1 &&
+                    fwrite(&padding[0], 1, padding.size(), writer.file) == padding.size();
+        return writer.ok;
+    }
+
+    // adds the entry once all of its pixels were written, false if it could not be
+    bool Finish(PixelCacheWriter &writer)
+    {
+        if (!writer.file)
+            return false;
+        // every byte is written once, so an entry that is short of its size was not fully produced
+        bool ok = writer.ok && writer.written == writer.size;
+        ok = fclose(writer.file) == 0 && ok;
+        writer.file = 0;
+        // written under a temporary name first so that a crash never leaves a truncated entry behind
+        remove(writer.path.c_str());
+        if (!ok || rename(writer.temporary.c_str(), writer.path.c_str()) != 0)
+        {
+            remove(writer.temporary.c_str());
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        bytesWritten += writer.size;
+        remember(writer.key, writer.name, DATA_OFFSET + writer.size);
+        evict();
+        return true;
+    }
+
+    // writes the index, called on destruction
+    void Save()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!Enabled() || !dirty)
+            return;
+        std::ofstream out((directory + "/index.txt").c_str());
+        out << "clock " << clock << "\n";
+        for (std::map<std::string, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+            out << "entry " << it->first << " " << it->second.bytes << " " << it->second.lastUsed << "\n";
+        for (std::map<std::string, Source>::const_iterator it = sources.begin(); it != sources.end(); ++it)
+            out << "source " << it->second.modified << " " << it->second.fileSize << " " << it->second.hash
+                << " " << it->first << "\n";
+        dirty = false;
+    }
+
+    // safe while decode jobs store entries
+    size_t TotalBytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return totalBytes();
+    }
+
+    size_t MaxBytes() const { return maxBytes; }
+
+private:
+    struct Entry {
+        size_t bytes;
+        uint64_t lastUsed;
+    };
+
+    struct Source {
+        int64_t modified;
+        int64_t fileSize;
+        uint64_t hash;
+    };
+
+    std::string directory;
+    size_t maxBytes;
+    PixelCacheMode mode;
+    uint64_t clock;     // use counter for the LRU order, persisted with the index
+    unsigned long writes;
+    bool dirty;
+    std::map<std::string, Entry> entries;   // by file name
+    std::map<std::string, Source> sources;  // by source name, see sourceName()
+    mutable std::mutex mutex;
+
+    static std::string sourceName(const PixelCacheKey &key)
+    {
+        std::ostringstream name;
+        name << key.channels << " " << (key.mipmaps ? 1 : 0) << " " << key.path;
+        return name.str();
+    }
+
+    static std::string entryName(const PixelCacheKey &key)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "%016llx_c%d%s.pix", (unsigned long long)key.hash, key.channels,
+                 key.mipmaps ? "_mips" : "");
+        return name;
+    }
+
+    std::string filePath(const std::string &name) const
+    {
+        return directory + "/" + name;
+    }
+
+    static bool readHeader(const MappedFile &file, CachedPixels &result)
+    {
+        uint32_t header[8];
+        if (file.Size() < DATA_OFFSET)
+            return false;
+        memcpy(header, file.Data(), sizeof(header));
+        result.width = (int)header[2];
+        result.height = (int)header[3];
+        result.channels = (int)header[4];
+        result.levels = header[5];
+        result.size = (size_t)header[6] | (size_t)((uint64_t)header[7] << 32);
+        return header[0] == MAGIC && header[1] == 1 && file.Size() >= DATA_OFFSET + result.size;
+    }
+
+    // under the lock
+    void remember(const PixelCacheKey &key, const std::string &name, size_t bytes)
+    {
+        Source source = { key.modified, key.fileSize, key.hash };
+        sources[sourceName(key)] = source;
+        Entry entry = { bytes, ++clock };
+        entries[name] = entry;
+        dirty = true;
+    }
+
+    // under the lock
+    size_t totalBytes() const
+    {
+        size_t total = 0;
+        for (std::map<std::string, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+            total += it->second.bytes;
+        return total;
+    }
+
+    // under the lock, drops least recently used entries until the cache fits its cap again
+    void evict()
+    {
+        size_t total = totalBytes();
+        while (total > maxBytes && entries.size() > 1)
+        {
+            std::map<std::string, Entry>::iterator oldest = entries.begin();
+            for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+                if (it->second.lastUsed < oldest->second.lastUsed)
+                    oldest = it;
+            // sources that pointed at the entry simply miss next time
+            remove(filePath(oldest->first).c_str());
+            total -= oldest->second.bytes;
+            entries.erase(oldest);
+        }
+    }
+
+    void loadIndex()
+    {
+        std::ifstream in((directory + "/index.txt").c_str());
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string type;
+            fields >> type;
+            if (type == "clock")
+                fields >> clock;
+            else if (type == "entry")
+            {
+                std::string name;
+                Entry entry;
+                if (fields >> name >> entry.bytes >> entry.lastUsed)
+                    entries[name] = entry;
+            }
+            else if (type == "source")
+            {
+                Source source;
+                std::string name;
+                if (fields >> source.modified >> source.fileSize >> source.hash && std::getline(fields, name) &&
+                    name.find_first_not_of(' ') != std::string::npos)
+                    sources[name.substr(name.find_first_not_of(' '))] = source;
+            }
+        }
+    }
+
+    PixelCache(const PixelCache &);
+    PixelCache &operator=(const PixelCache &);
+};
+#endif
@@ -0,0 +1,712 @@
+
+
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// PNG header fields plus the channel count stb_image would report for the file
+struct PngInfo {
+    int width;
+    int height;
+    int channels;   // after palette expansion
+    int bitDepth;
+    int colorType;
+    bool interlaced;
+};
+
+// Streaming PNG decoder. The IDAT data is read through a small buffer and inflated into a 32 KiB window,
+// each scanline is unfiltered against the previous one, converted to the requested channel count and
+// handed to a callback, so decoding never holds more than two rows of the image.
+//
+// Conversions follow stb_image (grey is replicated, colour to grey uses the same luma weights, 16 bit
+// samples keep their high byte), so the rows match stbi_load byte for byte. Interlaced images, bit depths
+// below 8 and colour keyed transparency are not Supported() and are left to stb_image.
+class PngStreamDecoder
+{
+public:
+    typedef std::function<void(const unsigned char *, int)> RowFn; // row, y
+
+    PngStreamDecoder() : file(0), error(0), wide(false), chunkRemaining(0)
+    {
+    }
+
+    ~PngStreamDecoder()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    // reads the chunks up to the first IDAT
+    bool Open(const std::string &path)
+    {
+        file = fopen(path.c_str(), "rb");
+        if (!file)
+            return fail("cannot open file");
+        static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        unsigned char header[8];
+        if (fread(header, 1, 8, file) != 8 || memcmp(header, signature, 8) != 0)
+            return fail("not a PNG");
+
+        bool hasHeader = false;
+        for (;;)
+        {
+            uint32_t length, type;
+            if (!readChunkHeader(length, type))
+                return fail("truncated file");
+            if (type == chunkType("IHDR"))
+            {
+                unsigned char data[13];
+                if (length != 13 || fread(data, 1, 13, file) != 13)
+                    return fail("bad IHDR");
+                info.width = (int)readU32(data);
+                info.height = (int)readU32(data + 4);
+                info.bitDepth = data[8];
+                info.colorType = data[9];
+                info.interlaced = data[12] != 0;
+                if (info.width <= 0 || info.height <= 0 || data[10] != 0 || data[11] != 0)
+                    return fail("bad IHDR");
+                static const int channelsOf[7] = { 1, 0, 3, 1, 2, 0, 4 };
+                if (info.colorType > 6 || channelsOf[info.colorType] == 0)
+                    return fail("bad colour type");
+                samples = channelsOf[info.colorType];
+                info.channels = samples == 1 && info.colorType == 3 ? 3 : samples;
+                hasHeader = true;
+            }
+            else if (type == chunkType("PLTE"))
+            {
+                palette.resize(256 * 4, 255);
+                for (uint32_t i = 0; i < length / 3 && i < 256; i++)
+                    if (fread(&palette[i * 4], 1, 3, file) != 3)
+                        return fail("truncated PLTE");
+                if (length > 768 && fseek(file, (long)(length - 768), SEEK_CUR) != 0)
+                    return fail("truncated PLTE");
+            }
+            else if (type == chunkType("tRNS"))
+            {
+                if (!hasHeader)
+                    return fail("tRNS before IHDR");
+                if (info.colorType != 3)
+                    return fail("colour keyed transparency");
+                palette.resize(256 * 4, 255);
+                for (uint32_t i = 0; i < length && i < 256; i++)
+                {
+                    int alpha = fgetc(file);
+                    if (alpha == EOF)
+                        return fail("truncated tRNS");
+                    palette[i * 4 + 3] = (unsigned char)alpha;
+                }
+                if (length > 256 && fseek(file, (long)(length - 256), SEEK_CUR) != 0)
+                    return fail("truncated tRNS");
+                info.channels = 4;
+            }
+            else if (type == chunkType("IDAT"))
+            {
+                if (!hasHeader || (info.colorType == 3 && palette.empty()))
+                    return fail("missing IHDR or PLTE");
+                chunkRemaining = length;
+                return true;
+            }
+            else if (type == chunkType("IEND"))
+                return fail("no image data");
+            else if (fseek(file, (long)length, SEEK_CUR) != 0)
+                return fail("truncated file");
+            // CRC
+            if (fseek(file, 4, SEEK_CUR) != 0)
+                return fail("truncated file");
+        }
+    }
+
+    const PngInfo &Info() const { return info; }
+
+    bool Supported() const
+    {
+        return !info.interlaced && (info.bitDepth == 8 || (info.bitDepth == 16 && info.colorType != 3));
+    }
+
+    // inflates the image data and calls row for every scanline, converted to desiredChannels (0 = Info().channels)
+    bool Decode(int desiredChannels, RowFn row)
+    {
+        wide = false;
+        return decode(desiredChannels, row);
+    }
+
+    // Like Decode(), but rows hold Info().channels 16 bit samples in native byte order, 8 bit samples widened
+    // by 257, so 16 bit images such as elevation data keep their full precision.
+    bool DecodeWide(RowFn row)
+    {
+        wide = true;
+        return decode(0, row);
+    }
+
+    const char *Error() const { return error; }
+
+private:
+    static const size_t WINDOW_SIZE = 32768;
+    static const size_t FLUSH_SIZE = 16384;     // divides WINDOW_SIZE, output is handed on in these steps
+    static const int FAST_BITS = 9;
+
+    bool decode(int desiredChannels, RowFn row)
+    {
+        if (!file || !Supported())
+            return fail("unsupported PNG");
+        outChannels = desiredChannels ? desiredChannels : info.channels;
+        pixelBytes = samples * info.bitDepth / 8;
+        stride = (size_t)info.width * pixelBytes;
+        current.assign(stride + 1, 0);
+        previous.assign(stride + 1, 0);
+        expanded.resize((size_t)info.width * info.channels);
+        converted.resize((size_t)info.width * outChannels);
+        wideRow.resize(wide ? (size_t)info.width * info.channels : 0);
+        filled = 0;
+        rowIndex = 0;
+        rowFn = row;
+
+        inputPos = inputEnd = 0;
+        input.resize(64 * 1024);
+        bits = 0;
+        numBits = 0;
+        overrun = 0;
+        dataEnded = false;
+        written = 0;
+        flushed = 0;
+        window.resize(WINDOW_SIZE);
+        if (!inflate())
+            return false;
+        if (rowIndex < info.height)
+            return fail("image data too short");
+        return true;
+    }
+
+    struct Huffman {
+        uint16_t fast[1 << FAST_BITS];  // (length << 9) | symbol for codes up to FAST_BITS, 0 = longer code
+        uint16_t firstCode[16];
+        uint16_t firstSymbol[16];
+        int maxCode[17];
+        uint8_t size[288];
+        uint16_t value[288];
+    };
+
+    FILE *file;
+    const char *error;
+    PngInfo info;
+    int samples;                        // samples per pixel in the file, 1 for palette indices
+    std::vector<unsigned char> palette; // RGBA
+
+    // rows
+    int outChannels;
+    int pixelBytes;
+    size_t stride;
+    std::vector<unsigned char> current;  // filter byte + scanline
+    std::vector<unsigned char> previous;
+    std::vector<unsigned char> expanded; // 8 bit samples, palette expanded
+    std::vector<unsigned char> converted;
+    std::vector<uint16_t> wideRow;
+    bool wide;
+    size_t filled;
+    int rowIndex;
+    RowFn rowFn;
+
+    // IDAT stream
+    std::vector<unsigned char> input;
+    size_t inputPos;
+    size_t inputEnd;
+    uint32_t chunkRemaining;
+    bool dataEnded;
+    uint32_t bits;
+    int numBits;
+    int overrun;
+
+    // inflate output
+    std::vector<unsigned char> window;
+    size_t written;
+    size_t flushed;
+
+    bool fail(const char *message)
+    {
+        error = message;
+        return false;
+    }
+
+    static uint32_t readU32(const unsigned char *data)
+    {
+        return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    }
+
+    static uint32_t chunkType(const char *name)
+    {
+        return readU32((const unsigned char*)name);
+    }
+
+    bool readChunkHeader(uint32_t &length, uint32_t &type)
+    {
+        unsigned char header[8];
+        if (fread(header, 1, 8, file) != 8)
+            return false;
+        length = readU32(header);
+        type = readU32(header + 4);
+        return length < 0x80000000u;
+    }
+
+    // next byte of the concatenated IDAT data, 0 past the end. The buffer never reaches beyond the
+    // current chunk, so the file position is at its CRC once the chunk is used up.
+    int nextByte()
+    {
+        while (chunkRemaining == 0)
+        {
+            uint32_t length, type;
+            if (dataEnded || fseek(file, 4, SEEK_CUR) != 0 || !readChunkHeader(length, type) ||
+                type != chunkType("IDAT"))
+            {
+                dataEnded = true;
+                overrun++;
+                return 0;
+            }
+            chunkRemaining = length;
+        }
+        if (inputPos == inputEnd)
+        {
+            inputEnd = fread(&input[0], 1, std::min((size_t)chunkRemaining, input.size()), file);
+            inputPos = 0;
+            if (inputEnd == 0)
+            {
+                chunkRemaining = 0;
+                dataEnded = true;
+                overrun++;
+                return 0;
+            }
+        }
+        chunkRemaining--;
+        return input[inputPos++];
+    }
+
+    void fillBits()
+    {
+        while (numBits <= 24)
+        {
+            bits |= (uint32_t)nextByte() << numBits;
+            numBits += 8;
+        }
+    }
+
+    uint32_t takeBits(int count)
+    {
+        if (numBits < count)
+            fillBits();
+        uint32_t value = bits & ((1u << count) - 1);
+        bits >>= count;
+        numBits -= count;
+        return value;
+    }
+
+    static int reverseBits(int value, int count)
+    {
+        int result = 0;
+        for (int i = 0; i < count; i++)
+        {
+            result = (result << 1) | (value & 1);
+            value >>= 1;
+        }
+        return result;
+    }
+
+    static bool buildHuffman(Huffman &huffman, const uint8_t *lengths, int count)
+    {
+        int sizes[17] = { 0 };
+        int nextCode[16];
+        memset(huffman.fast, 0, sizeof(huffman.fast));
+        for (int i = 0; i < count; i++)
+            sizes[lengths[i]]++;
+        sizes[0] = 0;
+        for (int i = 1; i < 16; i++)
+            if (sizes[i] > (1 << i))
+                return false;
+        int code = 0;
+        int symbol = 0;
+        for (int i = 1; i < 16; i++)
+        {
+            nextCode[i] = code;
+            huffman.firstCode[i] = (uint16_t)code;
+            huffman.firstSymbol[i] = (uint16_t)symbol;
+            code += sizes[i];
+            if (sizes[i] && code - 1 >= (1 << i))
+                return false;
+            huffman.maxCode[i] = code << (16 - i);
+            code <<= 1;
+            symbol += sizes[i];
+        }
+        huffman.maxCode[16] = 0x10000;
+        for (int i = 0; i < count; i++)
+        {
+            int length = lengths[i];
+            if (!length)
+                continue;
+            int index = nextCode[length] - huffman.firstCode[length] + huffman.firstSymbol[length];
+            huffman.size[index] = (uint8_t)length;
+            huffman.value[index] = (uint16_t)i;
+            if (length <= FAST_BITS)
+            {
+                for (int j = reverseBits(nextCode[length], length); j < (1 << FAST_BITS); j += 1 << length)
+                    huffman.fast[j] = (uint16_t)((length << 9) | i);
+            }
+            nextCode[length]++;
+        }
+        return true;
+    }
+
+    // -1 on a bad code
+    int decodeSymbol(const Huffman &huffman)
+    {
+        if (numBits < 16)
+            fillBits();
+        int fast = huffman.fast[bits & ((1 << FAST_BITS) - 1)];
+        if (fast)
+        {
+            int length = fast >> 9;
+            bits >>= length;
+            numBits -= length;
+            return fast & 511;
+        }
+        // codes are stored bit reversed, compare them msb first against the canonical ranges
+        int reversed = reverseBits((int)(bits & 0xFFFF), 16);
+        int length = FAST_BITS + 1;
+        while (length < 16 && reversed >= huffman.maxCode[length])
+            length++;
+        if (length >= 16)
+            return -1;
+        int index = (reversed >> (16 - length)) - huffman.firstCode[length] + huffman.firstSymbol[length];
+        if (index >= 288 || huffman.size[index] != length)
+            return -1;
+        bits >>= length;
+        numBits -= length;
+        return huffman.value[index];
+    }
+
+    void put(unsigned char byte)
+    {
+        window[written & (WINDOW_SIZE - 1)] = byte;
+        written++;
+        if ((written & (FLUSH_SIZE - 1)) == 0)
+            flush();
+    }
+
+    // hands the bytes written since the last flush to the row assembly; they lie in one FLUSH_SIZE step
+    void flush()
+    {
+        size_t start = flushed & (WINDOW_SIZE - 1);
+        consume(&window[start], written - flushed);
+        flushed = written;
+    }
+
+    void consume(const unsigned char *data, size_t size)
+    {
+        while (size > 0 && rowIndex < info.height)
+        {
+            size_t count = std::min(size, stride + 1 - filled);
+            memcpy(&current[filled], data, count);
+            filled += count;
+            data += count;
+            size -= count;
+            if (filled == stride + 1)
+            {
+                finishRow();
+                filled = 0;
+            }
+        }
+    }
+
+    static int paeth(int a, int b, int c)
+    {
+        int p = a + b - c;
+        int pa = p > a ? p - a : a - p;
+        int pb = p > b ? p - b : b - p;
+        int pc = p > c ? p - c : c - p;
+        if (pa <= pb && pa <= pc)
+            return a;
+        return pb <= pc ? b : c;
+    }
+
+    void finishRow()
+    {
+        unsigned char *row = &current[1];
+        const unsigned char *above = &previous[1];
+        int filter = current[0];
+        int bpp = pixelBytes;
+        switch (filter)
+        {
+        case 0:
+            break;
+        case 1:
+            for (size_t i = bpp; i < stride; i++)
+                row[i] = (unsigned char)(row[i] + row[i - bpp]);
+            break;
+        case 2:
+            for (size_t i = 0; i < stride; i++)
+                row[i] = (unsigned char)(row[i] + above[i]);
+            break;
+        case 3:
+            for (int i = 0; i < bpp; i++)
+                row[i] = (unsigned char)(row[i] + (above[i] >> 1));
+            for (size_t i = bpp; i < stride; i++)
+                row[i] = (unsigned char)(row[i] + ((row[i - bpp] + above[i]) >> 1));
+            break;
+        case 4:
+            for (int i = 0; i < bpp; i++)
+                row[i] = (unsigned char)(row[i] + above[i]);
+            for (size_t i = bpp; i < stride; i++)
+                row[i] = (unsigned char)(row[i] + paeth(row[i - bpp], above[i], above[i - bpp]));
+            break;
+        default:
+            // counted as an error once inflating is done
+            error = "bad filter type";
+            break;
+        }
+
+        if (wide)
+        {
+            finishWideRow(row);
+            return;
+        }
+
+        // 8 bit samples, palette expanded
+        const unsigned char *pixels = row;
+        if (info.colorType == 3)
+        {
+            for (int x = 0; x < info.width; x++)
+                memcpy(&expanded[(size_t)x * info.channels], &palette[row[x] * 4], info.channels);
+            pixels = &expanded[0];
+        }
+        else if (info.bitDepth == 16)
+        {
+            for (size_t i = 0; i < (size_t)info.width * info.channels; i++)
+                expanded[i] = row[i * 2];
+            pixels = &expanded[0];
+        }
+        if (outChannels != info.channels)
+        {
+            convertRow(pixels, info.channels, &converted[0], outChannels, info.width);
+            pixels = &converted[0];
+        }
+        rowFn(pixels, rowIndex++);
+        current.swap(previous);
+    }
+
+    // 16 bit samples, palette expanded, for DecodeWide()
+    void finishWideRow(const unsigned char *row)
+    {
+        size_t count = (size_t)info.width * info.channels;
+        if (info.colorType == 3)
+        {
+            for (int x = 0; x < info.width; x++)
+                for (int c = 0; c < info.channels; c++)
+                    wideRow[(size_t)x * info.channels + c] = (uint16_t)(palette[row[x] * 4 + c] * 257);
+        }
+        else if (info.bitDepth == 16)
+        {
+            for (size_t i = 0; i < count; i++)
+                wideRow[i] = (uint16_t)(row[i * 2] << 8 | row[i * 2 + 1]);
+        }
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+                wideRow[i] = (uint16_t)(row[i] * 257);
+        }
+        rowFn((const unsigned char*)&wideRow[0], rowIndex++);
+        current.swap(previous);
+    }
+
+    static unsigned char luma(const unsigned char *rgb)
+    {
+        return (unsigned char)((rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> 8);
+    }
+
+    // the conversions of stbi__convert_format
+    static void convertRow(const unsigned char *src, int srcChannels, unsigned char *dst, int dstChannels, int width)
+    {
+        for (int x = 0; x < width; x++, src += srcChannels, dst += dstChannels)
+        {
+            unsigned char grey = srcChannels >= 3 ? luma(src) : src[0];
+            unsigned char alpha = srcChannels == 2 ? src[1] : (srcChannels == 4 ? src[3] : 255);
+            switch (dstChannels)
+            {
+            case 1:
+                dst[0] = grey;
+                break;
+            case 2:
+                dst[0] = grey;
+                dst[1] = alpha;
+                break;
+            default:
+                if (srcChannels >= 3)
+                    memcpy(dst, src, 3);
+                else
+                    dst[0] = dst[1] = dst[2] = grey;
+                if (dstChannels == 4)
+                    dst[3] = alpha;
+                break;
+            }
+        }
+    }
+
+    bool inflate()
+    {
+        int cmf = nextByte();
+        int flg = nextByte();
+        if ((cmf * 256 + flg) % 31 != 0 || (cmf & 15) != 8 || (flg & 32) != 0)
+            return fail("bad zlib header");
+
+        static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                            67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+                                             5, 5, 5, 5, 0 };
+        static const int distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                              513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        static const int distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+                                               10, 11, 11, 12, 12, 13, 13 };
+
+        Huffman lengths, distances;
+        bool final = false;
+        while (!final)
+        {
+            final = takeBits(1) != 0;
+            int type = (int)takeBits(2);
+            if (type == 0)
+            {
+                if (!copyStored())
+                    return false;
+                continue;
+            }
+            if (type == 3)
+                return fail("bad block type");
+            if (type == 1)
+                fixedTables(lengths, distances);
+            else if (!dynamicTables(lengths, distances))
+                return false;
+
+            for (;;)
+            {
+                int symbol = decodeSymbol(lengths);
+                if (symbol < 0 || overrun > 4)
+                    return fail("corrupt image data");
+                if (symbol < 256)
+                {
+                    put((unsigned char)symbol);
+                    continue;
+                }
+                if (symbol == 256)
+                    break;
+                symbol -= 257;
+                if (symbol >= 29)
+                    return fail("bad length code");
+                int length = lengthBase[symbol] + (int)takeBits(lengthExtra[symbol]);
+                int code = decodeSymbol(distances);
+                if (code < 0 || code >= 30)
+                    return fail("bad distance code");
+                size_t distance = (size_t)distanceBase[code] + takeBits(distanceExtra[code]);
+                if (distance > written)
+                    return fail("bad distance");
+                for (int i = 0; i < length; i++)
+                    put(window[(written - distance) & (WINDOW_SIZE - 1)]);
+            }
+        }
+        flush();
+        return error == 0 || fail(error);
+    }
+
+    bool copyStored()
+    {
+        // the length fields start at the next byte boundary
+        takeBits(numBits & 7);
+        uint32_t header[4];
+        for (int i = 0; i < 4; i++)
+            header[i] = takeBits(8);
+        uint32_t length = header[0] | (header[1] << 8);
+        uint32_t check = header[2] | (header[3] << 8);
+        if ((length ^ 0xFFFF) != check)
+            return fail("corrupt stored block");
+        // whole bytes still in the bit buffer come first
+        while (length > 0 && numBits >= 8)
+        {
+            put((unsigned char)takeBits(8));
+            length--;
+        }
+        while (length-- > 0)
+            put((unsigned char)nextByte());
+        return overrun <= 4 || fail("truncated stored block");
+    }
+
+    static void fixedTables(Huffman &lengths, Huffman &distances)
+    {
+        uint8_t sizes[288];
+        int i = 0;
+        for (; i <= 143; i++)
+            sizes[i] = 8;
+        for (; i <= 255; i++)
+            sizes[i] = 9;
+        for (; i <= 279; i++)
+            sizes[i] = 7;
+        for (; i <= 287; i++)
+            sizes[i] = 8;
+        buildHuffman(lengths, sizes, 288);
+        for (i = 0; i < 30; i++)
+            sizes[i] = 5;
+        buildHuffman(distances, sizes, 30);
+    }
+
+    bool dynamicTables(Huffman &lengths, Huffman &distances)
+    {
+        static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+        int numLengths = (int)takeBits(5) + 257;
+        int numDistances = (int)takeBits(5) + 1;
+        int numCodeLengths = (int)takeBits(4) + 4;
+
+        uint8_t codeLengthSizes[19] = { 0 };
+        for (int i = 0; i < numCodeLengths; i++)
+            codeLengthSizes[order[i]] = (uint8_t)takeBits(3);
+        Huffman codeLengths;
+        if (!buildHuffman(codeLengths, codeLengthSizes, 19))
+            return fail("bad code lengths");
+
+        uint8_t sizes[288 + 32];
+        int total = numLengths + numDistances;
+        int n = 0;
+        while (n < total)
+        {
+            int symbol = decodeSymbol(codeLengths);
+            if (symbol < 0 || symbol >= 19)
+                return fail("bad code lengths");
+            if (symbol < 16)
+            {
+                sizes[n++] = (uint8_t)symbol;
+                continue;
+            }
+            uint8_t fill = 0;
+            int repeat;
+            if (symbol == 16)
+            {
+                if (n == 0)
+                    return fail("bad code lengths");
+                fill = sizes[n - 1];
+                repeat = 3 + (int)takeBits(2);
+            }
+            else if (symbol == 17)
+                repeat = 3 + (int)takeBits(3);
+            else
+                repeat = 11 + (int)takeBits(7);
+            if (n + repeat > total)
+                return fail("bad code lengths");
+            memset(sizes + n, fill, repeat);
+            n += repeat;
+        }
+        if (!buildHuffman(lengths, sizes, numLengths) || !buildHuffman(distances, sizes + numLengths, numDistances))
+            return fail("bad huffman tables");
+        return true;
+    }
+};
+#endif
@@ -0,0 +1,343 @@
+
+
+#ifndef RASTER_READER_H
+#define RASTER_READER_H
+
+#include <mapped_file.h>
+#include <png_stream.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+enum RasterSampleType {
+    RASTER_U8,
+    RASTER_U16,
+    RASTER_I16,
+    RASTER_F32
+};
+
+inline size_t rasterSampleBytes(RasterSampleType type)
+{
+    static const size_t bytes[] = { 1, 2, 2, 4 };
+    return bytes[type];
+}
+
+struct RasterInfo {
+    int width;
+    int height;
+    int channels;
+    RasterSampleType type;
+
+    size_t RowBytes() const { return (size_t)width * channels * rasterSampleBytes(type); }
+};
+
+// Reads rasters too large to decode in one piece, rows top to bottom, holding a strip of rows at a time.
+//
+// Sources are headerless raw samples, PNG (8 or 16 bit, through PngStreamDecoder) and baseline TIFF: uncompressed,
+// stripped, chunky, 8, 16 or 32 bit samples of one or more channels, either byte order. Compressed and tiled
+// TIFFs are rejected with a hint. Rows reach the callback in native byte order, row y with the samples of
+// Info().type. Read() can be called again for another pass over the file.
+class RasterReader
+{
+public:
+    typedef std::function<void(const unsigned char *, int)> RowFn; // row, y
+
+    RasterReader() : kind(NONE), error(0), stripRows(64), swapBytes(false), rowsPerStrip(0), bytesRead(0)
+    {
+        memset(&info, 0, sizeof(info));
+    }
+
+    // width x height samples of type, one channel, rows tightly packed from the start of the file
+    bool OpenRaw(const std::string &path, int width, int height, RasterSampleType type, bool bigEndian = false)
+    {
+        int64_t modified, size;
+        if (!fileStatus(path, modified, size))
+            return fail("cannot open file");
+        info.width = width;
+        info.height = height;
+        info.channels = 1;
+        info.type = type;
+        if (width <= 0 || height <= 0 || (uint64_t)size < (uint64_t)info.RowBytes() * height)
+            return fail("file smaller than the raster");
+        this->path = path;
+        kind = RAW;
+        swapBytes = bigEndian != hostIsBigEndian();
+        return true;
+    }
+
+    // PNG or TIFF, by extension
+    bool Open(const std::string &path)
+    {
+        std::string extension = path.substr(path.find_last_of('.') + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        this->path = path;
+        if (extension == "png")
+        {
+            PngStreamDecoder png;
+            if (!png.Open(path) || !png.Supported())
+                return fail(png.Error() ? png.Error() : "unsupported PNG");
+            info.width = png.Info().width;
+            info.height = png.Info().height;
+            info.channels = png.Info().channels;
+            info.type = png.Info().bitDepth == 16 ? RASTER_U16 : RASTER_U8;
+            kind = PNG;
+            return true;
+        }
+        if (extension == "tif" || extension == "tiff")
+            return openTiff();
+        return fail("unknown raster format, raw samples need their size and type");
+    }
+
+    const RasterInfo &Info() const { return info; }
+    const char *Error() const { return error; }
+    uint64_t BytesRead() const { return bytesRead; }
+
+    // rows read from the file at a time, raw and TIFF only, PNGs are decoded a row at a time anyway
+    void SetStripRows(int rows) { stripRows = std::max(rows, 1); }
+
+    bool Read(RowFn row)
+    {
+        if (kind == PNG)
+        {
+            PngStreamDecoder png;
+            int64_t modified, size;
+            if (!png.Open(path) || !fileStatus(path, modified, size))
+                return fail("cannot open file");
+            bool ok = info.type == RASTER_U16 ? png.DecodeWide(row) : png.Decode(0, row);
+            if (!ok)
+                return fail(png.Error());
+            bytesRead += (uint64_t)size;
+            return true;
+        }
+        if (kind == NONE)
+            return fail("not open");
+
+        FILE *file = fopen(path.c_str(), "rb");
+        if (!file)
+            return fail("cannot open file");
+        size_t rowBytes = info.RowBytes();
+        std::vector<unsigned char> strip((size_t)stripRows * rowBytes);
+        bool ok = true;
+        for (int y = 0; y < info.height && ok;)
+        {
+            // rows up to the end of the strip or of the TIFF strip they are stored in, which are contiguous
+            int count = std::min(stripRows, info.height - y);
+            uint64_t offset = (uint64_t)y * rowBytes;
+            if (kind == TIFF)
+            {
+                int strip = y / rowsPerStrip;
+                count = std::min(count, (strip + 1) * rowsPerStrip - y);
+                offset = stripOffsets[strip] + (uint64_t)(y - strip * rowsPerStrip) * rowBytes;
+            }
+            ok = seekFile(file, offset) && fread(&strip[0], rowBytes * count, 1, file) == 1;
+            if (!ok)
+                break;
+            bytesRead += rowBytes * count;
+            if (swapBytes)
+                swapSamples(&strip[0], (size_t)count * info.width * info.channels);
+            for (int i = 0; i < count; i++)
+                row(&strip[(size_t)i * rowBytes], y + i);
+            y += count;
+        }
+        fclose(file);
+        return ok || fail("truncated file");
+    }
+
+private:
+    enum Kind {
+        NONE,
+        RAW,
+        PNG,
+        TIFF
+    };
+
+    Kind kind;
+    std::string path;
+    RasterInfo info;
+    const char *error;
+    int stripRows;
+    bool swapBytes;
+    int rowsPerStrip;
+    std::vector<uint64_t> stripOffsets;
+    uint64_t bytesRead;
+
+    bool fail(const char *message)
+    {
+        error = message;
+        return false;
+    }
+
+    static bool hostIsBigEndian()
+    {
+        const uint16_t one = 1;
+        return *(const unsigned char*)&one == 0;
+    }
+
+    void swapSamples(unsigned char *samples, size_t count) const
+    {
+        size_t bytes = rasterSampleBytes(info.type);
+        for (size_t i = 0; i < count; i++, samples += bytes)
+            std::reverse(samples, samples + bytes);
+    }
+
+    // TIFF fields are read with a seek each, directory entries hold values of up to 4 bytes inline
+    struct TiffFile {
+        FILE *file;
+        bool bigEndian;
+        uint64_t size;
+
+        bool Read(uint64_t offset, void *dst, size_t bytes)
+        {
+            return offset + bytes <= size && seekFile(file, offset) && fread(dst, bytes, 1, file) == 1;
+        }
+
+        uint32_t Value(const unsigned char *bytes, size_t count) const
+        {
+            uint32_t value = 0;
+            for (size_t i = 0; i < count; i++)
+                value |= (uint32_t)bytes[i] << (bigEndian ? (count - 1 - i) * 8 : i * 8);
+            return value;
+        }
+    };
+
+    struct TiffEntry {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        unsigned char value[4];
+    };
+
+    // the values of a SHORT or LONG field
+    bool tiffValues(TiffFile &tiff, const TiffEntry &entry, std::vector<uint32_t> &values)
+    {
+        size_t size = entry.type == 3 ? 2 : (entry.type == 4 ? 4 : 0);
+        if (size == 0 || entry.count == 0 || entry.count > (1u << 24))
+            return false;
+        std::vector<unsigned char> bytes((size_t)entry.count * size);
+        if (bytes.size() <= 4)
+            memcpy(&bytes[0], entry.value, bytes.size());
+        else if (!tiff.Read(tiff.Value(entry.value, 4), &bytes[0], bytes.size()))
+            return false;
+        values.resize(entry.count);
+        for (uint32_t i = 0; i < entry.count; i++)
+            values[i] = tiff.Value(&bytes[i * size], size);
+        return true;
+    }
+
+    bool openTiff()
+    {
+        int64_t modified, size;
+        if (!fileStatus(path, modified, size))
+            return fail("cannot open file");
+        TiffFile tiff;
+        tiff.file = fopen(path.c_str(), "rb");
+        if (!tiff.file)
+            return fail("cannot open file");
+        tiff.size = (uint64_t)size;
+        bool ok = readTiffDirectory(tiff);
+        fclose(tiff.file);
+        return ok;
+    }
+
+    bool readTiffDirectory(TiffFile &tiff)
+    {
+        unsigned char header[8];
+        if (!tiff.Read(0, header, 8) || !((header[0] == 'I' && header[1] == 'I') || (header[0] == 'M' && header[1] == 'M')))
+            return fail("not a TIFF");
+        tiff.bigEndian = header[0] == 'M';
+        uint32_t magic = tiff.Value(header + 2, 2);
+        if (magic == 43)
+            return fail("BigTIFF is not supported");
+        if (magic != 42)
+            return fail("not a TIFF");
+
+        uint64_t directory = tiff.Value(header + 4, 4);
+        unsigned char countBytes[2];
+        if (!tiff.Read(directory, countBytes, 2))
+            return fail("truncated file");
+        uint32_t entries = tiff.Value(countBytes, 2);
+        std::vector<unsigned char> table((size_t)entries * 12);
+        if (entries == 0 || !tiff.Read(directory + 2, &table[0], table.size()))
+            return fail("truncated file");
+
+        uint32_t width = 0, height = 0, compression = 1, channels = 1, planar = 1, format = 1;
+        uint32_t rows = 0xFFFFFFFF;
+        std::vector<uint32_t> bits, offsets;
+        for (uint32_t i = 0; i < entries; i++)
+        {
+            TiffEntry entry;
+            const unsigned char *bytes = &table[(size_t)i * 12];
+            entry.tag = (uint16_t)tiff.Value(bytes, 2);
+            entry.type = (uint16_t)tiff.Value(bytes + 2, 2);
+            entry.count = tiff.Value(bytes + 4, 4);
+            memcpy(entry.value, bytes + 8, 4);
+            std::vector<uint32_t> values;
+            if (entry.tag == 322 || entry.tag == 323)
+                return fail("tiled TIFFs are not supported, write strips (gdal_translate -co TILED=NO)");
+            bool wanted = entry.tag == 256 || entry.tag == 257 || entry.tag == 258 || entry.tag == 259 ||
+                          entry.tag == 273 || entry.tag == 277 || entry.tag == 278 ||
+                          entry.tag == 284 || entry.tag == 339;
+            if (!wanted)
+                continue;
+            if (!tiffValues(tiff, entry, values))
+                return fail("bad TIFF field");
+            switch (entry.tag)
+            {
+            case 256: width = values[0]; break;
+            case 257: height = values[0]; break;
+            case 258: bits = values; break;
+            case 259: compression = values[0]; break;
+            case 273: offsets = values; break;
+            case 277: channels = values[0]; break;
+            case 278: rows = values[0]; break;
+            case 284: planar = values[0]; break;
+            case 339: format = values[0]; break;
+            }
+        }
+
+        if (compression != 1)
+            return fail("compressed TIFFs are not supported, write them uncompressed (gdal_translate -co COMPRESS=NONE)");
+        if (width == 0 || height == 0 || width > (1u << 30) || height > (1u << 30) || channels == 0 || channels > 4 ||
+            (planar != 1 && channels > 1) || bits.empty())
+            return fail("unsupported TIFF layout");
+        for (size_t i = 1; i < bits.size(); i++)
+            if (bits[i] != bits[0])
+                return fail("unsupported TIFF layout");
+        if (bits[0] == 8 && format == 1)
+            info.type = RASTER_U8;
+        else if (bits[0] == 16 && format == 1)
+            info.type = RASTER_U16;
+        else if (bits[0] == 16 && format == 2)
+            info.type = RASTER_I16;
+        else if (bits[0] == 32 && format == 3)
+            info.type = RASTER_F32;
+        else
+            return fail("unsupported TIFF sample format");
+        info.width = (int)width;
+        info.height = (int)height;
+        info.channels = (int)channels;
+
+        rowsPerStrip = (int)std::min(rows, height);
+        size_t strips = (height + rowsPerStrip - 1) / rowsPerStrip;
+        if (offsets.size() != strips)
+            return fail("bad TIFF strips");
+        stripOffsets.assign(offsets.begin(), offsets.end());
+        for (size_t i = 0; i < strips; i++)
+        {
+            uint64_t stripHeight = std::min((uint64_t)rowsPerStrip, (uint64_t)height - i * rowsPerStrip);
+            if (stripOffsets[i] + stripHeight * info.RowBytes() > tiff.size)
+                return fail("truncated file");
+        }
+        kind = TIFF;
+        swapBytes = tiff.bigEndian != hostIsBigEndian();
+        return true;
+    }
+};
+#endif
@@ -0,0 +1,154 @@
+
+
+#ifndef RESIDENCY_MANAGER_H
+#define RESIDENCY_MANAGER_H
+
+#include <glad/glad.h>
+
+#include <texture_registry.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// Accounts for the video memory of everything the engine creates and keeps it within a budget.
+//
+// Textures are accounted through the TextureRegistry, which knows the format and resident levels of each of
+// them, buffers are reported with TrackBuffer() when they are created. Textures the registry does not own
+// (fixed size atlases) are reported with TrackTexture(), they count towards usage but never give up levels.
+// Update() runs once per frame with the textures the frame drew with. While usage is over the budget it drops
+// the finest resident level of the least recently used texture, the largest first among textures last used
+// in the same frame, until usage fits or nothing can give up a level anymore. A budget of 0 only keeps count.
+//
+// Dropped levels stay dropped, raising the budget again only affects later evictions. GL thread only.
+class ResidencyManager
+{
+public:
+    struct Buffer {
+        size_t bytes;
+        std::string name;
+    };
+
+    // statistics
+    size_t peakBytes;
+    unsigned int levelsDropped;
+    size_t bytesDropped;
+
+    static ResidencyManager &Global()
+    {
+        static ResidencyManager manager;
+        return manager;
+    }
+
+    void SetBudget(size_t bytes) { budget = bytes; }
+    size_t Budget() const { return budget; }
+
+    // records a buffer of bytes created under id, tracking an id again replaces its size
+    void TrackBuffer(GLuint id, size_t bytes, const std::string &name)
+    {
+        Buffer buffer = { bytes, name };
+        buffers[id] = buffer;
+    }
+
+    void ForgetBuffer(GLuint id)
+    {
+        buffers.erase(id);
+    }
+
+    // records a texture created outside the registry, tracking an id again replaces its size
+    void TrackTexture(GLuint id, size_t bytes, const std::string &name)
+    {
+        Buffer texture = { bytes, name };
+        textures[id] = texture;
+    }
+
+    void ForgetTexture(GLuint id)
+    {
+        textures.erase(id);
+    }
+
+    const std::map<GLuint, Buffer> &Buffers() const { return buffers; }
+    const std::map<GLuint, Buffer> &Textures() const { return textures; }
+    size_t TextureBytes() const { return textureBytes; }
+
+    size_t BufferBytes() const
+    {
+        size_t bytes = 0;
+        for (std::map<GLuint, Buffer>::const_iterator it = buffers.begin(); it != buffers.end(); ++it)
+            bytes += it->second.bytes;
+        return bytes;
+    }
+
+    size_t UsageBytes() const { return textureBytes + BufferBytes(); }
+
+    void Update(TextureRegistry &registry, const std::vector<GLuint> &usedTextures)
+    {
+        frame++;
+        for (size_t i = 0; i < usedTextures.size(); i++)
+            lastUsed[usedTextures[i]] = frame;
+
+        std::vector<TextureRef> live = registry.Live();
+        textureBytes = 0;
+        for (std::map<GLuint, Buffer>::const_iterator it = textures.begin(); it != textures.end(); ++it)
+            textureBytes += it->second.bytes;
+        for (size_t i = 0; i < live.size(); i++)
+            textureBytes += live[i]->bytes;
+        size_t usage = UsageBytes();
+
+        // textures that cannot give up a level are taken out of the candidates
+        while (budget > 0 && usage > budget && !live.empty())
+        {
+            size_t oldest = 0;
+            for (size_t i = 1; i < live.size(); i++)
+                if (olderOrLarger(*live[i], *live[oldest]))
+                    oldest = i;
+            size_t before = live[oldest]->bytes;
+            if (!registry.DropTopLevel(live[oldest]))
+            {
+                live.erase(live.begin() + oldest);
+                continue;
+            }
+            size_t freed = before - live[oldest]->bytes;
+            textureBytes -= freed;
+            usage -= freed;
+            bytesDropped += freed;
+            levelsDropped++;
+        }
+        peakBytes = std::max(peakBytes, usage);
+    }
+
+    // frames since texture id was last drawn with, 0 = this frame
+    uint64_t FramesUnused(GLuint id) const
+    {
+        std::unordered_map<GLuint, uint64_t>::const_iterator it = lastUsed.find(id);
+        return it != lastUsed.end() ? frame - it->second : frame;
+    }
+
+private:
+    size_t budget;
+    size_t textureBytes;
+    uint64_t frame;
+    std::map<GLuint, Buffer> buffers;
+    std::map<GLuint, Buffer> textures;
+    std::unordered_map<GLuint, uint64_t> lastUsed;
+
+    ResidencyManager() : peakBytes(0), levelsDropped(0), bytesDropped(0), budget(0), textureBytes(0), frame(0)
+    {
+    }
+
+    ResidencyManager(const ResidencyManager &);
+    ResidencyManager &operator=(const ResidencyManager &);
+
+    bool olderOrLarger(const TextureRecord &a, const TextureRecord &b) const
+    {
+        uint64_t unusedA = FramesUnused(a.id);
+        uint64_t unusedB = FramesUnused(b.id);
+        if (unusedA != unusedB)
+            return unusedA > unusedB;
+        return a.bytes > b.bytes;
+    }
+};
+#endif
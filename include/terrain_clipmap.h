@@ -0,0 +1,565 @@
+
+
+#ifndef TERRAIN_CLIPMAP_H
+#define TERRAIN_CLIPMAP_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <draw_list.h>
+#include <terrain_dataset.h>
+#include <tile_fetch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Geometry clipmap terrain (Losasso and Hoppe): nested square rings of one fixed vertex grid centred on the
+// camera, level l with samples texelSize * 2^l apart, each level filling the hole the finer one leaves.
+//
+// Every level keeps the heights under its grid in one slice of an R16 texture array, addressed toroidally:
+// level texel (x, y) lives at (x mod size, y mod size). When the camera moves only the rows and columns that
+// came into a level's window are read from the source and uploaded, an L-shaped strip per level, so the upload
+// per frame depends on the camera speed and not on the size of the world. Levels move in steps of two of their
+// texels, which keeps the finer level on the coarser one's vertices; near its outer edge a level blends its
+// heights into the next coarser one (clipmap_vertex.shader) so the rings meet without cracks.
+//
+// All levels are drawn with one static vertex and index buffer: the index buffer holds the full grid for the
+// finest level and the grid around each of the four places the finer level's hole can be in, so a level is a
+// single indexed draw. The scale of a level's model matrix is its sample spacing, which is how the vertex
+// shader tells the levels apart and finds the level texel of the grid's corner in the clipmapCorners uniform,
+// set from Corner() with the program. Levels are placed relative to the camera like everything else.
+class TerrainClipmap
+{
+public:
+    // level l heights of the w x h texels at (x, y), level l texels being level 0 texels 2^l apart and
+    // level 0 texel 0 the corner of the terrain. Texels outside the terrain repeat its edge. Returns false if
+    // the heights are not available yet, the clipmap then tries again next frame.
+    typedef std::function<bool(int, int, int, int, int, uint16_t *)> HeightFn;
+
+    static const int MAX_LEVELS = 24;  // the size of clipmapCorners in clipmap_vertex.shader
+
+    // statistics
+    uint64_t texelsUploaded;
+    unsigned int frameTexels;   // of the last Update()
+    unsigned int fullUpdates;   // levels refilled completely, on the first frame or after a jump
+    uint64_t stalls;            // updates put off because the source did not have the heights yet
+
+    // width and height of the terrain in level 0 texels, texelSize world units apart, centred on the origin.
+    // grid is the number of cells across a level, a power of two.
+    TerrainClipmap(int levels, int grid, HeightFn source, uint32_t width, uint32_t height, float texelSize)
+        : texelsUploaded(0), frameTexels(0), fullUpdates(0), stalls(0), levels(std::min(std::max(levels, 1), MAX_LEVELS)), grid(16),
+          source(source), width(width), height(height), texelSize(texelSize), texture(0), vao(0), vbo(0), ebo(0)
+    {
+        while (grid > this->grid && this->grid < 1024)
+            this->grid *= 2;
+        size = this->grid + 4;
+        origins.assign(this->levels, glm::ivec2(0));
+        valid.assign(this->levels, false);
+
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, size, size, this->levels, 0, GL_RED, GL_UNSIGNED_SHORT, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        buildGrid();
+    }
+
+    ~TerrainClipmap()
+    {
+        Destroy();
+    }
+
+    // GL thread
+    void Destroy()
+    {
+        if (texture)
+            glDeleteTextures(1, &texture);
+        if (vao)
+            glDeleteVertexArrays(1, &vao);
+        if (vbo)
+            glDeleteBuffers(1, &vbo);
+        if (ebo)
+            glDeleteBuffers(1, &ebo);
+        texture = vao = vbo = ebo = 0;
+    }
+
+    // levels for a clipmap whose coarsest level covers the whole terrain wherever the camera is on it
+    static int LevelsFor(uint32_t width, uint32_t height, int grid)
+    {
+        int levels = 1;
+        while ((uint64_t)grid << (levels - 1) < 2 * (uint64_t)std::max(width, height) && levels < MAX_LEVELS)
+            levels++;
+        return levels;
+    }
+
+    GLuint Texture() const { return texture; }
+    GLuint VertexArray() const { return vao; }
+    int Levels() const { return levels; }
+    int Grid() const { return grid; }
+    int TextureSize() const { return size; }
+
+    // level texel of the corner of level's grid as Record() places it, clipmapCorners[level] of the vertex shader
+    glm::vec2 Corner(int level) const
+    {
+        return glm::vec2(origins[level] + glm::ivec2(2));
+    }
+    size_t Bytes() const { return (size_t)size * size * levels * 2 + vertexBytes + indexBytes; }
+
+    // GL thread, once per frame before the levels are recorded. Either every level that moved is updated or,
+    // if the source is missing some heights, none is, so the rings always nest.
+    void Update(const glm::dvec3 &position)
+    {
+        frameTexels = 0;
+        double x = (position.x + width * texelSize * 0.5) / texelSize;
+        double z = (position.z + height * texelSize * 0.5) / texelSize;
+
+        std::vector<Region> regions;
+        std::vector<glm::ivec2> next(levels);
+        unsigned int refills = 0;
+        for (int l = 0; l < levels; l++)
+        {
+            // the level's centre is on an even level texel, its window starts two texels before the grid
+            double step = std::ldexp(1.0, l + 1);
+            glm::ivec2 centre((int)std::floor(x / step) * 2, (int)std::floor(z / step) * 2);
+            next[l] = centre - glm::ivec2(grid / 2 + 2);
+            if (valid[l] && next[l] == origins[l])
+                continue;
+            glm::ivec2 from = origins[l], to = next[l];
+            if (!valid[l] || std::abs(to.x - from.x) >= size || std::abs(to.y - from.y) >= size)
+            {
+                addRegion(regions, l, to.x, to.y, size, size);
+                refills++;
+                continue;
+            }
+            // the columns that came in over the new rows, the rows that came in over the columns both share
+            if (to.x > from.x)
+                addRegion(regions, l, from.x + size, to.y, to.x - from.x, size);
+            else if (to.x < from.x)
+                addRegion(regions, l, to.x, to.y, from.x - to.x, size);
+            int shared = size - std::abs(to.x - from.x);
+            int sharedX = std::max(from.x, to.x);
+            if (to.y > from.y)
+                addRegion(regions, l, sharedX, from.y + size, shared, to.y - from.y);
+            else if (to.y < from.y)
+                addRegion(regions, l, sharedX, to.y, shared, from.y - to.y);
+        }
+        if (regions.empty())
+            return;
+
+        // read everything before uploading anything, asking for all of it so that missing heights arrive together
+        size_t total = 0;
+        for (size_t i = 0; i < regions.size(); i++)
+            total += (size_t)regions[i].width * regions[i].height;
+        heights.resize(total);
+        size_t offset = 0;
+        bool ready = true;
+        for (size_t i = 0; i < regions.size(); i++)
+        {
+            const Region &region = regions[i];
+            ready = source(region.level, region.x, region.y, region.width, region.height, &heights[offset]) && ready;
+            offset += (size_t)region.width * region.height;
+        }
+        if (!ready)
+        {
+            stalls++;
+            return;
+        }
+
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        offset = 0;
+        for (size_t i = 0; i < regions.size(); i++)
+        {
+            const Region &region = regions[i];
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, wrap(region.x), wrap(region.y), region.level, region.width,
+                            region.height, 1, GL_RED, GL_UNSIGNED_SHORT, &heights[offset]);
+            offset += (size_t)region.width * region.height;
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        frameTexels = (unsigned int)total;
+        texelsUploaded += total;
+        fullUpdates += refills;
+        origins = next;
+        valid.assign(levels, true);
+    }
+
+    // GL thread. After level 0 texels [x0, x1) x [y0, y1) changed in the source: the texels above them on every
+    // level are read and uploaded again where they are in a level's window. Texels outside the terrain repeat its
+    // edge, so a change on the edge reaches to the end of the window.
+    void Refresh(int x0, int y0, int x1, int y1)
+    {
+        if (x1 <= x0 || y1 <= y0)
+            return;
+        std::vector<Region> regions;
+        for (int l = 0; l < levels; l++)
+        {
+            if (!valid[l])
+                continue;
+            int left = x0 <= 0 ? origins[l].x : x0 >> l, right = x1 >= (int)width ? origins[l].x + size : ((x1 - 1) >> l) + 1;
+            int top = y0 <= 0 ? origins[l].y : y0 >> l, bottom = y1 >= (int)height ? origins[l].y + size : ((y1 - 1) >> l) + 1;
+            left = std::max(left, origins[l].x);
+            top = std::max(top, origins[l].y);
+            right = std::min(right, origins[l].x + size);
+            bottom = std::min(bottom, origins[l].y + size);
+            if (left < right && top < bottom)
+                addRegion(regions, l, left, top, right - left, bottom - top);
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        for (size_t i = 0; i < regions.size(); i++)
+        {
+            const Region &region = regions[i];
+            heights.resize((size_t)region.width * region.height);
+            if (!source(region.level, region.x, region.y, region.width, region.height, &heights[0]))
+                continue;
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, wrap(region.x), wrap(region.y), region.level, region.width,
+                            region.height, 1, GL_RED, GL_UNSIGNED_SHORT, &heights[0]);
+            texelsUploaded += (uint64_t)region.width * region.height;
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    // records one draw per level, finest first, relative to the camera at world position camera. state draws
+    // VertexArray() as GL_TRIANGLES with GL_UNSIGNED_INT indices through clipmap_vertex.shader.
+    void Record(CommandList &commands, unsigned int state, const glm::dvec3 &camera) const
+    {
+        for (int l = 0; l < levels && valid[l]; l++)
+        {
+            double spacing = std::ldexp((double)texelSize, l);
+            glm::ivec2 first = origins[l] + glm::ivec2(2);
+            glm::dvec3 corner(first.x * spacing - width * texelSize * 0.5, 0.0, first.y * spacing - height * texelSize * 0.5);
+            glm::mat4 model = glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(corner - camera)),
+                                         glm::vec3((float)spacing, 1.0f, (float)spacing));
+            // the finer level sits a quarter of the grid in, one cell further on a side it moved past
+            int range = 4;
+            if (l > 0)
+            {
+                glm::ivec2 hole = origins[l - 1] + glm::ivec2(2);
+                range = ((hole.x >> 1) - first.x - grid / 4) + ((hole.y >> 1) - first.y - grid / 4) * 2;
+            }
+            commands.Add(PASS_OPAQUE, state, model, (float)spacing * grid * 0.25f, ranges[range].first, ranges[range].second);
+        }
+    }
+
+private:
+    // a rectangle of level texels that does not wrap around the texture
+    struct Region {
+        int level;
+        int x, y;
+        int width, height;
+    };
+
+    int levels;
+    int grid;
+    int size;                   // texels across a level's texture, the grid's vertices and a margin
+    HeightFn source;
+    uint32_t width, height;
+    float texelSize;
+    GLuint texture;
+    GLuint vao, vbo, ebo;
+    size_t vertexBytes, indexBytes;
+    std::vector<glm::ivec2> origins;    // level texel at texture window start, per level
+    std::vector<bool> valid;
+    std::vector<uint16_t> heights;
+    std::pair<GLint, GLsizei> ranges[5]; // around the hole at (+0/1, +0/1), and the full grid
+
+    TerrainClipmap(const TerrainClipmap &);
+    TerrainClipmap &operator=(const TerrainClipmap &);
+
+    int wrap(int texel) const
+    {
+        int wrapped = texel % size;
+        return wrapped < 0 ? wrapped + size : wrapped;
+    }
+
+    // splits a rectangle where it wraps around the texture
+    void addRegion(std::vector<Region> &regions, int level, int x, int y, int w, int h) const
+    {
+        int splitX = std::min(w, size - wrap(x)), splitY = std::min(h, size - wrap(y));
+        for (int part = 0; part < 4; part++)
+        {
+            Region region;
+            region.level = level;
+            region.x = (part & 1) ? x + splitX : x;
+            region.width = (part & 1) ? w - splitX : splitX;
+            region.y = (part & 2) ? y + splitY : y;
+            region.height = (part & 2) ? h - splitY : splitY;
+            if (region.width > 0 && region.height > 0)
+                regions.push_back(region);
+        }
+    }
+
+    void buildGrid()
+    {
+        int row = grid + 1;
+        std::vector<float> vertices;
+        vertices.reserve((size_t)row * row * 3);
+        for (int z = 0; z <= grid; z++)
+            for (int x = 0; x <= grid; x++)
+            {
+                vertices.push_back((float)x);
+                vertices.push_back(0.0f);
+                vertices.push_back((float)z);
+            }
+
+        std::vector<GLuint> indices;
+        for (int range = 0; range < 5; range++)
+        {
+            int holeX = range < 4 ? grid / 4 + (range & 1) : grid;
+            int holeY = range < 4 ? grid / 4 + (range >> 1) : grid;
+            int holeSize = range < 4 ? grid / 2 : 0;
+            ranges[range].first = (GLint)indices.size();
+            for (int z = 0; z < grid; z++)
+                for (int x = 0; x < grid; x++)
+                {
+                    if (x >= holeX && x < holeX + holeSize && z >= holeY && z < holeY + holeSize)
+                        continue;
+                    GLuint corner = (GLuint)(z * row + x);
+                    GLuint quad[6] = { corner, corner + row, corner + 1, corner + 1, corner + row, corner + row + 1 };
+                    indices.insert(indices.end(), quad, quad + 6);
+                }
+            ranges[range].second = (GLsizei)indices.size() - ranges[range].first;
+        }
+        vertexBytes = vertices.size() * sizeof(float);
+        indexBytes = indices.size() * sizeof(GLuint);
+
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertexBytes, &vertices[0], GL_STATIC_DRAW);
+        glGenBuffers(1, &ebo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, &indices[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+};
+
+// Clipmap heights from an image held in memory, with a 2x2 box filtered copy for every coarser level
+class ClipmapImageHeights
+{
+public:
+    ClipmapImageHeights(const uint16_t *samples, int width, int height)
+    {
+        pyramid.push_back(Level());
+        pyramid[0].width = std::max(width, 1);
+        pyramid[0].height = std::max(height, 1);
+        pyramid[0].samples.assign(samples, samples + (size_t)width * height);
+        while (pyramid.back().width > 1 || pyramid.back().height > 1)
+        {
+            const Level &finer = pyramid.back();
+            Level level;
+            level.width = std::max(finer.width / 2, 1);
+            level.height = std::max(finer.height / 2, 1);
+            level.samples.resize((size_t)level.width * level.height);
+            for (int y = 0; y < level.height; y++)
+                for (int x = 0; x < level.width; x++)
+                {
+                    int x0 = std::min(x * 2, finer.width - 1), x1 = std::min(x * 2 + 1, finer.width - 1);
+                    int y0 = std::min(y * 2, finer.height - 1), y1 = std::min(y * 2 + 1, finer.height - 1);
+                    uint32_t sum = (uint32_t)finer.At(x0, y0) + finer.At(x1, y0) + finer.At(x0, y1) + finer.At(x1, y1);
+                    level.samples[(size_t)y * level.width + x] = (uint16_t)((sum + 2) / 4);
+                }
+            pyramid.push_back(level);
+        }
+    }
+
+    // a TerrainClipmap::HeightFn, levels past the 1x1 top repeat it
+    bool Read(int level, int x, int y, int w, int h, uint16_t *out) const
+    {
+        const Level &source = pyramid[std::min(level, (int)pyramid.size() - 1)];
+        for (int row = 0; row < h; row++)
+            for (int column = 0; column < w; column++)
+                *out++ = source.At(std::min(std::max(x + column, 0), source.width - 1),
+                                   std::min(std::max(y + row, 0), source.height - 1));
+        return true;
+    }
+
+private:
+    struct Level {
+        int width, height;
+        std::vector<uint16_t> samples;
+
+        uint16_t At(int x, int y) const { return samples[(size_t)y * width + x]; }
+    };
+
+    std::vector<Level> pyramid;
+};
+
+// Clipmap heights from the tiles of one layer of a terrain dataset. A mapped dataset is read in place, tiles of
+// any other are fetched through a TileFetcher and the last maxTiles used are kept. Clipmap levels coarser than
+// the dataset sample its top level.
+class ClipmapTileHeights
+{
+public:
+    // statistics
+    uint64_t tilesFetched;
+
+    ClipmapTileHeights(const TerrainDataset &dataset, TileFetcher &source, const std::string &resource, int layer,
+                       size_t maxTiles = 256)
+        : tilesFetched(0), dataset(dataset), source(source), resource(resource), layer(layer), maxTiles(maxTiles),
+          header(dataset.Header()), reads(0), pending(0)
+    {
+    }
+
+    // waits for the tiles still being fetched
+    ~ClipmapTileHeights()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pending > 0)
+            idle.wait(lock);
+    }
+
+    // a TerrainClipmap::HeightFn, requests the tiles it is missing and returns false until they are there
+    bool Read(int level, int x, int y, int w, int h, uint16_t *out)
+    {
+        int top = dataset.Levels() - 1;
+        int datasetLevel = std::min(level, top);
+        int64_t scale = (int64_t)1 << (level - datasetLevel);
+        const TerrainLevelRecord &record = dataset.Level(datasetLevel);
+        uint32_t dim = header.TileDim();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        reads++;
+        missing.clear();
+        bool complete = true;
+        int64_t lastTile = -1;
+        const uint16_t *tile = 0;
+        for (int row = 0; row < h; row++)
+            for (int column = 0; column < w; column++)
+            {
+                int64_t tx = std::min(std::max((int64_t)(x + column) * scale, (int64_t)0), (int64_t)record.width - 1);
+                int64_t ty = std::min(std::max((int64_t)(y + row) * scale, (int64_t)0), (int64_t)record.height - 1);
+                int64_t index = (int64_t)dataset.TileIndex(datasetLevel, (int)(tx / header.tileSize),
+                                                           (int)(ty / header.tileSize));
+                if (index != lastTile)
+                {
+                    tile = tileAt(datasetLevel, (int)(tx / header.tileSize), (int)(ty / header.tileSize), index);
+                    lastTile = index;
+                }
+                if (!tile)
+                {
+                    complete = false;
+                    continue;
+                }
+                size_t local = (size_t)(ty % header.tileSize + header.border) * dim + tx % header.tileSize + header.border;
+                out[(size_t)row * w + column] = tile[local];
+            }
+        evict();
+        lock.unlock();
+
+        // fetchers that are not open fail right away, so the requests go out without the lock held
+        for (size_t i = 0; i < missing.size(); i++)
+            fetch(missing[i]);
+        return complete;
+    }
+
+    size_t Cached() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return tiles.size();
+    }
+
+private:
+    struct Entry {
+        std::vector<uint16_t> texels;
+        uint64_t lastRead;
+    };
+
+    struct Missing {
+        int64_t index;
+        int level, tx, ty;
+    };
+
+    const TerrainDataset &dataset;
+    TileFetcher &source;
+    std::string resource;
+    int layer;
+    size_t maxTiles;
+    TerrainFileHeader header;
+    uint64_t reads;
+
+    mutable std::mutex mutex;
+    std::condition_variable idle;
+    int pending;
+    std::map<int64_t, Entry> tiles;
+    std::set<int64_t> requested;
+    std::vector<Missing> missing;
+
+    ClipmapTileHeights(const ClipmapTileHeights &);
+    ClipmapTileHeights &operator=(const ClipmapTileHeights &);
+
+    // the tile's texels, or 0 after noting it as missing; called with the mutex held
+    const uint16_t *tileAt(int level, int tx, int ty, int64_t index)
+    {
+        if (dataset.IsMapped())
+            return (const uint16_t*)dataset.Tile(level, tx, ty, layer);
+        std::map<int64_t, Entry>::iterator it = tiles.find(index);
+        if (it != tiles.end())
+        {
+            it->second.lastRead = reads;
+            return &it->second.texels[0];
+        }
+        if (requested.insert(index).second)
+        {
+            Missing tile = { index, level, tx, ty };
+            missing.push_back(tile);
+            pending++;
+        }
+        return 0;
+    }
+
+    void fetch(const Missing &tile)
+    {
+        size_t bytes = header.TileBytes(layer);
+        ClipmapTileHeights *self = this;
+        int64_t index = tile.index;
+        source.Fetch(resource, dataset.RecordOffset(tile.level, tile.tx, tile.ty) + header.layer[layer].offset, bytes,
+                     [self, index, bytes](const unsigned char *data, size_t)
+        {
+            std::lock_guard<std::mutex> lock(self->mutex);
+            self->requested.erase(index);
+            if (data)
+            {
+                Entry &entry = self->tiles[index];
+                entry.texels.resize(bytes / sizeof(uint16_t));
+                memcpy(&entry.texels[0], data, bytes);
+                entry.lastRead = self->reads;
+                self->tilesFetched++;
+            }
+            self->pending--;
+            self->idle.notify_all();
+        });
+    }
+
+    // drops the least recently read tiles over the limit, never those read by the current call
+    void evict()
+    {
+        while (tiles.size() > maxTiles)
+        {
+            std::map<int64_t, Entry>::iterator oldest = tiles.begin();
+            for (std::map<int64_t, Entry>::iterator it = tiles.begin(); it != tiles.end(); ++it)
+                if (it->second.lastRead < oldest->second.lastRead)
+                    oldest = it;
+            if (oldest->second.lastRead == reads)
+                break;
+            tiles.erase(oldest);
+        }
+    }
+};
+#endif
@@ -0,0 +1,805 @@
+
+
+#ifndef TERRAIN_DATASET_H
+#define TERRAIN_DATASET_H
+
+#include <job_system.h>
+#include <mapped_file.h>
+#include <tile_fetch.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Terrain dataset (.terrain), heights and material maps cut into fixed size tiles for every level of a mip
+// pyramid, laid out so that a renderer can map the file and page in only the tiles around the camera.
+//
+// Level 0 is the full resolution, every level above halves it, rounding up, until one tile covers the whole
+// terrain. Texel x of level l covers texels [2x, 2x + 1] of level l - 1, so a tile at level l covers exactly
+// the 2x2 tiles below it. Every tile holds tileSize^2 texels plus border texels on each side copied from its
+// neighbours (clamped at the edge of the level), so tiles filter and take normals without their neighbours.
+//
+// Layer 0 holds the heights as 16 bit unsigned integers, height = heightOffset + heightScale * value / 65535,
+// any further layers hold material maps. The tiles of one level are stored row major, levels finest first,
+// and each tile stores all its layers back to back, each starting on a page boundary, so the index of a tile
+// and the address of its texels are computed, not looked up. Each tile also records the lowest and highest
+// height of the level 0 texels it covers, for culling and level of detail selection.
+//
+// Layout, little endian:
+//   header     TerrainFileHeader, padded to one page
+//   bounds     tileCount pairs of uint16 min and max height
+//   tiles      from dataOffset, tile i at dataOffset + i * recordBytes, layer j at + layer[j].offset
+
+const uint32_t TERRAIN_MAGIC = 0x52524554; // "TERR"
+const uint32_t TERRAIN_VERSION = 1;
+const size_t TERRAIN_PAGE_BYTES = 4096;
+const int TERRAIN_MAX_LAYERS = 8;
+const int TERRAIN_MAX_LEVELS = 24;
+
+enum TerrainLayerFormat {
+    TERRAIN_R8,
+    TERRAIN_RG8,
+    TERRAIN_RGBA8,
+    TERRAIN_R16
+};
+
+inline int terrainFormatChannels(uint32_t format)
+{
+    static const int channels[] = { 1, 2, 4, 1 };
+    return format <= TERRAIN_R16 ? channels[format] : 0;
+}
+
+inline size_t terrainTexelBytes(uint32_t format)
+{
+    return format == TERRAIN_R16 ? 2 : (size_t)terrainFormatChannels(format);
+}
+
+struct TerrainLayerRecord {
+    char name[24];
+    uint32_t format;    // TerrainLayerFormat
+    uint32_t offset;    // of the layer within a tile's record
+};
+
+struct TerrainLevelRecord {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    uint64_t firstTile;
+};
+
+struct TerrainFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;         // of level 0, in texels
+    uint32_t height;
+    uint32_t tileSize;      // texels per tile side without borders
+    uint32_t border;        // texels on each side
+    uint32_t levels;
+    uint32_t layers;
+    float heightOffset;
+    float heightScale;
+    float texelSize;        // world units between level 0 texels
+    uint32_t reserved;
+    uint64_t tileCount;
+    uint64_t boundsOffset;
+    uint64_t dataOffset;
+    uint64_t recordBytes;
+    TerrainLayerRecord layer[TERRAIN_MAX_LAYERS];
+    TerrainLevelRecord level[TERRAIN_MAX_LEVELS];
+
+    uint32_t TileDim() const { return tileSize + 2 * border; }
+    size_t TileBytes(uint32_t layerIndex) const
+    {
+        return (size_t)TileDim() * TileDim() * terrainTexelBytes(layer[layerIndex].format);
+    }
+};
+
+static_assert(sizeof(TerrainFileHeader) <= TERRAIN_PAGE_BYTES, "the terrain header has to fit in one page");
+
+// What a dataset is created from; layer 0 has to be the TERRAIN_R16 heights.
+struct TerrainLayerDesc {
+    std::string name;
+    TerrainLayerFormat format;
+};
+
+struct TerrainDatasetDesc {
+    int width;
+    int height;
+    int tileSize;
+    int border;
+    float heightOffset;
+    float heightScale;
+    float texelSize;
+    std::vector<TerrainLayerDesc> layers;
+
+    TerrainDatasetDesc() : width(0), height(0), tileSize(256), border(2), heightOffset(0.0f), heightScale(1.0f),
+                           texelSize(1.0f)
+    {
+    }
+};
+
+// number of levels until one tile covers a width x height terrain
+inline int terrainLevelCount(int width, int height, int tileSize)
+{
+    int levels = 1;
+    while ((width > tileSize || height > tileSize) && levels < TERRAIN_MAX_LEVELS)
+    {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+inline uint64_t alignToPage(uint64_t bytes)
+{
+    return (bytes + TERRAIN_PAGE_BYTES - 1) / TERRAIN_PAGE_BYTES * TERRAIN_PAGE_BYTES;
+}
+
+// fills in the header of a dataset described by desc, false if desc is not valid
+inline bool terrainHeaderFor(const TerrainDatasetDesc &desc, TerrainFileHeader &header)
+{
+    if (desc.width <= 0 || desc.height <= 0 || desc.tileSize < 16 || desc.tileSize > 4096 || desc.border < 0 ||
+        desc.border > desc.tileSize / 2 || desc.layers.empty() || desc.layers.size() > (size_t)TERRAIN_MAX_LAYERS ||
+        desc.layers[0].format != TERRAIN_R16 ||
+        terrainLevelCount(desc.width, desc.height, desc.tileSize) >= TERRAIN_MAX_LEVELS)
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TERRAIN_MAGIC;
+    header.version = TERRAIN_VERSION;
+    header.width = desc.width;
+    header.height = desc.height;
+    header.tileSize = desc.tileSize;
+    header.border = desc.border;
+    header.levels = terrainLevelCount(desc.width, desc.height, desc.tileSize);
+    header.layers = (uint32_t)desc.layers.size();
+    header.heightOffset = desc.heightOffset;
+    header.heightScale = desc.heightScale;
+    header.texelSize = desc.texelSize;
+
+    uint64_t record = 0;
+    for (uint32_t i = 0; i < header.layers; i++)
+    {
+        if (desc.layers[i].format > TERRAIN_R16 || desc.layers[i].name.size() >= sizeof(header.layer[i].name))
+            return false;
+        strcpy(header.layer[i].name, desc.layers[i].name.c_str());
+        header.layer[i].format = desc.layers[i].format;
+        header.layer[i].offset = (uint32_t)record;
+        record += alignToPage(header.TileBytes(i));
+    }
+    header.recordBytes = record;
+
+    uint32_t width = header.width, height = header.height;
+    for (uint32_t l = 0; l < header.levels; l++)
+    {
+        TerrainLevelRecord &level = header.level[l];
+        level.width = width;
+        level.height = height;
+        level.tilesX = (width + header.tileSize - 1) / header.tileSize;
+        level.tilesY = (height + header.tileSize - 1) / header.tileSize;
+        level.firstTile = header.tileCount;
+        header.tileCount += (uint64_t)level.tilesX * level.tilesY;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+    header.boundsOffset = TERRAIN_PAGE_BYTES;
+    header.dataOffset = alignToPage(header.boundsOffset + header.tileCount * 2 * sizeof(uint16_t));
+    return true;
+}
+
+// Copies tile (tx, ty) of a level, texelBytes per texel, with its borders into dst (tileDim^2 texels). rowAt(y)
+// returns row y of the level for 0 <= y < height; texels outside the level repeat the nearest edge texel.
+template <typename RowAt>
+inline void extractTerrainTileRows(const RowAt &rowAt, int width, int height, size_t texelBytes, int tileSize,
+                                   int border, int tx, int ty, unsigned char *dst)
+{
+    int dim = tileSize + 2 * border;
+    int x0 = tx * tileSize - border;
+    int y0 = ty * tileSize - border;
+    // the inside of the level is one copy per row, only the edges are clamped texel by texel
+    int first = std::min(std::max(0, -x0), dim);
+    int last = std::max(std::min(dim, width - x0), first);
+    for (int y = 0; y < dim; y++)
+    {
+        const unsigned char *row = rowAt(std::min(std::max(y0 + y, 0), height - 1));
+        unsigned char *out = dst + (size_t)y * dim * texelBytes;
+        for (int x = 0; x < first; x++)
+            memcpy(out + x * texelBytes, row, texelBytes);
+        if (last > first)
+            memcpy(out + first * texelBytes, row + (size_t)(x0 + first) * texelBytes, (last - first) * texelBytes);
+        for (int x = last; x < dim; x++)
+            memcpy(out + x * texelBytes, row + (size_t)(width - 1) * texelBytes, texelBytes);
+    }
+}
+
+// the same for a level held in memory, rows tightly packed
+inline void extractTerrainTile(const unsigned char *level, int width, int height, size_t texelBytes, int tileSize,
+                               int border, int tx, int ty, unsigned char *dst)
+{
+    size_t rowBytes = (size_t)width * texelBytes;
+    extractTerrainTileRows([level, rowBytes](int y) { return level + y * rowBytes; }, width, height, texelBytes,
+                           tileSize, border, tx, ty, dst);
+}
+
+// One row of the next level from two rows of a level of width texels: a 2x2 box filter where the texel past an
+// odd edge repeats the last column, so the next level is half the width rounded up.
+template <typename T>
+inline void downsampleTerrainRow(const T *row0, const T *row1, int width, int channels, T *out)
+{
+    int dstWidth = (width + 1) / 2;
+    for (int x = 0; x < dstWidth; x++)
+    {
+        int x0 = x * 2 * channels;
+        int x1 = std::min(x * 2 + 1, width - 1) * channels;
+        for (int c = 0; c < channels; c++)
+            out[x * channels + c] = (T)(((uint32_t)row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+    }
+}
+
+// rows [first, last) of the next level of a width x height image, the last row repeats past an odd edge
+template <typename T>
+inline void downsampleTerrainRows(const T *src, int width, int height, int channels, int first, int last, T *dst)
+{
+    int dstWidth = (width + 1) / 2;
+    for (int y = first; y < last; y++)
+        downsampleTerrainRow(src + (size_t)std::min(y * 2, height - 1) * width * channels,
+                             src + (size_t)std::min(y * 2 + 1, height - 1) * width * channels, width, channels,
+                             dst + (size_t)y * dstWidth * channels);
+}
+
+// downsampleTerrainRow() of a layer in its format
+inline void downsampleTerrainLayerRow(const unsigned char *row0, const unsigned char *row1, int width, uint32_t format,
+                                 unsigned char *out)
+{
+    if (format == TERRAIN_R16)
+        downsampleTerrainRow((const uint16_t*)row0, (const uint16_t*)row1, width, 1, (uint16_t*)out);
+    else
+        downsampleTerrainRow(row0, row1, width, terrainFormatChannels(format), out);
+}
+
+// Writes a terrain dataset tile by tile in any order. Level 0 height tiles record their bounds as they are
+// written, Finish() derives the bounds of the levels above from them. Tiles that are never written read as
+// zeros, a writer destroyed before Finish() deletes the file. WriteTile() can be called from any thread.
+class TerrainDatasetWriter
+{
+public:
+    TerrainDatasetWriter() : file(0), failed(false)
+    {
+    }
+
+    // a dataset that was never finished is incomplete, its file goes
+    ~TerrainDatasetWriter()
+    {
+        if (!file)
+            return;
+        fclose(file);
+        remove(path.c_str());
+    }
+
+    bool Create(const std::string &path, const TerrainDatasetDesc &desc)
+    {
+        if (file || !terrainHeaderFor(desc, header))
+            return false;
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+        this->path = path;
+        failed = false;
+        bounds.assign((size_t)header.tileCount * 2, 0);
+        for (size_t i = 0; i < bounds.size(); i += 2)
+            bounds[i] = 0xFFFF;
+        // writing the last byte sizes the file, the tiles in between stay sparse until they are written
+        const unsigned char zero = 0;
+        uint64_t end = header.dataOffset + header.tileCount * header.recordBytes;
+        if (!seekFile(file, end - 1) || fwrite(&zero, 1, 1, file) != 1)
+        {
+            fclose(file);
+            file = 0;
+            return false;
+        }
+        return true;
+    }
+
+    const TerrainFileHeader &Header() const { return header; }
+
+    // texels is tileDim^2 texels of the layer's format, rows tightly packed
+    bool WriteTile(int level, int tx, int ty, int layer, const void *texels)
+    {
+        if (!file || level < 0 || level >= (int)header.levels || layer < 0 || layer >= (int)header.layers)
+            return false;
+        const TerrainLevelRecord &record = header.level[level];
+        if (tx < 0 || ty < 0 || tx >= (int)record.tilesX || ty >= (int)record.tilesY)
+            return false;
+        uint64_t tile = record.firstTile + (uint64_t)ty * record.tilesX + tx;
+        size_t bytes = header.TileBytes(layer);
+
+        uint16_t low = 0xFFFF, high = 0;
+        if (layer == 0 && level == 0)
+        {
+            const uint16_t *heights = (const uint16_t*)texels;
+            for (size_t i = 0; i < bytes / 2; i++)
+            {
+                low = std::min(low, heights[i]);
+                high = std::max(high, heights[i]);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (layer == 0 && level == 0)
+        {
+            bounds[tile * 2] = low;
+            bounds[tile * 2 + 1] = high;
+        }
+        bool ok = seekFile(file, header.dataOffset + tile * header.recordBytes + header.layer[layer].offset) &&
+                  fwrite(texels, bytes, 1, file) == 1;
+        failed = failed || !ok;
+        return ok;
+    }
+
+    // writes the header and the bounds, the dataset is complete once this returns true
+    bool Finish()
+    {
+        if (!file)
+            return false;
+        for (uint32_t l = 1; l < header.levels; l++)
+        {
+            const TerrainLevelRecord &level = header.level[l];
+            const TerrainLevelRecord &finer = header.level[l - 1];
+            for (uint32_t ty = 0; ty < level.tilesY; ty++)
+                for (uint32_t tx = 0; tx < level.tilesX; tx++)
+                {
+                    uint16_t low = 0xFFFF, high = 0;
+                    for (uint32_t cy = ty * 2; cy < std::min(ty * 2 + 2, finer.tilesY); cy++)
+                        for (uint32_t cx = tx * 2; cx < std::min(tx * 2 + 2, finer.tilesX); cx++)
+                        {
+                            uint64_t child = finer.firstTile + (uint64_t)cy * finer.tilesX + cx;
+                            low = std::min(low, bounds[child * 2]);
+                            high = std::max(high, bounds[child * 2 + 1]);
+                        }
+                    uint64_t tile = level.firstTile + (uint64_t)ty * level.tilesX + tx;
+                    bounds[tile * 2] = low;
+                    bounds[tile * 2 + 1] = high;
+                }
+        }
+        std::vector<unsigned char> page(TERRAIN_PAGE_BYTES, 0);
+        memcpy(&page[0], &header, sizeof(header));
+        bool ok = !failed && seekFile(file, 0) && fwrite(&page[0], page.size(), 1, file) == 1 &&
+                  fwrite(&bounds[0], bounds.size() * sizeof(uint16_t), 1, file) == 1;
+        ok = fclose(file) == 0 && ok;
+        file = 0;
+        if (!ok)
+            remove(path.c_str());
+        return ok;
+    }
+
+private:
+    FILE *file;
+    std::string path;
+    TerrainFileHeader header;
+    std::vector<uint16_t> bounds;
+    std::mutex mutex;
+    bool failed;
+
+    TerrainDatasetWriter(const TerrainDatasetWriter &);
+    TerrainDatasetWriter &operator=(const TerrainDatasetWriter &);
+};
+
+// Builds a whole dataset from level 0 images held in memory, one per layer of desc, rows tightly packed.
+// Tiles are cut and levels downsampled in parallel on jobs when given. Holds one level of one layer at a time
+// besides the input.
+inline bool buildTerrainDataset(const std::string &path, const TerrainDatasetDesc &desc,
+                                const std::vector<const void*> &images, JobSystem *jobs = nullptr)
+{
+    TerrainDatasetWriter writer;
+    if (images.size() != desc.layers.size() || !writer.Create(path, desc))
+        return false;
+    const TerrainFileHeader &header = writer.Header();
+
+    bool ok = true;
+    for (uint32_t layer = 0; layer < header.layers && ok; layer++)
+    {
+        uint32_t format = header.layer[layer].format;
+        size_t texelBytes = terrainTexelBytes(format);
+        int channels = terrainFormatChannels(format);
+        std::vector<unsigned char> current, next;
+        const unsigned char *src = (const unsigned char*)images[layer];
+        for (uint32_t l = 0; l < header.levels && ok; l++)
+        {
+            const TerrainLevelRecord &level = header.level[l];
+            std::vector<unsigned char> failures(level.tilesY, 0);
+            auto cut = [&](size_t first, size_t last)
+            {
+                std::vector<unsigned char> tile(header.TileBytes(layer));
+                for (size_t ty = first; ty < last; ty++)
+                    for (uint32_t tx = 0; tx < level.tilesX; tx++)
+                    {
+                        extractTerrainTile(src, level.width, level.height, texelBytes, header.tileSize, header.border,
+                                           tx, (int)ty, &tile[0]);
+                        if (!writer.WriteTile(l, tx, (int)ty, layer, &tile[0]))
+                            failures[ty] = 1;
+                    }
+            };
+            if (jobs)
+                jobs->ParallelFor(0, level.tilesY, 1, cut);
+            else
+                cut(0, level.tilesY);
+            ok = std::find(failures.begin(), failures.end(), 1) == failures.end();
+            if (l + 1 == header.levels)
+                break;
+
+            const TerrainLevelRecord &coarser = header.level[l + 1];
+            next.resize((size_t)coarser.width * coarser.height * texelBytes);
+            auto downsample = [&](size_t first, size_t last)
+            {
+                if (format == TERRAIN_R16)
+                    downsampleTerrainRows((const uint16_t*)src, level.width, level.height, 1, (int)first, (int)last,
+                                          (uint16_t*)&next[0]);
+                else
+                    downsampleTerrainRows(src, level.width, level.height, channels, (int)first, (int)last, &next[0]);
+            };
+            if (jobs)
+                jobs->ParallelFor(0, coarser.height, 16, downsample);
+            else
+                downsample(0, coarser.height);
+            current.swap(next);
+            src = &current[0];
+        }
+    }
+    return writer.Finish() && ok;
+}
+
+// Builds the pyramid of one layer from level 0 rows arriving top to bottom, for datasets far larger than memory.
+//
+// Every level keeps a ring of the rows its next tile rows need, batch tile rows plus the borders above and below.
+// Once a batch is complete its tiles are cut and written in parallel, and the rows below it that are ready are
+// box filtered in parallel into the next level, which fills its own ring the same way. Memory is about twice
+// the ring of level 0, see MemoryFor(), independent of the height of the terrain.
+class TerrainPyramidBuilder
+{
+public:
+    TerrainPyramidBuilder(TerrainDatasetWriter &writer, int layer, int batch, JobSystem *jobs = nullptr)
+        : writer(writer), header(writer.Header()), layer(layer), batch(std::max(batch, 1)), jobs(jobs), failed(false)
+    {
+        format = header.layer[layer].format;
+        texelBytes = terrainTexelBytes(format);
+        for (uint32_t l = 0; l < header.levels; l++)
+        {
+            Level level;
+            level.width = header.level[l].width;
+            level.height = header.level[l].height;
+            level.capacity = std::min(level.height, ringRows());
+            level.rowBytes = (size_t)level.width * texelBytes;
+            level.ring.resize(level.capacity * level.rowBytes);
+            level.received = 0;
+            level.nextTileRow = 0;
+            level.nextDownRow = 0;
+            levels.push_back(level);
+        }
+    }
+
+    // bytes the builder of layer holds with batch tile rows per batch and the given number of threads
+    static size_t MemoryFor(const TerrainFileHeader &header, int layer, int batch, unsigned int threads)
+    {
+        size_t texelBytes = terrainTexelBytes(header.layer[layer].format);
+        size_t rows = (size_t)batch * header.tileSize + 2 * header.border + 2;
+        size_t bytes = 0;
+        for (uint32_t l = 0; l < header.levels; l++)
+        {
+            bytes += std::min(rows, (size_t)header.level[l].height) * header.level[l].width * texelBytes;
+            // rows downsampled for the next level before they are handed on
+            if (l + 1 < header.levels)
+                bytes += (rows / 2 + 1) * header.level[l + 1].width * texelBytes;
+        }
+        return bytes + threads * header.TileBytes(layer);
+    }
+
+    // row is header.width texels of the layer's format
+    bool AddRow(const void *row)
+    {
+        if (!failed && levels[0].received < levels[0].height)
+            push(0, (const unsigned char*)row);
+        return !failed;
+    }
+
+    // true once every level of the layer is written
+    bool Done() const
+    {
+        return !failed && levels.back().nextTileRow == (int)header.level[header.levels - 1].tilesY;
+    }
+
+private:
+    struct Level {
+        int width;
+        int height;
+        int capacity;
+        size_t rowBytes;
+        std::vector<unsigned char> ring;    // row y in slot y % capacity
+        std::vector<unsigned char> next;    // rows downsampled for the next level
+        int received;
+        int nextTileRow;
+        int nextDownRow;
+    };
+
+    TerrainDatasetWriter &writer;
+    const TerrainFileHeader &header;
+    int layer;
+    int batch;
+    JobSystem *jobs;
+    bool failed;
+    uint32_t format;
+    size_t texelBytes;
+    std::vector<Level> levels;
+
+    TerrainPyramidBuilder(const TerrainPyramidBuilder &);
+    TerrainPyramidBuilder &operator=(const TerrainPyramidBuilder &);
+
+    int ringRows() const { return batch * (int)header.tileSize + 2 * (int)header.border + 2; }
+
+    template <typename F>
+    void parallelFor(size_t begin, size_t end, size_t grain, const F &fn)
+    {
+        if (jobs)
+            jobs->ParallelFor(begin, end, grain, fn);
+        else
+            fn(begin, end);
+    }
+
+    void push(int index, const unsigned char *row)
+    {
+        Level &level = levels[index];
+        memcpy(&level.ring[(size_t)(level.received % level.capacity) * level.rowBytes], row, level.rowBytes);
+        level.received++;
+        int lastRow = std::min((level.nextTileRow + batch) * (int)header.tileSize + (int)header.border, level.height);
+        if (level.received >= lastRow)
+            flush(index);
+    }
+
+    // writes the tile rows that are complete, then hands the rows below them on to the next level
+    void flush(int index)
+    {
+        Level &level = levels[index];
+        const TerrainLevelRecord &record = header.level[index];
+        int tileRows = (int)record.tilesY;
+        int ready = level.nextTileRow;
+        while (ready < tileRows &&
+               level.received >= std::min((ready + 1) * (int)header.tileSize + (int)header.border, level.height))
+            ready++;
+
+        const Level *source = &level;
+        auto rowAt = [source](int y) { return &source->ring[(size_t)(y % source->capacity) * source->rowBytes]; };
+        size_t tilesX = record.tilesX;
+        size_t first = (size_t)level.nextTileRow * tilesX;
+        std::vector<unsigned char> failures((size_t)(ready - level.nextTileRow) * tilesX, 0);
+        parallelFor(first, (size_t)ready * tilesX, 1, [&](size_t begin, size_t end)
+        {
+            std::vector<unsigned char> tile(header.TileBytes(layer));
+            for (size_t i = begin; i < end; i++)
+            {
+                extractTerrainTileRows(rowAt, level.width, level.height, texelBytes, header.tileSize, header.border,
+                                       (int)(i % tilesX), (int)(i / tilesX), &tile[0]);
+                if (!writer.WriteTile(index, (int)(i % tilesX), (int)(i / tilesX), layer, &tile[0]))
+                    failures[i - first] = 1;
+            }
+        });
+        failed = failed || std::find(failures.begin(), failures.end(), 1) != failures.end();
+        level.nextTileRow = ready;
+        if (failed || index + 1 == (int)levels.size())
+            return;
+
+        // rows of the next level whose two source rows have arrived, the last one repeats past an odd edge
+        Level &coarser = levels[index + 1];
+        int firstRow = level.nextDownRow;
+        int lastRow = level.received == level.height ? coarser.height : level.received / 2;
+        if (lastRow <= firstRow)
+            return;
+        level.next.resize((size_t)(lastRow - firstRow) * coarser.rowBytes);
+        parallelFor(firstRow, lastRow, 4, [&](size_t begin, size_t end)
+        {
+            for (size_t y = begin; y < end; y++)
+                downsampleTerrainLayerRow(rowAt(std::min((int)y * 2, level.height - 1)),
+                                          rowAt(std::min((int)y * 2 + 1, level.height - 1)), level.width, format,
+                                          &level.next[(y - firstRow) * coarser.rowBytes]);
+        });
+        level.nextDownRow = lastRow;
+        for (int y = 0; y < lastRow - firstRow && !failed; y++)
+            push(index + 1, &level.next[(size_t)y * coarser.rowBytes]);
+    }
+};
+
+// A terrain dataset mapped read-only. Tile() is a pointer into the mapping, the OS pages tiles in from disk
+// on first access, Prefetch() starts that ahead of time. Any thread can read tiles.
+//
+// Opened through a TileFetcher instead, only the header and the bounds are read up front and the tiles stay
+// where they are, on a tile server say; Tile() is 0 and they are fetched from RecordOffset().
+class TerrainDataset
+{
+public:
+    TerrainDataset() : bounds(0)
+    {
+        memset(&header, 0, sizeof(header));
+    }
+
+    bool Open(const std::string &path)
+    {
+        Close();
+        if (!file.Open(path) || file.Size() < TERRAIN_PAGE_BYTES || !validate(file.Data(), file.Size()))
+        {
+            file.Close();
+            return false;
+        }
+        bounds = (const uint16_t*)(file.Data() + header.boundsOffset);
+        return true;
+    }
+
+    // resource as the source knows it, blocks until the header and the bounds arrived
+    bool Open(TileFetcher &source, const std::string &resource)
+    {
+        Close();
+        std::vector<unsigned char> page, last;
+        if (!source.Read(resource, 0, TERRAIN_PAGE_BYTES, page))
+            return false;
+        // the file size only shows in whether its last byte is there
+        TerrainFileHeader stored;
+        memcpy(&stored, &page[0], sizeof(stored));
+        uint64_t size = stored.dataOffset + stored.tileCount * stored.recordBytes;
+        if (stored.magic != TERRAIN_MAGIC || size == 0 || !source.Read(resource, size - 1, 1, last) ||
+            !validate(&page[0], size))
+            return false;
+        std::vector<unsigned char> bytes;
+        if (!source.Read(resource, header.boundsOffset, (size_t)header.tileCount * 2 * sizeof(uint16_t), bytes))
+        {
+            Close();
+            return false;
+        }
+        remoteBounds.resize((size_t)header.tileCount * 2);
+        memcpy(&remoteBounds[0], &bytes[0], bytes.size());
+        bounds = &remoteBounds[0];
+        return true;
+    }
+
+    void Close()
+    {
+        file.Close();
+        memset(&header, 0, sizeof(header));
+        bounds = 0;
+        std::vector<uint16_t>().swap(remoteBounds);
+    }
+
+    bool IsOpen() const { return bounds != 0; }
+    bool IsMapped() const { return file.IsOpen(); }
+    const TerrainFileHeader &Header() const { return header; }
+    const TerrainLevelRecord &Level(int level) const { return header.level[level]; }
+    int Levels() const { return (int)header.levels; }
+    int Layers() const { return (int)header.layers; }
+
+    // layer called name, -1 if there is none
+    int FindLayer(const std::string &name) const
+    {
+        for (uint32_t i = 0; i < header.layers; i++)
+            if (name == header.layer[i].name)
+                return (int)i;
+        return -1;
+    }
+
+    bool HasTile(int level, int tx, int ty) const
+    {
+        return level >= 0 && level < (int)header.levels && tx >= 0 && ty >= 0 &&
+               tx < (int)header.level[level].tilesX && ty < (int)header.level[level].tilesY;
+    }
+
+    uint64_t TileIndex(int level, int tx, int ty) const
+    {
+        return header.level[level].firstTile + (uint64_t)ty * header.level[level].tilesX + tx;
+    }
+
+    // where the record of all layers of a tile starts in the file, recordBytes long
+    uint64_t RecordOffset(int level, int tx, int ty) const
+    {
+        return header.dataOffset + TileIndex(level, tx, ty) * header.recordBytes;
+    }
+
+    // tileDim^2 texels of layer, 0 if the tile does not exist or the dataset is not mapped
+    const unsigned char *Tile(int level, int tx, int ty, int layer) const
+    {
+        if (!IsMapped() || !HasTile(level, tx, ty) || layer < 0 || layer >= (int)header.layers)
+            return 0;
+        return file.Data() + RecordOffset(level, tx, ty) + header.layer[layer].offset;
+    }
+
+    // layer of a whole level as one image, rows of Level(level).width texels, put together from the tiles without
+    // their borders. False if the dataset is not mapped.
+    bool ReadLevel(int level, int layer, std::vector<unsigned char> &out) const
+    {
+        if (!IsMapped() || level < 0 || level >= (int)header.levels || layer < 0 || layer >= (int)header.layers)
+            return false;
+        const TerrainLevelRecord &record = header.level[level];
+        size_t texelBytes = terrainTexelBytes(header.layer[layer].format);
+        size_t rowBytes = (size_t)record.width * texelBytes;
+        out.resize(rowBytes * record.height);
+        for (uint32_t ty = 0; ty < record.tilesY; ty++)
+            for (uint32_t tx = 0; tx < record.tilesX; tx++)
+            {
+                const unsigned char *texels = Tile(level, (int)tx, (int)ty, layer);
+                uint32_t x0 = tx * header.tileSize, y0 = ty * header.tileSize;
+                uint32_t columns = std::min(header.tileSize, record.width - x0);
+                for (uint32_t y = y0; y < std::min(y0 + header.tileSize, record.height); y++)
+                    memcpy(&out[(size_t)y * rowBytes + x0 * texelBytes],
+                           texels + ((size_t)(y - y0 + header.border) * header.TileDim() + header.border) * texelBytes,
+                           columns * texelBytes);
+            }
+        return true;
+    }
+
+    // lowest and highest height under a tile, in world units
+    bool TileBounds(int level, int tx, int ty, float &low, float &high) const
+    {
+        if (!HasTile(level, tx, ty))
+            return false;
+        uint64_t tile = TileIndex(level, tx, ty);
+        low = HeightOf(bounds[tile * 2]);
+        high = HeightOf(bounds[tile * 2 + 1]);
+        return true;
+    }
+
+    float HeightOf(uint16_t value) const
+    {
+        return header.heightOffset + header.heightScale * (value / 65535.0f);
+    }
+
+    // starts reading all layers of a tile in the background
+    void Prefetch(int level, int tx, int ty) const
+    {
+        if (IsMapped() && HasTile(level, tx, ty))
+            file.Prefetch((size_t)RecordOffset(level, tx, ty), (size_t)header.recordBytes);
+    }
+
+    size_t FileSize() const { return (size_t)(header.dataOffset + header.tileCount * header.recordBytes); }
+
+private:
+    MappedFile file;
+    TerrainFileHeader header;
+    const uint16_t *bounds;
+    std::vector<uint16_t> remoteBounds;
+
+    TerrainDataset(const TerrainDataset &);
+    TerrainDataset &operator=(const TerrainDataset &);
+
+    // takes the header at data if it is valid for a file of size bytes
+    bool validate(const unsigned char *data, uint64_t size)
+    {
+        TerrainFileHeader stored;
+        memcpy(&stored, data, sizeof(stored));
+
+        // the layout has to be exactly what the header's description produces
+        TerrainDatasetDesc desc;
+        desc.width = (int)std::min(stored.width, (uint32_t)1 << 30);
+        desc.height = (int)std::min(stored.height, (uint32_t)1 << 30);
+        desc.tileSize = (int)std::min(stored.tileSize, (uint32_t)1 << 30);
+        desc.border = (int)std::min(stored.border, (uint32_t)1 << 30);
+        desc.heightOffset = stored.heightOffset;
+        desc.heightScale = stored.heightScale;
+        desc.texelSize = stored.texelSize;
+        for (uint32_t i = 0; i < std::min(stored.layers, (uint32_t)TERRAIN_MAX_LAYERS); i++)
+        {
+            TerrainLayerDesc layer;
+            layer.name.assign(stored.layer[i].name, strnlen(stored.layer[i].name, sizeof(stored.layer[i].name)));
+            layer.format = (TerrainLayerFormat)std::min(stored.layer[i].format, (uint32_t)TERRAIN_R16 + 1);
+            desc.layers.push_back(layer);
+        }
+        TerrainFileHeader expected;
+        if (stored.magic != TERRAIN_MAGIC || stored.version != TERRAIN_VERSION || stored.layers > TERRAIN_MAX_LAYERS ||
+            !terrainHeaderFor(desc, expected) || memcmp(&expected, &stored, sizeof(stored)) != 0 ||
+            size < stored.dataOffset + stored.tileCount * stored.recordBytes)
+            return false;
+        header = stored;
+        return true;
+    }
+};
+#endif
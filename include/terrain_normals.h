@@ -0,0 +1,494 @@
+
+
+#ifndef TERRAIN_NORMALS_H
+#define TERRAIN_NORMALS_H
+
+#include <glad/glad.h>
+
+#include <baked_file.h>
+#include <block_compression.h>
+#include <height_field.h>
+#include <job_system.h>
+#include <ktx_file.h>
+#include <mapped_file.h>
+#include <texture_upload.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TERRAIN_NORMALS_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TERRAIN_NORMALS_SSE2 1
+#endif
+
+// The terrain normal map, baked from the heights of a HeightField instead of shipped as an image.
+//
+// Normals come from a 3x3 Sobel kernel over the samples, in world units: samples TexelSize() apart and scaled by
+// the dataset's heightScale like the tessellation evaluation shader displaces them, so the lighting matches the
+// relief that is drawn. The normal map covers the terrain the way the height layer does, texel (x, y) over sample
+// (x, y), and holds world space normals with y up, the way fragment.shader reads them.
+//
+// Rows are split into bands over the job system; each band keeps the three rows of the kernel as floats and does
+// eight normals at a time with AVX2 (built with -mavx2), four with SSE2 and one at a time otherwise. The RGBA
+// result is box filtered into a mip chain and compressed to BC5 (x and z, the shader rebuilds y), again by bands.
+//
+// The levels are kept in a baked file (see baked_file.h) keyed by HeightField::ContentHash(), which
+// tools/terrain_bake writes next to the dataset; Bake() only reads it while it holds the normals of the same
+// heights, and bakes and rewrites it for any other heights (an edited heightmap, another dataset). While the
+// heights are sculpted, Refresh() computes and compresses again only the blocks over the samples that changed
+// and UploadChanged() replaces just those in the texture.
+class TerrainNormalBaker
+{
+public:
+    static const uint32_t VERSION = 2;  // of the baked file, bump when the kernel changes
+
+    // statistics, of the last Bake()
+    bool fromCache;
+    double hashMs;
+    double normalsMs;
+    double compressMs;
+    double refreshMs;   // of the last Refresh()
+
+    explicit TerrainNormalBaker(const std::string &path)
+        : fromCache(false), hashMs(0.0), normalsMs(0.0), compressMs(0.0), refreshMs(0.0), path(path), width(0), height(0)
+    {
+    }
+
+    // the BC5 mip chain of the normals of field, read from the baked file if it holds the bake of these heights
+    bool Bake(const HeightField &field, JobSystem *jobs = nullptr)
+    {
+        fromCache = false;
+        hashMs = normalsMs = compressMs = 0.0;
+        levels.clear();
+        mips.clear();
+        changed.clear();
+        width = field.Width();
+        height = field.Height();
+        if (field.Empty())
+            return false;
+
+        Clock::time_point start = Clock::now();
+        uint64_t key = field.ContentHash();
+        hashMs = millisecondsSince(start);
+        if (read(key))
+        {
+            fromCache = true;
+            return true;
+        }
+
+        start = Clock::now();
+        std::vector<unsigned char> rgba((size_t)width * height * 4);
+        Normals(field, 0, 0, width, height, &rgba[0], jobs);
+        normalsMs = millisecondsSince(start);
+
+        start = Clock::now();
+        unsigned int count = mipLevelCount(width, height);
+        levels.resize(count);
+        std::vector<unsigned char> next;
+        int levelWidth = width, levelHeight = height;
+        for (unsigned int level = 0; level < count; level++)
+        {
+            compress(&rgba[0], levelWidth, levelHeight, levels[level], jobs);
+            if (level + 1 == count)
+                break;
+            next.resize((size_t)std::max(levelWidth / 2, 1) * std::max(levelHeight / 2, 1) * 4);
+            downsampleImage(&rgba[0], levelWidth, levelHeight, 4, &next[0]);
+            rgba.swap(next);
+            levelWidth = std::max(levelWidth / 2, 1);
+            levelHeight = std::max(levelHeight / 2, 1);
+        }
+        compressMs = millisecondsSince(start);
+        write(key);
+        return true;
+    }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    unsigned int Levels() const { return (unsigned int)levels.size(); }
+    const std::string &Path() const { return path; }
+
+    // the BC5 blocks of a level, rows of blocks
+    const std::vector<unsigned char> &Level(unsigned int level) const { return levels[level]; }
+
+    size_t Bytes() const
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < levels.size(); i++)
+            bytes += levels[i].size();
+        return bytes;
+    }
+
+    // GL thread. Fills texture with the baked levels, or with a single flat normal if nothing was baked.
+    void Upload(GLuint texture) const
+    {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        if (levels.empty())
+        {
+            const unsigned char up[4] = { 128, 255, 128, 255 };
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, up);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        }
+        else
+        {
+            int levelWidth = width, levelHeight = height;
+            for (size_t level = 0; level < levels.size(); level++)
+            {
+                glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)level, GL_COMPRESSED_RG_RGTC2, levelWidth, levelHeight, 0,
+                                       (GLsizei)levels[level].size(), &levels[level][0]);
+                levelWidth = std::max(levelWidth / 2, 1);
+                levelHeight = std::max(levelHeight / 2, 1);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size() - 1);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    // After samples [x0, x1) x [y0, y1) of field changed: the normals they reach are computed again, the texels of
+    // the coarser levels above those filtered again and the blocks all of them are in compressed again, for
+    // UploadChanged(). The first call keeps the coarser levels uncompressed for this, filtered from the normals of
+    // the whole field once.
+    void Refresh(const HeightField &field, int x0, int y0, int x1, int y1, JobSystem *jobs = nullptr)
+    {
+        Clock::time_point start = Clock::now();
+        changed.clear();
+        if (levels.empty() || field.Width() != width || field.Height() != height)
+            return;
+        if (mips.empty())
+            keepLevels(field, jobs);
+        // the kernel reaches a sample to either side
+        x0 = std::max(x0 - 1, 0);
+        y0 = std::max(y0 - 1, 0);
+        x1 = std::min(x1 + 1, width);
+        y1 = std::min(y1 + 1, height);
+        if (x0 >= x1 || y0 >= y1)
+            return;
+
+        // level 0 is only ever computed on the whole blocks around the change, which also holds everything
+        // level 1 filters from
+        Region finest = blocksAround(0, x0, y0, x1, y1, width, height);
+        int finestWidth = finest.x1 - finest.x0, finestHeight = finest.y1 - finest.y0;
+        scratch.resize((size_t)finestWidth * finestHeight * 4);
+        Normals(field, finest.x0, finest.y0, finest.x1, finest.y1, &scratch[0], jobs);
+        recompress(finest, &scratch[0], finestWidth, finestHeight, finest.x0, finest.y0, width);
+
+        int levelWidth = width, levelHeight = height;
+        for (size_t level = 1; level < levels.size(); level++)
+        {
+            int nextWidth = std::max(levelWidth / 2, 1), nextHeight = std::max(levelHeight / 2, 1);
+            x0 >>= 1;
+            y0 >>= 1;
+            x1 = std::min(((x1 - 1) >> 1) + 1, nextWidth);
+            y1 = std::min(((y1 - 1) >> 1) + 1, nextHeight);
+            if (x0 >= x1 || y0 >= y1)
+                break;
+            // the 2x2 box of downsampleImage(), from the blocks of level 0 or the level kept below
+            const unsigned char *finer = level == 1 ? &scratch[0] : &mips[level - 1][0];
+            int originX = level == 1 ? finest.x0 : 0, originY = level == 1 ? finest.y0 : 0;
+            int stride = level == 1 ? finestWidth : levelWidth;
+            unsigned char *texels = &mips[level][0];
+            for (int y = y0; y < y1; y++)
+            {
+                const unsigned char *row0 = finer + (size_t)(std::min(y * 2, levelHeight - 1) - originY) * stride * 4;
+                const unsigned char *row1 = finer + (size_t)(std::min(y * 2 + 1, levelHeight - 1) - originY) * stride * 4;
+                for (int x = x0; x < x1; x++)
+                {
+                    int c0 = (std::min(x * 2, levelWidth - 1) - originX) * 4;
+                    int c1 = (std::min(x * 2 + 1, levelWidth - 1) - originX) * 4;
+                    for (int c = 0; c < 4; c++)
+                        texels[((size_t)y * nextWidth + x) * 4 + c] =
+                            (unsigned char)((row0[c0 + c] + row0[c1 + c] + row1[c0 + c] + row1[c1 + c] + 2) >> 2);
+                }
+            }
+            recompress(blocksAround((int)level, x0, y0, x1, y1, nextWidth, nextHeight), texels, nextWidth, nextHeight,
+                       0, 0, nextWidth);
+            levelWidth = nextWidth;
+            levelHeight = nextHeight;
+        }
+        refreshMs = millisecondsSince(start);
+    }
+
+    // GL thread. The blocks the last Refresh() compressed again, into texture as Upload() filled it.
+    void UploadChanged(GLuint texture) const
+    {
+        if (changed.empty())
+            return;
+        glBindTexture(GL_TEXTURE_2D, texture);
+        std::vector<unsigned char> blocks;
+        for (size_t i = 0; i < changed.size(); i++)
+        {
+            const Region &region = changed[i];
+            int levelWidth = std::max(width >> region.level, 1);
+            size_t blocksX = (size_t)(levelWidth + 3) / 4;
+            size_t rowBytes = (size_t)(region.x1 - region.x0 + 3) / 4 * 16;
+            int firstRow = region.y0 / 4, rows = (region.y1 - region.y0 + 3) / 4;
+            blocks.resize(rowBytes * rows);
+            for (int row = 0; row < rows; row++)
+                memcpy(&blocks[row * rowBytes], &levels[region.level][((firstRow + row) * blocksX + region.x0 / 4) * 16],
+                       rowBytes);
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, region.level, region.x0, region.y0, region.x1 - region.x0,
+                                      region.y1 - region.y0, GL_COMPRESSED_RG_RGTC2, (GLsizei)blocks.size(), &blocks[0]);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    static const char *SimdPath()
+    {
+#if defined(TERRAIN_NORMALS_AVX2)
+        return "AVX2";
+#elif defined(TERRAIN_NORMALS_SSE2)
+        return "SSE2";
+#else
+        return "scalar";
+#endif
+    }
+
+    // the normals of samples [x0, x1) x [y0, y1) into rgba, (x1 - x0) * 4 bytes a row: x, y and z mapped from
+    // -1..1 to 0..255 in red, green and blue, alpha 255. Samples past the edges of the field repeat the edge.
+    static void Normals(const HeightField &field, int x0, int y0, int x1, int y1, unsigned char *rgba,
+                        JobSystem *jobs = nullptr)
+    {
+        if (x1 <= x0 || y1 <= y0)
+            return;
+        size_t bands = (size_t)(y1 - y0 + BAND_ROWS - 1) / BAND_ROWS;
+        parallelFor(jobs, 0, bands, 1, [&](size_t begin, size_t end)
+        {
+            for (size_t band = begin; band < end; band++)
+            {
+                int first = y0 + (int)band * BAND_ROWS;
+                normalBand(field, x0, x1, first, std::min(first + BAND_ROWS, y1), rgba + (size_t)(first - y0) * (x1 - x0) * 4);
+            }
+        });
+    }
+
+private:
+    typedef std::chrono::high_resolution_clock Clock;
+
+    static const int BAND_ROWS = 32;
+
+    // texels [x0, x1) x [y0, y1) of a level, on whole blocks
+    struct Region {
+        int level;
+        int x0, y0, x1, y1;
+    };
+
+    std::string path;
+    int width, height;
+    std::vector<std::vector<unsigned char> > levels;
+    std::vector<std::vector<unsigned char> > mips;  // RGBA of the levels above 0, once Refresh() needs them
+    std::vector<Region> changed;                    // by the last Refresh()
+    std::vector<unsigned char> scratch;
+
+    static double millisecondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    template <typename F>
+    static void parallelFor(JobSystem *jobs, size_t begin, size_t end, size_t grain, const F &fn)
+    {
+        if (jobs)
+            jobs->ParallelFor(begin, end, grain, fn);
+        else
+            fn(begin, end);
+    }
+
+    // sample row y from x0 - 1 to x1, clamped to the field, as floats
+    static void loadRow(const HeightField &field, int x0, int x1, int y, float *row)
+    {
+        for (int x = x0 - 1; x <= x1; x++)
+            row[x - x0 + 1] = field.Sample(x, y);
+    }
+
+    static unsigned char encode(float v)
+    {
+        return (unsigned char)std::min((int)(v * 127.5f + 128.0f), 255);
+    }
+
+    // rows [y0, y1), the kernel's rows above, on and below each slide down by one per row
+    static void normalBand(const HeightField &field, int x0, int x1, int y0, int y1, unsigned char *rgba)
+    {
+        int count = x1 - x0;
+        std::vector<float> storage((size_t)(count + 2) * 3);
+        float *above = &storage[0], *on = above + count + 2, *below = on + count + 2;
+        loadRow(field, x0, x1, y0 - 1, above);
+        loadRow(field, x0, x1, y0, on);
+        // Sobel gradients are eight times the slope per sample; ny keeps that factor so that nothing is divided
+        float slope = -field.HeightScale() / 65535.0f;
+        float up = 8.0f * field.TexelSize();
+        for (int y = y0; y < y1; y++)
+        {
+            loadRow(field, x0, x1, y + 1, below);
+            uint32_t *out = (uint32_t*)(rgba + (size_t)(y - y0) * count * 4);
+            int i = 0;
+#if defined(TERRAIN_NORMALS_AVX2)
+            const __m256 two = _mm256_set1_ps(2.0f), slope8 = _mm256_set1_ps(slope), up8 = _mm256_set1_ps(up);
+            const __m256 half = _mm256_set1_ps(127.5f), bias = _mm256_set1_ps(128.0f), top = _mm256_set1_ps(255.0f);
+            for (; i + 8 <= count; i += 8)
+            {
+                __m256 a0 = _mm256_loadu_ps(above + i), a1 = _mm256_loadu_ps(above + i + 1), a2 = _mm256_loadu_ps(above + i + 2);
+                __m256 b0 = _mm256_loadu_ps(on + i), b2 = _mm256_loadu_ps(on + i + 2);
+                __m256 c0 = _mm256_loadu_ps(below + i), c1 = _mm256_loadu_ps(below + i + 1), c2 = _mm256_loadu_ps(below + i + 2);
+                __m256 gx = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(a2, a0), _mm256_sub_ps(c2, c0)),
+                                          _mm256_mul_ps(two, _mm256_sub_ps(b2, b0)));
+                __m256 gz = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(c0, a0), _mm256_sub_ps(c2, a2)),
+                                          _mm256_mul_ps(two, _mm256_sub_ps(c1, a1)));
+                __m256 nx = _mm256_mul_ps(gx, slope8), nz = _mm256_mul_ps(gz, slope8);
+                __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(nz, nz)),
+                                                             _mm256_mul_ps(up8, up8)));
+                __m256 scale = _mm256_div_ps(half, length);
+                __m256i r = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(nx, scale), bias), top));
+                __m256i g = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(up8, scale), bias), top));
+                __m256i b = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(nz, scale), bias), top));
+                __m256i pixels = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+                                                 _mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_set1_epi32((int)0xFF000000u)));
+                _mm256_storeu_si256((__m256i*)(out + i), pixels);
+            }
+#elif defined(TERRAIN_NORMALS_SSE2)
+            const __m128 two = _mm_set1_ps(2.0f), slope4 = _mm_set1_ps(slope), up4 = _mm_set1_ps(up);
+            const __m128 half = _mm_set1_ps(127.5f), bias = _mm_set1_ps(128.0f), top = _mm_set1_ps(255.0f);
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128 a0 = _mm_loadu_ps(above + i), a1 = _mm_loadu_ps(above + i + 1), a2 = _mm_loadu_ps(above + i + 2);
+                __m128 b0 = _mm_loadu_ps(on + i), b2 = _mm_loadu_ps(on + i + 2);
+                __m128 c0 = _mm_loadu_ps(below + i), c1 = _mm_loadu_ps(below + i + 1), c2 = _mm_loadu_ps(below + i + 2);
+                __m128 gx = _mm_add_ps(_mm_add_ps(_mm_sub_ps(a2, a0), _mm_sub_ps(c2, c0)), _mm_mul_ps(two, _mm_sub_ps(b2, b0)));
+                __m128 gz = _mm_add_ps(_mm_add_ps(_mm_sub_ps(c0, a0), _mm_sub_ps(c2, a2)), _mm_mul_ps(two, _mm_sub_ps(c1, a1)));
+                __m128 nx = _mm_mul_ps(gx, slope4), nz = _mm_mul_ps(gz, slope4);
+                __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(nz, nz)), _mm_mul_ps(up4, up4)));
+                __m128 scale = _mm_div_ps(half, length);
+                __m128i r = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(nx, scale), bias), top));
+                __m128i g = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(up4, scale), bias), top));
+                __m128i b = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(nz, scale), bias), top));
+                __m128i pixels = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                                              _mm_or_si128(_mm_slli_epi32(b, 16), _mm_set1_epi32((int)0xFF000000u)));
+                _mm_storeu_si128((__m128i*)(out + i), pixels);
+            }
+#endif
+            for (; i < count; i++)
+            {
+                float gx = (above[i + 2] - above[i]) + (below[i + 2] - below[i]) + 2.0f * (on[i + 2] - on[i]);
+                float gz = (below[i] - above[i]) + (below[i + 2] - above[i + 2]) + 2.0f * (below[i + 1] - above[i + 1]);
+                float nx = gx * slope, nz = gz * slope;
+                float scale = 1.0f / std::sqrt(nx * nx + nz * nz + up * up);
+                unsigned char *pixel = (unsigned char*)(out + i);
+                pixel[0] = encode(nx * scale);
+                pixel[1] = encode(up * scale);
+                pixel[2] = encode(nz * scale);
+                pixel[3] = 255;
+            }
+            std::swap(above, on);
+            std::swap(on, below);
+        }
+    }
+
+    // BC5 of the red and blue channels of a level, by rows of blocks
+    static void compress(const unsigned char *rgba, int width, int height, std::vector<unsigned char> &out,
+                         JobSystem *jobs)
+    {
+        int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+        out.resize(compressedLevelSize(GL_COMPRESSED_RG_RGTC2, width, height));
+        parallelFor(jobs, 0, (size_t)blocksY, 4, [&](size_t begin, size_t end)
+        {
+            PixelBlock block;
+            for (size_t by = begin; by < end; by++)
+                for (int bx = 0; bx < blocksX; bx++)
+                {
+                    fetchBlock(rgba, width, height, bx, (int)by, block);
+                    encodeBC5(block, 0, 2, &out[((size_t)by * blocksX + bx) * 16]);
+                }
+        });
+    }
+
+    // the uncompressed levels above level 0
+    void keepLevels(const HeightField &field, JobSystem *jobs)
+    {
+        std::vector<unsigned char> rgba((size_t)width * height * 4);
+        Normals(field, 0, 0, width, height, &rgba[0], jobs);
+        mips.resize(levels.size());
+        int levelWidth = width, levelHeight = height;
+        for (size_t level = 1; level < levels.size(); level++)
+        {
+            const unsigned char *finer = level == 1 ? &rgba[0] : &mips[level - 1][0];
+            mips[level].resize((size_t)std::max(levelWidth / 2, 1) * std::max(levelHeight / 2, 1) * 4);
+            downsampleImage(finer, levelWidth, levelHeight, 4, &mips[level][0]);
+            levelWidth = std::max(levelWidth / 2, 1);
+            levelHeight = std::max(levelHeight / 2, 1);
+        }
+    }
+
+    // texels [x0, x1) x [y0, y1) of a levelWidth x levelHeight level grown to the blocks they are in
+    static Region blocksAround(int level, int x0, int y0, int x1, int y1, int levelWidth, int levelHeight)
+    {
+        Region region = { level, x0 & ~3, y0 & ~3, std::min((x1 + 3) & ~3, levelWidth), std::min((y1 + 3) & ~3, levelHeight) };
+        return region;
+    }
+
+    // the blocks of region compressed again from rgba, an image of imageWidth x imageHeight texels whose first
+    // texel is texel (originX, originY) of the level, on a block corner; levelWidth is the width of the level
+    void recompress(const Region &region, const unsigned char *rgba, int imageWidth, int imageHeight, int originX,
+                    int originY, int levelWidth)
+    {
+        size_t blocksX = (size_t)(levelWidth + 3) / 4;
+        PixelBlock block;
+        for (int by = region.y0 / 4; by < (region.y1 + 3) / 4; by++)
+            for (int bx = region.x0 / 4; bx < (region.x1 + 3) / 4; bx++)
+            {
+                fetchBlock(rgba, imageWidth, imageHeight, bx - originX / 4, by - originY / 4, block);
+                encodeBC5(block, 0, 2, &levels[region.level][(by * blocksX + bx) * 16]);
+            }
+        changed.push_back(region);
+    }
+
+    bool read(uint64_t key)
+    {
+        BakedFileReader reader;
+        int bakedWidth = 0, bakedHeight = 0;
+        if (!reader.Open(path, bakedKind("NRML"), VERSION, key) || !reader.GetValue(bakedWidth) ||
+            !reader.GetValue(bakedHeight) || bakedWidth != width || bakedHeight != height)
+            return false;
+        levels.resize(mipLevelCount(width, height));
+        int levelWidth = width, levelHeight = height;
+        for (size_t level = 0; level < levels.size(); level++)
+        {
+            if (!reader.Get(levels[level]) ||
+                levels[level].size() != compressedLevelSize(GL_COMPRESSED_RG_RGTC2, levelWidth, levelHeight))
+            {
+                levels.clear();
+                return false;
+            }
+            levelWidth = std::max(levelWidth / 2, 1);
+            levelHeight = std::max(levelHeight / 2, 1);
+        }
+        return true;
+    }
+
+    void write(uint64_t key) const
+    {
+        if (path.find_last_of("/\\") != std::string::npos)
+            makeDirectory(path.substr(0, path.find_last_of("/\\")));
+        BakedFileWriter writer;
+        if (!writer.Create(path, bakedKind("NRML"), VERSION, key))
+            return;
+        writer.PutValue(width);
+        writer.PutValue(height);
+        for (size_t level = 0; level < levels.size(); level++)
+            writer.Put(levels[level]);
+        writer.Finish();
+    }
+
+    TerrainNormalBaker(const TerrainNormalBaker &);
+    TerrainNormalBaker &operator=(const TerrainNormalBaker &);
+};
+#endif
@@ -0,0 +1,982 @@
+
+
+#ifndef TERRAIN_PATHS_H
+#define TERRAIN_PATHS_H
+
+#include <glm/glm.hpp>
+
+#include <baked_file.h>
+#include <content_hash.h>
+#include <height_field.h>
+#include <job_system.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// moves cost (a + b) * PATH_STRAIGHT or (a + b) * PATH_DIAGONAL for the costs a and b of the two samples, 17 / 12
+// is within 0.2% of the square root of two
+static const uint32_t PATH_STRAIGHT = 12;
+static const uint32_t PATH_DIAGONAL = 17;
+static const uint32_t PATH_UNREACHED = 0xffffffffu;
+static const uint32_t PATH_BUCKETS = 32768;     // of the local searches' queues
+
+// How hard the terrain is to cross
+struct PathCostSettings {
+    float maxSlope;             // rise over run, steeper samples cannot be crossed
+    float slopeCost;            // added at maxSlope, in proportion below it
+    float materialCost[4];      // added for all of the blend map's red, green and blue, and the water that is the rest
+    float maxWater;             // samples with more water cannot be crossed
+
+    PathCostSettings() : maxSlope(1.0f), slopeCost(4.0f), maxWater(0.5f)
+    {
+        materialCost[0] = 0.0f;
+        materialCost[1] = 0.5f;
+        materialCost[2] = 1.0f;
+        materialCost[3] = 4.0f;
+    }
+};
+
+struct PathQuery {
+    glm::vec2 from, to;         // world x and z
+};
+
+struct TerrainPath {
+    std::vector<glm::vec3> points;  // sample centres on the ground, from the start to the goal
+    float cost;                     // in world units of flat ground that would cost the same
+    bool found;
+};
+
+// Route finding over the terrain samples, with HPA* (Botea, Mueller and Schaeffer, "Near Optimal Hierarchical
+// Path-Finding").
+//
+// Every sample gets a cost from the slope of the height field and the materials of the blend map, or is closed.
+// Moves go to the eight neighbours, diagonals only past two open samples, and cost the length of the move times
+// the mean of the two samples. The samples are cut into square clusters. Where two clusters touch, every run of
+// open sample pairs across the border is an entrance with transitions along it, one in the middle of a short
+// one; the samples of the transitions are the nodes of an abstract graph, joined across the border by the step
+// and inside a cluster by the cost of the cheapest path that stays in it. A query links start and goal to the
+// nodes of their clusters, runs A* over the abstract graph and refines every step of the result with A* inside
+// one cluster, so it touches a few clusters' worth of samples however long the route is. Paths come out within a
+// few percent of the cheapest.
+//
+// Build() prepares everything, Update() only the clusters around changed samples. Queries only read and can run
+// on any number of threads at once, but not during Build() or Update(). Given a baked file (see baked_file.h,
+// tools/terrain_bake writes one next to the dataset) the construction reads everything from there while it was
+// built from the same heights, blend map, settings and cluster size, and builds and writes it otherwise.
+class TerrainPathfinder
+{
+public:
+    static const uint32_t VERSION = 1;  // of the baked file
+
+    // statistics, of the last Build() or Update()
+    double buildMs;
+    unsigned int clustersRebuilt;
+
+    // blend is row major with blendChannels 8 bit channels per sample, the size of the field, or null; both have
+    // to stay around
+    TerrainPathfinder(const HeightField &field, const uint8_t *blend, int blendChannels,
+                      const PathCostSettings &settings = PathCostSettings(), JobSystem *jobs = nullptr,
+                      int clusterSize = 64, const std::string &baked = std::string())
+        : buildMs(0.0), clustersRebuilt(0), field(field), blend(blend), blendChannels(blendChannels),
+          settings(settings), clusterSize(std::max(clusterSize, 8)), cheapest(255)
+    {
+        if (!baked.empty() && Read(baked))
+            return;
+        Build(jobs);
+        if (!baked.empty())
+            Write(baked);
+    }
+
+    void Build(JobSystem *jobs = nullptr)
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        width = field.Width();
+        height = field.Height();
+        clustersX = (width + clusterSize - 1) / clusterSize;
+        clustersY = (height + clusterSize - 1) / clusterSize;
+        cost.assign((size_t)width * height, 0);
+        cheapest = 255;
+        verticalBorders.assign((size_t)clustersX * clustersY, std::vector<Transition>());
+        horizontalBorders.assign((size_t)clustersX * clustersY, std::vector<Transition>());
+        clusters.assign((size_t)clustersX * clustersY, Cluster());
+        std::vector<int> all(clusters.size());
+        for (size_t i = 0; i < all.size(); i++)
+            all[i] = (int)i;
+        rebuild(0, 0, width - 1, height - 1, all, jobs);
+        buildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    // after the samples x0..x1, y0..y1 changed in the field or the blend map
+    void Update(int x0, int y0, int x1, int y1, JobSystem *jobs = nullptr)
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        // the slopes of the samples next to the change change with it
+        x0 = std::max(x0 - 1, 0);
+        y0 = std::max(y0 - 1, 0);
+        x1 = std::min(x1 + 1, width - 1);
+        y1 = std::min(y1 + 1, height - 1);
+        if (x0 > x1 || y0 > y1)
+            return;
+        std::vector<int> changed;
+        for (int cy = y0 / clusterSize; cy <= y1 / clusterSize; cy++)
+            for (int cx = x0 / clusterSize; cx <= x1 / clusterSize; cx++)
+                changed.push_back(cy * clustersX + cx);
+        rebuild(x0, y0, x1, y1, changed, jobs);
+        buildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    bool FindPath(const glm::vec2 &from, const glm::vec2 &to, TerrainPath &path) const
+    {
+        path.points.clear();
+        path.cost = 0.0f;
+        path.found = false;
+        int start = cellAt(from), goal = cellAt(to);
+        if (start < 0 || goal < 0 || cost[start] == 0 || cost[goal] == 0)
+            return false;
+        LocalSearch local;
+        std::vector<int> cells;
+        float best = std::numeric_limits<float>::max();
+        int startCluster = clusterOf(start), goalCluster = clusterOf(goal);
+        if (startCluster == goalCluster)
+        {
+            uint32_t direct = searchRegion(clusterRegion(startCluster), start, goal, local);
+            if (direct != PATH_UNREACHED)
+            {
+                best = (float)direct;
+                trace(local, goal, cells);
+            }
+        }
+
+        // start and goal linked to the nodes of their clusters
+        std::vector<uint32_t> startCosts, goalCosts;
+        linkToNodes(startCluster, start, local, startCosts);
+        linkToNodes(goalCluster, goal, local, goalCosts);
+
+        // A* over the abstract graph, with the goal as one more node
+        int nodes = (int)nodeCells.size(), goalNode = nodes;
+        std::vector<float> g(nodes + 1, std::numeric_limits<float>::max());
+        std::vector<int> parent(nodes + 1, -1);
+        std::vector<bool> closed(nodes + 1, false);
+        std::vector<uint64_t> open;
+        for (size_t k = 0; k < startCosts.size(); k++)
+            if (startCosts[k] != PATH_UNREACHED)
+            {
+                int node = nodeBase[startCluster] + (int)k;
+                g[node] = (float)startCosts[k];
+                pushOpen(open, g[node] + estimateCells(nodeCells[node], goal), node);
+            }
+        while (!open.empty())
+        {
+            int node = popOpen(open);
+            if (closed[node])
+                continue;
+            closed[node] = true;
+            if (node == goalNode || g[node] >= best)
+                break;
+            if (nodeCluster[node] == goalCluster && goalCosts[node - nodeBase[goalCluster]] != PATH_UNREACHED)
+            {
+                float total = g[node] + (float)goalCosts[node - nodeBase[goalCluster]];
+                if (total < g[goalNode])
+                {
+                    g[goalNode] = total;
+                    parent[goalNode] = node;
+                    pushOpen(open, total, goalNode);
+                }
+            }
+            for (int e = edgeBase[node]; e < edgeBase[node + 1]; e++)
+            {
+                const Edge &edge = edges[e];
+                float total = g[node] + edge.cost;
+                if (!closed[edge.to] && total < g[edge.to])
+                {
+                    g[edge.to] = total;
+                    parent[edge.to] = node;
+                    pushOpen(open, total + estimateCells(nodeCells[edge.to], goal), edge.to);
+                }
+            }
+        }
+
+        if (g[goalNode] < best)
+        {
+            // refined from start over the abstract nodes to goal, every step within a cluster or across a border
+            std::vector<int> route, piece;
+            for (int node = parent[goalNode]; node >= 0; node = parent[node])
+                route.push_back(node);
+            std::reverse(route.begin(), route.end());
+            cells.assign(1, start);
+            int previous = start, previousCluster = startCluster;
+            for (size_t i = 0; i <= route.size(); i++)
+            {
+                int cell = i < route.size() ? nodeCells[route[i]] : goal;
+                int cluster = i < route.size() ? nodeCluster[route[i]] : goalCluster;
+                if (cell == previous)
+                    continue;
+                if (cluster != previousCluster)
+                    cells.push_back(cell);
+                else
+                {
+                    searchRegion(clusterRegion(cluster), previous, cell, local);
+                    trace(local, cell, piece);
+                    cells.insert(cells.end(), piece.begin() + 1, piece.end());
+                }
+                previous = cell;
+                previousCluster = cluster;
+            }
+            best = g[goalNode];
+        }
+        if (best == std::numeric_limits<float>::max())
+            return false;
+
+        path.points.reserve(cells.size());
+        for (size_t i = 0; i < cells.size(); i++)
+        {
+            float x = ((cells[i] % width) + 0.5f - width * 0.5f) * field.TexelSize();
+            float z = ((cells[i] / width) + 0.5f - height * 0.5f) * field.TexelSize();
+            path.points.push_back(glm::vec3(x, field.HeightAt(x, z), z));
+        }
+        path.cost = best * worldScale();
+        path.found = true;
+        return true;
+    }
+
+    // every query on its own, spread over the job system if there is one
+    void FindPaths(const PathQuery *queries, size_t count, TerrainPath *paths, JobSystem *jobs = nullptr) const
+    {
+        parallelFor(jobs, 0, count, 1, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                FindPath(queries[i].from, queries[i].to, paths[i]);
+        });
+    }
+
+    // everything a Build() prepares from a baked file, false if it was built from other inputs
+    bool Read(const std::string &path)
+    {
+        // read aside first, a file that does not fit leaves everything as it was
+        BakedFileReader reader;
+        int sizes[4];
+        uint32_t readCheapest;
+        std::vector<uint8_t> readCost;
+        std::vector<int> cells, verticalCounts, horizontalCounts, clusterCounts, costCounts;
+        std::vector<int> readNodeBase, readNodeCells, readNodeCluster, readEdgeBase;
+        std::vector<Transition> vertical, horizontal;
+        std::vector<uint32_t> costs;
+        std::vector<Edge> readEdges;
+        if (!reader.Open(path, bakedKind("PATH"), VERSION, key()) || !reader.GetValue(sizes) ||
+            sizes[0] != field.Width() || sizes[1] != field.Height() ||
+            sizes[2] != (field.Width() + clusterSize - 1) / clusterSize ||
+            sizes[3] != (field.Height() + clusterSize - 1) / clusterSize || !reader.GetValue(readCheapest) ||
+            !reader.Get(readCost) || !reader.Get(verticalCounts) || !reader.Get(vertical) ||
+            !reader.Get(horizontalCounts) || !reader.Get(horizontal) || !reader.Get(clusterCounts) || !reader.Get(cells) ||
+            !reader.Get(costCounts) || !reader.Get(costs) || !reader.Get(readNodeBase) || !reader.Get(readNodeCells) ||
+            !reader.Get(readNodeCluster) || !reader.Get(readEdgeBase) || !reader.Get(readEdges) ||
+            readCost.size() != (size_t)sizes[0] * sizes[1])
+            return false;
+        size_t count = (size_t)sizes[2] * sizes[3];
+        std::vector<std::vector<Transition> > readVertical, readHorizontal;
+        std::vector<std::vector<int> > clusterCells;
+        std::vector<std::vector<uint32_t> > clusterCosts;
+        if (!unflatten(verticalCounts, vertical, count, readVertical) ||
+            !unflatten(horizontalCounts, horizontal, count, readHorizontal) ||
+            !unflatten(clusterCounts, cells, count, clusterCells) || !unflatten(costCounts, costs, count, clusterCosts))
+            return false;
+        cheapest = readCheapest;
+        cost.swap(readCost);
+        verticalBorders.swap(readVertical);
+        horizontalBorders.swap(readHorizontal);
+        nodeBase.swap(readNodeBase);
+        nodeCells.swap(readNodeCells);
+        nodeCluster.swap(readNodeCluster);
+        edgeBase.swap(readEdgeBase);
+        edges.swap(readEdges);
+        width = sizes[0];
+        height = sizes[1];
+        clustersX = sizes[2];
+        clustersY = sizes[3];
+        clusters.assign(count, Cluster());
+        for (size_t i = 0; i < count; i++)
+        {
+            clusters[i].cells.swap(clusterCells[i]);
+            clusters[i].costs.swap(clusterCosts[i]);
+        }
+        buildMs = 0.0;
+        clustersRebuilt = 0;
+        return true;
+    }
+
+    bool Write(const std::string &path) const
+    {
+        BakedFileWriter writer;
+        if (!writer.Create(path, bakedKind("PATH"), VERSION, key()))
+            return false;
+        int sizes[4] = { width, height, clustersX, clustersY };
+        writer.PutValue(sizes);
+        writer.PutValue(cheapest);
+        writer.Put(cost);
+        std::vector<int> counts;
+        std::vector<Transition> transitions;
+        flatten(verticalBorders, counts, transitions);
+        writer.Put(counts);
+        writer.Put(transitions);
+        flatten(horizontalBorders, counts, transitions);
+        writer.Put(counts);
+        writer.Put(transitions);
+        std::vector<int> cells, costCounts;
+        std::vector<uint32_t> costs;
+        counts.clear();
+        for (size_t i = 0; i < clusters.size(); i++)
+        {
+            counts.push_back((int)clusters[i].cells.size());
+            cells.insert(cells.end(), clusters[i].cells.begin(), clusters[i].cells.end());
+            costCounts.push_back((int)clusters[i].costs.size());
+            costs.insert(costs.end(), clusters[i].costs.begin(), clusters[i].costs.end());
+        }
+        writer.Put(counts);
+        writer.Put(cells);
+        writer.Put(costCounts);
+        writer.Put(costs);
+        writer.Put(nodeBase);
+        writer.Put(nodeCells);
+        writer.Put(nodeCluster);
+        writer.Put(edgeBase);
+        writer.Put(edges);
+        return writer.Finish();
+    }
+
+    int ClustersX() const { return clustersX; }
+    int ClustersY() const { return clustersY; }
+    size_t Nodes() const { return nodeCells.size(); }
+    size_t Edges() const { return edges.size(); }
+
+    size_t Bytes() const
+    {
+        size_t bytes = cost.size() + (nodeCells.size() * 2 + nodeBase.size() + edgeBase.size()) * sizeof(int) +
+                       edges.size() * sizeof(Edge);
+        for (size_t i = 0; i < clusters.size(); i++)
+            bytes += clusters[i].cells.size() * sizeof(int) + clusters[i].costs.size() * sizeof(uint32_t);
+        for (size_t i = 0; i < verticalBorders.size(); i++)
+            bytes += (verticalBorders[i].size() + horizontalBorders[i].size()) * sizeof(Transition);
+        return bytes;
+    }
+
+    // cost of sample (x, y), 16 for open flat ground with no material cost and 0 if it cannot be crossed
+    uint8_t Cost(int x, int y) const { return cost[(size_t)y * width + x]; }
+
+private:
+    // a pair of samples across a border, a in the cluster left of or above it
+    struct Transition {
+        int a, b;
+    };
+
+    // the nodes of a cluster, sorted, and the cost between every two of them within the cluster
+    struct Cluster {
+        std::vector<int> cells;
+        std::vector<uint32_t> costs;
+    };
+
+    struct Edge {
+        int to;
+        float cost;
+    };
+
+    struct Region {
+        int x0, y0, x1, y1;
+    };
+
+    static const int ENTRANCE_SPLIT = 6;        // entrances this long get transitions at both ends
+    static const int ENTRANCE_SPACING = 16;     // and in between, at most this far apart
+
+    // Searches within a region are Dijkstra or A* with integer costs, so the open list is a bucket queue (Dial):
+    // a ring of lists by priority, wider than the most a priority can grow in one move (2 * 510 * PATH_DIAGONAL
+    // with the estimate), and a bit per bucket to find the next one that is not empty. The region is kept with a
+    // border of one closed sample around it, so no move needs a bounds check.
+    struct LocalSearch {
+        Region region;
+        std::vector<uint8_t> costs;
+        std::vector<uint32_t> g, priority;
+        std::vector<int> parent, next, previous;
+        std::vector<uint32_t> reached, done, target;     // generation stamps
+        std::vector<int> heads;
+        std::vector<uint64_t> occupied;
+        uint32_t cursor;
+        size_t queued;
+        uint32_t generation;
+
+        LocalSearch() : heads(PATH_BUCKETS, -1), occupied(PATH_BUCKETS / 64, 0), cursor(0), queued(0), generation(0)
+        {
+            region.x0 = region.y0 = 0;
+            region.x1 = region.y1 = -1;
+        }
+
+        void Push(int index, uint32_t p)
+        {
+            uint32_t bucket = p & (PATH_BUCKETS - 1);
+            priority[index] = p;
+            next[index] = heads[bucket];
+            previous[index] = -1;
+            if (heads[bucket] >= 0)
+                previous[heads[bucket]] = index;
+            heads[bucket] = index;
+            occupied[bucket >> 6] |= (uint64_t)1 << (bucket & 63);
+            queued++;
+        }
+
+        void Remove(int index)
+        {
+            uint32_t bucket = priority[index] & (PATH_BUCKETS - 1);
+            if (previous[index] >= 0)
+                next[previous[index]] = next[index];
+            else
+                heads[bucket] = next[index];
+            if (next[index] >= 0)
+                previous[next[index]] = previous[index];
+            if (heads[bucket] < 0)
+                occupied[bucket >> 6] &= ~((uint64_t)1 << (bucket & 63));
+            queued--;
+        }
+
+        // the index of the lowest priority, taken off the queue; only while something is queued
+        int Pop()
+        {
+            uint32_t bucket = cursor & (PATH_BUCKETS - 1);
+            uint32_t word = bucket >> 6;
+            uint64_t bits = occupied[word] & (~(uint64_t)0 << (bucket & 63));
+            while (bits == 0)
+            {
+                word = (word + 1) & (PATH_BUCKETS / 64 - 1);
+                bits = occupied[word];
+            }
+            uint32_t found = (word << 6) + lowestBit(bits);
+            cursor += (found - bucket) & (PATH_BUCKETS - 1);
+            int index = heads[found];
+            Remove(index);
+            return index;
+        }
+
+        void Clear()
+        {
+            for (uint32_t word = 0; word < PATH_BUCKETS / 64 && queued > 0; word++)
+                for (; occupied[word] != 0; occupied[word] &= occupied[word] - 1)
+                {
+                    uint32_t bucket = (word << 6) + lowestBit(occupied[word]);
+                    for (int index = heads[bucket]; index >= 0; index = next[index])
+                        queued--;
+                    heads[bucket] = -1;
+                }
+            cursor = 0;
+        }
+
+        static uint32_t lowestBit(uint64_t bits)
+        {
+#if defined(__GNUC__)
+            return (uint32_t)__builtin_ctzll(bits);
+#else
+            uint32_t bit = 0;
+            for (; (bits & 1) == 0; bits >>= 1)
+                bit++;
+            return bit;
+#endif
+        }
+    };
+
+    const HeightField &field;
+    const uint8_t *blend;
+    int blendChannels;
+    PathCostSettings settings;
+    int clusterSize;
+    int width, height, clustersX, clustersY;
+    std::vector<uint8_t> cost;
+    uint32_t cheapest;                                          // lowest cost of an open sample, for the estimates
+    std::vector<std::vector<Transition> > verticalBorders;      // right of cluster i
+    std::vector<std::vector<Transition> > horizontalBorders;    // below cluster i
+    std::vector<Cluster> clusters;
+
+    // the abstract graph, nodes numbered cluster by cluster
+    std::vector<int> nodeBase, nodeCells, nodeCluster;
+    std::vector<int> edgeBase;
+    std::vector<Edge> edges;
+
+    TerrainPathfinder(const TerrainPathfinder &);
+    TerrainPathfinder &operator=(const TerrainPathfinder &);
+
+    template <typename F>
+    static void parallelFor(JobSystem *jobs, size_t begin, size_t end, size_t grain, const F &fn)
+    {
+        if (jobs)
+            jobs->ParallelFor(begin, end, grain, fn);
+        else
+            fn(begin, end);
+    }
+
+    // the abstract open list is a heap of the priority's bits over the node, non-negative floats order like their
+    // bits
+    static void pushOpen(std::vector<uint64_t> &open, float priority, int node)
+    {
+        uint32_t bits;
+        memcpy(&bits, &priority, sizeof(bits));
+        open.push_back((uint64_t)bits << 32 | (uint32_t)node);
+        std::push_heap(open.begin(), open.end(), std::greater<uint64_t>());
+    }
+
+    static int popOpen(std::vector<uint64_t> &open)
+    {
+        std::pop_heap(open.begin(), open.end(), std::greater<uint64_t>());
+        int node = (int)(uint32_t)open.back();
+        open.pop_back();
+        return node;
+    }
+
+    // what a build depends on: the heights, the blend map, the settings and the cluster size
+    uint64_t key() const
+    {
+        uint64_t hash = field.ContentHash();
+        if (blend)
+            hash = hashBytes(blend, (size_t)field.Width() * field.Height() * blendChannels, hash);
+        int sizes[2] = { blend ? blendChannels : 0, clusterSize };
+        hash = hashBytes((const unsigned char*)sizes, sizeof(sizes), hash);
+        return hashBytes((const unsigned char*)&settings, sizeof(settings), hash);
+    }
+
+    template <typename T>
+    static void flatten(const std::vector<std::vector<T> > &lists, std::vector<int> &counts, std::vector<T> &all)
+    {
+        counts.clear();
+        all.clear();
+        for (size_t i = 0; i < lists.size(); i++)
+        {
+            counts.push_back((int)lists[i].size());
+            all.insert(all.end(), lists[i].begin(), lists[i].end());
+        }
+    }
+
+    // false unless there are as many counts as lists and they add up to all of the elements
+    template <typename T>
+    static bool unflatten(const std::vector<int> &counts, const std::vector<T> &all, size_t lists,
+                          std::vector<std::vector<T> > &out)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+            total += counts[i] >= 0 ? (size_t)counts[i] : all.size() + 1;
+        if (counts.size() != lists || total != all.size())
+            return false;
+        out.assign(lists, std::vector<T>());
+        size_t first = 0;
+        for (size_t i = 0; i < lists; i++)
+        {
+            out[i].assign(all.begin() + first, all.begin() + first + counts[i]);
+            first += counts[i];
+        }
+        return true;
+    }
+
+    // costs are integers, the cost of a straight move over flat ground is 32 * PATH_STRAIGHT for one texel
+    float worldScale() const { return field.TexelSize() / (32.0f * PATH_STRAIGHT); }
+
+    // the costs of x0..x1, y0..y1, which are within the changed clusters, and everything that depends on them
+    void rebuild(int x0, int y0, int x1, int y1, const std::vector<int> &changed, JobSystem *jobs)
+    {
+        computeCosts(x0, y0, x1, y1, jobs);
+        // a cheaper sample lowers the estimates, a dearer one leaves them low enough
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+            {
+                uint8_t c = cost[(size_t)y * width + x];
+                if (c != 0 && c < cheapest)
+                    cheapest = c;
+            }
+
+        // the borders of the changed clusters, those above and left of one belong to its neighbours
+        std::vector<int> bordering(changed);
+        for (size_t i = 0; i < changed.size(); i++)
+        {
+            if (changed[i] % clustersX > 0)
+                bordering.push_back(changed[i] - 1);
+            if (changed[i] / clustersX > 0)
+                bordering.push_back(changed[i] - clustersX);
+        }
+        std::sort(bordering.begin(), bordering.end());
+        bordering.erase(std::unique(bordering.begin(), bordering.end()), bordering.end());
+        std::vector<std::vector<Transition> > vertical(bordering.size()), horizontal(bordering.size());
+        for (size_t i = 0; i < bordering.size(); i++)
+        {
+            vertical[i].swap(verticalBorders[bordering[i]]);
+            horizontal[i].swap(horizontalBorders[bordering[i]]);
+        }
+        parallelFor(jobs, 0, bordering.size(), 16, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                findTransitions(bordering[i]);
+        });
+
+        // the changed clusters and those on either side of a border whose transitions moved
+        std::vector<int> affected(changed);
+        for (size_t i = 0; i < bordering.size(); i++)
+        {
+            int cluster = bordering[i];
+            if (!sameTransitions(vertical[i], verticalBorders[cluster]))
+            {
+                affected.push_back(cluster);
+                affected.push_back(cluster + 1);
+            }
+            if (!sameTransitions(horizontal[i], horizontalBorders[cluster]))
+            {
+                affected.push_back(cluster);
+                affected.push_back(cluster + clustersX);
+            }
+        }
+        std::sort(affected.begin(), affected.end());
+        affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+        parallelFor(jobs, 0, affected.size(), 1, [&](size_t begin, size_t end)
+        {
+            LocalSearch local;
+            for (size_t i = begin; i < end; i++)
+                buildCluster(affected[i], local);
+        });
+        clustersRebuilt = (unsigned int)affected.size();
+        buildGraph();
+    }
+
+    static bool sameTransitions(const std::vector<Transition> &a, const std::vector<Transition> &b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++)
+            if (a[i].a != b[i].a || a[i].b != b[i].b)
+                return false;
+        return true;
+    }
+
+    float worldHeight(int x, int y) const
+    {
+        return field.HeightOffset() + field.Sample(x, y) * (field.HeightScale() / 65535.0f);
+    }
+
+    void computeCosts(int x0, int y0, int x1, int y1, JobSystem *jobs)
+    {
+        parallelFor(jobs, (size_t)y0, (size_t)y1 + 1, 16, [&](size_t begin, size_t end)
+        {
+            float invRun = 1.0f / (2.0f * field.TexelSize());
+            for (int y = (int)begin; y < (int)end; y++)
+                for (int x = x0; x <= x1; x++)
+                {
+                    float dx = (worldHeight(x + 1, y) - worldHeight(x - 1, y)) * invRun;
+                    float dz = (worldHeight(x, y + 1) - worldHeight(x, y - 1)) * invRun;
+                    float slope = std::sqrt(dx * dx + dz * dz);
+                    float factor = 1.0f + settings.slopeCost * slope / settings.maxSlope;
+                    bool closed = slope > settings.maxSlope;
+                    if (blend)
+                    {
+                        const uint8_t *texel = blend + ((size_t)y * width + x) * blendChannels;
+                        float water = 1.0f;
+                        for (int c = 0; c < std::min(blendChannels, 3); c++)
+                        {
+                            factor += settings.materialCost[c] * (texel[c] / 255.0f);
+                            water -= texel[c] / 255.0f;
+                        }
+                        water = std::max(water, 0.0f);
+                        factor += settings.materialCost[3] * water;
+                        closed = closed || water > settings.maxWater;
+                    }
+                    cost[(size_t)y * width + x] = closed ? 0 : (uint8_t)std::min(std::max(factor * 16.0f + 0.5f, 1.0f), 255.0f);
+                }
+        });
+    }
+
+    int cellAt(const glm::vec2 &position) const
+    {
+        float invTexel = 1.0f / field.TexelSize();
+        float x = std::floor(position.x * invTexel + width * 0.5f), y = std::floor(position.y * invTexel + height * 0.5f);
+        if (x < 0.0f || y < 0.0f || x >= (float)width || y >= (float)height)
+            return -1;
+        return (int)y * width + (int)x;
+    }
+
+    int clusterOf(int cell) const
+    {
+        return (cell / width) / clusterSize * clustersX + (cell % width) / clusterSize;
+    }
+
+    Region clusterRegion(int cluster) const
+    {
+        Region region;
+        region.x0 = cluster % clustersX * clusterSize;
+        region.y0 = cluster / clustersX * clusterSize;
+        region.x1 = std::min(region.x0 + clusterSize, width) - 1;
+        region.y1 = std::min(region.y0 + clusterSize, height) - 1;
+        return region;
+    }
+
+    // octile distance over the cheapest samples, never more than the cost of getting there
+    uint32_t estimate(int dx, int dy) const
+    {
+        dx = std::abs(dx);
+        dy = std::abs(dy);
+        uint32_t steps = (uint32_t)std::max(dx, dy) * PATH_STRAIGHT + (uint32_t)std::min(dx, dy) * (PATH_DIAGONAL - PATH_STRAIGHT);
+        return steps * 2 * cheapest;
+    }
+
+    float estimateCells(int from, int to) const
+    {
+        return (float)estimate(from % width - to % width, from / width - to / width);
+    }
+
+    // the transitions on the borders right of and below cluster
+    void findTransitions(int cluster)
+    {
+        Region region = clusterRegion(cluster);
+        verticalBorders[cluster].clear();
+        horizontalBorders[cluster].clear();
+        if (region.x1 + 1 < width)
+            findEntrances(region.x1, region.y0, 0, 1, region.y1 - region.y0 + 1, 1, verticalBorders[cluster]);
+        if (region.y1 + 1 < height)
+            findEntrances(region.x0, region.y1, 1, 0, region.x1 - region.x0 + 1, width, horizontalBorders[cluster]);
+    }
+
+    // length samples from (x, y) along (dx, dy), each paired with the one across further on
+    void findEntrances(int x, int y, int dx, int dy, int length, int across, std::vector<Transition> &out) const
+    {
+        int run = 0;
+        for (int i = 0; i <= length; i++)
+        {
+            int cell = (y + dy * i) * width + x + dx * i;
+            if (i < length && cost[cell] != 0 && cost[cell + across] != 0)
+            {
+                run++;
+                continue;
+            }
+            if (run > 0)
+            {
+                int first = i - run, count = run < ENTRANCE_SPLIT ? 1 : (run - 2) / ENTRANCE_SPACING + 2;
+                for (int k = 0; k < count; k++)
+                {
+                    int along = count == 1 ? first + (run - 1) / 2 : first + (run - 1) * k / (count - 1);
+                    int a = (y + dy * along) * width + x + dx * along;
+                    Transition transition = { a, a + across };
+                    out.push_back(transition);
+                }
+            }
+            run = 0;
+        }
+    }
+
+    void buildCluster(int index, LocalSearch &local)
+    {
+        Cluster &cluster = clusters[index];
+        const std::vector<Transition> &right = verticalBorders[index], &below = horizontalBorders[index];
+        cluster.cells.clear();
+        for (size_t i = 0; i < right.size(); i++)
+            cluster.cells.push_back(right[i].a);
+        for (size_t i = 0; i < below.size(); i++)
+            cluster.cells.push_back(below[i].a);
+        if (index % clustersX > 0)
+            for (size_t i = 0; i < verticalBorders[index - 1].size(); i++)
+                cluster.cells.push_back(verticalBorders[index - 1][i].b);
+        if (index / clustersX > 0)
+            for (size_t i = 0; i < horizontalBorders[index - clustersX].size(); i++)
+                cluster.cells.push_back(horizontalBorders[index - clustersX][i].b);
+        std::sort(cluster.cells.begin(), cluster.cells.end());
+        cluster.cells.erase(std::unique(cluster.cells.begin(), cluster.cells.end()), cluster.cells.end());
+
+        // costs are symmetric, so every node is searched from towards the ones after it only
+        size_t n = cluster.cells.size();
+        cluster.costs.assign(n * n, PATH_UNREACHED);
+        Region region = clusterRegion(index);
+        for (size_t k = 0; k < n; k++)
+        {
+            cluster.costs[k * n + k] = 0;
+            if (k + 1 == n)
+                break;
+            searchRegion(region, cluster.cells[k], -1, local, &cluster.cells[k + 1], n - k - 1);
+            for (size_t m = k + 1; m < n; m++)
+                cluster.costs[k * n + m] = cluster.costs[m * n + k] = reachedCost(local, cluster.cells[m]);
+        }
+    }
+
+    void buildGraph()
+    {
+        nodeBase.assign(clusters.size() + 1, 0);
+        for (size_t i = 0; i < clusters.size(); i++)
+            nodeBase[i + 1] = nodeBase[i] + (int)clusters[i].cells.size();
+        int nodes = nodeBase.back();
+        nodeCells.resize(nodes);
+        nodeCluster.resize(nodes);
+        for (size_t i = 0; i < clusters.size(); i++)
+            for (size_t k = 0; k < clusters[i].cells.size(); k++)
+            {
+                nodeCells[nodeBase[i] + k] = clusters[i].cells[k];
+                nodeCluster[nodeBase[i] + k] = (int)i;
+            }
+
+        std::vector<std::vector<Edge> > adjacent(nodes);
+        for (size_t i = 0; i < clusters.size(); i++)
+        {
+            const Cluster &cluster = clusters[i];
+            size_t n = cluster.cells.size();
+            for (size_t k = 0; k < n; k++)
+                for (size_t m = 0; m < n; m++)
+                    if (m != k && cluster.costs[k * n + m] != PATH_UNREACHED)
+                    {
+                        Edge edge = { nodeBase[i] + (int)m, (float)cluster.costs[k * n + m] };
+                        adjacent[nodeBase[i] + k].push_back(edge);
+                    }
+            addCrossings(verticalBorders[i], (int)i, (int)i + 1, adjacent);
+            addCrossings(horizontalBorders[i], (int)i, (int)i + clustersX, adjacent);
+        }
+        edgeBase.assign(nodes + 1, 0);
+        edges.clear();
+        for (int node = 0; node < nodes; node++)
+        {
+            edges.insert(edges.end(), adjacent[node].begin(), adjacent[node].end());
+            edgeBase[node + 1] = (int)edges.size();
+        }
+    }
+
+    void addCrossings(const std::vector<Transition> &border, int first, int second,
+                      std::vector<std::vector<Edge> > &adjacent) const
+    {
+        for (size_t i = 0; i < border.size(); i++)
+        {
+            int a = nodeOf(first, border[i].a), b = nodeOf(second, border[i].b);
+            float step = (float)((cost[border[i].a] + cost[border[i].b]) * PATH_STRAIGHT);
+            Edge ab = { b, step }, ba = { a, step };
+            adjacent[a].push_back(ab);
+            adjacent[b].push_back(ba);
+        }
+    }
+
+    int nodeOf(int cluster, int cell) const
+    {
+        const std::vector<int> &cells = clusters[cluster].cells;
+        return nodeBase[cluster] + (int)(std::lower_bound(cells.begin(), cells.end(), cell) - cells.begin());
+    }
+
+    // costs from cell to every node of cluster, within the cluster
+    void linkToNodes(int cluster, int cell, LocalSearch &local, std::vector<uint32_t> &costs) const
+    {
+        const std::vector<int> &cells = clusters[cluster].cells;
+        costs.resize(cells.size());
+        if (cells.empty())
+            return;
+        searchRegion(clusterRegion(cluster), cell, -1, local, &cells[0], cells.size());
+        for (size_t k = 0; k < cells.size(); k++)
+            costs[k] = reachedCost(local, cells[k]);
+    }
+
+    uint32_t reachedCost(const LocalSearch &local, int cell) const
+    {
+        int index = localIndex(local.region, cell);
+        return local.done[index] == local.generation ? local.g[index] : PATH_UNREACHED;
+    }
+
+    int localIndex(const Region &region, int cell) const
+    {
+        return (cell / width - region.y0 + 1) * (region.x1 - region.x0 + 3) + cell % width - region.x0 + 1;
+    }
+
+    // A* from start to goal inside region, or without a goal Dijkstra until every one of targets is settled; the
+    // cost to goal
+    uint32_t searchRegion(const Region &region, int start, int goal, LocalSearch &local, const int *targets = nullptr,
+                          size_t targetCount = 0) const
+    {
+        int stride = region.x1 - region.x0 + 3;
+        size_t size = (size_t)stride * (region.y1 - region.y0 + 3);
+        if (local.g.size() < size)
+        {
+            local.g.resize(size);
+            local.priority.resize(size);
+            local.parent.resize(size);
+            local.next.resize(size);
+            local.previous.resize(size);
+            local.reached.assign(size, 0);
+            local.done.assign(size, 0);
+            local.target.assign(size, 0);
+            local.generation = 0;
+        }
+        if (local.region.x0 != region.x0 || local.region.y0 != region.y0 || local.region.x1 != region.x1 ||
+            local.region.y1 != region.y1)
+        {
+            local.costs.assign(size, 0);
+            for (int y = region.y0; y <= region.y1; y++)
+                std::copy(&cost[(size_t)y * width + region.x0], &cost[(size_t)y * width + region.x1] + 1,
+                          &local.costs[(size_t)(y - region.y0 + 1) * stride + 1]);
+            local.region = region;
+        }
+        if (++local.generation == 0)
+        {
+            std::fill(local.reached.begin(), local.reached.end(), 0);
+            std::fill(local.done.begin(), local.done.end(), 0);
+            std::fill(local.target.begin(), local.target.end(), 0);
+            local.generation = 1;
+        }
+        local.Clear();
+        const uint32_t generation = local.generation;
+        size_t remaining = targetCount;
+        for (size_t i = 0; i < targetCount; i++)
+            local.target[localIndex(region, targets[i])] = generation;
+
+        const int offsets[8] = { 1, -1, stride, -stride, stride + 1, -stride + 1, stride - 1, -stride - 1 };
+        const int besideX[8] = { 0, 0, 0, 0, 1, 1, -1, -1 };
+        const int besideY[8] = { 0, 0, 0, 0, stride, -stride, stride, -stride };
+        const uint8_t *costs = &local.costs[0];
+        int goalIndex = goal >= 0 ? localIndex(region, goal) : -1;
+        int goalX = goalIndex % stride, goalY = goalIndex / stride;
+        int first = localIndex(region, start);
+        local.g[first] = 0;
+        local.parent[first] = -1;
+        local.reached[first] = generation;
+        local.cursor = goalIndex >= 0 ? estimate(first % stride - goalX, first / stride - goalY) : 0;
+        local.Push(first, local.cursor);
+        while (local.queued > 0)
+        {
+            int index = local.Pop();
+            local.done[index] = generation;
+            if (index == goalIndex)
+                return local.g[index];
+            if (local.target[index] == generation && --remaining == 0)
+                break;
+            for (int d = 0; d < 8; d++)
+            {
+                int next = index + offsets[d];
+                if (costs[next] == 0 || local.done[next] == generation)
+                    continue;
+                // no cutting corners, both samples beside a diagonal move are open
+                if (d >= 4 && (costs[index + besideX[d]] == 0 || costs[index + besideY[d]] == 0))
+                    continue;
+                uint32_t step = (uint32_t)(costs[index] + costs[next]) * (d >= 4 ? PATH_DIAGONAL : PATH_STRAIGHT);
+                uint32_t total = local.g[index] + step;
+                bool queued = local.reached[next] == generation;
+                if (queued && total >= local.g[next])
+                    continue;
+                if (queued)
+                    local.Remove(next);
+                local.g[next] = total;
+                local.parent[next] = index;
+                local.reached[next] = generation;
+                uint32_t p = total;
+                if (goalIndex >= 0)
+                    p += estimate(next % stride - goalX, next / stride - goalY);
+                local.Push(next, p);
+            }
+        }
+        return PATH_UNREACHED;
+    }
+
+    // the cells of the last search from its start to cell
+    void trace(const LocalSearch &local, int cell, std::vector<int> &out) const
+    {
+        const Region &region = local.region;
+        int stride = region.x1 - region.x0 + 3;
+        out.clear();
+        for (int index = localIndex(region, cell); index >= 0; index = local.parent[index])
+            out.push_back((region.y0 + index / stride - 1) * width + region.x0 + index % stride - 1);
+        std::reverse(out.begin(), out.end());
+    }
+};
+#endif
@@ -0,0 +1,557 @@
+
+
+#ifndef TERRAIN_SCULPT_H
+#define TERRAIN_SCULPT_H
+
+#include <glm/glm.hpp>
+
+#include <baked_file.h>
+#include <height_field.h>
+#include <job_system.h>
+#include <mapped_file.h>
+#include <terrain_dataset.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+enum SculptMode {
+    SCULPT_RAISE,
+    SCULPT_LOWER,
+    SCULPT_SMOOTH,      // towards the average of the 3x3 samples around
+    SCULPT_FLATTEN      // towards target
+};
+
+struct SculptBrush {
+    SculptMode mode;
+    float radius;       // world units
+    float strength;     // world units per second raising or lowering, the part of the way per second otherwise
+    float hardness;     // the part of the radius at full strength, the rest falls off smoothly
+    float target;       // world height flatten pulls towards
+
+    SculptBrush() : mode(SCULPT_RAISE), radius(24.0f), strength(8.0f), hardness(0.5f), target(0.0f)
+    {
+    }
+};
+
+// samples [x0, x1) x [y0, y1) of level 0, or texels of another level
+struct TerrainRect {
+    int x0, y0, x1, y1;
+
+    TerrainRect() : x0(0), y0(0), x1(0), y1(0)
+    {
+    }
+
+    TerrainRect(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1)
+    {
+    }
+
+    bool Empty() const { return x1 <= x0 || y1 <= y0; }
+
+    void Add(const TerrainRect &other)
+    {
+        if (other.Empty())
+            return;
+        if (Empty())
+        {
+            *this = other;
+            return;
+        }
+        x0 = std::min(x0, other.x0);
+        y0 = std::min(y0, other.y0);
+        x1 = std::max(x1, other.x1);
+        y1 = std::max(y1, other.y1);
+    }
+};
+
+// Live editing of the terrain heights: brushes change the samples of a HeightField, and everything else is
+// brought up to date from the rectangle a dab changed, so the cost of a dab depends on the brush and not on the
+// size of the map.
+//
+// Besides the field itself the sculptor keeps the dataset's coarser levels in memory, filtered from the field the
+// way the dataset's tiles were (downsampleTerrainRow()), and the bounds of every tile. A dab refilters the texels
+// of the coarser levels above the samples it changed and widens the bounds of the tiles around them. After a
+// stroke ExactBounds() recomputes the bounds of the tiles it touched, which only reads the heights and can run on
+// a worker while nothing is sculpted, and SetBounds() puts them in. Read() returns the heights of any level the way
+// the dataset's tiles hold them, TerrainStreamer uses it for the tiles TileEdited() reports and TerrainClipmap can
+// read from it directly. The other derived data is updated from the rectangles Dab() and EndStroke() return:
+// HeightRayCaster::Update() and TerrainNormalBaker::Refresh() after every dab, the pathfinder and the viewshed
+// along with ExactBounds() after a stroke.
+//
+// Edits are saved as delta tiles: the level 0 tiles whose samples changed, in a baked file (see baked_file.h)
+// keyed by the content hash of the heights they were made on, so they are only applied to those.
+class TerrainSculptor
+{
+public:
+    static const uint32_t VERSION = 1;  // of the edits file
+
+    // statistics
+    double dabMs;               // the last Dab()
+    double strokeMs;            // the dabs of the current or last stroke
+    unsigned int strokeDabs;
+
+    // the exact bounds of a level 0 tile, see ExactBounds()
+    struct TileRange {
+        int tx, ty;
+        float low, high;
+    };
+
+    // field holds level 0 of layer of dataset, the heights the sculptor edits
+    TerrainSculptor(HeightField &field, const TerrainDataset &dataset, int layer, JobSystem *jobs = nullptr)
+        : dabMs(0.0), strokeMs(0.0), strokeDabs(0), field(field), dataset(dataset), layer(layer), baseHash(0)
+    {
+        const TerrainFileHeader &header = dataset.Header();
+        if (field.Empty() || !dataset.IsOpen() || (uint32_t)field.Width() != header.width ||
+            (uint32_t)field.Height() != header.height)
+            return;
+        baseHash = field.ContentHash();
+        pyramid.resize(dataset.Levels());
+        for (int l = 0; l < dataset.Levels(); l++)
+        {
+            pyramid[l].width = (int)dataset.Level(l).width;
+            pyramid[l].height = (int)dataset.Level(l).height;
+        }
+        for (int l = 1; l < dataset.Levels(); l++)
+        {
+            Level &level = pyramid[l];
+            level.samples.resize((size_t)level.width * level.height);
+            parallelFor(jobs, 0, (size_t)level.height, 16, [&](size_t begin, size_t end)
+            {
+                filter(l, 0, (int)begin, level.width, (int)end);
+            });
+        }
+
+        bounds.resize((size_t)header.tileCount * 2);
+        for (int l = 0; l < dataset.Levels(); l++)
+            for (uint32_t ty = 0; ty < dataset.Level(l).tilesY; ty++)
+                for (uint32_t tx = 0; tx < dataset.Level(l).tilesX; tx++)
+                {
+                    uint64_t tile = dataset.TileIndex(l, (int)tx, (int)ty);
+                    dataset.TileBounds(l, (int)tx, (int)ty, bounds[tile * 2], bounds[tile * 2 + 1]);
+                }
+        edited.assign((size_t)header.tileCount, false);
+        changed.assign((size_t)dataset.Level(0).tilesX * dataset.Level(0).tilesY, false);
+    }
+
+    // false if the field is not the dataset's level 0, nothing can be edited then
+    bool Ready() const { return !pyramid.empty(); }
+    int Layer() const { return layer; }
+    int Levels() const { return (int)pyramid.size(); }
+    int LevelWidth(int level) const { return pyramid[level].width; }
+    int LevelHeight(int level) const { return pyramid[level].height; }
+
+    // the coarser levels, the field itself is not counted
+    size_t Bytes() const
+    {
+        size_t bytes = bounds.size() * sizeof(float);
+        for (size_t l = 0; l < pyramid.size(); l++)
+            bytes += pyramid[l].samples.size() * sizeof(uint16_t);
+        return bytes;
+    }
+
+    // level 0 tiles with changed samples, what Save() writes
+    size_t EditedTiles() const
+    {
+        return (size_t)std::count(changed.begin(), changed.end(), true);
+    }
+
+    // One dab of brush at world position centre (x, z), the brush's strength applied for seconds. Returns the
+    // samples it may have changed.
+    TerrainRect Dab(const SculptBrush &brush, const glm::vec2 &centre, float seconds)
+    {
+        Clock::time_point start = Clock::now();
+        TerrainRect rect;
+        if (!Ready() || brush.radius <= 0.0f || seconds <= 0.0f)
+            return rect;
+        // continuous sample coordinates, sample centres on whole numbers like HeightField::HeightAt()
+        float texel = field.TexelSize();
+        float cx = centre.x / texel + field.Width() * 0.5f - 0.5f, cy = centre.y / texel + field.Height() * 0.5f - 0.5f;
+        float radius = brush.radius / texel;
+        rect.x0 = std::max((int)std::floor(cx - radius), 0);
+        rect.y0 = std::max((int)std::floor(cy - radius), 0);
+        rect.x1 = std::min((int)std::floor(cx + radius) + 1, field.Width());
+        rect.y1 = std::min((int)std::floor(cy + radius) + 1, field.Height());
+        if (rect.Empty())
+            return TerrainRect();
+
+        // the samples before the dab with one more all around for smoothing, clamped to the field
+        int w = rect.x1 - rect.x0, h = rect.y1 - rect.y0;
+        int stride = w + 2;
+        before.resize((size_t)stride * (h + 2));
+        for (int y = -1; y <= h; y++)
+            for (int x = -1; x <= w; x++)
+                before[(size_t)(y + 1) * stride + x + 1] = field.Sample(rect.x0 + x, rect.y0 + y);
+
+        float sampleScale = field.HeightScale() / 65535.0f;
+        float rise = (brush.mode == SCULPT_LOWER ? -1.0f : 1.0f) * brush.strength * seconds / sampleScale;
+        float rate = std::min(brush.strength * seconds, 1.0f);
+        float target = (brush.target - field.HeightOffset()) / sampleScale;
+        float hard = std::min(std::max(brush.hardness, 0.0f), 0.999f);
+        float invRadius = 1.0f / std::max(radius, 0.5f);
+        uint16_t low = 0xFFFF, high = 0;
+        after.resize((size_t)w * h);
+        for (int y = 0; y < h; y++)
+        {
+            const float *above = &before[(size_t)y * stride + 1], *on = above + stride, *below = on + stride;
+            float dy = (rect.y0 + y - cy) * invRadius;
+            for (int x = 0; x < w; x++)
+            {
+                float dx = (rect.x0 + x - cx) * invRadius;
+                float d = std::sqrt(dx * dx + dy * dy);
+                float v = on[x];
+                if (d < 1.0f)
+                {
+                    // 1 inside the hard core, a smoothstep down to 0 at the radius
+                    float t = std::min(std::max((d - hard) / (1.0f - hard), 0.0f), 1.0f);
+                    float weight = 1.0f - t * t * (3.0f - 2.0f * t);
+                    switch (brush.mode)
+                    {
+                    case SCULPT_RAISE:
+                    case SCULPT_LOWER:
+                        v += rise * weight;
+                        break;
+                    case SCULPT_SMOOTH:
+                    {
+                        float average = (above[x - 1] + above[x] + above[x + 1] + on[x - 1] + on[x] + on[x + 1] +
+                                         below[x - 1] + below[x] + below[x + 1]) * (1.0f / 9.0f);
+                        v += (average - v) * rate * weight;
+                        break;
+                    }
+                    case SCULPT_FLATTEN:
+                        v += (target - v) * rate * weight;
+                        break;
+                    }
+                }
+                uint16_t sample = (uint16_t)std::min(std::max(v + 0.5f, 0.0f), 65535.0f);
+                after[(size_t)y * w + x] = sample;
+                low = std::min(low, sample);
+                high = std::max(high, sample);
+            }
+        }
+        field.Write(rect.x0, rect.y0, rect.x1, rect.y1, &after[0]);
+        refilter(rect);
+        widenBounds(rect, low, high);
+        stroke.Add(rect);
+        strokeDabs++;
+        dabMs = millisecondsSince(start);
+        strokeMs += dabMs;
+        return rect;
+    }
+
+    // The stroke is over. Returns the samples it may have changed, for what is too slow to update after every
+    // dab; the bounds of the tiles over them stay wider than needed until SetBounds(ExactBounds()) of it.
+    TerrainRect EndStroke()
+    {
+        TerrainRect rect = stroke;
+        stroke = TerrainRect();
+        strokeMs = 0.0;
+        strokeDabs = 0;
+        return rect;
+    }
+
+    // Exact bounds of the level 0 tiles over samples rect, over all their texels as the dataset's writer takes
+    // them. Only reads the heights, so it may run on a worker as long as no dab changes them meanwhile.
+    std::vector<TileRange> ExactBounds(const TerrainRect &rect) const
+    {
+        std::vector<TileRange> tiles;
+        if (!Ready() || rect.Empty())
+            return tiles;
+        const TerrainFileHeader &header = dataset.Header();
+        int size = (int)header.tileSize, border = (int)header.border, dim = (int)header.TileDim();
+        int tx0, ty0, tx1, ty1;
+        tilesOver(0, rect, tx0, ty0, tx1, ty1);
+        std::vector<uint16_t> texels((size_t)dim * dim);
+        for (int ty = ty0; ty < ty1; ty++)
+            for (int tx = tx0; tx < tx1; tx++)
+            {
+                Read(0, tx * size - border, ty * size - border, dim, dim, &texels[0]);
+                TileRange tile;
+                tile.tx = tx;
+                tile.ty = ty;
+                tile.low = dataset.HeightOf(*std::min_element(texels.begin(), texels.end()));
+                tile.high = dataset.HeightOf(*std::max_element(texels.begin(), texels.end()));
+                tiles.push_back(tile);
+            }
+        return tiles;
+    }
+
+    // puts in the bounds of level 0 tiles from ExactBounds() and those of the tiles above them from their children
+    void SetBounds(const std::vector<TileRange> &tiles)
+    {
+        if (tiles.empty())
+            return;
+        int tx0 = tiles[0].tx, ty0 = tiles[0].ty, tx1 = tx0 + 1, ty1 = ty0 + 1;
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            uint64_t tile = dataset.TileIndex(0, tiles[i].tx, tiles[i].ty);
+            bounds[tile * 2] = tiles[i].low;
+            bounds[tile * 2 + 1] = tiles[i].high;
+            tx0 = std::min(tx0, tiles[i].tx);
+            ty0 = std::min(ty0, tiles[i].ty);
+            tx1 = std::max(tx1, tiles[i].tx + 1);
+            ty1 = std::max(ty1, tiles[i].ty + 1);
+        }
+        for (int l = 1; l < (int)pyramid.size(); l++)
+        {
+            tx0 >>= 1;
+            ty0 >>= 1;
+            tx1 = ((tx1 - 1) >> 1) + 1;
+            ty1 = ((ty1 - 1) >> 1) + 1;
+            for (int ty = ty0; ty < ty1; ty++)
+                for (int tx = tx0; tx < tx1; tx++)
+                {
+                    float low = 1e30f, high = -1e30f;
+                    for (int y = ty * 2; y < ty * 2 + 2; y++)
+                        for (int x = tx * 2; x < tx * 2 + 2; x++)
+                            if (dataset.HasTile(l - 1, x, y))
+                            {
+                                uint64_t child = dataset.TileIndex(l - 1, x, y);
+                                low = std::min(low, bounds[child * 2]);
+                                high = std::max(high, bounds[child * 2 + 1]);
+                            }
+                    uint64_t tile = dataset.TileIndex(l, tx, ty);
+                    bounds[tile * 2] = low;
+                    bounds[tile * 2 + 1] = high;
+                }
+        }
+    }
+
+    // the texels of level whose heights depend on rect of level 0, reaching margin texels past the edges of the
+    // level where rect touches them, as the borders of the tiles there repeat the edge
+    TerrainRect LevelRect(int level, const TerrainRect &rect, int margin = 0) const
+    {
+        TerrainRect texels = rect;
+        for (int l = 1; l <= level; l++)
+        {
+            texels.x0 >>= 1;
+            texels.y0 >>= 1;
+            texels.x1 = ((texels.x1 - 1) >> 1) + 1;
+            texels.y1 = ((texels.y1 - 1) >> 1) + 1;
+        }
+        const Level &target = pyramid[level];
+        if (texels.x0 <= 0)
+            texels.x0 = -margin;
+        if (texels.y0 <= 0)
+            texels.y0 = -margin;
+        if (texels.x1 >= target.width)
+            texels.x1 = target.width + margin;
+        if (texels.y1 >= target.height)
+            texels.y1 = target.height + margin;
+        return texels;
+    }
+
+    // the heights of the w x h texels of level at (x, y), clamped to the level like the borders of the dataset's
+    // tiles. Levels coarser than the dataset sample its top level, as ClipmapTileHeights does, so this is also a
+    // TerrainClipmap::HeightFn.
+    bool Read(int level, int x, int y, int w, int h, uint16_t *out) const
+    {
+        if (!Ready())
+            return false;
+        int top = (int)pyramid.size() - 1;
+        int source = std::min(level, top);
+        int64_t scale = (int64_t)1 << std::min(level - source, 30);
+        const Level &from = pyramid[source];
+        for (int row = 0; row < h; row++)
+        {
+            int sy = (int)std::min(std::max((int64_t)(y + row) * scale, (int64_t)0), (int64_t)from.height - 1);
+            for (int column = 0; column < w; column++)
+            {
+                int sx = (int)std::min(std::max((int64_t)(x + column) * scale, (int64_t)0), (int64_t)from.width - 1);
+                *out++ = source == 0 ? field.Sample(sx, sy) : from.At(sx, sy);
+            }
+        }
+        return true;
+    }
+
+    // bounds of a tile with the edits, in world units, like TerrainDataset::TileBounds()
+    bool TileBounds(int level, int tx, int ty, float &low, float &high) const
+    {
+        if (!Ready() || !dataset.HasTile(level, tx, ty))
+            return false;
+        uint64_t tile = dataset.TileIndex(level, tx, ty);
+        low = bounds[tile * 2];
+        high = bounds[tile * 2 + 1];
+        return true;
+    }
+
+    // whether the heights of a tile, borders included, may differ from the dataset's
+    bool TileEdited(int level, int tx, int ty) const
+    {
+        return Ready() && dataset.HasTile(level, tx, ty) && edited[dataset.TileIndex(level, tx, ty)];
+    }
+
+    // writes the edited level 0 tiles without their borders, false if nothing could be written
+    bool Save(const std::string &path) const
+    {
+        if (!Ready())
+            return false;
+        const TerrainFileHeader &header = dataset.Header();
+        int size = (int)header.tileSize, tilesX = (int)dataset.Level(0).tilesX;
+        std::vector<int32_t> tiles;
+        std::vector<uint16_t> samples;
+        for (size_t i = 0; i < changed.size(); i++)
+            if (changed[i])
+            {
+                int tx = (int)i % tilesX, ty = (int)i / tilesX;
+                tiles.push_back(tx);
+                tiles.push_back(ty);
+                samples.resize(samples.size() + (size_t)size * size);
+                Read(0, tx * size, ty * size, size, size, &samples[samples.size() - (size_t)size * size]);
+            }
+        if (path.find_last_of("/\\") != std::string::npos)
+            makeDirectory(path.substr(0, path.find_last_of("/\\")));
+        BakedFileWriter writer;
+        if (!writer.Create(path, bakedKind("EDIT"), VERSION, baseHash))
+            return false;
+        writer.PutValue((uint32_t)size);
+        writer.Put(tiles);
+        writer.Put(samples);
+        return writer.Finish();
+    }
+
+    // applies the edits saved for these heights. Returns the samples they changed, empty if there were none.
+    TerrainRect Load(const std::string &path)
+    {
+        TerrainRect rect;
+        BakedFileReader reader;
+        uint32_t size = 0;
+        std::vector<int32_t> tiles;
+        std::vector<uint16_t> samples;
+        if (!Ready() || !reader.Open(path, bakedKind("EDIT"), VERSION, baseHash) || !reader.GetValue(size) ||
+            size != dataset.Header().tileSize || !reader.Get(tiles) || !reader.Get(samples) || tiles.size() % 2 != 0 ||
+            samples.size() != tiles.size() / 2 * size * size)
+            return rect;
+        for (size_t i = 0; i < tiles.size(); i += 2)
+        {
+            if (!dataset.HasTile(0, tiles[i], tiles[i + 1]))
+                continue;
+            TerrainRect tile(tiles[i] * (int)size, tiles[i + 1] * (int)size, (tiles[i] + 1) * (int)size,
+                             (tiles[i + 1] + 1) * (int)size);
+            const uint16_t *heights = &samples[i / 2 * size * size];
+            field.Write(tile.x0, tile.y0, tile.x1, tile.y1, heights);
+            tile.x1 = std::min(tile.x1, field.Width());
+            tile.y1 = std::min(tile.y1, field.Height());
+            refilter(tile);
+            widenBounds(tile, *std::min_element(heights, heights + size * size),
+                        *std::max_element(heights, heights + size * size));
+            SetBounds(ExactBounds(tile));
+            rect.Add(tile);
+        }
+        return rect;
+    }
+
+private:
+    typedef std::chrono::high_resolution_clock Clock;
+
+    struct Level {
+        int width, height;
+        std::vector<uint16_t> samples;  // none on level 0, that is the field
+
+        Level() : width(0), height(0)
+        {
+        }
+
+        uint16_t At(int x, int y) const { return samples[(size_t)y * width + x]; }
+    };
+
+    HeightField &field;
+    const TerrainDataset &dataset;
+    int layer;
+    uint64_t baseHash;              // of the heights before any edits, the key of the edits file
+    std::vector<Level> pyramid;
+    std::vector<float> bounds;      // low and high per dataset tile, in world units
+    std::vector<bool> edited;       // per dataset tile
+    std::vector<bool> changed;      // per level 0 tile, samples inside it changed
+    TerrainRect stroke;
+    std::vector<float> before;
+    std::vector<uint16_t> after;
+
+    TerrainSculptor(const TerrainSculptor &);
+    TerrainSculptor &operator=(const TerrainSculptor &);
+
+    static double millisecondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    template <typename F>
+    static void parallelFor(JobSystem *jobs, size_t begin, size_t end, size_t grain, const F &fn)
+    {
+        if (jobs)
+            jobs->ParallelFor(begin, end, grain, fn);
+        else
+            fn(begin, end);
+    }
+
+    uint16_t sample(int level, int x, int y) const
+    {
+        return level == 0 ? field.Sample(x, y) : pyramid[level].At(x, y);
+    }
+
+    // texels [x0, x1) x [y0, y1) of level from the level below, the 2x2 box of downsampleTerrainRow()
+    void filter(int level, int x0, int y0, int x1, int y1)
+    {
+        const Level &finer = pyramid[level - 1];
+        Level &target = pyramid[level];
+        for (int y = y0; y < y1; y++)
+        {
+            int r0 = std::min(y * 2, finer.height - 1), r1 = std::min(y * 2 + 1, finer.height - 1);
+            for (int x = x0; x < x1; x++)
+            {
+                int c0 = x * 2, c1 = std::min(x * 2 + 1, finer.width - 1);
+                target.samples[(size_t)y * target.width + x] =
+                    (uint16_t)(((uint32_t)sample(level - 1, c0, r0) + sample(level - 1, c1, r0) +
+                                sample(level - 1, c0, r1) + sample(level - 1, c1, r1) + 2) >> 2);
+            }
+        }
+    }
+
+    // the coarser levels above samples rect of level 0 again
+    void refilter(const TerrainRect &rect)
+    {
+        for (int l = 1; l < (int)pyramid.size(); l++)
+        {
+            TerrainRect texels = LevelRect(l, rect);
+            filter(l, texels.x0, texels.y0, texels.x1, texels.y1);
+        }
+    }
+
+    // the tiles of level whose texels, borders included, overlap texels
+    void tilesOver(int level, const TerrainRect &texels, int &tx0, int &ty0, int &tx1, int &ty1) const
+    {
+        const TerrainFileHeader &header = dataset.Header();
+        int size = (int)header.tileSize, border = (int)header.border;
+        tx0 = std::max(texels.x0 - border, 0) / size;
+        ty0 = std::max(texels.y0 - border, 0) / size;
+        tx1 = std::min((texels.x1 - 1 + border) / size + 1, (int)dataset.Level(level).tilesX);
+        ty1 = std::min((texels.y1 - 1 + border) / size + 1, (int)dataset.Level(level).tilesY);
+    }
+
+    // The tiles over samples rect of level 0 on every level are marked edited and their bounds widened to take
+    // samples between low and high, which holds for the averages above them too.
+    void widenBounds(const TerrainRect &rect, uint16_t low, uint16_t high)
+    {
+        float lowest = dataset.HeightOf(low), highest = dataset.HeightOf(high);
+        int tilesX = (int)dataset.Level(0).tilesX, size = (int)dataset.Header().tileSize;
+        for (int ty = rect.y0 / size; ty <= (rect.y1 - 1) / size; ty++)
+            for (int tx = rect.x0 / size; tx <= (rect.x1 - 1) / size; tx++)
+                changed[(size_t)ty * tilesX + tx] = true;
+        for (int l = 0; l < (int)pyramid.size(); l++)
+        {
+            int tx0, ty0, tx1, ty1;
+            tilesOver(l, LevelRect(l, rect), tx0, ty0, tx1, ty1);
+            for (int ty = ty0; ty < ty1; ty++)
+                for (int tx = tx0; tx < tx1; tx++)
+                {
+                    uint64_t tile = dataset.TileIndex(l, tx, ty);
+                    edited[tile] = true;
+                    bounds[tile * 2] = std::min(bounds[tile * 2], lowest);
+                    bounds[tile * 2 + 1] = std::max(bounds[tile * 2 + 1], highest);
+                }
+        }
+    }
+};
+#endif
@@ -0,0 +1,680 @@
+
+
+#ifndef TERRAIN_STREAMER_H
+#define TERRAIN_STREAMER_H
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <frame_prep.h>
+#include <terrain_dataset.h>
+#include <terrain_sculpt.h>
+#include <texture_upload.h>
+#include <tile_fetch.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// What the camera sees this frame, for TerrainStreamer::Update()
+struct TerrainView {
+    glm::vec3 position;
+    glm::vec3 front;
+    glm::vec3 velocity;          // world units per second
+    glm::mat4 viewProjection;
+    float pixelScale;            // pixels covered by one world unit one unit away, height / (2 tan(fovy / 2))
+};
+
+// Keeps the tiles of a terrain dataset the camera needs in a fixed size GPU cache and streams the rest in.
+//
+// Every layer gets a texture array atlas of tileDim x tileDim slices, one per cache slot. The indirection
+// texture has one RG16UI texel per level 0 tile, the slot and level of the finest resident tile covering it,
+// the shaders sample through it (terrainAtlasCoord() in tessellation_eval.shader). The single tile of the
+// coarsest level is loaded up front and never evicted, so wherever a tile is missing a coarser one is drawn.
+//
+// Update() selects the wanted tiles from a quadtree walk: a tile is refined while one of its texels covers
+// more than detail pixels, and tiles outside the frustum are skipped. The camera position a few tenths of a
+// second ahead (from its velocity) is walked too, and the surroundings in coarse detail weighted towards
+// Front, both at a lower priority. Missing tiles are requested by projected size once their parent is
+// resident, so detail arrives coarse to fine. Tiles are fetched through a TileFetcher, from the dataset file
+// on disk or from a tile server, one record of all layers each; its I/O threads copy them into the upload
+// ring, and the GL thread only uploads finished tiles into the least recently wanted slots, a few per frame,
+// and never waits for the disk or the network. The in-flight limit is what lets the fetcher batch tiles.
+//
+// With a TerrainSculptor the heights are the edited ones: the bounds of the tiles are the sculptor's, the height
+// layer of an edited tile is read from the sculptor when it arrives, and UpdateRegion() uploads what changed into
+// the resident tiles with one glTexSubImage3D() per tile it reaches.
+class TerrainStreamer
+{
+public:
+    // statistics
+    uint64_t requested;         // tiles handed to the fetcher
+    uint64_t loaded;            // tiles uploaded into the atlas
+    uint64_t evicted;
+    uint64_t dropped;           // loads that arrived with no slot to go to
+    uint64_t failed;            // fetches that failed, requested again later
+    uint64_t bytesLoaded;
+    uint64_t texelsEdited;      // uploaded by UpdateRegion()
+    uint64_t hits;              // tiles in view found resident, summed over frames
+    uint64_t misses;
+    float frameHitRate;         // of the last Update()
+
+    // resource is the dataset's file as the fetcher knows it
+    TerrainStreamer(const TerrainDataset &dataset, TileFetcher &source, const std::string &resource,
+                    UploadService *uploads, int slots)
+        : requested(0), loaded(0), evicted(0), dropped(0), failed(0), bytesLoaded(0), texelsEdited(0), hits(0),
+          misses(0), frameHitRate(1.0f), dataset(dataset), source(source), resource(resource), uploads(uploads),
+          sculptor(0), header(dataset.Header()), indirection(0), frame(0), maxInFlight(16), maxUploads(4), detail(1.0f),
+          prefetchTime(0.5f), inFlight(0), indirectionDirty(true), nextLatency(0), start(Clock::now()), pending(0)
+    {
+        GLint maxLayers = 256;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+        slots = std::max(1, std::min(slots, std::min((int)maxLayers, 65535)));
+        cache.resize(slots);
+        slotOf.assign(header.tileCount, (int32_t)SLOT_NONE);
+
+        GLsizei dim = (GLsizei)header.TileDim();
+        atlas.resize(header.layers);
+        glGenTextures((GLsizei)atlas.size(), &atlas[0]);
+        for (uint32_t i = 0; i < header.layers; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, atlas[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internalFormatFor(i), dim, dim, slots, 0, formatFor(i), typeFor(i), 0);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+            // single channel layers read as grey
+            if (terrainFormatChannels(header.layer[i].format) == 1)
+            {
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_G, GL_RED);
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_B, GL_RED);
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        const TerrainLevelRecord &finest = dataset.Level(0);
+        table.resize((size_t)finest.tilesX * finest.tilesY * 2);
+        glGenTextures(1, &indirection);
+        glBindTexture(GL_TEXTURE_2D, indirection);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16UI, finest.tilesX, finest.tilesY, 0, GL_RG_INTEGER, GL_UNSIGNED_SHORT, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        // the coarsest level is a single tile, read on this thread once
+        int top = dataset.Levels() - 1;
+        int slot = 0;
+        std::vector<unsigned char> record;
+        if (!source.Read(resource, dataset.RecordOffset(top, 0, 0), (size_t)header.recordBytes, record))
+            record.assign((size_t)header.recordBytes, 0);
+        for (uint32_t i = 0; i < header.layers; i++)
+            uploadTile(slot, i, &record[header.layer[i].offset]);
+        cache[slot].tile = (int64_t)dataset.TileIndex(top, 0, 0);
+        cache[slot].level = top;
+        cache[slot].pinned = true;
+        slotOf[cache[slot].tile] = slot;
+        updateIndirection();
+    }
+
+    ~TerrainStreamer()
+    {
+        Destroy();
+    }
+
+    // GL thread, waits for the outstanding fetches and deletes the textures
+    void Destroy()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pending > 0)
+            idle.wait(lock);
+        for (size_t i = 0; i < finished.size(); i++)
+            release(*finished[i]);
+        finished.clear();
+        if (!atlas.empty())
+            glDeleteTextures((GLsizei)atlas.size(), &atlas[0]);
+        atlas.clear();
+        if (indirection)
+            glDeleteTextures(1, &indirection);
+        indirection = 0;
+    }
+
+    void SetMaxInFlight(int loads) { maxInFlight = std::max(loads, 1); }
+    void SetMaxUploads(int tiles) { maxUploads = std::max(tiles, 1); }
+    void SetDetail(float pixels) { detail = std::max(pixels, 0.05f); }
+    void SetPrefetchTime(float seconds) { prefetchTime = std::max(seconds, 0.0f); }
+    float Detail() const { return detail; }
+    float PrefetchTime() const { return prefetchTime; }
+
+    GLuint Atlas(int layer) const { return layer >= 0 && layer < (int)atlas.size() ? atlas[layer] : 0; }
+    GLuint Indirection() const { return indirection; }
+    int Slots() const { return (int)cache.size(); }
+    int InFlight() const { return inFlight; }
+    size_t Wanted() const { return wanted.size(); }
+
+    int Resident() const
+    {
+        int count = 0;
+        for (size_t i = 0; i < cache.size(); i++)
+            count += cache[i].tile >= 0;
+        return count;
+    }
+
+    // video memory of the atlases and the indirection texture
+    size_t Bytes() const
+    {
+        size_t bytes = table.size() * sizeof(uint16_t);
+        for (uint32_t i = 0; i < header.layers; i++)
+            bytes += header.TileBytes(i) * cache.size();
+        return bytes;
+    }
+
+    // milliseconds from request to upload over the last loads, fraction 0.5 is the median
+    double LatencyPercentile(double fraction) const
+    {
+        if (latencies.empty())
+            return 0.0;
+        std::vector<float> sorted(latencies);
+        size_t index = std::min((size_t)(fraction * sorted.size()), sorted.size() - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+    double HitRate() const { return hits + misses > 0 ? hits / (double)(hits + misses) : 1.0; }
+
+    // GL thread. Heights from sculptor from now on, the resident tiles it edited already are uploaded again.
+    void SetSculptor(const TerrainSculptor *sculptor)
+    {
+        this->sculptor = sculptor && sculptor->Ready() ? sculptor : 0;
+        if (!this->sculptor)
+            return;
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            if (cache[i].tile < 0)
+                continue;
+            int tx, ty;
+            slotTile(cache[i], tx, ty);
+            if (sculptor->TileEdited(cache[i].level, tx, ty))
+                uploadEdited((int)i, cache[i].level, tx, ty);
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    // GL thread. After the sculptor changed samples [x0, x1) x [y0, y1): the texels that changed with them on
+    // every level, uploaded into the resident tiles that hold them, borders included.
+    void UpdateRegion(int x0, int y0, int x1, int y1)
+    {
+        TerrainRect changed(x0, y0, x1, y1);
+        if (!sculptor || changed.Empty())
+            return;
+        int size = (int)header.tileSize, border = (int)header.border;
+        glBindTexture(GL_TEXTURE_2D_ARRAY, atlas[sculptor->Layer()]);
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            if (cache[i].tile < 0)
+                continue;
+            int tx, ty;
+            slotTile(cache[i], tx, ty);
+            TerrainRect texels = sculptor->LevelRect(cache[i].level, changed, border);
+            int left = tx * size - border, top = ty * size - border;
+            texels.x0 = std::max(texels.x0, left);
+            texels.y0 = std::max(texels.y0, top);
+            texels.x1 = std::min(texels.x1, left + (int)header.TileDim());
+            texels.y1 = std::min(texels.y1, top + (int)header.TileDim());
+            if (texels.Empty())
+                continue;
+            int w = texels.x1 - texels.x0, h = texels.y1 - texels.y0;
+            edits.resize((size_t)w * h);
+            sculptor->Read(cache[i].level, texels.x0, texels.y0, w, h, &edits[0]);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, texels.x0 - left, texels.y0 - top, (GLint)i, w, h, 1, GL_RED,
+                            GL_UNSIGNED_SHORT, &edits[0]);
+            texelsEdited += (uint64_t)w * h;
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    // GL thread, once per frame before the terrain is drawn
+    void Update(const TerrainView &view)
+    {
+        frame++;
+        selectTiles(view);
+
+        // hits only count the tiles in view, prefetched ones are wanted ahead of time
+        unsigned int visible = 0, frameHits = 0;
+        for (size_t i = 0; i < wanted.size(); i++)
+        {
+            int32_t slot = slotOf[wanted[i].tile];
+            if (slot >= 0)
+            {
+                cache[slot].lastWanted = frame;
+                cache[slot].priority = wanted[i].priority;
+            }
+            visible += wanted[i].visible;
+            frameHits += wanted[i].visible && slot >= 0;
+        }
+        hits += frameHits;
+        misses += visible - frameHits;
+        frameHitRate = visible > 0 ? frameHits / (float)visible : 1.0f;
+
+        uploadFinished();
+        requestMissing();
+        if (indirectionDirty)
+            updateIndirection();
+    }
+
+private:
+    typedef std::chrono::high_resolution_clock Clock;
+
+    enum {
+        SLOT_NONE = -1,
+        SLOT_LOADING = -2,
+        LATENCY_SAMPLES = 256
+    };
+
+    struct Slot {
+        int64_t tile;           // -1 = free
+        int level;
+        uint64_t lastWanted;    // frame
+        float priority;         // in that frame
+        bool pinned;
+
+        Slot() : tile(-1), level(0), lastWanted(0), priority(0.0f), pinned(false)
+        {
+        }
+    };
+
+    struct Want {
+        uint64_t tile;
+        int level, tx, ty;
+        float priority;
+        bool visible;
+    };
+
+    // a tile on its way from the file to the atlas
+    struct Load {
+        uint64_t tile;
+        int level, tx, ty;
+        double requestedMs;
+        bool failed;
+        StagingBlock block;
+        std::vector<unsigned char> texels;  // when the upload ring has no room
+    };
+
+    // one quadtree walk, from the camera or from where it is going to be
+    struct Pass {
+        glm::vec3 eye;
+        glm::vec3 front;
+        const Frustum *frustum;     // 0 = everything, weighted by direction
+        float pixelScale;
+        float detail;
+        float weight;
+        bool visible;
+    };
+
+    const TerrainDataset &dataset;
+    TileFetcher &source;
+    std::string resource;
+    UploadService *uploads;
+    const TerrainSculptor *sculptor;
+    TerrainFileHeader header;
+    std::vector<GLuint> atlas;
+    GLuint indirection;
+    std::vector<uint16_t> table;
+    std::vector<Slot> cache;
+    std::vector<int32_t> slotOf;        // per tile, a slot or SLOT_NONE/SLOT_LOADING
+    std::vector<Want> wanted;
+    std::unordered_map<uint64_t, size_t> wantIndex;
+    uint64_t frame;
+    int maxInFlight;
+    int maxUploads;
+    float detail;
+    float prefetchTime;
+    int inFlight;
+    bool indirectionDirty;
+    std::vector<float> latencies;       // ring of the last LATENCY_SAMPLES
+    size_t nextLatency;
+    Clock::time_point start;
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    int pending;                        // fetches not finished yet, Destroy() waits for them
+    std::vector<std::shared_ptr<Load> > finished;
+    std::vector<uint16_t> edits;
+
+    TerrainStreamer(const TerrainStreamer &);
+    TerrainStreamer &operator=(const TerrainStreamer &);
+
+    double now() const
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    GLenum internalFormatFor(uint32_t layer) const
+    {
+        static const GLenum formats[] = { GL_R8, GL_RG8, GL_RGBA8, GL_R16 };
+        return formats[header.layer[layer].format];
+    }
+
+    GLenum formatFor(uint32_t layer) const
+    {
+        static const GLenum formats[] = { GL_RED, GL_RG, GL_RGBA, GL_RED };
+        return formats[header.layer[layer].format];
+    }
+
+    GLenum typeFor(uint32_t layer) const
+    {
+        return header.layer[layer].format == TERRAIN_R16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    }
+
+    void uploadTile(int slot, uint32_t layer, const void *texels)
+    {
+        GLsizei dim = (GLsizei)header.TileDim();
+        glBindTexture(GL_TEXTURE_2D_ARRAY, atlas[layer]);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, slot, dim, dim, 1, formatFor(layer), typeFor(layer), texels);
+    }
+
+    // the height layer of a tile from the sculptor
+    void uploadEdited(int slot, int level, int tx, int ty)
+    {
+        int dim = (int)header.TileDim();
+        edits.resize((size_t)dim * dim);
+        sculptor->Read(level, tx * (int)header.tileSize - (int)header.border, ty * (int)header.tileSize - (int)header.border,
+                       dim, dim, &edits[0]);
+        uploadTile(slot, (uint32_t)sculptor->Layer(), &edits[0]);
+    }
+
+    // tile coordinates of a slot's tile on its level
+    void slotTile(const Slot &slot, int &tx, int &ty) const
+    {
+        uint64_t index = (uint64_t)slot.tile - dataset.Level(slot.level).firstTile;
+        tx = (int)(index % dataset.Level(slot.level).tilesX);
+        ty = (int)(index / dataset.Level(slot.level).tilesX);
+    }
+
+    void want(int level, int tx, int ty, float priority, bool visible)
+    {
+        uint64_t tile = dataset.TileIndex(level, tx, ty);
+        std::unordered_map<uint64_t, size_t>::iterator it = wantIndex.find(tile);
+        if (it != wantIndex.end())
+        {
+            wanted[it->second].priority = std::max(wanted[it->second].priority, priority);
+            wanted[it->second].visible = wanted[it->second].visible || visible;
+            return;
+        }
+        Want entry = { tile, level, tx, ty, priority, visible };
+        wantIndex[tile] = wanted.size();
+        wanted.push_back(entry);
+    }
+
+    // world space bounds of a tile, level 0 texels are texelSize apart and the terrain is centred on the origin
+    void tileBox(int level, int tx, int ty, glm::vec3 &boxMin, glm::vec3 &boxMax) const
+    {
+        float size = header.texelSize;
+        uint64_t span = (uint64_t)header.tileSize << level;
+        float halfWidth = header.width * size * 0.5f, halfHeight = header.height * size * 0.5f;
+        float low = 0.0f, high = 0.0f;
+        if (sculptor)
+            sculptor->TileBounds(level, tx, ty, low, high);
+        else
+            dataset.TileBounds(level, tx, ty, low, high);
+        boxMin = glm::vec3(tx * span * size - halfWidth, low, ty * span * size - halfHeight);
+        boxMax = glm::vec3(std::min((tx + 1) * span, (uint64_t)header.width) * size - halfWidth, high,
+                           std::min((ty + 1) * span, (uint64_t)header.height) * size - halfHeight);
+    }
+
+    void visit(const Pass &pass, int level, int tx, int ty)
+    {
+        glm::vec3 boxMin, boxMax;
+        tileBox(level, tx, ty, boxMin, boxMax);
+        float weight = pass.weight;
+        if (pass.frustum && !pass.frustum->IntersectsBox(boxMin, boxMax))
+            return;
+        glm::vec3 toTile = (boxMin + boxMax) * 0.5f - pass.eye;
+        if (!pass.frustum && glm::dot(toTile, toTile) > 0.0f)
+            weight *= 0.25f + 0.75f * std::max(glm::dot(pass.front, glm::normalize(toTile)), 0.0f);
+
+        float distance = std::max(glm::distance(pass.eye, glm::clamp(pass.eye, boxMin, boxMax)), header.texelSize);
+        float texelPixels = header.texelSize * (float)(1u << level) * pass.pixelScale / distance;
+        want(level, tx, ty, weight * texelPixels * header.tileSize, pass.visible);
+        if (level == 0 || texelPixels <= pass.detail)
+            return;
+        for (int y = ty * 2; y < ty * 2 + 2; y++)
+            for (int x = tx * 2; x < tx * 2 + 2; x++)
+                if (dataset.HasTile(level - 1, x, y))
+                    visit(pass, level - 1, x, y);
+    }
+
+    void selectTiles(const TerrainView &view)
+    {
+        wanted.clear();
+        wantIndex.clear();
+        int top = dataset.Levels() - 1;
+        Frustum frustum(view.viewProjection);
+        Pass current = { view.position, view.front, &frustum, view.pixelScale, detail, 1.0f, true };
+        visit(current, top, 0, 0);
+
+        glm::vec3 ahead = view.velocity * prefetchTime;
+        if (glm::dot(ahead, ahead) > 0.0f)
+        {
+            Frustum next(view.viewProjection * glm::translate(glm::mat4(1.0f), -ahead));
+            Pass predicted = { view.position + ahead, view.front, &next, view.pixelScale, detail, 0.5f, false };
+            visit(predicted, top, 0, 0);
+        }
+        // a few levels coarser all around, so that turning around finds something
+        Pass around = { view.position, view.front, 0, view.pixelScale, detail * 8.0f, 0.25f, false };
+        visit(around, top, 0, 0);
+    }
+
+    bool parentResident(const Want &tile) const
+    {
+        if (tile.level + 1 >= dataset.Levels())
+            return true;
+        return slotOf[dataset.TileIndex(tile.level + 1, tile.tx / 2, tile.ty / 2)] >= 0;
+    }
+
+    static bool higherPriority(const Want &a, const Want &b)
+    {
+        return a.priority > b.priority;
+    }
+
+    // What it takes to evict a slot: nothing if it is free or was not wanted this frame, otherwise a tile half
+    // again as important as the one in it, so that near ties do not swap back and forth as the camera moves.
+    float keepPriority(const Slot &slot) const
+    {
+        if (slot.pinned)
+            return 1e30f;
+        return slot.tile < 0 || slot.lastWanted < frame ? 0.0f : slot.priority * 1.5f;
+    }
+
+    // the most important missing tiles there are loads and slots for, the cheapest slots are set aside for
+    // the loads already in flight
+    void requestMissing()
+    {
+        if (inFlight >= maxInFlight)
+            return;
+        std::vector<Want> missing;
+        for (size_t i = 0; i < wanted.size(); i++)
+            if (slotOf[wanted[i].tile] == SLOT_NONE && parentResident(wanted[i]))
+                missing.push_back(wanted[i]);
+        std::sort(missing.begin(), missing.end(), higherPriority);
+        std::vector<float> keep(cache.size());
+        for (size_t i = 0; i < cache.size(); i++)
+            keep[i] = keepPriority(cache[i]);
+        std::sort(keep.begin(), keep.end());
+        size_t next = (size_t)inFlight;
+        for (size_t i = 0; i < missing.size() && inFlight < maxInFlight; i++, next++)
+        {
+            if (next >= keep.size() || keep[next] > missing[i].priority)
+                break;
+            request(missing[i]);
+        }
+    }
+
+    void request(const Want &tile)
+    {
+        std::shared_ptr<Load> load(new Load());
+        load->tile = tile.tile;
+        load->level = tile.level;
+        load->tx = tile.tx;
+        load->ty = tile.ty;
+        load->requestedMs = now();
+        load->failed = false;
+        slotOf[tile.tile] = SLOT_LOADING;
+        inFlight++;
+        requested++;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending++;
+        }
+        // every layer of a tile is one record in the file, copied out on the fetcher's I/O thread
+        size_t bytes = (size_t)header.recordBytes;
+        source.Fetch(resource, dataset.RecordOffset(tile.level, tile.tx, tile.ty), bytes,
+                     [this, load, bytes](const unsigned char *record, size_t)
+        {
+            load->failed = record == 0;
+            load->block = uploads && record ? uploads->Allocate(bytes) : StagingBlock();
+            if (load->block.Valid())
+                memcpy(load->block.ptr, record, bytes);
+            else if (record)
+            {
+                if (uploads)
+                    uploads->CountFallback(bytes);
+                load->texels.assign(record, record + bytes);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.push_back(load);
+            pending--;
+            idle.notify_all();
+        });
+    }
+
+    void release(const Load &load)
+    {
+        if (load.block.Valid())
+            load.block.service->Release(load.block);
+    }
+
+    // a free slot, or the cheapest to evict for a tile of priority, least recently wanted first; -1 if there is none
+    int freeSlot(float priority)
+    {
+        int best = -1;
+        float bestKeep = 0.0f;
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            const Slot &slot = cache[i];
+            if (slot.tile < 0)
+                return (int)i;
+            float keep = keepPriority(slot);
+            if (keep <= priority && (best < 0 || keep < bestKeep ||
+                                     (keep == bestKeep && slot.lastWanted < cache[best].lastWanted)))
+            {
+                best = (int)i;
+                bestKeep = keep;
+            }
+        }
+        return best;
+    }
+
+    void uploadFinished()
+    {
+        std::vector<std::shared_ptr<Load> > ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t count = std::min(finished.size(), (size_t)maxUploads);
+            ready.assign(finished.begin(), finished.begin() + count);
+            finished.erase(finished.begin(), finished.begin() + count);
+        }
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+            const Load &load = *ready[i];
+            inFlight--;
+            if (load.failed)
+            {
+                slotOf[load.tile] = SLOT_NONE;
+                failed++;
+                continue;
+            }
+            std::unordered_map<uint64_t, size_t>::const_iterator it = wantIndex.find(load.tile);
+            float priority = it != wantIndex.end() ? wanted[it->second].priority : 0.0f;
+            int slot = freeSlot(priority);
+            if (slot < 0)
+            {
+                slotOf[load.tile] = SLOT_NONE;
+                dropped++;
+                release(load);
+                continue;
+            }
+            if (cache[slot].tile >= 0)
+            {
+                slotOf[cache[slot].tile] = SLOT_NONE;
+                evicted++;
+            }
+
+            const unsigned char *record = load.block.Valid() ? (const unsigned char*)uploads->Begin(load.block)
+                                                             : &load.texels[0];
+            for (uint32_t layer = 0; layer < header.layers; layer++)
+                uploadTile(slot, layer, record + header.layer[layer].offset);
+            if (sculptor && sculptor->TileEdited(load.level, load.tx, load.ty))
+                uploadEdited(slot, load.level, load.tx, load.ty);
+            if (load.block.Valid())
+                uploads->End(load.block, (size_t)header.recordBytes);
+            release(load);
+
+            cache[slot].tile = (int64_t)load.tile;
+            cache[slot].level = load.level;
+            cache[slot].lastWanted = it != wantIndex.end() ? frame : frame - 1;
+            cache[slot].priority = priority;
+            slotOf[load.tile] = slot;
+            indirectionDirty = true;
+            loaded++;
+            bytesLoaded += header.recordBytes;
+
+            float latency = (float)(now() - load.requestedMs);
+            if (latencies.size() < (size_t)LATENCY_SAMPLES)
+                latencies.push_back(latency);
+            else
+                latencies[nextLatency++ % LATENCY_SAMPLES] = latency;
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    // paints every resident tile over the level 0 tiles it covers, coarsest first so finer tiles win
+    void updateIndirection()
+    {
+        const TerrainLevelRecord &finest = dataset.Level(0);
+        for (int level = dataset.Levels() - 1; level >= 0; level--)
+            for (size_t i = 0; i < cache.size(); i++)
+            {
+                if (cache[i].tile < 0 || cache[i].level != level)
+                    continue;
+                uint64_t index = (uint64_t)cache[i].tile - dataset.Level(level).firstTile;
+                uint32_t tilesX = dataset.Level(level).tilesX;
+                uint32_t x0 = (uint32_t)(index % tilesX) << level, y0 = (uint32_t)(index / tilesX) << level;
+                uint32_t x1 = std::min(x0 + (1u << level), finest.tilesX);
+                uint32_t y1 = std::min(y0 + (1u << level), finest.tilesY);
+                for (uint32_t y = y0; y < y1; y++)
+                    for (uint32_t x = x0; x < x1; x++)
+                    {
+                        table[((size_t)y * finest.tilesX + x) * 2] = (uint16_t)i;
+                        table[((size_t)y * finest.tilesX + x) * 2 + 1] = (uint16_t)level;
+                    }
+            }
+        glBindTexture(GL_TEXTURE_2D, indirection);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, finest.tilesX, finest.tilesY, GL_RG_INTEGER, GL_UNSIGNED_SHORT, &table[0]);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        indirectionDirty = false;
+    }
+};
+#endif
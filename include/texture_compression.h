@@ -0,0 +1,161 @@
+
+
+#ifndef TEXTURE_COMPRESSION_H
+#define TEXTURE_COMPRESSION_H
+
+#include <block_compression.h>
+#include <job_system.h>
+#include <ktx_file.h>
+#include <texture_upload.h>
+
+#include <cctype>
+#include <string>
+#include <vector>
+
+// Block compression of whole images into KTX levels (see block_compression.h for the encoders), shared by
+// tools/texture_compress and tools/terrain_bake.
+
+inline const char *compressedFormatName(GLenum format)
+{
+    switch (format)
+    {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        return "BC1";
+    case GL_COMPRESSED_RED_RGTC1:
+        return "BC4";
+    case GL_COMPRESSED_RG_RGTC2:
+        return "BC5";
+    default:
+        return "BC7";
+    }
+}
+
+inline GLenum compressedFormatForPath(const std::string &path)
+{
+    std::string name = path.substr(path.find_last_of("/\\") == std::string::npos ? 0 : path.find_last_of("/\\") + 1);
+    for (size_t i = 0; i < name.size(); i++)
+        name[i] = (char)tolower(name[i]);
+    if (name.find("height") != std::string::npos || name.find("specular") != std::string::npos)
+        return GL_COMPRESSED_RED_RGTC1;
+    if (name.find("normal") != std::string::npos)
+        return GL_COMPRESSED_RG_RGTC2;
+    if (name.find("sky") != std::string::npos)
+        return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    return GL_COMPRESSED_RGBA_BPTC_UNORM;
+}
+
+inline void encodeCompressedBlock(GLenum format, const PixelBlock &block, unsigned char *out)
+{
+    switch (format)
+    {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        encodeBC1(block, out);
+        break;
+    case GL_COMPRESSED_RED_RGTC1:
+        encodeBC4(block, 0, out);
+        break;
+    case GL_COMPRESSED_RG_RGTC2:
+        encodeBC5(block, 0, 2, out);
+        break;
+    default:
+        encodeBC7(block, out);
+        break;
+    }
+}
+
+// squared error of an encoded block over the channels the format keeps
+inline double compressedBlockError(GLenum format, const PixelBlock &block, const unsigned char *encoded)
+{
+    unsigned char decoded[16][4];
+    int channels[4] = { 0, 1, 2, 3 };
+    int numChannels = 4;
+    switch (format)
+    {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        decodeBC1(encoded, decoded);
+        numChannels = 3;
+        break;
+    case GL_COMPRESSED_RED_RGTC1:
+        decodeBC4(encoded, 0, decoded);
+        numChannels = 1;
+        break;
+    case GL_COMPRESSED_RG_RGTC2:
+        // red and green hold the source's red and blue
+        decodeBC5(encoded, decoded);
+        for (int i = 0; i < 16; i++)
+            decoded[i][2] = decoded[i][1];
+        channels[1] = 2;
+        numChannels = 2;
+        break;
+    default:
+        decodeBC7(encoded, decoded);
+        break;
+    }
+    double error = 0.0;
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < numChannels; c++)
+        {
+            double d = (double)decoded[i][channels[c]] - block.c[channels[c]][i];
+            error += d * d;
+        }
+    return error / (16.0 * numChannels);
+}
+
+// compresses one level, returns the mean squared error per channel
+inline double compressLevel(JobSystem &jobs, GLenum format, const unsigned char *rgba, int width, int height,
+                            std::vector<unsigned char> &out)
+{
+    int blocksX = (width + 3) / 4;
+    int blocksY = (height + 3) / 4;
+    unsigned int blockBytes = compressedBlockBytes(format);
+    out.resize((size_t)blocksX * blocksY * blockBytes);
+    std::vector<double> rowErrors(blocksY, 0.0);
+
+    jobs.ParallelFor(0, blocksY, 4, [&](size_t first, size_t last)
+    {
+        PixelBlock block;
+        for (size_t by = first; by < last; by++)
+        {
+            for (int bx = 0; bx < blocksX; bx++)
+            {
+                unsigned char *encoded = &out[((size_t)by * blocksX + bx) * blockBytes];
+                fetchBlock(rgba, width, height, bx, (int)by, block);
+                encodeCompressedBlock(format, block, encoded);
+                rowErrors[by] += compressedBlockError(format, block, encoded);
+            }
+        }
+    });
+
+    double error = 0.0;
+    for (int by = 0; by < blocksY; by++)
+        error += rowErrors[by];
+    return error / ((double)blocksX * blocksY);
+}
+
+// compresses an RGBA image and, with mipmaps, its box filtered mip chain into levels; returns the mean squared
+// error per channel of the base level
+inline double compressImageLevels(JobSystem &jobs, GLenum format, const unsigned char *rgba, int width, int height,
+                                  bool mipmaps, std::vector<std::vector<unsigned char> > &levels)
+{
+    unsigned int count = mipmaps ? mipLevelCount(width, height) : 1;
+    levels.assign(count, std::vector<unsigned char>());
+    std::vector<unsigned char> level(rgba, rgba + (size_t)width * height * 4);
+    std::vector<unsigned char> next;
+    double baseError = 0.0;
+    for (unsigned int l = 0; l < count; l++)
+    {
+        double error = compressLevel(jobs, format, &level[0], width, height, levels[l]);
+        if (l == 0)
+            baseError = error;
+        if (l + 1 < count)
+        {
+            next.resize((size_t)(width > 1 ? width / 2 : 1) * (height > 1 ? height / 2 : 1) * 4);
+            downsampleImage(&level[0], width, height, 4, &next[0]);
+            level.swap(next);
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+    }
+    return baseError;
+}
+#endif
@@ -0,0 +1,423 @@
+
+
+#ifndef TEXTURE_REGISTRY_H
+#define TEXTURE_REGISTRY_H
+
+#include <glad/glad.h>
+
+#include <asset_loader.h>
+#include <content_hash.h>
+#include <texture_streamer.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// How a texture is stored and sampled. Part of the registry key, the same image with another descriptor
+// is another texture.
+struct TextureDesc {
+    int channels;           // requested channel count, 0 = as in the file
+    bool mipmaps;
+    GLint internalFormat;   // 0 = matching the channel count; ignored for compressed files
+    GLenum wrap;
+    GLenum minFilter;
+    GLenum magFilter;
+
+    TextureDesc() : channels(0), mipmaps(true), internalFormat(0), wrap(GL_REPEAT),
+                    minFilter(GL_LINEAR_MIPMAP_LINEAR), magFilter(GL_LINEAR)
+    {
+    }
+
+    bool operator==(const TextureDesc &other) const
+    {
+        return channels == other.channels && mipmaps == other.mipmaps && internalFormat == other.internalFormat &&
+               wrap == other.wrap && minFilter == other.minFilter && magFilter == other.magFilter;
+    }
+};
+
+struct TextureKey {
+    uint64_t content;   // hash of the file contents, of all face hashes for cube maps
+    GLenum target;
+    TextureDesc desc;
+
+    bool operator==(const TextureKey &other) const
+    {
+        return content == other.content && target == other.target && desc == other.desc;
+    }
+};
+
+struct TextureKeyHash {
+    size_t operator()(const TextureKey &key) const
+    {
+        uint64_t fields[7] = { key.content, key.target, (uint64_t)key.desc.channels, key.desc.mipmaps ? 1u : 0u,
+                               (uint64_t)key.desc.internalFormat, key.desc.wrap,
+                               ((uint64_t)key.desc.minFilter << 32) | key.desc.magFilter };
+        return (size_t)hashBytes((const unsigned char*)fields, sizeof(fields));
+    }
+};
+
+// A texture owned by the registry. width, height and bytes are filled in once the image has been uploaded.
+struct TextureRecord {
+    GLuint id;
+    GLenum target;
+    std::string name;   // first path it was requested by
+    int width;
+    int height;
+    GLenum compressedFormat; // 0 for 8 bit texels
+    int texelBytes;     // as stored by the driver, RGB is padded to four bytes
+    unsigned int faces; // 6 for cube maps
+    unsigned int levels;
+    unsigned int baseLevel; // finest level resident, above 0 while mips stream in or after levels were dropped
+    size_t bytes;       // estimated video memory of the resident levels
+    bool ready;
+    bool streaming;     // finer levels are still on their way
+    TextureKey key;
+};
+
+// Shared handle to a registered texture. The GL texture is deleted when the last handle goes away.
+typedef std::shared_ptr<const TextureRecord> TextureRef;
+
+// One registry for every texture in the program. Requests are looked up by the content hash of the image and
+// the descriptor, so the same image is only decoded and uploaded once no matter how many paths, models or
+// materials refer to it. Identical faces of a cube map are decoded once as well.
+//
+// With an AssetLoader the images are decoded on the job system and the returned textures are filled in when
+// the uploads arrive, without one they are loaded on the spot. With a TextureStreamer the mip chains of 2D
+// textures arrive coarsest level first over the following frames. GL thread only.
+class TextureRegistry
+{
+public:
+    struct Stats {
+        unsigned int textures;      // live textures
+        unsigned int requests;
+        unsigned int hits;          // requests answered with an existing texture
+        size_t vramBytes;
+        size_t dedupBytes;          // video memory (and uploads) that duplicates of the live handles would cost
+    };
+
+    static TextureRegistry &Global()
+    {
+        static TextureRegistry registry;
+        return registry;
+    }
+
+    void SetLoader(AssetLoader *assetLoader)
+    {
+        loader = assetLoader;
+    }
+
+    void SetStreamer(TextureStreamer *textureStreamer)
+    {
+        streamer = textureStreamer;
+    }
+
+    TextureRef Texture2D(const std::string &path, const TextureDesc &desc = TextureDesc())
+    {
+        TextureKey key;
+        key.content = contentHash(path);
+        key.target = GL_TEXTURE_2D;
+        key.desc = desc;
+        TextureRef existing = find(key);
+        if (existing)
+            return existing;
+
+        std::shared_ptr<TextureRecord> record = create(key, path);
+        TextureDesc d = desc;
+        TextureRegistry *registry = this;
+        load(path, desc, true, [registry, record, d](const DecodedImage &image)
+        {
+            if (!image.Valid())
+            {
+                std::cout << "Texture failed to load at path: " << image.path << std::endl;
+                return;
+            }
+            glBindTexture(GL_TEXTURE_2D, record->id);
+            if (registry->streamer && image.levels > 1)
+            {
+                std::weak_ptr<TextureRecord> weak = record;
+                record->baseLevel = registry->streamer->Add(record->id, weak, d.internalFormat, image,
+                                                            [weak](unsigned int level)
+                {
+                    std::shared_ptr<TextureRecord> streamed = weak.lock();
+                    if (!streamed)
+                        return;
+                    streamed->baseLevel = level;
+                    streamed->streaming = level > 0;
+                    updateBytes(*streamed);
+                });
+                record->streaming = record->baseLevel > 0;
+            }
+            else
+            {
+                texImageLevels(GL_TEXTURE_2D, d.internalFormat, image);
+                if (d.mipmaps && image.levels == 1 && !image.compressedFormat)
+                    glGenerateMipmap(GL_TEXTURE_2D);
+                else if (image.levels == 1)
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, d.wrap);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, d.wrap);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, d.minFilter);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, d.magFilter);
+            registry->uploaded(*record, image, d);
+        });
+        return record;
+    }
+
+    // faces in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X onwards
+    TextureRef Cubemap(const std::vector<std::string> &faces, const TextureDesc &desc)
+    {
+        std::vector<uint64_t> hashes(faces.size());
+        for (size_t i = 0; i < faces.size(); i++)
+            hashes[i] = contentHash(faces[i]);
+        TextureKey key;
+        key.content = hashBytes((const unsigned char*)&hashes[0], hashes.size() * sizeof(uint64_t));
+        key.target = GL_TEXTURE_CUBE_MAP;
+        key.desc = desc;
+        TextureRef existing = find(key);
+        if (existing)
+            return existing;
+
+        std::shared_ptr<TextureRecord> record = create(key, faces.empty() ? std::string() : faces[0]);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, record->id);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, desc.minFilter);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, desc.magFilter);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, desc.wrap);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, desc.wrap);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, desc.wrap);
+        if (!desc.mipmaps)
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, 0);
+
+        // faces with the same contents are decoded once and uploaded to every face they appear on
+        bool compressed = allCompressed(faces);
+        for (size_t i = 0; i < faces.size(); i++)
+        {
+            bool first = true;
+            for (size_t j = 0; j < i; j++)
+                first = first && hashes[j] != hashes[i];
+            if (!first)
+                continue;
+            std::vector<unsigned int> targets;
+            for (size_t j = i; j < faces.size(); j++)
+                if (hashes[j] == hashes[i])
+                    targets.push_back((unsigned int)j);
+
+            TextureDesc d = desc;
+            TextureRegistry *registry = this;
+            load(faces[i], desc, compressed, [registry, record, d, targets](const DecodedImage &image)
+            {
+                if (!image.Valid())
+                {
+                    std::cout << "Cubemap tex failed to load at path: " << image.path << std::endl;
+                    return;
+                }
+                glBindTexture(GL_TEXTURE_CUBE_MAP, record->id);
+                for (size_t t = 0; t < targets.size(); t++)
+                    texImageLevels(GL_TEXTURE_CUBE_MAP_POSITIVE_X + targets[t], d.internalFormat, image);
+                registry->uploaded(*record, image, d);
+                registry->faceDedupBytes += (targets.size() - 1) * (record->bytes / record->faces);
+            });
+        }
+        return record;
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.textures = 0;
+        stats.requests = requests;
+        stats.hits = hits;
+        stats.vramBytes = 0;
+        stats.dedupBytes = faceDedupBytes;
+        for (Map::const_iterator it = textures.begin(); it != textures.end(); ++it)
+        {
+            std::shared_ptr<TextureRecord> record = it->second.lock();
+            if (!record)
+                continue;
+            // handles out there besides the one just locked, each would be a texture of its own without sharing;
+            // a load in flight holds one too until its image arrives
+            long handles = record.use_count() - 1;
+            stats.textures++;
+            stats.vramBytes += record->bytes;
+            if (handles > 1)
+                stats.dedupBytes += (size_t)(handles - 1) * record->bytes;
+        }
+        return stats;
+    }
+
+    // every texture alive right now
+    std::vector<TextureRef> Live() const
+    {
+        std::vector<TextureRef> live;
+        for (Map::const_iterator it = textures.begin(); it != textures.end(); ++it)
+        {
+            TextureRef record = it->second.lock();
+            if (record)
+                live.push_back(record);
+        }
+        return live;
+    }
+
+    // Gives up the finest resident level of a 2D texture: sampling is clamped to the next level and the
+    // level is respecified with a zero size, which hands its memory back to the driver. Textures that are
+    // still streaming in, cube maps and textures down to their last level are left alone.
+    bool DropTopLevel(const TextureRef &texture)
+    {
+        Map::iterator it = textures.find(texture->key);
+        std::shared_ptr<TextureRecord> record = it != textures.end() ? it->second.lock() : std::shared_ptr<TextureRecord>();
+        if (!record || !record->ready || record->streaming || record->target != GL_TEXTURE_2D ||
+            record->baseLevel + 1 >= record->levels)
+            return false;
+        glBindTexture(GL_TEXTURE_2D, record->id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, record->baseLevel + 1);
+        // outside [BASE_LEVEL, MAX_LEVEL] the level's format does not matter for completeness
+        glTexImage2D(GL_TEXTURE_2D, record->baseLevel, GL_RED, 0, 0, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
+        record->baseLevel++;
+        updateBytes(*record);
+        return true;
+    }
+
+    // deletes every live texture while the context is still current; handles released later only free memory
+    void Shutdown()
+    {
+        for (Map::iterator it = textures.begin(); it != textures.end(); ++it)
+        {
+            std::shared_ptr<TextureRecord> record = it->second.lock();
+            if (record)
+                glDeleteTextures(1, &record->id);
+        }
+        if (streamer)
+            streamer->Clear();
+        loader = 0;
+        streamer = 0;
+        shutdown = true;
+    }
+
+private:
+    typedef std::unordered_map<TextureKey, std::weak_ptr<TextureRecord>, TextureKeyHash> Map;
+
+    struct FileHash {
+        int64_t modified;
+        int64_t size;
+        uint64_t hash;
+    };
+
+    AssetLoader *loader;
+    TextureStreamer *streamer;
+    Map textures;
+    std::unordered_map<std::string, FileHash> fileHashes;
+    unsigned int requests;
+    unsigned int hits;
+    size_t faceDedupBytes;
+    bool shutdown;
+
+    TextureRegistry() : loader(0), streamer(0), requests(0), hits(0), faceDedupBytes(0), shutdown(false)
+    {
+    }
+
+    TextureRegistry(const TextureRegistry &);
+    TextureRegistry &operator=(const TextureRegistry &);
+
+    // contents hash of a file, remembered for as long as its modification time and size stay the same.
+    // Files that cannot be read are keyed by their path, they fail to load once and share the empty texture.
+    uint64_t contentHash(const std::string &path)
+    {
+        FileHash entry;
+        if (!fileStatus(path, entry.modified, entry.size))
+            return hashBytes((const unsigned char*)path.data(), path.size());
+        std::unordered_map<std::string, FileHash>::iterator it = fileHashes.find(path);
+        if (it != fileHashes.end() && it->second.modified == entry.modified && it->second.size == entry.size)
+            return it->second.hash;
+        if (!hashFile(path, entry.hash))
+            return hashBytes((const unsigned char*)path.data(), path.size());
+        fileHashes[path] = entry;
+        return entry.hash;
+    }
+
+    TextureRef find(const TextureKey &key)
+    {
+        requests++;
+        Map::iterator it = textures.find(key);
+        if (it == textures.end())
+            return TextureRef();
+        std::shared_ptr<TextureRecord> record = it->second.lock();
+        if (record)
+            hits++;
+        return record;
+    }
+
+    std::shared_ptr<TextureRecord> create(const TextureKey &key, const std::string &name)
+    {
+        TextureRecord *raw = new TextureRecord();
+        glGenTextures(1, &raw->id);
+        raw->target = key.target;
+        raw->name = name;
+        raw->width = 0;
+        raw->height = 0;
+        raw->compressedFormat = 0;
+        raw->texelBytes = 0;
+        raw->faces = key.target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+        raw->levels = 0;
+        raw->baseLevel = 0;
+        raw->bytes = 0;
+        raw->ready = false;
+        raw->streaming = false;
+        raw->key = key;
+        TextureRegistry *registry = this;
+        std::shared_ptr<TextureRecord> record(raw, [registry](TextureRecord *r) { registry->release(r); });
+        textures[key] = record;
+        return record;
+    }
+
+    void release(TextureRecord *record)
+    {
+        if (!shutdown)
+            glDeleteTextures(1, &record->id);
+        Map::iterator it = textures.find(record->key);
+        if (it != textures.end() && it->second.expired())
+            textures.erase(it);
+        delete record;
+    }
+
+    void load(const std::string &path, const TextureDesc &desc, bool allowCompressed, AssetLoader::UploadFn upload)
+    {
+        if (loader)
+        {
+            loader->Load(path, desc.channels, desc.mipmaps, upload, allowCompressed);
+            return;
+        }
+        DecodedImage image = decodeImage(path, desc.channels, desc.mipmaps, nullptr, allowCompressed);
+        upload(image);
+        image.Free();
+    }
+
+    void uploaded(TextureRecord &record, const DecodedImage &image, const TextureDesc &desc)
+    {
+        record.width = image.width;
+        record.height = image.height;
+        record.compressedFormat = image.compressedFormat;
+        record.texelBytes = (image.channels == 3 || desc.internalFormat == GL_RGB ? 4 : image.channels) *
+                            (int)dataTypeBytes(image.dataType);
+        record.levels = desc.mipmaps && image.levels == 1 && !image.compressedFormat
+                            ? mipLevelCount(image.width, image.height) : image.levels;
+        record.ready = true;
+        updateBytes(record);
+    }
+
+    static void updateBytes(TextureRecord &record)
+    {
+        size_t bytes = 0;
+        for (unsigned int level = record.baseLevel; level < record.levels; level++)
+        {
+            int width = std::max(record.width >> level, 1);
+            int height = std::max(record.height >> level, 1);
+            bytes += record.compressedFormat ? compressedLevelSize(record.compressedFormat, width, height)
+                                             : (size_t)width * height * record.texelBytes;
+        }
+        record.bytes = bytes * record.faces;
+    }
+};
+#endif
@@ -0,0 +1,152 @@
+
+
+#ifndef TEXTURE_STREAMER_H
+#define TEXTURE_STREAMER_H
+
+#include <glad/glad.h>
+
+#include <asset_loader.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Uploads mip chains coarsest level first, spread over frames. A texture is usable as soon as its smallest
+// levels are in: GL_TEXTURE_BASE_LEVEL is clamped to the finest level uploaded so far, which keeps the
+// texture complete, and is lowered as finer levels arrive. Update() uploads finer levels on a byte budget per
+// frame, always the smallest level still missing in any texture first, so everything sharpens evenly.
+//
+// The decoded image (its staging block or client memory) is kept until the base level is in. GL thread only.
+class TextureStreamer
+{
+public:
+    typedef std::function<void(unsigned int)> ProgressFn; // called with each new base level
+
+    // statistics
+    size_t bytesStreamed;       // uploaded by Update()
+    unsigned int completed;     // textures streamed down to level 0
+
+    explicit TextureStreamer(size_t frameBudget, int previewSize = 64)
+        : bytesStreamed(0), completed(0), frameBudget(frameBudget), previewSize(previewSize), pendingBytes(0)
+    {
+    }
+
+    ~TextureStreamer()
+    {
+        Clear();
+    }
+
+    void SetFrameBudget(size_t bytes) { frameBudget = bytes; }
+    size_t FrameBudget() const { return frameBudget; }
+
+    // Uploads the levels of image no larger than the preview size to texture id right away and queues the
+    // rest. Pending levels are dropped once alive expires (the texture was deleted). Returns the base level.
+    unsigned int Add(GLuint id, const std::weak_ptr<const void> &alive, GLint internalFormat, const DecodedImage &image,
+                     ProgressFn progress = ProgressFn())
+    {
+        unsigned int first = 0;
+        while (first + 1 < image.levels &&
+               std::max(image.width >> first, image.height >> first) > previewSize)
+            first++;
+
+        glBindTexture(GL_TEXTURE_2D, id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, first);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels - 1);
+        texImageLevelRange(GL_TEXTURE_2D, internalFormat, image, first, image.levels);
+        if (first == 0)
+        {
+            completed++;
+            return 0;
+        }
+
+        Stream stream;
+        stream.id = id;
+        stream.alive = alive;
+        stream.internalFormat = internalFormat;
+        stream.image = image;
+        stream.baseLevel = first;
+        stream.progress = progress;
+        pending.push_back(stream);
+        pendingBytes += image.LevelOffset(first);
+        return first;
+    }
+
+    // GL thread, once per frame. Uploads finer levels until the frame budget is spent, at least one level so
+    // that levels larger than the budget still get through. Returns the bytes uploaded.
+    size_t Update()
+    {
+        size_t spent = 0;
+        while (!pending.empty())
+        {
+            for (size_t i = pending.size(); i-- > 0;)
+                if (pending[i].alive.expired())
+                    drop(i);
+            if (pending.empty())
+                break;
+            size_t next = 0;
+            for (size_t i = 1; i < pending.size(); i++)
+                if (nextSize(pending[i]) < nextSize(pending[next]))
+                    next = i;
+
+            Stream &stream = pending[next];
+            unsigned int level = stream.baseLevel - 1;
+            size_t bytes = stream.image.LevelSize(level);
+            if (spent > 0 && spent + bytes > frameBudget)
+                break;
+            glBindTexture(GL_TEXTURE_2D, stream.id);
+            texImageLevelRange(GL_TEXTURE_2D, stream.internalFormat, stream.image, level, level + 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+            stream.baseLevel = level;
+            spent += bytes;
+            pendingBytes -= bytes;
+            bytesStreamed += bytes;
+            if (stream.progress)
+                stream.progress(level);
+            if (level == 0)
+            {
+                completed++;
+                drop(next);
+            }
+        }
+        return spent;
+    }
+
+    size_t Pending() const { return pending.size(); }
+    size_t PendingBytes() const { return pendingBytes; }
+
+    // forgets every pending texture, which releases their images
+    void Clear()
+    {
+        while (!pending.empty())
+            drop(pending.size() - 1);
+    }
+
+private:
+    struct Stream {
+        GLuint id;
+        std::weak_ptr<const void> alive;
+        GLint internalFormat;
+        DecodedImage image;
+        unsigned int baseLevel;
+        ProgressFn progress;
+    };
+
+    size_t frameBudget;
+    int previewSize;
+    size_t pendingBytes;
+    std::vector<Stream> pending;
+
+    static size_t nextSize(const Stream &stream)
+    {
+        return stream.image.LevelSize(stream.baseLevel - 1);
+    }
+
+    void drop(size_t index)
+    {
+        pendingBytes -= pending[index].image.LevelOffset(pending[index].baseLevel);
+        pending[index].image.Free();
+        pending.erase(pending.begin() + index);
+    }
+};
+#endif
@@ -0,0 +1,380 @@
+
+
+#ifndef TEXTURE_UPLOAD_H
+#define TEXTURE_UPLOAD_H
+
+#include <glad/glad.h>
+
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+
+// number of mip levels of a full chain down to 1x1
+inline unsigned int mipLevelCount(int width, int height)
+{
+    unsigned int levels = 1;
+    while (width > 1 || height > 1)
+    {
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        levels++;
+    }
+    return levels;
+}
+
+// size in bytes of the first levels of a tightly packed 8 bit mip chain
+inline size_t mipChainSize(int width, int height, int channels, unsigned int levels)
+{
+    size_t size = 0;
+    for (unsigned int level = 0; level < levels; level++)
+    {
+        size += (size_t)width * height * channels;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    return size;
+}
+
+// one row of the 2x2 box filter below, from two rows of the finer level
+inline void downsampleRow(const unsigned char *row0, const unsigned char *row1, int width, int channels, unsigned char *out)
+{
+    int dstWidth = width > 1 ? width / 2 : 1;
+    for (int x = 0; x < dstWidth; x++)
+    {
+        int x0 = (x * 2 < width ? x * 2 : width - 1) * channels;
+        int x1 = (x * 2 + 1 < width ? x * 2 + 1 : width - 1) * channels;
+        for (int c = 0; c < channels; c++)
+            out[x * channels + c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+    }
+}
+
+// 2x2 box filter of an 8 bit image into the next mip level; odd edges fold the last row/column in
+inline void downsampleImage(const unsigned char *src, int width, int height, int channels, unsigned char *dst)
+{
+    int dstWidth = width > 1 ? width / 2 : 1;
+    int dstHeight = height > 1 ? height / 2 : 1;
+    for (int y = 0; y < dstHeight; y++)
+    {
+        int y0 = y * 2 < height ? y * 2 : height - 1;
+        int y1 = y * 2 + 1 < height ? y * 2 + 1 : height - 1;
+        downsampleRow(src + (size_t)y0 * width * channels, src + (size_t)y1 * width * channels, width, channels,
+                      dst + (size_t)y * dstWidth * channels);
+    }
+}
+
+// Writes a mip chain, the same as downsampleImage() level after level, from rows that arrive top to bottom.
+// Each level only keeps its last even row until the odd row below it arrives, so a whole chain is built
+// with a few rows of memory and dst, which may be write combined staging memory, is only ever written.
+// written, if given, sees every row as well, with its offset from dst, to copy the chain elsewhere as it grows.
+class MipChainWriter
+{
+public:
+    typedef std::function<void(size_t, const unsigned char *, size_t)> RowFn; // offset, row, bytes
+
+    MipChainWriter(int width, int height, int channels, unsigned int levels, unsigned char *dst,
+                   RowFn written = RowFn())
+        : channels(channels), chain(levels), written(written)
+    {
+        size_t offset = 0;
+        for (unsigned int l = 0; l < levels; l++)
+        {
+            Level &level = chain[l];
+            level.width = width;
+            level.height = height;
+            level.rows = 0;
+            level.dst = dst + offset;
+            level.offset = offset;
+            offset += (size_t)width * height * channels;
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+            if (l + 1 < levels)
+            {
+                level.pending.resize((size_t)level.width * channels);
+                level.next.resize((size_t)width * channels);
+            }
+        }
+    }
+
+    // the next row of level 0
+    void AddRow(const unsigned char *row)
+    {
+        addRow(0, row);
+    }
+
+private:
+    struct Level {
+        int width;
+        int height;
+        int rows;                           // rows written so far
+        unsigned char *dst;
+        size_t offset;                      // of dst from the start of the chain
+        std::vector<unsigned char> pending; // last even row
+        std::vector<unsigned char> next;    // row of the next level being built
+    };
+
+    int channels;
+    std::vector<Level> chain;
+    RowFn written;
+
+    void addRow(unsigned int l, const unsigned char *row)
+    {
+        Level &level = chain[l];
+        size_t rowBytes = (size_t)level.width * channels;
+        memcpy(level.dst + (size_t)level.rows * rowBytes, row, rowBytes);
+        if (written)
+            written(level.offset + (size_t)level.rows * rowBytes, row, rowBytes);
+        int y = level.rows++;
+        if (l + 1 >= chain.size())
+            return;
+        const unsigned char *row0 = row;
+        if (level.height > 1)
+        {
+            // the last row of an odd height has no partner and does not reach the next level
+            if (y % 2 == 0)
+            {
+                memcpy(&level.pending[0], row, rowBytes);
+                return;
+            }
+            row0 = &level.pending[0];
+        }
+        downsampleRow(row0, row, level.width, channels, &level.next[0]);
+        addRow(l + 1, &level.next[0]);
+    }
+};
+
+// writes level 0 and levels - 1 box filtered mips of an image back to back into dst
+inline void writeMipChain(const unsigned char *pixels, int width, int height, int channels, unsigned int levels, unsigned char *dst)
+{
+    MipChainWriter writer(width, height, channels, levels, dst);
+    for (int y = 0; y < height; y++)
+        writer.AddRow(pixels + (size_t)y * width * channels);
+}
+
+class UploadService;
+
+// A range of the staging ring. ptr can be written from any thread until the first upload from the block.
+struct StagingBlock {
+    UploadService *service;
+    unsigned long id;
+    size_t offset;      // offset into the pixel unpack buffer
+    size_t size;
+    unsigned char *ptr; // persistently mapped address of offset
+
+    StagingBlock() : service(0), id(0), offset(0), size(0), ptr(0)
+    {
+    }
+
+    bool Valid() const { return ptr != 0; }
+};
+
+// Texture upload service built around one persistently mapped pixel unpack buffer used as a ring.
+// Any thread can allocate a block and write pixels into it; the GL thread issues glTexImage2D/glTexSubImage2D
+// with the buffer bound, so the driver copies from the buffer asynchronously instead of from client memory,
+// then fences the block. Retire() recycles released blocks whose fence has signalled, strictly in
+// allocation order.
+//
+// Persistent mapping needs ARB_buffer_storage (core in 4.4). Without it the service stays disabled,
+// Allocate() fails and callers fall back to uploading from client memory.
+class UploadService
+{
+public:
+    // statistics, bytes uploaded through the ring and bytes that had to take the client memory path
+    size_t bytesStaged;
+    size_t bytesFallback;
+    size_t peakInFlight;
+
+    explicit UploadService(size_t capacity) : bytesStaged(0), bytesFallback(0), peakInFlight(0),
+                                              buffer(0), mapped(0), capacity(capacity), head(0), nextId(1)
+    {
+#ifdef GL_ARB_buffer_storage
+        if (GLAD_GL_ARB_buffer_storage)
+        {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, capacity, 0, flags);
+            mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, capacity, flags);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+#endif
+        if (!mapped)
+            std::cout << "Persistent mapping not available, textures are uploaded from client memory" << std::endl;
+    }
+
+    ~UploadService()
+    {
+        Destroy();
+    }
+
+    // GL thread, frees the buffer and fences while the context is still current. Safe to call twice.
+    void Destroy()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < regions.size(); i++)
+            if (regions[i].fence)
+                glDeleteSync(regions[i].fence);
+        regions.clear();
+        if (buffer)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            glDeleteBuffers(1, &buffer);
+            buffer = 0;
+        }
+        mapped = 0;
+    }
+
+    bool Enabled() const { return mapped != 0; }
+
+    // any thread. Returns an invalid block if the ring is disabled or does not have size bytes free right now.
+    StagingBlock Allocate(size_t size)
+    {
+        StagingBlock block;
+        if (!mapped || size == 0 || size > capacity)
+            return block;
+        // keep every block 16 byte aligned, which also satisfies any unpack alignment
+        size = (size + 15) & ~(size_t)15;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t offset;
+        if (regions.empty())
+        {
+            head = 0;
+            offset = 0;
+        }
+        else
+        {
+            size_t tail = regions.front().begin;
+            if (head >= tail)
+            {
+                if (capacity - head >= size)
+                    offset = head;
+                else if (tail > size)
+                    offset = 0;
+                else
+                    return block;
+            }
+            else if (tail - head > size)
+                offset = head;
+            else
+                return block;
+        }
+        Region region;
+        region.id = nextId++;
+        region.begin = offset;
+        region.end = offset + size;
+        region.fence = 0;
+        region.done = false;
+        regions.push_back(region);
+        head = offset + size;
+
+        size_t inFlight = head >= regions.front().begin ? head - regions.front().begin : capacity - regions.front().begin + head;
+        peakInFlight = inFlight > peakInFlight ? inFlight : peakInFlight;
+
+        block.service = this;
+        block.id = region.id;
+        block.offset = offset;
+        block.size = size;
+        block.ptr = mapped + offset;
+        return block;
+    }
+
+    // GL thread. Binds the ring so that a following glTexImage2D reads from block, offset is returned as the
+    // pointer argument to pass. Call End() once the uploads reading from the block have been issued.
+    const void *Begin(const StagingBlock &block)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        return (const void*)block.offset;
+    }
+
+    // GL thread. Unbinds the ring and fences the bytes just uploaded from block. A block can be uploaded
+    // from several times (identical cube map faces, mip levels streamed over frames), the last fence covers all.
+    void End(const StagingBlock &block, size_t bytes)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        std::lock_guard<std::mutex> lock(mutex);
+        bytesStaged += bytes;
+        Region *region = find(block.id);
+        if (region)
+        {
+            if (region->fence)
+                glDeleteSync(region->fence);
+            region->fence = fence;
+        }
+        else
+            glDeleteSync(fence);
+    }
+
+    // any thread, hands a block back once nothing will upload from it anymore. It is recycled as soon as
+    // the GPU has consumed the uploads fenced by End().
+    void Release(const StagingBlock &block)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Region *region = find(block.id);
+        if (region)
+            region->done = true;
+    }
+
+    // GL thread, call once per frame (and while waiting for uploads) to recycle consumed blocks
+    void Retire()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!regions.empty() && regions.front().done)
+        {
+            Region &region = regions.front();
+            if (region.fence)
+            {
+                GLenum status = glClientWaitSync(region.fence, 0, 0);
+                if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                    break;
+                glDeleteSync(region.fence);
+            }
+            regions.pop_front();
+        }
+    }
+
+    // any thread, records an upload that bypassed the ring
+    void CountFallback(size_t size)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bytesFallback += size;
+    }
+
+    size_t Capacity() const { return capacity; }
+    GLuint Buffer() const { return buffer; }
+
+private:
+    struct Region {
+        unsigned long id;
+        size_t begin;
+        size_t end;
+        GLsync fence;
+        bool done;
+    };
+
+    GLuint buffer;
+    unsigned char *mapped;
+    size_t capacity;
+    size_t head;
+    unsigned long nextId;
+    std::deque<Region> regions;
+    std::mutex mutex;
+
+    Region *find(unsigned long id)
+    {
+        for (size_t i = 0; i < regions.size(); i++)
+            if (regions[i].id == id)
+                return &regions[i];
+        return 0;
+    }
+
+    UploadService(const UploadService &);
+    UploadService &operator=(const UploadService &);
+};
+#endif
@@ -0,0 +1,608 @@
+
+
+#ifndef TILE_FETCH_H
+#define TILE_FETCH_H
+
+#include <mapped_file.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET SocketHandle;
+#define INVALID_SOCKET_HANDLE INVALID_SOCKET
+inline void closeSocket(SocketHandle socket) { closesocket(socket); }
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int SocketHandle;
+#define INVALID_SOCKET_HANDLE (-1)
+inline void closeSocket(SocketHandle socket) { close(socket); }
+#endif
+
+// a peer that closed the connection fails the send instead of raising SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SOCKET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SOCKET_SEND_FLAGS 0
+#endif
+
+enum FetchKind {
+    FETCH_FILE,     // read() from files under a directory
+    FETCH_MAPPED,   // files under a directory mapped into memory, handed out in place
+    FETCH_HTTP      // GET with a Range header from a server, over kept alive connections
+};
+
+// A plain HTTP/1.1 connection that is kept open between requests. Responses need a Content-Length, which is
+// what tile servers (and tools/tile_server.cpp) send; chunked transfers are not supported.
+class HttpConnection
+{
+public:
+    // largest body taken for a whole resource, a server ignoring Range answers with one too
+    static const uint64_t MAX_WHOLE_BODY = (uint64_t)256 << 20;
+
+    HttpConnection() : socket(INVALID_SOCKET_HANDLE), start(0), end(0), opened(0)
+    {
+    }
+
+    ~HttpConnection()
+    {
+        Close();
+    }
+
+    void Close()
+    {
+        if (socket != INVALID_SOCKET_HANDLE)
+            closeSocket(socket);
+        socket = INVALID_SOCKET_HANDLE;
+        start = end = 0;
+    }
+
+    // GETs count bytes at offset of target, the whole resource if count is 0. Status and body are filled in;
+    // false if the server could not be reached or answered with a body of another size than asked for (a 206) or
+    // larger than MAX_WHOLE_BODY (anything else), which is not read then. A request on a connection the server closed meanwhile is sent
+    // again on a new one.
+    bool Get(const std::string &host, const std::string &port, const std::string &target, uint64_t offset,
+             uint64_t count, int &status, std::vector<unsigned char> &body)
+    {
+        char request[1024];
+        int length = count > 0
+            ? snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%llu-%llu\r\n\r\n",
+                       target.c_str(), host.c_str(), (unsigned long long)offset, (unsigned long long)(offset + count - 1))
+            : snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", target.c_str(), host.c_str());
+        if (length <= 0 || length >= (int)sizeof(request))
+            return false;
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            bool reused = socket != INVALID_SOCKET_HANDLE;
+            if (!reused && !connect(host, port))
+                return false;
+            if (sendAll(request, (size_t)length) && readResponse(count, status, body))
+                return true;
+            Close();
+            if (!reused)
+                return false;
+        }
+        return false;
+    }
+
+    // connections opened so far, 1 as long as the server keeps it alive
+    unsigned int Opened() const { return opened; }
+
+private:
+    SocketHandle socket;
+    char buffer[16384];
+    size_t start, end;      // unread bytes in buffer
+    unsigned int opened;
+
+    bool connect(const std::string &host, const std::string &port)
+    {
+        addrinfo hints, *addresses = 0;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+            return false;
+        for (addrinfo *address = addresses; address && socket == INVALID_SOCKET_HANDLE; address = address->ai_next)
+        {
+            socket = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (socket == INVALID_SOCKET_HANDLE)
+                continue;
+            if (::connect(socket, address->ai_addr, (int)address->ai_addrlen) != 0)
+                Close();
+        }
+        freeaddrinfo(addresses);
+        if (socket == INVALID_SOCKET_HANDLE)
+            return false;
+        // requests are small and answered one at a time, Nagle would only delay them
+        int noDelay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+#ifdef SO_NOSIGPIPE
+        setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&noDelay, sizeof(noDelay));
+#endif
+        opened++;
+        return true;
+    }
+
+    bool sendAll(const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            int sent = (int)send(socket, data, (int)std::min(size, (size_t)1 << 30), SOCKET_SEND_FLAGS);
+            if (sent <= 0)
+                return false;
+            data += sent;
+            size -= (size_t)sent;
+        }
+        return true;
+    }
+
+    bool fill()
+    {
+        if (start == end)
+            start = end = 0;
+        if (end == sizeof(buffer))
+            return false;
+        int received = (int)recv(socket, buffer + end, (int)(sizeof(buffer) - end), 0);
+        if (received <= 0)
+            return false;
+        end += (size_t)received;
+        return true;
+    }
+
+    // the response to a request for count bytes, 0 for the whole resource
+    bool readResponse(uint64_t count, int &status, std::vector<unsigned char> &body)
+    {
+        // status line and headers
+        std::string headers;
+        for (;;)
+        {
+            const char *found = 0;
+            for (size_t i = start; i + 3 < end && !found; i++)
+                if (memcmp(buffer + i, "\r\n\r\n", 4) == 0)
+                    found = buffer + i;
+            if (found)
+            {
+                headers.assign(buffer + start, (size_t)(found + 4 - (buffer + start)));
+                start = (size_t)(found + 4 - buffer);
+                break;
+            }
+            if (start > 0)
+            {
+                memmove(buffer, buffer + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            if (!fill())
+                return false;
+        }
+        if (sscanf(headers.c_str(), "HTTP/1.%*d %d", &status) != 1)
+            return false;
+        std::string lower(headers);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        size_t field = lower.find("\r\ncontent-length:");
+        if (field == std::string::npos)
+            return false;
+        uint64_t length = strtoull(lower.c_str() + field + 17, 0, 10);
+        bool close = lower.find("\r\nconnection: close") != std::string::npos;
+        // the length is the server's word, never allocated for unchecked
+        if (status == 206 ? length != count : length > MAX_WHOLE_BODY)
+            return false;
+
+        body.resize((size_t)length);
+        size_t copied = 0;
+        while (copied < length)
+        {
+            if (start == end && !fill())
+                return false;
+            size_t count = std::min(end - start, (size_t)(length - copied));
+            memcpy(&body[copied], buffer + start, count);
+            copied += count;
+            start += count;
+        }
+        if (close)
+            Close();
+        return true;
+    }
+};
+
+// Fetches byte ranges of resources from a pluggable backend, asynchronously: a directory of files, the same
+// mapped into memory, or a tile server over HTTP. Resources are paths relative to the location given to
+// Open(), "./src/textures/a.jpg" is "src/textures/a.jpg" on a server; an empty directory takes local paths as
+// they are.
+//
+// Requests are queued and served by a fixed number of I/O threads (for HTTP one kept alive connection each),
+// which is the limit on requests in flight. A thread takes the oldest request and every queued request of the
+// same resource close enough to it into one batch, read as a single range, so that tiles queued together
+// reach a server as one request. The done function runs on the I/O thread with the bytes, which are only
+// valid during the call, or with 0 if the request failed.
+class TileFetcher
+{
+public:
+    typedef std::function<void(const unsigned char *, size_t)> DoneFn;
+
+    // statistics
+    uint64_t requests;          // completed, batched ones each count
+    uint64_t batches;           // reads or HTTP requests that served them
+    uint64_t bytesTransferred;  // read from disk or received, including the gaps batches bridge
+    uint64_t failures;
+    unsigned int connectionsOpened; // HTTP, one per thread while the server keeps them alive
+
+    TileFetcher() : requests(0), batches(0), bytesTransferred(0), failures(0), connectionsOpened(0), kind(FETCH_FILE),
+                    mergeGap(64 * 1024), maxBatchBytes(4 * 1024 * 1024), stop(true), busy(0), nextLatency(0),
+                    start(std::chrono::high_resolution_clock::now())
+    {
+    }
+
+    ~TileFetcher()
+    {
+        Close();
+    }
+
+    // a directory (or "") for FETCH_FILE and FETCH_MAPPED, http://host[:port][/path] for FETCH_HTTP
+    bool Open(const std::string &location, FetchKind kind, int threads = 4)
+    {
+        Close();
+        this->kind = kind;
+        root = location;
+        if (kind == FETCH_HTTP)
+        {
+            if (location.compare(0, 7, "http://") != 0)
+                return false;
+            std::string rest = location.substr(7);
+            size_t slash = rest.find('/');
+            std::string authority = rest.substr(0, slash);
+            root = slash == std::string::npos ? "/" : rest.substr(slash);
+            if (root[root.size() - 1] != '/')
+                root += '/';
+            size_t colon = authority.find(':');
+            host = authority.substr(0, colon);
+            port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+#ifdef _WIN32
+            WSADATA data;
+            WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+        }
+        else if (!root.empty() && root[root.size() - 1] != '/')
+            root += '/';
+
+        stop = false;
+        for (int i = 0; i < std::max(threads, 1); i++)
+            workers.push_back(std::thread(&TileFetcher::workerLoop, this));
+        return true;
+    }
+
+    // "http://" locations are servers, anything else a local directory, mapped when mapped is set
+    bool Open(const std::string &location, bool mapped = true, int threads = 4)
+    {
+        return Open(location, location.compare(0, 7, "http://") == 0 ? FETCH_HTTP : (mapped ? FETCH_MAPPED : FETCH_FILE),
+                    threads);
+    }
+
+    // waits for the requests in flight, queued ones are failed
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        workers.clear();
+        std::deque<Request> abandoned;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            abandoned.swap(queue);
+        }
+        for (size_t i = 0; i < abandoned.size(); i++)
+            abandoned[i].done(0, 0);
+        mapped.clear();
+    }
+
+    FetchKind Kind() const { return kind; }
+    bool Remote() const { return kind == FETCH_HTTP; }
+    int Threads() const { return (int)workers.size(); }
+
+    // requests further apart than gap bytes are not batched, batches stop growing at maxBytes
+    void SetBatching(size_t gap, size_t maxBytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        mergeGap = gap;
+        maxBatchBytes = maxBytes;
+    }
+
+    // size bytes at offset of resource, size 0 fetches the whole resource. Fails right away when not open.
+    void Fetch(const std::string &resource, uint64_t offset, size_t size, DoneFn done)
+    {
+        Request request;
+        request.resource = normalise(resource);
+        request.offset = offset;
+        request.size = size;
+        request.done = done;
+        request.queuedMs = elapsedMs();
+        bool queued;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued = !stop;
+            if (queued)
+                queue.push_back(request);
+        }
+        if (queued)
+            wake.notify_one();
+        else
+            done(0, 0);
+    }
+
+    // blocking Fetch(), any thread but the I/O threads
+    bool Read(const std::string &resource, uint64_t offset, size_t size, std::vector<unsigned char> &out)
+    {
+        struct Result {
+            std::mutex mutex;
+            std::condition_variable done;
+            bool finished;
+            bool ok;
+        };
+        std::shared_ptr<Result> result(new Result());
+        result->finished = false;
+        result->ok = false;
+        std::vector<unsigned char> *target = &out;
+        Fetch(resource, offset, size, [result, target](const unsigned char *data, size_t bytes)
+        {
+            if (data)
+                target->assign(data, data + bytes);
+            std::lock_guard<std::mutex> lock(result->mutex);
+            result->ok = data != 0;
+            result->finished = true;
+            result->done.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(result->mutex);
+        while (!result->finished)
+            result->done.wait(lock);
+        return result->ok;
+    }
+
+    // requests waiting for an I/O thread, and batches being read
+    size_t Queued() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    int Busy() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return busy;
+    }
+
+    // milliseconds from Fetch() to done over the last requests, fraction 0.5 is the median
+    double LatencyPercentile(double fraction) const
+    {
+        std::vector<float> sorted;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sorted = latencies;
+        }
+        if (sorted.empty())
+            return 0.0;
+        size_t index = std::min((size_t)(fraction * sorted.size()), sorted.size() - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+private:
+    enum {
+        LATENCY_SAMPLES = 512
+    };
+
+    struct Request {
+        std::string resource;
+        uint64_t offset;
+        size_t size;
+        DoneFn done;
+        double queuedMs;
+    };
+
+    FetchKind kind;
+    std::string root;               // directory, or path prefix on the server
+    std::string host;
+    std::string port;
+    size_t mergeGap;
+    size_t maxBatchBytes;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Request> queue;
+    bool stop;
+    int busy;
+    std::vector<std::thread> workers;
+    std::map<std::string, std::shared_ptr<MappedFile> > mapped;
+    std::vector<float> latencies;
+    size_t nextLatency;
+    std::chrono::high_resolution_clock::time_point start;
+
+    TileFetcher(const TileFetcher &);
+    TileFetcher &operator=(const TileFetcher &);
+
+    double elapsedMs() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    std::string normalise(const std::string &resource) const
+    {
+        size_t first = 0;
+        while (resource.compare(first, 2, "./") == 0)
+            first += 2;
+        // absolute local paths stay absolute without a directory to be relative to
+        while (first < resource.size() && resource[first] == '/' && (kind == FETCH_HTTP || !root.empty()))
+            first++;
+        return resource.substr(first);
+    }
+
+    // the oldest request and every queued one of the same resource that extends it by less than the gap
+    void takeBatch(std::vector<Request> &batch, uint64_t &begin, uint64_t &end)
+    {
+        batch.assign(1, queue.front());
+        queue.pop_front();
+        begin = batch[0].offset;
+        end = batch[0].offset + batch[0].size;
+        if (batch[0].size == 0)
+            return;
+        for (bool grew = true; grew;)
+        {
+            grew = false;
+            for (std::deque<Request>::iterator it = queue.begin(); it != queue.end();)
+            {
+                uint64_t first = std::min(begin, it->offset);
+                uint64_t last = std::max(end, it->offset + it->size);
+                if (it->size == 0 || it->resource != batch[0].resource || it->offset > end + mergeGap ||
+                    it->offset + it->size + mergeGap < begin || last - first > maxBatchBytes)
+                {
+                    ++it;
+                    continue;
+                }
+                begin = first;
+                end = last;
+                batch.push_back(*it);
+                it = queue.erase(it);
+                grew = true;
+            }
+        }
+    }
+
+    void workerLoop()
+    {
+        HttpConnection connection;
+        std::vector<Request> batch;
+        std::vector<unsigned char> data;
+        for (;;)
+        {
+            uint64_t begin, end;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!stop && queue.empty())
+                    wake.wait(lock);
+                if (stop)
+                    return;
+                takeBatch(batch, begin, end);
+                busy++;
+            }
+
+            const unsigned char *bytes = 0;
+            size_t size = 0;
+            unsigned int opened = connection.Opened();
+            std::shared_ptr<MappedFile> file;
+            if (kind == FETCH_MAPPED)
+            {
+                file = mapping(batch[0].resource);
+                if (file && (batch[0].size == 0 || end <= file->Size()))
+                {
+                    bytes = file->Data() + begin;
+                    size = batch[0].size == 0 ? file->Size() : (size_t)(end - begin);
+                }
+            }
+            else if (read(connection, batch[0].resource, begin, end, batch[0].size == 0, data))
+            {
+                bytes = data.empty() ? (const unsigned char*)"" : &data[0];
+                size = data.size();
+            }
+
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                const Request &request = batch[i];
+                if (bytes && request.size == 0)
+                    request.done(bytes, size);
+                else if (bytes)
+                    request.done(bytes + (request.offset - begin), request.size);
+                else
+                    request.done(0, 0);
+            }
+
+            double now = elapsedMs();
+            std::lock_guard<std::mutex> lock(mutex);
+            busy--;
+            batches++;
+            connectionsOpened += connection.Opened() - opened;
+            requests += batch.size();
+            failures += bytes ? 0 : batch.size();
+            bytesTransferred += size;
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                float latency = (float)(now - batch[i].queuedMs);
+                if (latencies.size() < (size_t)LATENCY_SAMPLES)
+                    latencies.push_back(latency);
+                else
+                    latencies[nextLatency++ % LATENCY_SAMPLES] = latency;
+            }
+        }
+    }
+
+    std::shared_ptr<MappedFile> mapping(const std::string &resource)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::string, std::shared_ptr<MappedFile> >::iterator it = mapped.find(resource);
+        if (it != mapped.end())
+            return it->second;
+        std::shared_ptr<MappedFile> file(new MappedFile());
+        if (!file->Open(root + resource))
+            return std::shared_ptr<MappedFile>();
+        mapped[resource] = file;
+        return file;
+    }
+
+    // bytes [begin, end) of resource, or all of it
+    bool read(HttpConnection &connection, const std::string &resource, uint64_t begin, uint64_t end, bool whole,
+              std::vector<unsigned char> &data)
+    {
+        if (kind == FETCH_HTTP)
+        {
+            int status = 0;
+            if (!connection.Get(host, port, root + resource, begin, whole ? 0 : end - begin, status, data))
+                return false;
+            // a server that ignores Range answers with the whole resource
+            if (status == 200 && !whole)
+            {
+                if (data.size() < end)
+                    return false;
+                data.erase(data.begin() + (size_t)end, data.end());
+                data.erase(data.begin(), data.begin() + (size_t)begin);
+            }
+            return status == 200 || (status == 206 && data.size() == end - begin);
+        }
+
+        FILE *file = fopen((root + resource).c_str(), "rb");
+        if (!file)
+            return false;
+        if (whole)
+        {
+            int64_t modified, size;
+            end = fileStatus(root + resource, modified, size) ? (uint64_t)size : 0;
+        }
+        data.resize((size_t)(end - begin));
+        bool ok = seekFile(file, begin) && (data.empty() || fread(&data[0], data.size(), 1, file) == 1);
+        fclose(file);
+        return ok;
+    }
+};
+#endif
@@ -0,0 +1,430 @@
+
+
+#ifndef VIEWSHED_H
+#define VIEWSHED_H
+
+#include <glm/glm.hpp>
+
+#include <height_field.h>
+#include <job_system.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VIEWSHED_SSE2 1
+#endif
+
+// An observer on the terrain
+struct ViewshedObserver {
+    glm::vec2 position;     // world x and z
+    float height;           // eye above the ground
+    float radius;           // world units, 0 to see as far as the terrain goes
+};
+
+// Visibility analysis over a HeightField: which samples can be seen from one or more observers.
+//
+// Each observer is swept ring by ring outwards (the XDraw variant of the R2/R3 family): the square ring at distance
+// i along the major axis of an octant gets the horizon of every sample, the steepest slope from the eye over the
+// terrain before it, from the two samples of ring i - 1 its line of sight passes between. A sample is visible if a
+// target on it is not below its horizon. That is a line of sight test against every sample in O(1) each, and for
+// sample j of ring i the two are samples j - 1 and j of ring i - 1, so samples go four at a time with SSE2: along
+// the rings where a ring is a row, in strips of rows across the rings where it would be a column.
+//
+// The eight octants of an observer are independent and every sample belongs to exactly one of them, so they are
+// the jobs; observers are worked on a few at a time, each into a plane of its own, and the planes are added up
+// row by row into the raster. Raster() holds the number of observers that see each sample, saturated at 255, row
+// major like the height field's samples.
+class Viewshed
+{
+public:
+    // statistics, of the last Compute()
+    double computeMs;
+    size_t visibleSamples;      // seen by at least one observer
+    unsigned int observers;     // that were on the terrain
+
+    explicit Viewshed(const HeightField &field, JobSystem *jobs = nullptr)
+        : computeMs(0.0), visibleSamples(0), observers(0), field(field), width(0), height(0), lowest(0.0f)
+    {
+        Build(jobs);
+    }
+
+    // copies the heights out of the field, again after they change
+    void Build(JobSystem *jobs = nullptr)
+    {
+        width = field.Width();
+        height = field.Height();
+        heights.assign((size_t)width * height, 0.0f);
+        raster.assign((size_t)width * height, 0);
+        float scale = field.HeightScale() / 65535.0f;
+        parallelFor(jobs, 0, (size_t)height, 16, [&](size_t begin, size_t end)
+        {
+            for (int y = (int)begin; y < (int)end; y++)
+                for (int x = 0; x < width; x++)
+                    heights[(size_t)y * width + x] = field.HeightOffset() + field.Sample(x, y) * scale;
+        });
+        lowest = heights.empty() ? 0.0f : *std::min_element(heights.begin(), heights.end());
+    }
+
+    // copies the heights of samples [x0, x1) x [y0, y1) again after they changed. The lowest height only ever
+    // goes down, the horizon of the eyes just has to stay below every slope.
+    void Update(int x0, int y0, int x1, int y1)
+    {
+        float scale = field.HeightScale() / 65535.0f;
+        for (int y = std::max(y0, 0); y < std::min(y1, height); y++)
+            for (int x = std::max(x0, 0); x < std::min(x1, width); x++)
+            {
+                float h = field.HeightOffset() + field.Sample(x, y) * scale;
+                heights[(size_t)y * width + x] = h;
+                lowest = std::min(lowest, h);
+            }
+    }
+
+    // visibility of a target targetHeight above the ground on every sample
+    void Compute(const std::vector<ViewshedObserver> &list, float targetHeight, JobSystem *jobs = nullptr)
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        std::vector<Setup> setups;
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            Setup setup;
+            if (setupObserver(list[i], targetHeight, setup))
+                setups.push_back(setup);
+        }
+        observers = (unsigned int)setups.size();
+
+        // eight octant jobs per observer, enough observers at a time to keep every thread busy
+        size_t batch = jobs ? std::max<size_t>((jobs->NumThreads() + 7) / 8, 1) : 1;
+        batch = std::min(batch, std::max<size_t>(setups.size(), 1));
+        if (planes.size() < batch)
+            planes.resize(batch);
+        for (size_t i = 0; i < batch && !setups.empty(); i++)
+            planes[i].resize((size_t)width * height);
+
+        std::vector<uint32_t> rowVisible(height, 0);
+        size_t first = 0;
+        do
+        {
+            size_t count = std::min(batch, setups.size() - first);
+            parallelFor(jobs, 0, count * 8, 1, [&](size_t begin, size_t end)
+            {
+                for (size_t task = begin; task < end; task++)
+                    sweepOctant(setups[first + task / 8], (int)(task % 8), &planes[task / 8][0]);
+            });
+            bool last = first + count >= setups.size();
+            parallelFor(jobs, 0, (size_t)height, 16, [&](size_t begin, size_t end)
+            {
+                for (int y = (int)begin; y < (int)end; y++)
+                {
+                    uint8_t *row = &raster[(size_t)y * width];
+                    if (first == 0)
+                        memset(row, 0, width);
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        const Setup &setup = setups[first + i];
+                        if (y >= setup.y0 && y <= setup.y1)
+                            accumulate(row + setup.x0, &planes[i][(size_t)y * width + setup.x0], setup.x1 - setup.x0 + 1);
+                    }
+                    if (last)
+                        rowVisible[y] = countNonZero(row, width);
+                }
+            });
+            first += count;
+        } while (first < setups.size());
+
+        visibleSamples = 0;
+        for (int y = 0; y < height; y++)
+            visibleSamples += rowVisible[y];
+        computeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    const uint8_t *Raster() const { return raster.empty() ? 0 : &raster[0]; }
+
+    size_t Bytes() const
+    {
+        size_t bytes = heights.size() * sizeof(float) + raster.size();
+        for (size_t i = 0; i < planes.size(); i++)
+            bytes += planes[i].size();
+        return bytes;
+    }
+
+    static const char *SimdPath()
+    {
+#if defined(VIEWSHED_SSE2)
+        return "SSE2";
+#else
+        return "scalar";
+#endif
+    }
+
+private:
+    struct Setup {
+        int x, y;                   // the observer's sample
+        float eye, target;          // eye height, target height above the ground
+        float open;                 // the horizon of the eye, below every slope to the terrain
+        int reach;                  // rings, in samples
+        float reachSquared;
+        int x0, y0, x1, y1;         // the samples its octants write
+    };
+
+    struct Octant {
+        bool majorX;
+        int rings, minorLimit, firstOwned;
+        ptrdiff_t origin, majorStride, minorStride;
+    };
+
+    const HeightField &field;
+    int width, height;
+    std::vector<float> heights;                 // world heights, row major
+    float lowest;
+    std::vector<uint8_t> raster;
+    std::vector<std::vector<uint8_t> > planes;  // one observer's visibility each
+
+    Viewshed(const Viewshed &);
+    Viewshed &operator=(const Viewshed &);
+
+    template <typename F>
+    static void parallelFor(JobSystem *jobs, size_t begin, size_t end, size_t grain, const F &fn)
+    {
+        if (jobs)
+            jobs->ParallelFor(begin, end, grain, fn);
+        else
+            fn(begin, end);
+    }
+
+    bool setupObserver(const ViewshedObserver &observer, float targetHeight, Setup &setup) const
+    {
+        if (width == 0)
+            return false;
+        float invTexel = 1.0f / field.TexelSize();
+        float sx = std::floor(observer.position.x * invTexel + width * 0.5f);
+        float sy = std::floor(observer.position.y * invTexel + height * 0.5f);
+        if (sx < 0.0f || sy < 0.0f || sx >= (float)width || sy >= (float)height)
+            return false;
+        setup.x = (int)sx;
+        setup.y = (int)sy;
+        setup.eye = heights[(size_t)setup.y * width + setup.x] + observer.height;
+        setup.target = targetHeight;
+        // and not so far below that it swamps the slopes it is interpolated with
+        setup.open = lowest - setup.eye - 1.0f;
+        float reach = observer.radius > 0.0f ? observer.radius * invTexel : (float)std::max(width, height);
+        setup.reach = (int)std::min(std::ceil(reach), (float)std::max(width, height));
+        setup.reachSquared = reach * reach;
+        setup.x0 = std::max(setup.x - setup.reach, 0);
+        setup.y0 = std::max(setup.y - setup.reach, 0);
+        setup.x1 = std::min(setup.x + setup.reach, width - 1);
+        setup.y1 = std::min(setup.y + setup.reach, height - 1);
+        return true;
+    }
+
+    // octant 0..7: the major axis (x for the first four), its direction and the direction of the minor axis.
+    // Samples on the axes belong to the octant on their positive minor side, those on the diagonals to the x major
+    // octants, so the octants write disjoint samples and together every one within reach.
+    void sweepOctant(const Setup &setup, int octant, uint8_t *plane) const
+    {
+        Octant o;
+        o.majorX = octant < 4;
+        int majorSign = (octant & 1) ? -1 : 1, minorSign = (octant & 2) ? -1 : 1;
+        int majorLimit = o.majorX ? (majorSign > 0 ? width - 1 - setup.x : setup.x) : (majorSign > 0 ? height - 1 - setup.y : setup.y);
+        o.minorLimit = o.majorX ? (minorSign > 0 ? height - 1 - setup.y : setup.y) : (minorSign > 0 ? width - 1 - setup.x : setup.x);
+        o.majorStride = majorSign * (o.majorX ? (ptrdiff_t)1 : (ptrdiff_t)width);
+        o.minorStride = minorSign * (o.majorX ? (ptrdiff_t)width : (ptrdiff_t)1);
+        o.origin = (ptrdiff_t)setup.y * width + setup.x;
+        o.rings = std::min(majorLimit, setup.reach);
+        o.firstOwned = minorSign > 0 ? 0 : 1;
+        if (octant == 0)
+            plane[o.origin] = 1;
+        if (o.rings <= 0)
+            return;
+        if (o.majorX)
+            sweepRows(setup, o, plane);
+        else
+            sweepRings(setup, o, plane);
+    }
+
+    // y major octants, ring after ring: a ring is a run of one row
+    void sweepRings(const Setup &setup, const Octant &o, uint8_t *plane) const
+    {
+        // horizons of the last and the current ring, sample j at j + 1 so that j - 1 is always there, with room
+        // for a whole group of four past the end
+        size_t size = (size_t)std::min(o.rings, o.minorLimit) + 8;
+        std::vector<float> previous(size, setup.open), current(size, setup.open), samples(size, 0.0f);
+        std::vector<uint8_t> visible(size, 0);
+        for (int i = 1; i <= o.rings; i++)
+        {
+            int end = std::min(i, o.minorLimit);
+            const float *ring = &heights[o.origin + i * o.majorStride];
+            for (int j = 0; j <= end; j++)
+                samples[j] = ring[j * o.minorStride];
+            // on the ring before, sample i - 1 stands in for the missing i
+            int previousEnd = std::min(i - 1, o.minorLimit);
+            previous[previousEnd + 2] = previous[previousEnd + 1];
+            previous[0] = previous[1];
+            int j = 0;
+#if defined(VIEWSHED_SSE2)
+            Four four(setup, i);
+            for (; j <= end; j += 4)
+            {
+                __m128 horizon;
+                int mask = four.Sweep(j, _mm_loadu_ps(&previous[j]), _mm_loadu_ps(&previous[j + 1]),
+                                      _mm_loadu_ps(&samples[j]), horizon);
+                _mm_storeu_ps(&current[j + 1], horizon);
+                for (int k = 0; k < 4; k++)
+                    visible[j + k] = (uint8_t)((mask >> k) & 1);
+            }
+#endif
+            for (; j <= end; j++)
+                current[j + 1] = sweepOne(setup, i, j, previous[j], previous[j + 1], samples[j], visible[j]);
+
+            uint8_t *out = plane + o.origin + i * o.majorStride;
+            int lastOwned = std::min(i - 1, end);
+            for (j = o.firstOwned; j <= lastOwned; j++)
+                out[j * o.minorStride] = visible[j];
+            previous.swap(current);
+        }
+    }
+
+    // x major octants: a ring would be a column, one cache line and often one page per sample, so they go a strip
+    // of rows at a time instead, along the rows from the observer out, keeping the horizons of the row before the
+    // strip for every ring. Rows past a ring only hold what is needed for the weight of 0 they get on the next.
+    void sweepRows(const Setup &setup, const Octant &o, uint8_t *plane) const
+    {
+        std::vector<float> edge(o.rings + 1, setup.open), nextEdge(o.rings + 1, setup.open);
+        int lastRow = std::min(o.rings, o.minorLimit);
+#if defined(VIEWSHED_SSE2)
+        // sixteen rows, four groups of four that only depend on each other through the ring before
+        const int STRIP = 16;
+#else
+        const int STRIP = 1;
+#endif
+        for (int first = 0; first <= lastRow; first += STRIP)
+        {
+            int lanes = std::min(STRIP, lastRow - first + 1);
+            const float *rows[STRIP];
+            uint8_t *out[STRIP];
+            for (int k = 0; k < STRIP; k++)
+            {
+                rows[k] = &heights[o.origin + (first + std::min(k, lanes - 1)) * o.minorStride];
+                out[k] = plane + o.origin + (first + k) * o.minorStride;
+            }
+            int firstLane = first < o.firstOwned ? o.firstOwned - first : 0;
+#if defined(VIEWSHED_SSE2)
+            __m128 open = _mm_set1_ps(setup.open);
+            __m128 near[4] = { open, open, open, open };
+            for (int i = std::max(first, 1); i <= o.rings; i++)
+            {
+                Four four(setup, i);
+                ptrdiff_t offset = i * o.majorStride;
+                __m128 before = _mm_set1_ps(edge[i - 1]);
+                int masks[4];
+                for (int g = 0; g < 4; g++)
+                {
+                    // far is the row before each: the last of the group before, then this group's first three
+                    __m128 far = _mm_move_ss(_mm_shuffle_ps(near[g], near[g], _MM_SHUFFLE(2, 1, 0, 0)),
+                                             _mm_shuffle_ps(before, before, _MM_SHUFFLE(3, 3, 3, 3)));
+                    const float **r = rows + g * 4;
+                    __m128 samples = _mm_set_ps(r[3][offset], r[2][offset], r[1][offset], r[0][offset]);
+                    before = near[g];
+                    masks[g] = four.Sweep(first + g * 4, far, near[g], samples, near[g]);
+                }
+                int owned = std::min(lanes, i - first + 1);
+                for (int k = firstLane; k < owned; k++)
+                    out[k][offset] = (uint8_t)((masks[k >> 2] >> (k & 3)) & 1);
+                nextEdge[i] = _mm_cvtss_f32(_mm_shuffle_ps(near[3], near[3], _MM_SHUFFLE(3, 3, 3, 3)));
+            }
+#else
+            float near = setup.open;
+            for (int i = std::max(first, 1); i <= o.rings; i++)
+            {
+                ptrdiff_t offset = i * o.majorStride;
+                uint8_t visible;
+                near = sweepOne(setup, i, first, edge[i - 1], near, rows[0][offset], visible);
+                if (firstLane == 0)
+                    out[0][offset] = visible;
+                nextEdge[i] = near;
+            }
+#endif
+            edge.swap(nextEdge);
+        }
+    }
+
+    // sample j of ring i: the line of sight to it crosses ring i - 1 at j - j / i, between its samples j - 1 and j,
+    // whose horizons are far and near. Returns the horizon of the sample.
+    static float sweepOne(const Setup &setup, int i, int j, float far, float near, float sample, uint8_t &visible)
+    {
+        float crossing = near + (far - near) * (j * (1.0f / i));
+        float distanceSquared = (float)i * i + (float)j * j;
+        float invDistance = 1.0f / std::sqrt(distanceSquared);
+        float ground = sample - setup.eye;
+        visible = (ground + setup.target) * invDistance >= crossing && distanceSquared <= setup.reachSquared;
+        return std::max(ground * invDistance, crossing);
+    }
+
+#if defined(VIEWSHED_SSE2)
+    // sweepOne() for samples j..j + 3 of ring i
+    struct Four {
+        __m128 invRing, ringSquared, eye, target, reachSquared;
+
+        Four(const Setup &setup, int i)
+            : invRing(_mm_set1_ps(1.0f / i)), ringSquared(_mm_set1_ps((float)i * i)), eye(_mm_set1_ps(setup.eye)),
+              target(_mm_set1_ps(setup.target)), reachSquared(_mm_set1_ps(setup.reachSquared))
+        {
+        }
+
+        int Sweep(int j, __m128 far, __m128 near, __m128 samples, __m128 &horizon) const
+        {
+            __m128 minor = _mm_add_ps(_mm_set1_ps((float)j), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+            __m128 crossing = _mm_add_ps(near, _mm_mul_ps(_mm_sub_ps(far, near), _mm_mul_ps(minor, invRing)));
+            __m128 distanceSquared = _mm_add_ps(ringSquared, _mm_mul_ps(minor, minor));
+            __m128 invDistance = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(distanceSquared));
+            __m128 ground = _mm_sub_ps(samples, eye);
+            __m128 seen = _mm_and_ps(_mm_cmpge_ps(_mm_mul_ps(_mm_add_ps(ground, target), invDistance), crossing),
+                                     _mm_cmple_ps(distanceSquared, reachSquared));
+            horizon = _mm_max_ps(_mm_mul_ps(ground, invDistance), crossing);
+            return _mm_movemask_ps(seen);
+        }
+    };
+#endif
+
+    // row += plane, saturating
+    static void accumulate(uint8_t *row, const uint8_t *plane, int count)
+    {
+        int i = 0;
+#if defined(VIEWSHED_SSE2)
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i sum = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(row + i)),
+                                        _mm_loadu_si128((const __m128i*)(plane + i)));
+            _mm_storeu_si128((__m128i*)(row + i), sum);
+        }
+#endif
+        for (; i < count; i++)
+            row[i] = (uint8_t)std::min(row[i] + plane[i], 255);
+    }
+
+    static uint32_t countNonZero(const uint8_t *row, int count)
+    {
+        uint32_t total = 0;
+        int i = 0;
+#if defined(VIEWSHED_SSE2)
+        for (; i + 16 <= count; i += 16)
+        {
+            int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + i)), _mm_setzero_si128()));
+            for (int bits = ~zero & 0xFFFF; bits; bits &= bits - 1)
+                total++;
+        }
+#endif
+        for (; i < count; i++)
+            total += row[i] != 0;
+        return total;
+    }
+};
+#endif
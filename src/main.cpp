@@ -6,6 +6,24 @@
 
 #include <shader_t.h>
 #include <camera.h>
+#include <draw_list.h>
+#include <frame_prep.h>
+#include <job_system.h>
+#include <asset_loader.h>
+#include <texture_registry.h>
+#include <texture_streamer.h>
+#include <residency_manager.h>
+#include <raster_reader.h>
+#include <terrain_dataset.h>
+#include <terrain_streamer.h>
+#include <terrain_clipmap.h>
+#include <height_field.h>
+#include <baked_file.h>
+#include <height_ray.h>
+#include <viewshed.h>
+#include <terrain_normals.h>
+#include <terrain_paths.h>
+#include <terrain_sculpt.h>
 //#include <model.h>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -13,6 +31,11 @@
 
 #include <iostream>
 #include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <memory>
 
 #include "imgui.h"
 #include "imgui_impl_opengl3.h"
@@ -22,8 +45,7 @@
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers);
 void processInput(GLFWwindow *window);
-unsigned int loadTexture(const char *path);
-unsigned int loadCubemap(std::vector<std::string> faces);
+float cloudLayerDepth(const glm::mat4 &model);
 
 // settings
 const unsigned int SCR_WIDTH = 1920;
@@ -41,8 +63,52 @@ float lastY = SCR_HEIGHT / 2.0f;
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
-int main()
+int main(int argc, char **argv)
 {
+    // command line: --no-cache decodes every image, --rebuild-cache throws the pixel cache away first,
+    // --cache-size <MiB> caps the pixel cache, --no-progressive uploads whole mip chains before the first
+    // frame, --stream-budget <MiB> sets how much texture data is streamed in per frame otherwise,
+    // --vram-budget <MiB> caps the video memory of textures and buffers (0 = no cap), --terrain <file> streams
+    // another terrain dataset (see tools/terrain_import.cpp), --terrain-slots <N> sizes its tile cache,
+    // --source <dir|http://host:port/path> fetches the terrain from elsewhere, from a server the textures too
+    // (see tools/tile_server.cpp), --clipmap <tiles|heightmap> draws the terrain as a geometry clipmap with heights
+    // from the terrain tiles or from src/terrainmaps/heightmap.png instead of tessellated patches
+    PixelCacheMode cacheMode = CACHE_ENABLED;
+    size_t cacheSize = 2048;
+    bool progressive = true;
+    size_t streamBudget = 8;
+    size_t vramBudget = 0;
+    std::string terrainPath = "./cache/terrain.terrain";
+    int terrainSlots = 64;
+    std::string source;
+    std::string clipmapSource;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--no-cache")
+            cacheMode = CACHE_BYPASS;
+        else if (arg == "--rebuild-cache")
+            cacheMode = CACHE_REBUILD;
+        else if (arg == "--cache-size" && i + 1 < argc)
+            cacheSize = (size_t)atol(argv[++i]);
+        else if (arg == "--no-progressive")
+            progressive = false;
+        else if (arg == "--stream-budget" && i + 1 < argc)
+            streamBudget = (size_t)atol(argv[++i]);
+        else if (arg == "--vram-budget" && i + 1 < argc)
+            vramBudget = (size_t)atol(argv[++i]);
+        else if (arg == "--terrain" && i + 1 < argc)
+            terrainPath = argv[++i];
+        else if (arg == "--terrain-slots" && i + 1 < argc)
+            terrainSlots = atoi(argv[++i]);
+        else if (arg == "--source" && i + 1 < argc)
+            source = argv[++i];
+        else if (arg == "--clipmap" && i + 1 < argc)
+            clipmapSource = argv[++i];
+        else
+            std::cout << "Unknown argument " << arg << std::endl;
+    }
+
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
@@ -78,7 +144,13 @@ int main()
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
+    CompressedFormats::Query();
     
+    // job system shared by loading and frame preparation, this thread is part of it
+    // -------------------------------------------------------------------------------
+    JobSystem jobs(JobSystem::DefaultWorkerCount());
+    std::cout << "Job system running " << jobs.NumThreads() << " threads" << std::endl;
+
     // Setup Dear ImGui context
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
@@ -110,6 +182,9 @@ int main()
                                "./src/shaders/fragment.shader", nullptr,
                                "./src/shaders/tessellation_control.shader",
                                "./src/shaders/tessellation_eval.shader");
+
+    Shader clipmapShader("./src/shaders/clipmap_vertex.shader",
+                         "./src/shaders/fragment.shader");
     
     Shader cloudShader("./src/shaders/cloud_vertex.shader",
                                "./src/shaders/cloud_fragment.shader");
@@ -117,68 +192,291 @@ int main()
     Shader skyboxShader("./src/shaders/skybox_vertex.shader",
                                "./src/shaders/skybox_fragment.shader");
 
+    Shader lineShader("./src/shaders/line_vertex.shader",
+                      "./src/shaders/line_fragment.shader");
+
     //MODELS
     //Shader modelShader("src/shaders/model_v.shader", "src/shaders/model_f.shader");
 
-    // load and create a texture
-    // -------------------------
-    unsigned int heightMap;
-    glGenTextures(1, &heightMap);
+    // load and create textures, every image is decoded on the job system (or mapped from the pixel cache),
+    // copied into the staging ring together with its mip chain and uploaded from there as it arrives
+    // ----------------------------------------------------------------------------------------------------
+    UploadService uploads(64 * 1024 * 1024);
+    ResidencyManager &residency = ResidencyManager::Global();
+    residency.SetBudget(vramBudget * 1024 * 1024);
+    if (uploads.Enabled())
+        residency.TrackBuffer(uploads.Buffer(), uploads.Capacity(), "upload ring");
+    PixelCache pixelCache("./cache", cacheSize * 1024 * 1024, cacheMode);
+    AssetLoader loader(jobs, &uploads, &pixelCache);
+    // terrain tiles and, from a server, images come through the fetcher; local files are mapped
+    TileFetcher fetcher;
+    fetcher.Open(source, true);
+    if (fetcher.Remote())
+    {
+        loader.SetSource(&fetcher, "./cache/remote");
+        std::cout << "Fetching assets from " << source << std::endl;
+    }
+    // every upload has tightly packed rows and relies on this, nothing sets it back
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, heightMap); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-    // set the texture wrapping parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    // set texture filtering parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image, create texture and generate mipmaps
-    int width, height, nrChannels;
-    unsigned char *data = stbi_load("./src/terrainmaps/heightmap.png", &width, &height, &nrChannels, 0);
-    if (data)
+
+    // every texture comes from the registry, which decodes each distinct image once however often it is
+    // requested; the handles keep the textures alive until the end of main
+    TextureRegistry &textures = TextureRegistry::Global();
+    textures.SetLoader(&loader);
+    // progressive: the first frame only waits for the decodes and the smallest mips, finer levels follow
+    // on a per frame budget
+    TextureStreamer streamer(streamBudget * 1024 * 1024);
+    if (progressive)
+        textures.SetStreamer(&streamer);
+
+    //terrain texturing
+    TextureRef texture3 = textures.Texture2D("./src/textures/texture3.jpg");
+    TextureRef texture4 = textures.Texture2D("./src/textures/texture4.jpg");
+    TextureRef texture5 = textures.Texture2D("./src/textures/texture5.jpg");
+    TextureRef texture6 = textures.Texture2D("./src/textures/texture6.jpg");
+
+    //SKYBOX
+    std::vector<std::string> faces
+    {
+    "./src/skybox/skyrender0001.bmp", //right
+    "./src/skybox/skyrender0004.bmp", //left
+    "./src/skybox/skyrender0003.bmp", //top
+    "./src/skybox/skyrender0004.bmp", //bottom
+    "./src/skybox/skyrender0005.bmp", //front
+    "./src/skybox/skyrender0002.bmp" //back (nevidlivo)
+    };
+    TextureDesc skyDesc;
+    skyDesc.mipmaps = false;
+    skyDesc.wrap = GL_CLAMP_TO_EDGE;
+    skyDesc.minFilter = GL_LINEAR;
+    TextureRef cubemapTexture = textures.Cubemap(faces, skyDesc);
+
+    // heights, texture blend map and specular map are streamed in tiles around the camera; tools/terrain_bake
+    // imports a local dataset from the maps in src/terrainmaps and bakes what is derived from it next to it
+    TerrainDataset terrain;
+    std::string terrainFile = fetcher.Remote() || source.empty() ? terrainPath : source + "/" + terrainPath;
+    bool terrainOpen = fetcher.Remote()
+        ? terrain.Open(fetcher, terrainPath)
+        : terrain.Open(terrainFile);
+    if (!terrainOpen)
     {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        tessHeightMapShader.setInt("heightMap", 0);
-        std::cout << "Loaded heightmap of size " << height << " x " << width << std::endl;
+        std::cout << "Failed to open terrain " << terrainFile << (fetcher.Remote() ? " on " + source : ", run terrain_bake")
+                  << std::endl;
+        glfwTerminate();
+        return -1;
     }
+    const TerrainFileHeader &terrainHeader = terrain.Header();
+    int heightLayer = terrain.FindLayer("height");
+    int blendLayer = terrain.FindLayer("blend");
+    int specularLayer = terrain.FindLayer("specular");
+
+    loader.Wait();
+    loader.PrintTimeline(std::cout);
+    pixelCache.Save();
+
+    int width = (int)(terrainHeader.width * terrainHeader.texelSize);
+    int height = (int)(terrainHeader.height * terrainHeader.texelSize);
+    std::cout << "Streaming terrain of size " << terrainHeader.height << " x " << terrainHeader.width << " in "
+              << terrainHeader.tileCount << " tiles of " << terrainHeader.tileSize << " over " << terrainHeader.levels
+              << " levels" << std::endl;
+    TerrainStreamer terrainStreamer(terrain, fetcher, terrainPath, &uploads, terrainSlots);
+    residency.TrackTexture(terrainStreamer.Atlas(0), terrainStreamer.Bytes(), "terrain tile cache");
+
+    // the full resolution heights stay on the CPU for ground queries
+    HeightField ground;
+    double groundStart = glfwGetTime();
+    if (ground.Load(terrain, heightLayer, &fetcher, terrainPath))
+        std::cout << "Height field of " << ground.Width() << " x " << ground.Height() << " samples, "
+                  << ground.Bytes() / (1024 * 1024) << " MiB, " << HeightField::SimdPath() << " queries, loaded in "
+                  << (glfwGetTime() - groundStart) * 1000.0 << " ms" << std::endl;
     else
+        std::cout << "Cannot load the terrain heights for ground queries" << std::endl;
+    bool followGround = true;
+    // sculpting edits the same heights, with the edits saved next to the dataset applied before anything is
+    // derived from them. The data derived from edited heights is cached under names of its own so that it does not
+    // replace what terrain_bake wrote.
+    TerrainSculptor sculptor(ground, terrain, heightLayer, &jobs);
+    std::string editsPath = bakedPathFor(terrainFile, "edits");
+    bool edited = !sculptor.Load(editsPath).Empty();
+    if (edited)
+        std::cout << "Applied " << sculptor.EditedTiles() << " edited tiles from " << editsPath << std::endl;
+    std::string bakedSuffix = edited ? "_edited" : "";
+    terrainStreamer.SetSculptor(&sculptor);
+    SculptBrush brush;
+    bool sculpting = false, stroking = false;
+    // after a stroke the exact tile bounds, the paths and the visibility are brought up to date on the workers,
+    // sculpting waits and nothing else touches the pathfinder or the viewshed until they are done
+    JobCounter strokeRefresh;
+    bool strokeRefreshing = false;
+    std::vector<TerrainSculptor::TileRange> strokeBounds;
+    // picking: the maximum mipmap over the same heights. It and the data derived from the heights below are read
+    // from what terrain_bake wrote next to the dataset, and only derived here (and written there) when that was
+    // baked from other heights or not at all, as with a remote source.
+    double raysStart = glfwGetTime();
+    HeightRayCaster groundRays(ground, &jobs, bakedPathFor(terrainFile, "rays" + bakedSuffix));
+    if (!ground.Empty())
+        std::cout << "Ray casting pyramid of " << groundRays.Levels() << " levels, " << groundRays.Bytes() / (1024 * 1024)
+                  << " MiB, ready in " << (glfwGetTime() - raysStart) * 1000.0 << " ms" << std::endl;
+
+    // the normal map of the same heights
+    TerrainNormalBaker normalBaker(bakedPathFor(terrainFile, "normals" + bakedSuffix));
+    if (normalBaker.Bake(ground, &jobs))
+        std::cout << "Normal map of " << normalBaker.Width() << " x " << normalBaker.Height() << " in "
+                  << normalBaker.Levels() << " levels, "
+                  << (normalBaker.fromCache ? "read from " + normalBaker.Path()
+                                            : std::string("baked with ") + TerrainNormalBaker::SimdPath())
+                  << " in " << normalBaker.hashMs + normalBaker.normalsMs + normalBaker.compressMs << " ms" << std::endl;
+    GLuint normalMap;
+    glGenTextures(1, &normalMap);
+    normalBaker.Upload(normalMap);
+    residency.TrackTexture(normalMap, std::max(normalBaker.Bytes(), (size_t)4), "normal map");
+
+    // visibility analysis, how many of the observers see each sample goes to the terrain shaders as an overlay
+    Viewshed viewshed(ground, &jobs);
+    std::vector<ViewshedObserver> observers;
+    float observerHeight = 2.0f, observerRadius = 0.0f, targetHeight = 0.0f;
+    bool viewshedOverlay = false, viewshedDirty = true, viewshedUpload = false;
+    GLuint viewshedTexture;
+    glGenTextures(1, &viewshedTexture);
+    glBindTexture(GL_TEXTURE_2D, viewshedTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, std::max(viewshed.Width(), 1), std::max(viewshed.Height(), 1), 0, GL_RED,
+                 GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    residency.TrackTexture(viewshedTexture, (size_t)viewshed.Width() * viewshed.Height(), "viewshed");
+
+    // routes over the ground, costed by the slopes and by the materials of the dataset's blend layer, which only
+    // a mapped dataset has at hand; queries run on the workers and the last path is drawn as a line strip just
+    // above the ground
+    std::vector<uint8_t> groundBlend;
+    if (!terrain.ReadLevel(0, blendLayer, groundBlend) && !ground.Empty())
+        std::cout << "Paths are costed by the slopes alone, the blend map is not at hand" << std::endl;
+    double pathsStart = glfwGetTime();
+    TerrainPathfinder pathfinder(ground, groundBlend.empty() ? nullptr : &groundBlend[0], groundBlend.empty() ? 0 : 4,
+                                 PathCostSettings(), &jobs, 64, bakedPathFor(terrainFile, "paths" + bakedSuffix));
+    if (!ground.Empty())
+        std::cout << "Path abstraction of " << pathfinder.Nodes() << " nodes and " << pathfinder.Edges() << " edges, "
+                  << pathfinder.Bytes() / (1024 * 1024) << " MiB, ready in " << (glfwGetTime() - pathsStart) * 1000.0
+                  << " ms" << std::endl;
+    PathQuery pathQuery;
+    bool pathStartSet = false, pathGoalSet = false, pathDirty = false;
+    TerrainPath path;
+    path.found = false;
+    glm::dvec3 pathOrigin(0.0);
+    double pathMs = 0.0;
+    GLsizei pathVertices = 0;
+    unsigned int pathVAO, pathVBO;
+    glGenVertexArrays(1, &pathVAO);
+    glGenBuffers(1, &pathVBO);
+    glBindVertexArray(pathVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, pathVBO);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+
+    // geometry clipmap, heights read from the sculptor's levels, from the tiles the streamer uses or from the whole
+    // heightmap held in memory. Materials still come from the streamed tiles.
+    std::unique_ptr<ClipmapTileHeights> clipmapTiles;
+    std::unique_ptr<ClipmapImageHeights> clipmapImage;
+    std::unique_ptr<TerrainClipmap> clipmap;
+    if (clipmapSource == "heightmap")
     {
-        std::cout << "Failed to load texture" << std::endl;
+        RasterReader reader;
+        std::vector<uint16_t> heights;
+        if (reader.Open("./src/terrainmaps/heightmap.png") && (uint32_t)reader.Info().width == terrainHeader.width &&
+            (uint32_t)reader.Info().height == terrainHeader.height)
+        {
+            const RasterInfo &info = reader.Info();
+            heights.resize((size_t)info.width * info.height);
+            reader.Read([&](const unsigned char *row, int y)
+            {
+                for (int x = 0; x < info.width; x++)
+                    heights[(size_t)y * info.width + x] = info.type == RASTER_U16
+                        ? ((const uint16_t*)row)[(size_t)x * info.channels] : (uint16_t)(row[(size_t)x * info.channels] * 257u);
+            });
+            clipmapImage.reset(new ClipmapImageHeights(&heights[0], info.width, info.height));
+        }
+        else
+            std::cout << "Cannot use the heightmap for the clipmap, " << (reader.Error() ? reader.Error() : "size differs")
+                      << ", using the terrain tiles" << std::endl;
+    }
+    if (!clipmapSource.empty())
+    {
+        TerrainClipmap::HeightFn heights;
+        if (clipmapImage)
+        {
+            ClipmapImageHeights *image = clipmapImage.get();
+            heights = [image](int level, int x, int y, int w, int h, uint16_t *out)
+            {
+                return image->Read(level, x, y, w, h, out);
+            };
+        }
+        else if (sculptor.Ready())
+        {
+            TerrainSculptor *levels = &sculptor;
+            heights = [levels](int level, int x, int y, int w, int h, uint16_t *out)
+            {
+                return levels->Read(level, x, y, w, h, out);
+            };
+        }
+        else
+        {
+            clipmapTiles.reset(new ClipmapTileHeights(terrain, fetcher, terrainPath, heightLayer));
+            ClipmapTileHeights *tiles = clipmapTiles.get();
+            heights = [tiles](int level, int x, int y, int w, int h, uint16_t *out)
+            {
+                return tiles->Read(level, x, y, w, h, out);
+            };
+        }
+        int grid = 128;
+        clipmap.reset(new TerrainClipmap(TerrainClipmap::LevelsFor(terrainHeader.width, terrainHeader.height, grid),
+                                         grid, heights, terrainHeader.width, terrainHeader.height, terrainHeader.texelSize));
+        residency.TrackTexture(clipmap->Texture(), clipmap->Bytes(), "terrain clipmap");
+        std::cout << "Drawing the terrain as a clipmap of " << clipmap->Levels() << " levels of " << grid << " x "
+                  << grid << " cells" << std::endl;
     }
-    stbi_image_free(data);
+    TextureRegistry::Stats textureStats = textures.GetStats();
+    std::cout << "Texture registry: " << textureStats.textures << " textures for " << textureStats.requests
+              << " requests, " << textureStats.vramBytes / (1024 * 1024) << " MiB of video memory, "
+              << textureStats.dedupBytes / (1024 * 1024) << " MiB saved by sharing" << std::endl;
 
     // set up vertex data (and buffer(s)) and configure vertex attributes
     // ------------------------------------------------------------------
     std::vector<float> vertices;
     vertices.reserve(8180);
 
+    // control points relative to their patch's corner, recordTerrainPatches() places every patch relative to the camera
     unsigned rez = 20;
+    float patchWidth = width / (float)rez;
+    float patchHeight = height / (float)rez;
     for(unsigned i = 0; i <= rez-1; i++)
     {
         for(unsigned j = 0; j <= rez-1; j++)
         {
-            vertices.push_back(-width/2.0f + width*i/(float)rez); // v.x
+            vertices.push_back(0.0f); // v.x
             vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*j/(float)rez); // v.z
+            vertices.push_back(0.0f); // v.z
             vertices.push_back(i / (float)rez); // u
             vertices.push_back(j / (float)rez); // v
 
-            vertices.push_back(-width/2.0f + width*(i+1)/(float)rez); // v.x
+            vertices.push_back(patchWidth); // v.x
             vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*j/(float)rez); // v.z
+            vertices.push_back(0.0f); // v.z
             vertices.push_back((i+1) / (float)rez); // u
             vertices.push_back(j / (float)rez); // v
 
-            vertices.push_back(-width/2.0f + width*i/(float)rez); // v.x
+            vertices.push_back(0.0f); // v.x
             vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*(j+1)/(float)rez); // v.z
+            vertices.push_back(patchHeight); // v.z
             vertices.push_back(i / (float)rez); // u
             vertices.push_back((j+1) / (float)rez); // v
 
-            vertices.push_back(-width/2.0f + width*(i+1)/(float)rez); // v.x
+            vertices.push_back(patchWidth); // v.x
             vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*(j+1)/(float)rez); // v.z
+            vertices.push_back(patchHeight); // v.z
             vertices.push_back((i+1) / (float)rez); // u
             vertices.push_back((j+1) / (float)rez); // v
         }
@@ -240,6 +538,7 @@ int main()
     glGenBuffers(1, &VBO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
+    residency.TrackBuffer(VBO, sizeof(float) * vertices.size(), "terrain patches");
 
     // position attribute
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
@@ -251,27 +550,51 @@ int main()
     glPatchParameteri(GL_PATCH_VERTICES, NUM_PATCH_PTS);
 
     tessHeightMapShader.use();
-    //normal map
-    unsigned int normalMap = loadTexture("./src/terrainmaps/normalmap.png");
+    tessHeightMapShader.setInt("heightAtlas", 0);
     tessHeightMapShader.setInt("normalMap", 1);
-
-    //specular map
-    unsigned int specularMap = loadTexture("./src/terrainmaps/specularmap.png");
-    tessHeightMapShader.setInt("specularMap", 8);
-
-    //texture blend map
-    unsigned int textureBlendMap = loadTexture("./src/terrainmaps/textureblendmap.png");
-    tessHeightMapShader.setInt("textureBlendMap", 2);
-
-    //terrain texturing
-    unsigned int texture3 = loadTexture("./src/textures/texture3.jpg");
+    tessHeightMapShader.setInt("specularAtlas", 8);
+    tessHeightMapShader.setInt("blendAtlas", 2);
+    tessHeightMapShader.setInt("terrainIndirection", 11);
+    tessHeightMapShader.setVec2("terrainSize", glm::vec2((float)terrainHeader.width, (float)terrainHeader.height));
+    tessHeightMapShader.setFloat("terrainTileSize", (float)terrainHeader.tileSize);
+    tessHeightMapShader.setFloat("terrainBorder", (float)terrainHeader.border);
+    tessHeightMapShader.setFloat("heightOffset", terrainHeader.heightOffset);
+    tessHeightMapShader.setFloat("heightScale", terrainHeader.heightScale);
     tessHeightMapShader.setInt("texture3",3);
-    unsigned int texture4 = loadTexture("./src/textures/texture4.jpg");
     tessHeightMapShader.setInt("texture4",4);
-    unsigned int texture5 = loadTexture("./src/textures/texture5.jpg");
     tessHeightMapShader.setInt("texture5",5);
-    unsigned int texture6 = loadTexture("./src/textures/texture6.jpg");
     tessHeightMapShader.setInt("texture6",6);
+    tessHeightMapShader.setInt("viewshed", 10);
+    // a BC5 normal map only stores x and z, the shader rebuilds y
+    GLint normalMapFormat = 0;
+    glBindTexture(GL_TEXTURE_2D, normalMap);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &normalMapFormat);
+    tessHeightMapShader.setBool("normalMapXZ", normalMapFormat == GL_COMPRESSED_RG_RGTC2);
+
+    clipmapShader.use();
+    clipmapShader.setInt("heightClipmap", 12);
+    clipmapShader.setInt("normalMap", 1);
+    clipmapShader.setInt("specularAtlas", 8);
+    clipmapShader.setInt("blendAtlas", 2);
+    clipmapShader.setInt("terrainIndirection", 11);
+    clipmapShader.setVec2("terrainSize", glm::vec2((float)terrainHeader.width, (float)terrainHeader.height));
+    clipmapShader.setFloat("terrainTileSize", (float)terrainHeader.tileSize);
+    clipmapShader.setFloat("terrainBorder", (float)terrainHeader.border);
+    clipmapShader.setFloat("heightOffset", terrainHeader.heightOffset);
+    clipmapShader.setFloat("heightScale", terrainHeader.heightScale);
+    clipmapShader.setInt("texture3",3);
+    clipmapShader.setInt("texture4",4);
+    clipmapShader.setInt("texture5",5);
+    clipmapShader.setInt("texture6",6);
+    clipmapShader.setInt("viewshed", 10);
+    clipmapShader.setBool("normalMapXZ", normalMapFormat == GL_COMPRESSED_RG_RGTC2);
+    if (clipmap)
+    {
+        clipmapShader.setFloat("clipmapTexelSize", terrainHeader.texelSize);
+        clipmapShader.setFloat("clipmapTextureSize", (float)clipmap->TextureSize());
+        clipmapShader.setFloat("clipmapGrid", (float)clipmap->Grid());
+        clipmapShader.setInt("clipmapLevels", clipmap->Levels());
+    }
 
     // lighting
     glm::vec3 lightPos(625.2f, 205.0f, 1600.0f);
@@ -281,10 +604,10 @@ int main()
     float diffuseStrength = 0.3f;
     float specularStrength = 0.4f;
     
-    tessHeightMapShader.setVec3("viewPos", camera.Position);
+    // camera relative rendering, lights are placed relative to the camera every frame
+    glm::dvec3 cameraWorld = camera.WorldPosition();
 
     cloudShader.use();
-    cloudShader.setVec3("rayOrigin", camera.Position);
     glm::vec4 cloudBaseColor(0.7f, 0.7f, 0.7f, 0.0f);
     glm::vec3 rayColor1(1.0f, 0.95f, 0.5f);
     glm::vec3 rayColor2(0.5f, 0.8f, 0.55f);
@@ -304,116 +627,69 @@ int main()
     modelShader.setVec3("viewPos", camera.Position);
     
     stbi_set_flip_vertically_on_load(true);
-    Model tree1("./src/resources/objects/tree1/tree1.obj");
-    unsigned int modelDiffuseMap = loadTexture("./src/resources/objects/tree1/diffuse.jpeg");
+    Model tree1("./src/resources/objects/tree1/tree1.obj", false, &jobs);
+    TextureRef modelDiffuseMap = textures.Texture2D("./src/resources/objects/tree1/diffuse.jpeg");
     modelShader.setInt("modelDiffuse", 7);
-    unsigned int modelSpecularMap = loadTexture("./src/resources/objects/tree1/specular.png");
+    TextureRef modelSpecularMap = textures.Texture2D("./src/resources/objects/tree1/specular.png");
     modelShader.setInt("modelSpecular", 8);
     */
 
-    //SKYBOX
-    std::vector<std::string> faces
-    {
-    "./src/skybox/skyrender0001.bmp", //right
-    "./src/skybox/skyrender0004.bmp", //left
-    "./src/skybox/skyrender0003.bmp", //top
-    "./src/skybox/skyrender0004.bmp", //bottom
-    "./src/skybox/skyrender0005.bmp", //front
-    "./src/skybox/skyrender0002.bmp" //back (nevidlivo)
-    };
-    
-    unsigned int cubemapTexture = loadCubemap(faces);
     skyboxShader.use();
-    skyboxShader.setInt("skybox", 0);
+    skyboxShader.setInt("skybox", 9);
     float skyboxIntensity = 1.0f;
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(window))
-    {
-        // per-frame time logic
-        // --------------------
-        float currentFrame = glfwGetTime();
-        deltaTime = currentFrame - lastFrame;
-        lastFrame = currentFrame;
-
-        // input
-        // -----
-        processInput(window);
-
-        // render
-        // ------
-        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        // feed inputs to dear imgui, start new frame
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
-
-        //SKYBOX
-        glDepthFunc(GL_LEQUAL);
-        skyboxShader.use();
-
-        //uniforms for GUI control
-        skyboxShader.setFloat("skyboxIntensity", skyboxIntensity);
-
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100000.0f);
-        glm::mat4 view = glm::mat4(glm::mat3(camera.GetViewMatrix())); // remove translation from the view matrix
-        skyboxShader.setMat4("projection", projection);
-        skyboxShader.setMat4("view", view);
-
-        glBindVertexArray(VAO);
-        glActiveTexture(GL_TEXTURE9);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
-        glDrawArrays(GL_TRIANGLES, NUM_PATCH_PTS*rez*rez, 36);
-        glDepthFunc(GL_LESS); // set depth function back to default
-
-        // be sure to activate shader when setting uniforms/drawing objects
-        tessHeightMapShader.use();
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, heightMap);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, normalMap);
-        glActiveTexture(GL_TEXTURE8);
-        glBindTexture(GL_TEXTURE_2D, specularMap);
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, textureBlendMap);
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, texture3);
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D, texture4);
-        glActiveTexture(GL_TEXTURE5);
-        glBindTexture(GL_TEXTURE_2D, texture5);
-        glActiveTexture(GL_TEXTURE6);
-        glBindTexture(GL_TEXTURE_2D, texture6);
+    // draw list, every pass records into it and it is submitted sorted once per frame
+    // -------------------------------------------------------------------------------
+    DrawList drawList(100000.0f);
+    glm::mat4 projection;
+    glm::mat4 view;
 
+    drawList.RegisterProgram(tessHeightMapShader, [&]()
+    {
         //uniforms for GUI control
         tessHeightMapShader.setVec3("lightColor", lightColor);
-        tessHeightMapShader.setVec3("lightPos", lightPos);
+        tessHeightMapShader.setVec3("lightPos", glm::vec3(glm::dvec3(lightPos) - cameraWorld));
+        tessHeightMapShader.setVec3("viewPos", glm::vec3(0.0f));
         tessHeightMapShader.setFloat("ambientStrength", ambientStrength);
         tessHeightMapShader.setFloat("diffuseStrength", diffuseStrength);
         tessHeightMapShader.setFloat("specularStrength", specularStrength);
         tessHeightMapShader.setFloat("shininess", shininess);
+        tessHeightMapShader.setBool("viewshedOverlay", viewshedOverlay);
 
         // view/projection transformations
-        projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100000.0f);
-        view = camera.GetViewMatrix();
         tessHeightMapShader.setMat4("projection", projection);
         tessHeightMapShader.setMat4("view", view);
+    });
 
-        // world transformation
-        glm::mat4 model = glm::mat4(1.0f);
-        tessHeightMapShader.setMat4("model", model);
-
-        // render terrain
-        glBindVertexArray(VAO);
-        //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        glDrawArrays(GL_PATCHES, 0, NUM_PATCH_PTS*rez*rez);
+    drawList.RegisterProgram(clipmapShader, [&]()
+    {
+        clipmapShader.setVec3("lightColor", lightColor);
+        clipmapShader.setVec3("lightPos", glm::vec3(glm::dvec3(lightPos) - cameraWorld));
+        clipmapShader.setVec3("viewPos", glm::vec3(0.0f));
+        clipmapShader.setFloat("ambientStrength", ambientStrength);
+        clipmapShader.setFloat("diffuseStrength", diffuseStrength);
+        clipmapShader.setFloat("specularStrength", specularStrength);
+        clipmapShader.setFloat("shininess", shininess);
+        // where the levels are this frame, Record() placed them the same way
+        for (int l = 0; clipmap && l < clipmap->Levels(); l++)
+            clipmapShader.setVec2("clipmapCorners[" + std::to_string(l) + "]", clipmap->Corner(l));
+        clipmapShader.setBool("viewshedOverlay", viewshedOverlay);
+
+        clipmapShader.setMat4("projection", projection);
+        clipmapShader.setMat4("view", view);
+    });
+
+    drawList.RegisterProgram(skyboxShader, [&]()
+    {
+        //uniforms for GUI control
+        skyboxShader.setFloat("skyboxIntensity", skyboxIntensity);
 
-        //render clouds
-        cloudShader.use();
+        skyboxShader.setMat4("projection", projection);
+        skyboxShader.setMat4("view", glm::mat4(glm::mat3(view))); // remove translation from the view matrix
+    });
 
+    drawList.RegisterProgram(cloudShader, [&]()
+    {
         //uniforms for GUI control
         cloudShader.setVec4("cloudBaseColor", cloudBaseColor);
         cloudShader.setVec3("rayColor1", rayColor1);
@@ -424,57 +700,337 @@ int main()
         cloudShader.setVec3("perlinSeed2", perlinSeed2);
         cloudShader.setVec3("perlinSeed3", perlinSeed3);
 
+        cloudShader.setVec3("rayOrigin", glm::vec3(cameraWorld));
+
         cloudShader.setMat4("projection", projection);
         cloudShader.setMat4("view", view);
-        model = glm::translate(model, glm::vec3(0.0f, cloudYtranslation, 0.0f));
-        model = glm::scale(model, glm::vec3(5000.0f, 5000.0f, 5000.0f));
-        cloudShader.setMat4("model", model);
+    });
+
+    glm::vec3 pathColor(1.0f, 0.85f, 0.1f);
+    drawList.RegisterProgram(lineShader, [&]()
+    {
+        lineShader.setVec3("lineColor", pathColor);
+
+        lineShader.setMat4("projection", projection);
+        lineShader.setMat4("view", view);
+    });
+
+    // MODELS
+    /*
+    drawList.RegisterProgram(modelShader, [&]()
+    {
+        modelShader.setMat4("projection", projection);
+        modelShader.setMat4("view", view);
+    });
+    vector<TextureBinding> treeMaterial;
+    TextureBinding treeDiffuse = { 7, GL_TEXTURE_2D, modelDiffuseMap->id };
+    TextureBinding treeSpecular = { 8, GL_TEXTURE_2D, modelSpecularMap->id };
+    treeMaterial.push_back(treeDiffuse);
+    treeMaterial.push_back(treeSpecular);
+    tree1.RegisterDrawStates(drawList, modelShader, treeMaterial);
+
+    glm::vec3 treeMin, treeMax;
+    tree1.GetBounds(treeMin, treeMax);
+    std::vector<ModelInstance> trees;
+    glm::vec3 treePositions[] = { glm::vec3(-220.0f, -12.5f, 150.0f), glm::vec3(-260.0f, -12.5f, 155.0f), glm::vec3(-260.0f, -12.5f, 105.0f) };
+    float treeRotations[] = { 0.0f, 45.0f, 45.0f };
+    for(unsigned int i = 0; i < 3; i++)
+    {
+        glm::mat4 treeModel = glm::mat4(1.0f);
+        treeModel = glm::translate(treeModel, treePositions[i]);
+        treeModel = glm::scale(treeModel, glm::vec3(0.5f, 0.5f, 0.5f));
+        treeModel = glm::rotate(treeModel, glm::radians(treeRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f));
+        trees.push_back(ModelInstance(treeModel, treeMin, treeMax, 2000.0f));
+    }
+    */
+
+    // draw states, shared by every draw of a kind, only the model matrix and range change between them
+    DrawState terrainState;
+    terrainState.program = tessHeightMapShader.ID;
+    terrainState.vao = VAO;
+    terrainState.mode = GL_PATCHES;
+    terrainState.first = 0;
+    terrainState.count = NUM_PATCH_PTS*rez*rez;
+    terrainState.AddTexture(0, GL_TEXTURE_2D_ARRAY, terrainStreamer.Atlas(heightLayer));
+    terrainState.AddTexture(1, GL_TEXTURE_2D, normalMap);
+    terrainState.AddTexture(8, GL_TEXTURE_2D_ARRAY, terrainStreamer.Atlas(specularLayer));
+    terrainState.AddTexture(2, GL_TEXTURE_2D_ARRAY, terrainStreamer.Atlas(blendLayer));
+    terrainState.AddTexture(11, GL_TEXTURE_2D, terrainStreamer.Indirection());
+    terrainState.AddTexture(3, GL_TEXTURE_2D, texture3->id);
+    terrainState.AddTexture(4, GL_TEXTURE_2D, texture4->id);
+    terrainState.AddTexture(5, GL_TEXTURE_2D, texture5->id);
+    terrainState.AddTexture(6, GL_TEXTURE_2D, texture6->id);
+    terrainState.AddTexture(10, GL_TEXTURE_2D, viewshedTexture);
+    unsigned int terrainDraw = drawList.AddState(terrainState);
+
+    DrawState clipmapState;
+    clipmapState.program = clipmapShader.ID;
+    clipmapState.vao = clipmap ? clipmap->VertexArray() : 0;
+    clipmapState.mode = GL_TRIANGLES;
+    clipmapState.indexType = GL_UNSIGNED_INT;
+    clipmapState.AddTexture(12, GL_TEXTURE_2D_ARRAY, clipmap ? clipmap->Texture() : 0);
+    clipmapState.AddTexture(1, GL_TEXTURE_2D, normalMap);
+    clipmapState.AddTexture(8, GL_TEXTURE_2D_ARRAY, terrainStreamer.Atlas(specularLayer));
+    clipmapState.AddTexture(2, GL_TEXTURE_2D_ARRAY, terrainStreamer.Atlas(blendLayer));
+    clipmapState.AddTexture(11, GL_TEXTURE_2D, terrainStreamer.Indirection());
+    clipmapState.AddTexture(3, GL_TEXTURE_2D, texture3->id);
+    clipmapState.AddTexture(4, GL_TEXTURE_2D, texture4->id);
+    clipmapState.AddTexture(5, GL_TEXTURE_2D, texture5->id);
+    clipmapState.AddTexture(6, GL_TEXTURE_2D, texture6->id);
+    clipmapState.AddTexture(10, GL_TEXTURE_2D, viewshedTexture);
+    unsigned int clipmapDraw = drawList.AddState(clipmapState);
+
+    DrawState skyboxState;
+    skyboxState.program = skyboxShader.ID;
+    skyboxState.vao = VAO;
+    skyboxState.first = NUM_PATCH_PTS*rez*rez;
+    skyboxState.count = 36;
+    skyboxState.depthFunc = GL_LEQUAL;
+    skyboxState.AddTexture(9, GL_TEXTURE_CUBE_MAP, cubemapTexture->id);
+    unsigned int skyboxDraw = drawList.AddState(skyboxState);
+
+    DrawState cloudState;
+    cloudState.program = cloudShader.ID;
+    cloudState.vao = VAO;
+    cloudState.first = NUM_PATCH_PTS*rez*rez+30;
+    cloudState.count = 6;
+    unsigned int cloudDraw = drawList.AddState(cloudState);
+
+    DrawState pathState;
+    pathState.program = lineShader.ID;
+    pathState.vao = pathVAO;
+    pathState.mode = GL_LINE_STRIP;
+    unsigned int pathDraw = drawList.AddState(pathState);
+
+    // frame jobs, run on the worker threads every frame and record into their own command lists.
+    // They only read the frame context and the GUI values, which are not touched while the jobs run.
+    // ----------------------------------------------------------------------------------------------
+    FramePrep framePrep(drawList, jobs);
+
+    //SKYBOX
+    framePrep.AddJob([&](const FrameContext &frame, CommandList &commands)
+    {
+        (void)frame;
+        commands.Add(PASS_SKY, skyboxDraw, glm::mat4(1.0f), 0.0f);
+    });
 
-        glDrawArrays(GL_TRIANGLES, NUM_PATCH_PTS*rez*rez+30, 6);
+    // terrain, culled per patch against the height range of the dataset, or the clipmap's levels
+    framePrep.AddJob([&](const FrameContext &frame, CommandList &commands)
+    {
+        if (clipmap)
+        {
+            clipmap->Record(commands, clipmapDraw, frame.cameraWorld);
+            return;
+        }
+        // the terrain is centred on the world origin
+        recordTerrainPatches(frame, commands, terrainDraw, glm::dvec3(0.0), width, height, rez,
+                             terrainHeader.heightOffset, terrainHeader.heightOffset + terrainHeader.heightScale);
+    });
+
+    //clouds, each layer is sorted by its vertical distance to the camera
+    framePrep.AddJob([&](const FrameContext &frame, CommandList &commands)
+    {
+        glm::mat4 model = relativeModel(frame, glm::dvec3(0.0, cloudYtranslation, 0.0));
+        model = glm::scale(model, glm::vec3(5000.0f, 5000.0f, 5000.0f));
+        commands.Add(PASS_TRANSPARENT, cloudDraw, model, cloudLayerDepth(model));
 
         for(int i=0;i<16;++i) {
             model = glm::translate(model, glm::vec3(0.0f, -0.0005f, 0.0f));
-            cloudShader.setMat4("model", model);
-            glDrawArrays(GL_TRIANGLES, NUM_PATCH_PTS*rez*rez+30, 6);
+            commands.Add(PASS_TRANSPARENT, cloudDraw, model, cloudLayerDepth(model));
         }
 
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, glm::vec3(0.0f, cloudYtranslation, 0.0f));
+        model = relativeModel(frame, glm::dvec3(0.0, cloudYtranslation, 0.0));
         model = glm::scale(model, glm::vec3(5000.0f, 5000.0f, 5000.0f));
-        cloudShader.setMat4("model", model);
         for(int i=0;i<16;++i) {
             model = glm::translate(model, glm::vec3(0.0f, 0.0005f, 0.0f));
-            cloudShader.setMat4("model", model);
-            glDrawArrays(GL_TRIANGLES, NUM_PATCH_PTS*rez*rez+30, 6);
+            commands.Add(PASS_TRANSPARENT, cloudDraw, model, cloudLayerDepth(model));
         }
+    });
 
-        // MODELS
-        /*
-        modelShader.use();
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_2D, modelDiffuseMap);
-        glActiveTexture(GL_TEXTURE8);
-        glBindTexture(GL_TEXTURE_2D, modelSpecularMap);
-        modelShader.setMat4("projection", projection);
-        modelShader.setMat4("view", view);
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, glm::vec3(-220.0f, -12.5f, 150.0f));
-        model = glm::scale(model, glm::vec3(0.5f, 0.5f, 0.5f));	
-        modelShader.setMat4("model", model);
-        tree1.Draw(modelShader);
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, glm::vec3(-260.0f, -12.5f, 155.0f)); 
-        model = glm::scale(model, glm::vec3(0.5f, 0.5f, 0.5f));	
-        model = glm::rotate(model, (float)glm::radians(45.0), glm::vec3(0.0,1.0,0.0));
-        modelShader.setMat4("model", model);
-        tree1.Draw(modelShader);
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, glm::vec3(-260.0f, -12.5f, 105.0f)); 
-        model = glm::scale(model, glm::vec3(0.5f, 0.5f, 0.5f));	
-        model = glm::rotate(model, (float)glm::radians(45.0), glm::vec3(0.0,1.0,0.0));
-        modelShader.setMat4("model", model);
-        tree1.Draw(modelShader);
-        */
+    // the last path found, its vertices are relative to its first point
+    framePrep.AddJob([&](const FrameContext &frame, CommandList &commands)
+    {
+        if (pathVertices > 1)
+            commands.Add(PASS_OPAQUE, pathDraw, relativeModel(frame, pathOrigin), 0.0f, 0, pathVertices);
+    });
+
+    // MODELS
+    /*
+    framePrep.AddJob([&](const FrameContext &frame, CommandList &commands)
+    {
+        recordModelInstances(frame, commands, tree1, trees);
+    });
+    */
+
+    // render loop
+    // -----------
+    bool firstFrameShown = false;
+    bool fullQualityShown = false;
+    glm::dvec3 lastPosition = camera.WorldPosition();
+    glm::vec3 cameraVelocity(0.0f);
+    while (!glfwWindowShouldClose(window))
+    {
+        // per-frame time logic
+        // --------------------
+        float currentFrame = glfwGetTime();
+        deltaTime = currentFrame - lastFrame;
+        lastFrame = currentFrame;
+
+        // input
+        // -----
+        processInput(window);
+
+        // keep the camera above the ground
+        if (followGround && !ground.Empty())
+        {
+            glm::dvec3 world = camera.WorldPosition();
+            double lowest = ground.HeightAt((float)world.x, (float)world.z) + 2.0;
+            if (world.y < lowest)
+                camera.Position.y += (float)(lowest - world.y);
+        }
+
+        // render
+        // ------
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // feed inputs to dear imgui, start new frame
+        ImGui_ImplOpenGL3_NewFrame();
+        ImGui_ImplGlfw_NewFrame();
+        ImGui::NewFrame();
+
+        // view/projection transformations
+        projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100000.0f);
+        view = camera.GetRelativeViewMatrix();
+        cameraWorld = camera.WorldPosition();
+
+        FrameContext frame;
+        frame.view = view;
+        frame.projection = projection;
+        frame.viewProjection = projection * view;
+        frame.cameraWorld = cameraWorld;
+        frame.frustum = Frustum(frame.viewProjection);
+        frame.time = currentFrame;
+
+        // terrain tiles for this view, the velocity is smoothed over a few frames for the prefetch
+        if (deltaTime > 0.0f)
+            cameraVelocity = glm::mix(cameraVelocity, glm::vec3(cameraWorld - lastPosition) / deltaTime, 0.25f);
+        lastPosition = cameraWorld;
+        TerrainView terrainView;
+        terrainView.position = glm::vec3(cameraWorld);
+        terrainView.front = camera.Front;
+        terrainView.velocity = cameraVelocity;
+        terrainView.viewProjection = projection * camera.GetViewMatrix();
+        terrainView.pixelScale = SCR_HEIGHT / (2.0f * std::tan(glm::radians(camera.Zoom) * 0.5f));
+        terrainStreamer.Update(terrainView);
+        if (clipmap)
+            clipmap->Update(cameraWorld);
+        // sculpting, a dab per frame where the cursor points at the ground while the left button is held outside the
+        // GUI. The picking pyramid, the normal map, the resident tiles and the clipmap follow every dab, the paths
+        // and the visibility only the finished stroke.
+        if (strokeRefreshing && strokeRefresh.Done())
+        {
+            strokeRefreshing = false;
+            sculptor.SetBounds(strokeBounds);
+            viewshedUpload = true;
+            pathDirty = pathStartSet && pathGoalSet;
+        }
+        if (sculpting && sculptor.Ready() && !strokeRefreshing)
+        {
+            double cursorX, cursorY;
+            int windowWidth, windowHeight;
+            glfwGetCursorPos(window, &cursorX, &cursorY);
+            glfwGetWindowSize(window, &windowWidth, &windowHeight);
+            glm::vec4 cursorFar = glm::inverse(projection * view) *
+                glm::vec4((float)(2.0 * cursorX / std::max(windowWidth, 1) - 1.0),
+                          (float)(1.0 - 2.0 * cursorY / std::max(windowHeight, 1)), 1.0f, 1.0f);
+            HeightRayHit underCursor;
+            bool held = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS &&
+                        !ImGui::GetIO().WantCaptureMouse;
+            if (held && groundRays.Cast(glm::vec3(cameraWorld), glm::normalize(glm::vec3(cursorFar) / cursorFar.w),
+                                        100000.0f, underCursor))
+            {
+                // flatten pulls towards the height where the stroke began
+                if (!stroking && brush.mode == SCULPT_FLATTEN)
+                    brush.target = underCursor.position.y;
+                stroking = true;
+                TerrainRect rect = sculptor.Dab(brush, glm::vec2(underCursor.position.x, underCursor.position.z), deltaTime);
+                if (!rect.Empty())
+                {
+                    groundRays.Update(rect.x0, rect.y0, rect.x1, rect.y1);
+                    normalBaker.Refresh(ground, rect.x0, rect.y0, rect.x1, rect.y1, &jobs);
+                    normalBaker.UploadChanged(normalMap);
+                    terrainStreamer.UpdateRegion(rect.x0, rect.y0, rect.x1, rect.y1);
+                    if (clipmap && !clipmapImage)
+                        clipmap->Refresh(rect.x0, rect.y0, rect.x1, rect.y1);
+                }
+            }
+            else if (stroking && !held)
+            {
+                stroking = false;
+                TerrainRect rect = sculptor.EndStroke();
+                if (!rect.Empty())
+                {
+                    // the observers as they are now, the GUI may change them meanwhile and computes again then
+                    std::vector<ViewshedObserver> strokeObservers = observers;
+                    float strokeTarget = targetHeight;
+                    strokeRefreshing = true;
+                    jobs.Run([&, rect, strokeObservers, strokeTarget]()
+                    {
+                        strokeBounds = sculptor.ExactBounds(rect);
+                        pathfinder.Update(rect.x0, rect.y0, rect.x1 - 1, rect.y1 - 1, &jobs);
+                        viewshed.Update(rect.x0, rect.y0, rect.x1, rect.y1);
+                        viewshed.Compute(strokeObservers, strokeTarget, &jobs);
+                    }, &strokeRefresh);
+                }
+            }
+        }
+        // visibility, again whenever the observers change
+        if (viewshedDirty && !strokeRefreshing && viewshed.Width() > 0)
+        {
+            viewshed.Compute(observers, targetHeight, &jobs);
+            viewshedDirty = false;
+            viewshedUpload = true;
+        }
+        if (viewshedUpload)
+        {
+            glBindTexture(GL_TEXTURE_2D, viewshedTexture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewshed.Width(), viewshed.Height(), GL_RED, GL_UNSIGNED_BYTE,
+                            viewshed.Raster());
+            glBindTexture(GL_TEXTURE_2D, 0);
+            viewshedUpload = false;
+        }
+        // the path again whenever one of its ends moves, lifted a texel so that the terrain does not hide it
+        if (pathDirty && !strokeRefreshing)
+        {
+            double pathStart = glfwGetTime();
+            pathfinder.FindPaths(&pathQuery, 1, &path, &jobs);
+            pathMs = (glfwGetTime() - pathStart) * 1000.0;
+            std::vector<glm::vec3> strip;
+            if (path.found)
+            {
+                pathOrigin = glm::dvec3(path.points[0]);
+                for (size_t i = 0; i < path.points.size(); i++)
+                    strip.push_back(path.points[i] - path.points[0] + glm::vec3(0.0f, ground.TexelSize(), 0.0f));
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, pathVBO);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * strip.size(), strip.empty() ? nullptr : &strip[0],
+                         GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            residency.TrackBuffer(pathVBO, sizeof(glm::vec3) * strip.size(), "path");
+            pathVertices = (GLsizei)strip.size();
+            pathDirty = false;
+        }
+
+        framePrep.Prepare(frame);
+        framePrep.Submit();
+
+        // finish a few background uploads per frame, stream in finer mips and recycle staging space
+        // the GPU is done with
+        jobs.MainThread().Drain(4);
+        streamer.Update();
+        uploads.Retire();
+        residency.Update(textures, drawList.UsedTextures());
 
        // render GUI
         ImGui::SetNextWindowSize(ImVec2((float)400.0f, (float)175.0f));
@@ -505,6 +1061,175 @@ int main()
         ImGui::SliderFloat("y-translation", (float*)&cloudYtranslation, -2500.0f, 1000.0f);
         ImGui::End();
 
+        const DrawStats &drawStats = drawList.Stats();
+        ImGui::SetNextWindowSize(ImVec2((float)400.0f, (float)235.0f));
+        ImGui::Begin("Draw list");
+        ImGui::Text("workers: %u", framePrep.NumWorkers());
+        ImGui::Text("prepare: %.3f ms, submit: %.3f ms", framePrep.prepareMs, framePrep.submitMs);
+        ImGui::Text("packets: %u", (unsigned int)drawList.Size());
+        ImGui::Text("draw calls: %u", drawStats.drawCalls);
+        ImGui::Text("program switches: %u", drawStats.programSwitches);
+        ImGui::Text("texture binds: %u", drawStats.textureBinds);
+        TextureRegistry::Stats textureStats = textures.GetStats();
+        ImGui::Text("textures: %u (%u of %u requests shared)", textureStats.textures, textureStats.hits, textureStats.requests);
+        ImGui::Text("texture memory: %.1f MiB, %.1f MiB saved", textureStats.vramBytes / (1024.0 * 1024.0),
+                    textureStats.dedupBytes / (1024.0 * 1024.0));
+        ImGui::Text("streaming: %u textures, %.1f MiB to go", (unsigned int)streamer.Pending(),
+                    streamer.PendingBytes() / (1024.0 * 1024.0));
+        ImGui::End();
+
+        ImGui::SetNextWindowSize(ImVec2((float)400.0f, (float)390.0f));
+        ImGui::Begin("Terrain streaming");
+        ImGui::Checkbox("keep the camera above the ground", &followGround);
+        glm::dvec3 cameraGround = camera.WorldPosition();
+        ImGui::Text("ground: %.2f, %.2f above it", ground.HeightAt((float)cameraGround.x, (float)cameraGround.z),
+                    cameraGround.y - ground.HeightAt((float)cameraGround.x, (float)cameraGround.z));
+        HeightRayHit lookingAt;
+        if (groundRays.Cast(glm::vec3(cameraGround), camera.Front, 100000.0f, lookingAt))
+            ImGui::Text("looking at: %.1f, %.1f, %.1f, %.1f away", lookingAt.position.x, lookingAt.position.y,
+                        lookingAt.position.z, lookingAt.distance);
+        else
+            ImGui::Text("looking at: sky");
+        float terrainDetail = terrainStreamer.Detail();
+        if (ImGui::SliderFloat("detail (pixels per texel)", &terrainDetail, 0.25f, 8.0f))
+            terrainStreamer.SetDetail(terrainDetail);
+        float prefetchTime = terrainStreamer.PrefetchTime();
+        if (ImGui::SliderFloat("prefetch (s)", &prefetchTime, 0.0f, 2.0f))
+            terrainStreamer.SetPrefetchTime(prefetchTime);
+        ImGui::Text("tiles: %d of %d slots, %u wanted, %d loading", terrainStreamer.Resident(), terrainStreamer.Slots(),
+                    (unsigned int)terrainStreamer.Wanted(), terrainStreamer.InFlight());
+        ImGui::Text("hit rate: %.1f%% this frame, %.1f%% overall", terrainStreamer.frameHitRate * 100.0f,
+                    terrainStreamer.HitRate() * 100.0);
+        ImGui::Text("latency: %.1f ms median, %.1f ms 95th, %.1f ms max", terrainStreamer.LatencyPercentile(0.5),
+                    terrainStreamer.LatencyPercentile(0.95), terrainStreamer.LatencyPercentile(1.0));
+        ImGui::Text("loaded: %u tiles, %.1f MiB", (unsigned int)terrainStreamer.loaded,
+                    terrainStreamer.bytesLoaded / (1024.0 * 1024.0));
+        ImGui::Text("evicted: %u, dropped: %u, failed: %u", (unsigned int)terrainStreamer.evicted,
+                    (unsigned int)terrainStreamer.dropped, (unsigned int)terrainStreamer.failed);
+        const char *fetchKinds[] = { "files", "mapped files", "HTTP" };
+        ImGui::Text("fetch: %s, %d threads, %u queued, %d busy", fetchKinds[fetcher.Kind()], fetcher.Threads(),
+                    (unsigned int)fetcher.Queued(), fetcher.Busy());
+        ImGui::Text("fetched: %.1f MiB, %u requests in %u batches, %u connections",
+                    fetcher.bytesTransferred / (1024.0 * 1024.0), (unsigned int)fetcher.requests,
+                    (unsigned int)fetcher.batches, fetcher.connectionsOpened);
+        ImGui::Text("fetch latency: %.1f ms median, %.1f ms 95th, %.1f ms max", fetcher.LatencyPercentile(0.5),
+                    fetcher.LatencyPercentile(0.95), fetcher.LatencyPercentile(1.0));
+        if (clipmap)
+        {
+            ImGui::Text("clipmap: %d levels, %u texels this frame, %.1f MiB uploaded", clipmap->Levels(),
+                        clipmap->frameTexels, clipmap->texelsUploaded * 2.0 / (1024.0 * 1024.0));
+            ImGui::Text("clipmap: %u full updates, %u stalls, %s", clipmap->fullUpdates, (unsigned int)clipmap->stalls,
+                        clipmapTiles ? (std::to_string(clipmapTiles->Cached()) + " tiles cached").c_str()
+                                     : clipmapImage ? "heightmap" : "sculpted heights");
+        }
+        ImGui::End();
+
+        ImGui::SetNextWindowSize(ImVec2((float)400.0f, (float)210.0f));
+        ImGui::Begin("Viewshed");
+        ImGui::Checkbox("show on the terrain", &viewshedOverlay);
+        ImGui::SliderFloat("eye height", &observerHeight, 0.0f, 100.0f);
+        ImGui::SliderFloat("radius (0 = all)", &observerRadius, 0.0f, 4000.0f);
+        if (ImGui::SliderFloat("target height", &targetHeight, 0.0f, 50.0f))
+            viewshedDirty = true;
+        if (ImGui::Button("add an observer where the camera looks") && lookingAt.distance >= 0.0f)
+        {
+            ViewshedObserver observer;
+            observer.position = glm::vec2(lookingAt.position.x, lookingAt.position.z);
+            observer.height = observerHeight;
+            observer.radius = observerRadius;
+            observers.push_back(observer);
+            viewshedOverlay = viewshedDirty = true;
+        }
+        if (ImGui::Button("remove all observers"))
+        {
+            observers.clear();
+            viewshedDirty = true;
+        }
+        if (strokeRefreshing)
+            ImGui::Text("computing again after the stroke");
+        else
+            ImGui::Text("%u observers, %.1f ms, %.1f%% of the terrain seen", viewshed.observers, viewshed.computeMs,
+                        100.0 * viewshed.visibleSamples / std::max((double)viewshed.Width() * viewshed.Height(), 1.0));
+        ImGui::End();
+
+        ImGui::SetNextWindowSize(ImVec2((float)400.0f, (float)150.0f));
+        ImGui::Begin("Paths");
+        ImGui::ColorEdit3("line color", (float*)&pathColor);
+        if (ImGui::Button("start where the camera looks") && lookingAt.distance >= 0.0f)
+        {
+            pathQuery.from = glm::vec2(lookingAt.position.x, lookingAt.position.z);
+            pathStartSet = true;
+            pathDirty = pathStartSet && pathGoalSet;
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("goal where the camera looks") && lookingAt.distance >= 0.0f)
+        {
+            pathQuery.to = glm::vec2(lookingAt.position.x, lookingAt.position.z);
+            pathGoalSet = true;
+            pathDirty = pathStartSet && pathGoalSet;
+        }
+        if (path.found)
+            ImGui::Text("%u samples, cost %.1f, found in %.2f ms", (unsigned int)path.points.size(), path.cost, pathMs);
+        else
+            ImGui::Text(pathStartSet && pathGoalSet ? "no path between start and goal" : "set a start and a goal");
+        if (strokeRefreshing)
+            ImGui::Text("updating the clusters after the stroke");
+        else
+            ImGui::Text("%d x %d clusters, %u nodes, %u edges, built in %.0f ms", pathfinder.ClustersX(),
+                        pathfinder.ClustersY(), (unsigned int)pathfinder.Nodes(), (unsigned int)pathfinder.Edges(),
+                        pathfinder.buildMs);
+        ImGui::End();
+
+        ImGui::SetNextWindowSize(ImVec2((float)400.0f, (float)245.0f));
+        ImGui::Begin("Sculpting");
+        ImGui::Checkbox("sculpt with the left mouse button", &sculpting);
+        int sculptMode = (int)brush.mode;
+        ImGui::RadioButton("raise", &sculptMode, SCULPT_RAISE);
+        ImGui::SameLine();
+        ImGui::RadioButton("lower", &sculptMode, SCULPT_LOWER);
+        ImGui::SameLine();
+        ImGui::RadioButton("smooth", &sculptMode, SCULPT_SMOOTH);
+        ImGui::SameLine();
+        ImGui::RadioButton("flatten", &sculptMode, SCULPT_FLATTEN);
+        brush.mode = (SculptMode)sculptMode;
+        ImGui::SliderFloat("radius", &brush.radius, 1.0f, 500.0f);
+        ImGui::SliderFloat("strength", &brush.strength, 0.0f, 50.0f);
+        ImGui::SliderFloat("hardness", &brush.hardness, 0.0f, 1.0f);
+        if (ImGui::Button("save edits") && sculptor.Ready())
+            std::cout << (sculptor.Save(editsPath) ? "Saved the edits to " : "Cannot save the edits to ") << editsPath
+                      << std::endl;
+        ImGui::Text("dab: %.2f ms, normals: %.2f ms, stroke: %.1f ms in %u dabs", sculptor.dabMs,
+                    normalBaker.refreshMs, sculptor.strokeMs, sculptor.strokeDabs);
+        ImGui::Text(strokeRefreshing ? "updating paths and visibility after the stroke" : "paths and visibility up to date");
+        ImGui::Text("%u edited tiles, %.1f MiB of tiles uploaded", (unsigned int)sculptor.EditedTiles(),
+                    terrainStreamer.texelsEdited * 2.0 / (1024.0 * 1024.0));
+        ImGui::End();
+
+        ImGui::SetNextWindowSize(ImVec2((float)400.0f, (float)300.0f));
+        ImGui::Begin("Video memory");
+        int budgetMiB = (int)(residency.Budget() / (1024 * 1024));
+        if (ImGui::SliderInt("budget (MiB, 0 = none)", &budgetMiB, 0, 2048))
+            residency.SetBudget((size_t)budgetMiB * 1024 * 1024);
+        ImGui::Text("in use: %.1f MiB, peak %.1f MiB", residency.UsageBytes() / (1024.0 * 1024.0),
+                    residency.peakBytes / (1024.0 * 1024.0));
+        ImGui::Text("textures: %.1f MiB, buffers: %.1f MiB", residency.TextureBytes() / (1024.0 * 1024.0),
+                    residency.BufferBytes() / (1024.0 * 1024.0));
+        ImGui::Text("dropped: %u levels, %.1f MiB", residency.levelsDropped, residency.bytesDropped / (1024.0 * 1024.0));
+        std::vector<TextureRef> liveTextures = textures.Live();
+        for (size_t i = 0; i < liveTextures.size(); i++)
+        {
+            const TextureRecord &record = *liveTextures[i];
+            ImGui::Text("%7.2f MiB  level %u/%u  %s", record.bytes / (1024.0 * 1024.0), record.baseLevel, record.levels,
+                        record.name.substr(record.name.find_last_of('/') + 1).c_str());
+        }
+        const std::map<GLuint, ResidencyManager::Buffer> &fixedTextures = residency.Textures();
+        for (std::map<GLuint, ResidencyManager::Buffer>::const_iterator it = fixedTextures.begin(); it != fixedTextures.end(); ++it)
+            ImGui::Text("%7.2f MiB  %s", it->second.bytes / (1024.0 * 1024.0), it->second.name.c_str());
+        const std::map<GLuint, ResidencyManager::Buffer> &buffers = residency.Buffers();
+        for (std::map<GLuint, ResidencyManager::Buffer>::const_iterator it = buffers.begin(); it != buffers.end(); ++it)
+            ImGui::Text("%7.2f MiB  buffer %s", it->second.bytes / (1024.0 * 1024.0), it->second.name.c_str());
+        ImGui::End();
+
         // Render dear imgui into screen
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
@@ -513,7 +1238,22 @@ int main()
         // -------------------------------------------------------------------------------
         glfwSwapBuffers(window);
         glfwPollEvents();
+
+        // glfw's clock starts at glfwInit
+        if (!firstFrameShown)
+        {
+            std::cout << "First frame after " << glfwGetTime() * 1000.0 << " ms" << std::endl;
+            firstFrameShown = true;
+        }
+        if (!fullQualityShown && loader.Idle() && streamer.Pending() == 0)
+        {
+            std::cout << "Full texture quality after " << glfwGetTime() * 1000.0 << " ms, "
+                      << streamer.bytesStreamed / (1024 * 1024) << " MiB streamed in after the first frame" << std::endl;
+            fullQualityShown = true;
+        }
     }
+    // the refresh after the last stroke uses the pathfinder and the viewshed
+    jobs.Wait(strokeRefresh);
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -524,6 +1264,25 @@ int main()
     // ------------------------------------------------------------------------
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
+    residency.ForgetBuffer(VBO);
+    residency.ForgetTexture(terrainStreamer.Atlas(0));
+    terrainStreamer.Destroy();
+    if (clipmap)
+    {
+        residency.ForgetTexture(clipmap->Texture());
+        clipmap->Destroy();
+    }
+    clipmapTiles.reset();
+    residency.ForgetTexture(viewshedTexture);
+    glDeleteTextures(1, &viewshedTexture);
+    residency.ForgetTexture(normalMap);
+    glDeleteTextures(1, &normalMap);
+    residency.ForgetBuffer(pathVBO);
+    glDeleteVertexArrays(1, &pathVAO);
+    glDeleteBuffers(1, &pathVBO);
+    fetcher.Close();
+    textures.Shutdown();
+    uploads.Destroy();
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
@@ -579,71 +1338,10 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     }
 }
 
-unsigned int loadTexture(char const * path)
+// distance from the camera to a cloud layer, the layer is the top face of the unit cube scaled by model, which
+// is relative to the camera
+float cloudLayerDepth(const glm::mat4 &model)
 {
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(path, &width, &height, &nrComponents, 0);
-    if (data)
-    {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
-    }
-    else
-    {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
-    }
-    return textureID;
+    glm::vec4 layerCenter = model * glm::vec4(0.0f, 0.5f, 0.0f, 1.0f);
+    return std::abs(layerCenter.y);
 }
-
-unsigned int loadCubemap(std::vector<std::string> faces)
-{
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
-
-    int width, height, nrChannels;
-    for (unsigned int i = 0; i < faces.size(); i++)
-    {
-        unsigned char *data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
-        if (data)
-        {
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 
-                         0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
-            );
-            stbi_image_free(data);
-        }
-        else
-        {
-            std::cout << "Cubemap tex failed to load at path: " << faces[i] << std::endl;
-            stbi_image_free(data);
-        }
-    }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-    return textureID;
-}  
-
@@ -0,0 +1,53 @@
+
+
+#version 410 core
+layout (location = 0) in vec3 aPos;     // grid vertex, x and z in cells of the level
+
+// geometry clipmap (see terrain_clipmap.h): one toroidally addressed slice of heights per level, the model
+// matrix places the level's grid relative to the camera and its scale is the level's sample spacing
+uniform sampler2DArray heightClipmap;
+uniform float clipmapTexelSize;     // world units between level 0 samples
+uniform float clipmapTextureSize;   // texels across a slice
+uniform float clipmapGrid;          // cells across a level
+uniform int clipmapLevels;
+uniform vec2 clipmapCorners[24];    // level texel of the corner of each level's grid, TerrainClipmap::Corner()
+uniform vec2 terrainSize;           // level 0 texels
+uniform float heightOffset;         // world height of 0 and of the full range
+uniform float heightScale;
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+out vec2 texCoord;
+out float Height;
+out vec3 FragPos;
+
+// texel is a level texel index, whole for the level's own samples and halves on the next coarser level
+float clipmapHeight(int level, vec2 texel)
+{
+    // wrapped first, the texel alone would lose the fraction in a large world
+    return texture(heightClipmap, vec3((mod(texel, clipmapTextureSize) + 0.5) / clipmapTextureSize, float(level))).r;
+}
+
+void main()
+{
+    float spacing = model[0][0];
+    int level = int(round(log2(spacing / clipmapTexelSize)));
+    vec2 texel = clipmapCorners[level] + aPos.xz;
+
+    // the outer tenth of a level blends into the next coarser level, which it matches exactly at the edge
+    float h = clipmapHeight(level, texel);
+    float centre = clipmapGrid * 0.5;
+    float width = clipmapGrid * 0.1;
+    vec2 fromCentre = abs(aPos.xz - centre);
+    float alpha = clamp((max(fromCentre.x, fromCentre.y) - (centre - width)) / width, 0.0, 1.0);
+    if (level + 1 < clipmapLevels && alpha > 0.0)
+        h = mix(h, clipmapHeight(level + 1, texel * 0.5), alpha);
+
+    Height = heightOffset + heightScale * h;
+    vec4 world = model * vec4(aPos, 1.0);
+    world.y = model[3].y + Height;
+    texCoord = texel * exp2(float(level)) / terrainSize;
+    FragPos = world.xyz;
+    gl_Position = projection * view * world;
+}
@@ -74,9 +74,10 @@ vec4 ray_march(int steps)
 {
     vec4 color = cloudBaseColor;
 
-    vec3 direction = normalize(FragPos - rayOrigin);
+    // FragPos is relative to the camera, rayOrigin is where the camera is in the world
+    vec3 direction = normalize(FragPos);
 
-    vec3 current_position = FragPos / sizeAmountRatio;
+    vec3 current_position = (FragPos + rayOrigin) / sizeAmountRatio;
 
     for (int step = 0; step < steps; ++step)
     {
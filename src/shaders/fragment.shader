@@ -8,10 +8,15 @@ in vec3 FragPos;
 
 out vec4 FragColor;
 
-uniform sampler2D heightMap;
 uniform sampler2D normalMap;
-uniform sampler2D textureBlendMap;
-uniform sampler2D specularMap;
+uniform sampler2DArray blendAtlas;
+uniform sampler2DArray specularAtlas;
+uniform usampler2D terrainIndirection;
+uniform vec2 terrainSize;
+uniform float terrainTileSize;
+uniform float terrainBorder;
+uniform float heightOffset;
+uniform float heightScale;
 uniform sampler2D texture3;
 uniform sampler2D texture4;
 uniform sampler2D texture5;
@@ -26,13 +31,29 @@ uniform float ambientStrength;
 uniform float diffuseStrength;
 uniform float specularStrength;
 uniform float shininess;
+uniform bool normalMapXZ;   // BC5 normal map holding x and z in red and green
+uniform sampler2D viewshed; // how many observers see each terrain sample, see viewshed.h
+uniform bool viewshedOverlay;
+
+// the same lookup as in tessellation_eval.shader
+vec3 terrainAtlasCoord(vec2 uv)
+{
+    vec2 texel = clamp(uv, 0.0, 1.0) * terrainSize;
+    ivec2 cell = min(ivec2(texel / terrainTileSize), textureSize(terrainIndirection, 0) - 1);
+    uvec2 entry = texelFetch(terrainIndirection, cell, 0).rg;
+    vec2 levelTexel = texel / exp2(float(entry.y));
+    vec2 tile = min(floor(levelTexel / terrainTileSize), vec2(cell >> int(entry.y)));
+    vec2 local = levelTexel - tile * terrainTileSize + terrainBorder;
+    return vec3(local / (terrainTileSize + 2.0 * terrainBorder), float(entry.x));
+}
 
 void main()
 {
-    float h = (Height + 16)/64.0f;
+    float h = (Height - heightOffset) / heightScale;
     vec2 texCoordScaled = 64.0 * texCoord;
+    vec3 atlasCoord = terrainAtlasCoord(texCoord);
 
-    vec4 blendMapColour = texture(textureBlendMap, texCoord);
+    vec4 blendMapColour = texture(blendAtlas, atlasCoord);
 
     float waterTexAmount = 1 - (blendMapColour.r + blendMapColour.g + blendMapColour.b);
     vec4 waterTexColour = texture(texture5, texCoordScaled) * waterTexAmount;
@@ -44,6 +65,11 @@ void main()
     vec4 totalTexColour = waterTexColour + rTexColour + gTexColour + bTexColour;
 
     vec3 normal = texture(normalMap, texCoord).rgb;
+    if (normalMapXZ)
+    {
+        vec2 xz = normal.rg * 2.0 - 1.0;
+        normal = vec3(xz.x, sqrt(max(1.0 - dot(xz, xz), 0.0)), xz.y) * 0.5 + 0.5;
+    }
     normal = normalize(normal * 2.0 - 1.0);  
 
     // ambient lighting
@@ -58,8 +84,16 @@ void main()
     vec3 viewDir = normalize(viewPos - FragPos);
     vec3 reflectDir = reflect(-lightDir, normal);  
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), shininess);
-    vec3 specular = spec * texture(specularMap, texCoord).rgb;  
+    vec3 specular = spec * texture(specularAtlas, atlasCoord).rgb;  
 
     FragColor = vec4(ambientStrength*ambient + diffuseStrength*diffuse + specularStrength*specular, 1.0);
+
+    // seen by one observer green, by more towards yellow, by none red
+    if (viewshedOverlay)
+    {
+        float observers = texture(viewshed, texCoord).r * 255.0;
+        vec3 tint = observers < 0.5 ? vec3(0.8, 0.15, 0.1) : mix(vec3(0.2, 0.8, 0.2), vec3(0.95, 0.85, 0.2), clamp((observers - 1.0) / 4.0, 0.0, 1.0));
+        FragColor.rgb = mix(FragColor.rgb, tint, 0.35);
+    }
 }
 
@@ -3,7 +3,15 @@
 #version 410 core
 layout(quads, fractional_odd_spacing, ccw) in;
 
-uniform sampler2D heightMap;
+// streamed terrain (see terrain_streamer.h): one atlas slice per resident tile, the indirection texture holds
+// the slot and level of the finest resident tile over every level 0 tile
+uniform sampler2DArray heightAtlas;
+uniform usampler2D terrainIndirection;
+uniform vec2 terrainSize;       // level 0 texels
+uniform float terrainTileSize;
+uniform float terrainBorder;
+uniform float heightOffset;     // world height of 0 and of the full range
+uniform float heightScale;
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
@@ -14,6 +22,18 @@ out vec2 texCoord;
 out float Height;
 out vec3 FragPos;
 
+// atlas coordinate of uv in the finest resident tile
+vec3 terrainAtlasCoord(vec2 uv)
+{
+    vec2 texel = clamp(uv, 0.0, 1.0) * terrainSize;
+    ivec2 cell = min(ivec2(texel / terrainTileSize), textureSize(terrainIndirection, 0) - 1);
+    uvec2 entry = texelFetch(terrainIndirection, cell, 0).rg;
+    vec2 levelTexel = texel / exp2(float(entry.y));
+    vec2 tile = min(floor(levelTexel / terrainTileSize), vec2(cell >> int(entry.y)));
+    vec2 local = levelTexel - tile * terrainTileSize + terrainBorder;
+    return vec3(local / (terrainTileSize + 2.0 * terrainBorder), float(entry.x));
+}
+
 void main()
 {
     float u = gl_TessCoord.x;
@@ -28,7 +48,7 @@ void main()
     vec2 t1 = (t11 - t10) * u + t10;
     texCoord = (t1 - t0) * v + t0;
 
-    Height = texture(heightMap, texCoord).r * 64.0 - 16.0;
+    Height = heightOffset + heightScale * texture(heightAtlas, terrainAtlasCoord(texCoord)).r;
 
     vec4 p00 = gl_in[0].gl_Position;
     vec4 p01 = gl_in[1].gl_Position;
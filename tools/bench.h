@@ -0,0 +1,77 @@
+
+
+#ifndef TOOLS_BENCH_H
+#define TOOLS_BENCH_H
+
+#include <height_field.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Timing, reporting and test terrain shared by the benchmarks in tools/.
+typedef std::chrono::high_resolution_clock Clock;
+
+inline double millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// the fastest of iterations runs of run, in milliseconds
+template <typename F>
+inline double best(int iterations, F run)
+{
+    double fastest = 1e30;
+    for (int i = 0; i < iterations; i++)
+    {
+        Clock::time_point start = Clock::now();
+        run();
+        fastest = std::min(fastest, millisecondsSince(start));
+    }
+    return fastest;
+}
+
+// a line of results: what was measured, how long it took and the rate of count things in that time, per second in
+// units of scale, as in report("decode", ms, bytes, 1e6, "MB/s")
+inline void report(const char *name, double ms, double count, double scale, const char *unit)
+{
+    printf("  %-34s %8.2f ms %9.1f %s\n", name, ms, count * 1e3 / ms / scale, unit);
+}
+
+// width x height 16 bit heights of summed sine waves, for benchmarks run without a dataset
+inline void synthesizeHeights(int width, int height, std::vector<uint16_t> &samples)
+{
+    samples.resize((size_t)width * height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            double h = 0.5 + 0.25 * std::sin(x * 0.013) * std::cos(y * 0.011) + 0.15 * std::sin(x * 0.071 + y * 0.053) +
+                       0.05 * std::sin(x * 0.31) * std::sin(y * 0.29);
+            samples[(size_t)y * width + x] = (uint16_t)(std::min(std::max(h, 0.0), 1.0) * 65535.0);
+        }
+}
+
+// the height layer of the dataset at path, or without a path synthesized heights of width x height samples (the
+// size of the bundled terrain by default) one unit apart from -16 to 48. False, and says so, if path cannot be read.
+inline bool loadOrSynthesizeField(const std::string &path, HeightField &field, int width = 3840, int height = 1910)
+{
+    if (!path.empty())
+    {
+        TerrainDataset dataset;
+        if (!dataset.Open(path) || !field.Load(dataset, dataset.FindLayer("height")))
+        {
+            fprintf(stderr, "cannot load the heights of %s\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+    std::vector<uint16_t> samples;
+    synthesizeHeights(width, height, samples);
+    field.Assign(&samples[0], width, height, 1.0f, -16.0f, 64.0f);
+    return true;
+}
+#endif
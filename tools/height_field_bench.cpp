@@ -0,0 +1,168 @@
+// Measures HeightField queries: single and batched bilinear heights and normals at random points and along a
+// path, against plain bilinear filtering of a row major copy of the same samples, and checks that the batched
+// queries and the row major reference agree with HeightAt().
+//
+// usage: height_field_bench [--queries N] [--iterations N] [file.terrain]
+//
+// Without a dataset a 4096 x 4096 field of summed sine waves is used. Every measurement runs N times over the
+// same points and the fastest run is reported, in millions of queries per second.
+
+#include <height_field.h>
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// the same filtering as HeightField::HeightAt() in double precision over row major samples, the reference
+struct RowMajorField {
+    std::vector<uint16_t> samples;
+    int width, height;
+    double texelSize, heightOffset, heightScale;
+
+    double HeightAt(double x, double z) const
+    {
+        double sx = std::min(std::max(x / texelSize + width * 0.5 - 0.5, -1.0), (double)width);
+        double sz = std::min(std::max(z / texelSize + height * 0.5 - 0.5, -1.0), (double)height);
+        double x0 = std::floor(sx), z0 = std::floor(sz);
+        double fx = sx - x0, fz = sz - z0;
+        int ix0 = std::min(std::max((int)x0, 0), width - 1), ix1 = std::min(std::max((int)x0 + 1, 0), width - 1);
+        int iz0 = std::min(std::max((int)z0, 0), height - 1), iz1 = std::min(std::max((int)z0 + 1, 0), height - 1);
+        double h00 = samples[(size_t)iz0 * width + ix0], h10 = samples[(size_t)iz0 * width + ix1];
+        double h01 = samples[(size_t)iz1 * width + ix0], h11 = samples[(size_t)iz1 * width + ix1];
+        double top = h00 + (h10 - h00) * fx, bottom = h01 + (h11 - h01) * fx;
+        return heightOffset + heightScale * ((top + (bottom - top) * fz) / 65535.0);
+    }
+
+    // the float version of the same, what a straightforward implementation would do
+    float HeightAtFloat(float x, float z) const
+    {
+        float sx = std::min(std::max(x / (float)texelSize + width * 0.5f - 0.5f, -1.0f), (float)width);
+        float sz = std::min(std::max(z / (float)texelSize + height * 0.5f - 0.5f, -1.0f), (float)height);
+        float x0 = std::floor(sx), z0 = std::floor(sz);
+        float fx = sx - x0, fz = sz - z0;
+        int ix0 = std::min(std::max((int)x0, 0), width - 1), ix1 = std::min(std::max((int)x0 + 1, 0), width - 1);
+        int iz0 = std::min(std::max((int)z0, 0), height - 1), iz1 = std::min(std::max((int)z0 + 1, 0), height - 1);
+        float h00 = samples[(size_t)iz0 * width + ix0], h10 = samples[(size_t)iz0 * width + ix1];
+        float h01 = samples[(size_t)iz1 * width + ix0], h11 = samples[(size_t)iz1 * width + ix1];
+        float top = h00 + (h10 - h00) * fx, bottom = h01 + (h11 - h01) * fx;
+        return (float)heightOffset + (float)heightScale * ((top + (bottom - top) * fz) / 65535.0f);
+    }
+};
+
+static void measure(const char *title, const HeightField &field, const RowMajorField &reference,
+                    const std::vector<float> &x, const std::vector<float> &z, int iterations)
+{
+    size_t count = x.size();
+    std::vector<float> heights(count), batched(count);
+    std::vector<glm::vec3> normals(count);
+    volatile float sink = 0.0f;
+    printf("%s, %u queries\n", title, (unsigned int)count);
+
+    report("row major, float", best(iterations, [&]()
+    {
+        float sum = 0.0f;
+        for (size_t i = 0; i < count; i++)
+            sum += reference.HeightAtFloat(x[i], z[i]);
+        sink = sum;
+    }), count, 1e6, "M/s");
+    report("HeightAt", best(iterations, [&]()
+    {
+        for (size_t i = 0; i < count; i++)
+            heights[i] = field.HeightAt(x[i], z[i]);
+    }), count, 1e6, "M/s");
+    char name[64];
+    snprintf(name, sizeof(name), "HeightsAt (%s)", HeightField::SimdPath());
+    report(name, best(iterations, [&]() { field.HeightsAt(&x[0], &z[0], &batched[0], count); }), count, 1e6, "M/s");
+    report("NormalAt", best(iterations, [&]()
+    {
+        for (size_t i = 0; i < count; i++)
+            normals[i] = field.NormalAt(x[i], z[i]);
+    }), count, 1e6, "M/s");
+    snprintf(name, sizeof(name), "NormalsAt (%s)", HeightField::SimdPath());
+    report(name, best(iterations, [&]() { field.NormalsAt(&x[0], &z[0], &normals[0], count); }), count, 1e6, "M/s");
+
+    double batchError = 0.0, referenceError = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        batchError = std::max(batchError, (double)std::fabs(batched[i] - heights[i]));
+        referenceError = std::max(referenceError, std::fabs(heights[i] - reference.HeightAt(x[i], z[i])));
+    }
+    printf("  largest difference: batched %.3g, double precision reference %.3g (world units)\n", batchError,
+           referenceError);
+    (void)sink;
+}
+
+int main(int argc, char **argv)
+{
+    size_t queries = 4 * 1024 * 1024;
+    int iterations = 5;
+    std::string path;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc)
+            queries = (size_t)std::max(atol(argv[++i]), 1L);
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = std::max(atoi(argv[++i]), 1);
+        else if (argv[i][0] != '-' && path.empty())
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--queries N] [--iterations N] [file.terrain]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    HeightField field;
+    Clock::time_point start = Clock::now();
+    if (!loadOrSynthesizeField(path, field, 4096, 4096))
+        return 1;
+    if (!path.empty())
+        printf("loaded %s in %.1f ms\n", path.c_str(), millisecondsSince(start));
+    RowMajorField reference;
+    reference.width = field.Width();
+    reference.height = field.Height();
+    reference.texelSize = field.TexelSize();
+    reference.heightOffset = field.HeightOffset();
+    reference.heightScale = field.HeightScale();
+    reference.samples.resize((size_t)reference.width * reference.height);
+    for (int y = 0; y < reference.height; y++)
+        for (int x = 0; x < reference.width; x++)
+            reference.samples[(size_t)y * reference.width + x] = field.Sample(x, y);
+    printf("%d x %d samples, %.1f MiB, %s\n", field.Width(), field.Height(), field.Bytes() / (1024.0 * 1024.0),
+           HeightField::SimdPath());
+
+    // random points over the terrain and a little past its edges
+    float extentX = field.Width() * field.TexelSize() * 0.55f, extentZ = field.Height() * field.TexelSize() * 0.55f;
+    std::vector<float> x(queries), z(queries);
+    uint32_t state = 12345u;
+    for (size_t i = 0; i < queries; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        x[i] = ((state >> 8) / 16777216.0f * 2.0f - 1.0f) * extentX;
+        state = state * 1664525u + 1013904223u;
+        z[i] = ((state >> 8) / 16777216.0f * 2.0f - 1.0f) * extentZ;
+    }
+    measure("random points", field, reference, x, z, iterations);
+
+    // a winding path a quarter texel a step, the way a moving object or a placement scan asks
+    float px = 0.0f, pz = 0.0f, heading = 0.0f;
+    for (size_t i = 0; i < queries; i++)
+    {
+        heading += std::sin(i * 0.0007f) * 0.01f;
+        px += std::cos(heading) * field.TexelSize() * 0.25f;
+        pz += std::sin(heading) * field.TexelSize() * 0.25f;
+        if (std::fabs(px) > extentX || std::fabs(pz) > extentZ)
+            heading += 3.14159265f;
+        x[i] = px;
+        z[i] = pz;
+    }
+    measure("path", field, reference, x, z, iterations);
+    return 0;
+}
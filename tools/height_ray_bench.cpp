@@ -0,0 +1,190 @@
+// Measures ray casting against a HeightField through the maximum mipmap of HeightRayCaster: picking rays cast
+// down from above the terrain and line of sight tests between points just over the ground, one at a time and
+// batched over the job system, against marching each ray in half texel steps with HeightAt(), which also checks
+// that both find the same hits.
+//
+// usage: height_ray_bench [--rays N] [--iterations N] [--threads N] [file.terrain]
+//
+// Without a dataset a 4096 x 4096 field of summed sine waves is used. Every measurement runs N times over the
+// same rays and the fastest run is reported, in thousands of rays per second. The marching reference is timed
+// on a sixteenth of the rays, it is that much slower.
+
+#include <height_ray.h>
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the straightforward way: half texel steps until the ray is below the surface, then bisection to the crossing
+static float march(const HeightField &field, const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance)
+{
+    float length = glm::length(direction);
+    if (length <= 0.0f)
+        return -1.0f;
+    float step = field.TexelSize() * 0.5f / length;
+    float previous = 0.0f;
+    for (float t = 0.0f; t <= maxDistance + step; t += step)
+    {
+        float s = std::min(t, maxDistance);
+        glm::vec3 p = origin + direction * s;
+        if (p.y <= field.HeightAt(p.x, p.z))
+        {
+            if (s == 0.0f)
+                return 0.0f;
+            float low = previous, high = s;
+            for (int i = 0; i < 16; i++)
+            {
+                float middle = (low + high) * 0.5f;
+                glm::vec3 q = origin + direction * middle;
+                (q.y <= field.HeightAt(q.x, q.z) ? high : low) = middle;
+            }
+            return high;
+        }
+        previous = s;
+    }
+    return -1.0f;
+}
+
+static void measure(const char *title, const HeightField &field, const HeightRayCaster &caster, JobSystem &jobs,
+                    const std::vector<glm::vec3> &origins, const std::vector<glm::vec3> &directions,
+                    float maxDistance, int iterations)
+{
+    size_t count = origins.size();
+    size_t marched = std::max(count / 16, (size_t)1);
+    std::vector<HeightRayHit> hits(count), batched(count);
+    std::vector<float> reference(marched);
+    printf("%s, %u rays\n", title, (unsigned int)count);
+
+    report("marching HeightAt", best(iterations, [&]()
+    {
+        for (size_t i = 0; i < marched; i++)
+            reference[i] = march(field, origins[i], directions[i], maxDistance);
+    }), marched, 1e3, "K/s");
+    report("Cast", best(iterations, [&]()
+    {
+        for (size_t i = 0; i < count; i++)
+            caster.Cast(origins[i], directions[i], maxDistance, hits[i]);
+    }), count, 1e3, "K/s");
+    report("CastBatch", best(iterations, [&]()
+    {
+        caster.CastBatch(&origins[0], &directions[0], count, maxDistance, &batched[0]);
+    }), count, 1e3, "K/s");
+    char name[64];
+    snprintf(name, sizeof(name), "CastBatch, %u workers", jobs.NumWorkers());
+    report(name, best(iterations, [&]()
+    {
+        caster.CastBatch(&origins[0], &directions[0], count, maxDistance, &batched[0], &jobs);
+    }), count, 1e3, "K/s");
+
+    // the marching steps over crossings narrower than its step, so where the two differ it is later
+    size_t hitCount = 0, disagreements = 0, later = 0, batchDifferences = 0;
+    double largest = 0.0, offSurface = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        hitCount += hits[i].distance >= 0.0f;
+        batchDifferences += hits[i].distance != batched[i].distance;
+    }
+    for (size_t i = 0; i < marched; i++)
+    {
+        if ((hits[i].distance >= 0.0f) != (reference[i] >= 0.0f))
+            disagreements++;
+        else if (reference[i] >= 0.0f)
+        {
+            double difference = (double)std::fabs(hits[i].distance - reference[i]) * glm::length(directions[i]);
+            if (difference > field.TexelSize() * 0.5f && reference[i] > hits[i].distance)
+                later++;
+            else
+                largest = std::max(largest, difference);
+            if (hits[i].distance > 0.0f)
+                offSurface = std::max(offSurface, (double)std::fabs(hits[i].position.y -
+                                                                    field.HeightAt(hits[i].position.x, hits[i].position.z)));
+        }
+    }
+    printf("  %.1f%% hit, batched differs on %u\n", 100.0 * hitCount / count, (unsigned int)batchDifferences);
+    printf("  marching: disagrees on %u of %u, finds a later crossing on %u, otherwise within %.3g\n",
+           (unsigned int)disagreements, (unsigned int)marched, (unsigned int)later, largest);
+    printf("  largest height above or below the surface at a hit %.3g\n", offSurface);
+}
+
+int main(int argc, char **argv)
+{
+    size_t rays = 256 * 1024;
+    int iterations = 3;
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    std::string path;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rays") == 0 && i + 1 < argc)
+            rays = (size_t)std::max(atol(argv[++i]), 1L);
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = (unsigned int)std::max(atoi(argv[++i]), 1);
+        else if (argv[i][0] != '-' && path.empty())
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--rays N] [--iterations N] [--threads N] [file.terrain]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    HeightField field;
+    if (!loadOrSynthesizeField(path, field, 4096, 4096))
+        return 1;
+
+    JobSystem jobs(threads);
+    Clock::time_point start = Clock::now();
+    HeightRayCaster serial(field);
+    double serialMs = millisecondsSince(start);
+    start = Clock::now();
+    HeightRayCaster caster(field, &jobs);
+    double parallelMs = millisecondsSince(start);
+    printf("%d x %d samples, %d levels, %.1f MiB, built in %.1f ms (%.1f ms with the job system)\n", field.Width(),
+           field.Height(), caster.Levels(), caster.Bytes() / (1024.0 * 1024.0), serialMs, parallelMs);
+
+    float extentX = field.Width() * field.TexelSize() * 0.45f, extentZ = field.Height() * field.TexelSize() * 0.45f;
+    float top = field.HeightOffset() + field.HeightScale();
+    uint32_t state = 12345u;
+    auto random = [&state]() -> float
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / 16777216.0f;
+    };
+
+    // picking: from a little above the highest point down into the terrain, up to 60 degrees off vertical
+    std::vector<glm::vec3> origins(rays), directions(rays);
+    for (size_t i = 0; i < rays; i++)
+    {
+        origins[i] = glm::vec3((random() * 2.0f - 1.0f) * extentX, top + field.HeightScale() * 0.5f * random(),
+                               (random() * 2.0f - 1.0f) * extentZ);
+        float heading = random() * 6.2831853f, tilt = random() * 1.0471976f;
+        directions[i] = glm::vec3(std::cos(heading) * std::sin(tilt), -std::cos(tilt), std::sin(heading) * std::sin(tilt));
+    }
+    measure("picking", field, caster, jobs, origins, directions, 1e6f, iterations);
+
+    // line of sight: between points two texels over the ground up to a quarter of the terrain apart, the
+    // direction is the whole segment so the hits are those short of 1
+    float reach = std::min(extentX, extentZ) * 0.5f;
+    for (size_t i = 0; i < rays; i++)
+    {
+        glm::vec3 from((random() * 2.0f - 1.0f) * extentX, 0.0f, (random() * 2.0f - 1.0f) * extentZ);
+        glm::vec3 to(from.x + (random() * 2.0f - 1.0f) * reach, 0.0f, from.z + (random() * 2.0f - 1.0f) * reach);
+        to.x = std::min(std::max(to.x, -extentX), extentX);
+        to.z = std::min(std::max(to.z, -extentZ), extentZ);
+        from.y = field.HeightAt(from.x, from.z) + field.TexelSize() * 2.0f;
+        to.y = field.HeightAt(to.x, to.z) + field.TexelSize() * 2.0f;
+        origins[i] = from;
+        directions[i] = to - from;
+    }
+    measure("line of sight", field, caster, jobs, origins, directions, 1.0f, iterations);
+    return 0;
+}
@@ -0,0 +1,136 @@
+// Measures how fast heightmap containers decode, on one thread and on the job system, and optionally how the
+// same map decodes from PNG with the streaming decoder and with stb_image.
+//
+// usage: heightmap_bench [--iterations N] [--threads N] map.hmap [image.png]
+//
+// Every decode runs N times into one preallocated buffer and the fastest run is reported, the container is
+// mapped once up front the way the AssetLoader keeps it, PNGs are opened on every run.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <heightmap_file.h>
+#include <job_system.h>
+#include <png_stream.h>
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static double decodeContainer(const HeightmapReader &reader, JobSystem *jobs, std::vector<unsigned char> &dst,
+                              int iterations)
+{
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++)
+    {
+        Clock::time_point start = Clock::now();
+        if (!reader.Decode(&dst[0], jobs))
+            return -1.0;
+        best = std::min(best, millisecondsSince(start));
+    }
+    return best;
+}
+
+static double decodePngStream(const std::string &path, std::vector<unsigned char> &dst, int iterations)
+{
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++)
+    {
+        Clock::time_point start = Clock::now();
+        PngStreamDecoder png;
+        if (!png.Open(path) || !png.Supported())
+            return -1.0;
+        size_t rowBytes = (size_t)png.Info().width;
+        if ((size_t)png.Info().height * rowBytes > dst.size())
+            dst.resize((size_t)png.Info().height * rowBytes);
+        unsigned char *out = &dst[0];
+        if (!png.Decode(1, [&out, rowBytes](const unsigned char *row, int) { memcpy(out, row, rowBytes); out += rowBytes; }))
+            return -1.0;
+        best = std::min(best, millisecondsSince(start));
+    }
+    return best;
+}
+
+static double decodeStb(const std::string &path, int iterations)
+{
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++)
+    {
+        Clock::time_point start = Clock::now();
+        int width, height, channels;
+        unsigned char *pixels = stbi_load(path.c_str(), &width, &height, &channels, 1);
+        if (!pixels)
+            return -1.0;
+        stbi_image_free(pixels);
+        best = std::min(best, millisecondsSince(start));
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 10;
+    unsigned int threads = JobSystem::DefaultWorkerCount();
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc)
+            iterations = std::max(1, atoi(argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = (unsigned int)atoi(argv[++i]);
+        else
+            paths.push_back(arg);
+    }
+    if (paths.empty() || paths.size() > 2)
+    {
+        printf("usage: heightmap_bench [--iterations N] [--threads N] map.hmap [image.png]\n");
+        return 1;
+    }
+
+    HeightmapReader reader;
+    if (!reader.Open(paths[0]))
+    {
+        printf("%s: not a heightmap container\n", paths[0].c_str());
+        return 1;
+    }
+    const HeightmapInfo &info = reader.Info();
+    size_t bytes = info.DecodedSize();
+    std::vector<unsigned char> dst(bytes, 1);
+    printf("%s: %dx%d, %zu bit samples, %dx%d tiles, %zu bytes, fastest of %d runs\n", paths[0].c_str(), info.width,
+           info.height, info.SampleBytes() * 8, info.tileSize, info.tileSize, reader.FileSize(), iterations);
+
+    JobSystem jobs(threads);
+    double single = decodeContainer(reader, nullptr, dst, iterations);
+    double parallel = decodeContainer(reader, &jobs, dst, iterations);
+    if (single < 0.0 || parallel < 0.0)
+    {
+        printf("%s: corrupt tile\n", paths[0].c_str());
+        return 1;
+    }
+    report("container, 1 thread", single, bytes, 1e6, "MB/s");
+    char name[64];
+    snprintf(name, sizeof(name), "container, job system (%u workers)", threads);
+    report(name, parallel, bytes, 1e6, "MB/s");
+
+    if (paths.size() == 2)
+    {
+        double stream = decodePngStream(paths[1], dst, iterations);
+        double stb = decodeStb(paths[1], iterations);
+        if (stream < 0.0 || stb < 0.0)
+        {
+            printf("%s: cannot decode\n", paths[1].c_str());
+            return 1;
+        }
+        size_t pngBytes = (size_t)info.width * info.height;
+        report("png, streaming decoder", stream, pngBytes, 1e6, "MB/s");
+        report("png, stb_image", stb, pngBytes, 1e6, "MB/s");
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Converts heightmaps to the heightmap container (see heightmap_file.h), written next to the input with the
+// extension replaced by .hmap, where decodeImage() and the AssetLoader pick it up for single channel requests.
+//
+// usage: heightmap_convert [--16] [--raw WxH u16|f32] [--tile N] [--threads N] [-o out.hmap] input...
+//
+// Images are read with stb_image as one channel, 8 bit unless --16 asks for 16 bit samples. --raw reads tightly
+// packed little endian samples of the given size and type instead. Every container is decoded again and
+// compared against its input before the sizes are printed.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <heightmap_file.h>
+#include <job_system.h>
+
+#include "bench.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static size_t fileSize(const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return 0;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size > 0 ? (size_t)size : 0;
+}
+
+static bool readRaw(const std::string &path, size_t size, std::vector<unsigned char> &samples)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    samples.resize(size);
+    bool ok = size > 0 && fread(&samples[0], size, 1, file) == 1;
+    fclose(file);
+    return ok;
+}
+
+static bool loadSamples(const std::string &path, bool sixteenBit, int rawWidth, int rawHeight, HeightFormat rawFormat,
+                        std::vector<unsigned char> &samples, int &width, int &height, HeightFormat &format)
+{
+    if (rawWidth > 0)
+    {
+        width = rawWidth;
+        height = rawHeight;
+        format = rawFormat;
+        if (!readRaw(path, (size_t)width * height * heightSampleBytes(format), samples))
+        {
+            printf("%s: cannot read %dx%d samples\n", path.c_str(), width, height);
+            return false;
+        }
+        return true;
+    }
+
+    int channels;
+    void *pixels = sixteenBit ? (void*)stbi_load_16(path.c_str(), &width, &height, &channels, 1)
+                              : (void*)stbi_load(path.c_str(), &width, &height, &channels, 1);
+    if (!pixels)
+    {
+        printf("%s: %s\n", path.c_str(), stbi_failure_reason());
+        return false;
+    }
+    format = sixteenBit ? HEIGHT_U16 : HEIGHT_U8;
+    size_t size = (size_t)width * height * heightSampleBytes(format);
+    samples.assign((const unsigned char*)pixels, (const unsigned char*)pixels + size);
+    stbi_image_free(pixels);
+    return true;
+}
+
+static bool convert(JobSystem &jobs, const std::string &input, const std::string &output, bool sixteenBit, int rawWidth,
+                    int rawHeight, HeightFormat rawFormat, int tileSize)
+{
+    std::vector<unsigned char> samples;
+    int width, height;
+    HeightFormat format;
+    if (!loadSamples(input, sixteenBit, rawWidth, rawHeight, rawFormat, samples, width, height, format))
+        return false;
+
+    Clock::time_point start = Clock::now();
+    if (!writeHeightmap(output, &samples[0], width, height, format, &jobs, tileSize))
+    {
+        printf("%s: cannot write %s\n", input.c_str(), output.c_str());
+        return false;
+    }
+    double encodeMs = millisecondsSince(start);
+
+    HeightmapReader reader;
+    std::vector<unsigned char> decoded(samples.size());
+    start = Clock::now();
+    bool ok = reader.Open(output) && reader.Decode(&decoded[0], &jobs);
+    double decodeMs = millisecondsSince(start);
+    if (!ok || memcmp(&decoded[0], &samples[0], samples.size()) != 0)
+    {
+        printf("%s: %s does not decode to the input\n", input.c_str(), output.c_str());
+        return false;
+    }
+
+    size_t inputSize = fileSize(input);
+    size_t outputSize = reader.FileSize();
+    printf("%s -> %s: %dx%d %s, %zu -> %zu bytes (%.2f bits per sample), encode %.1f ms, decode %.1f ms\n",
+           input.c_str(), output.c_str(), width, height, format == HEIGHT_U8 ? "u8" : (format == HEIGHT_U16 ? "u16" : "f32"),
+           inputSize, outputSize, outputSize * 8.0 / ((double)width * height), encodeMs, decodeMs);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool sixteenBit = false;
+    int rawWidth = 0, rawHeight = 0;
+    HeightFormat rawFormat = HEIGHT_U16;
+    int tileSize = 64;
+    unsigned int threads = JobSystem::DefaultWorkerCount();
+    std::string output;
+    std::vector<std::string> inputs;
+    bool valid = true;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--16")
+            sixteenBit = true;
+        else if (arg == "--raw" && i + 2 < argc)
+        {
+            std::string type = argv[i + 2];
+            valid = sscanf(argv[i + 1], "%dx%d", &rawWidth, &rawHeight) == 2 && rawWidth > 0 && rawHeight > 0 &&
+                    (type == "u16" || type == "f32") && valid;
+            rawFormat = type == "f32" ? HEIGHT_F32 : HEIGHT_U16;
+            i += 2;
+        }
+        else if (arg == "--tile" && i + 1 < argc)
+            tileSize = atoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = (unsigned int)atoi(argv[++i]);
+        else if (arg == "-o" && i + 1 < argc)
+            output = argv[++i];
+        else
+            inputs.push_back(arg);
+    }
+    if (!valid || inputs.empty() || (!output.empty() && inputs.size() > 1) || tileSize < 16 || tileSize > 256 ||
+        tileSize % 16 != 0)
+    {
+        printf("usage: heightmap_convert [--16] [--raw WxH u16|f32] [--tile N] [--threads N] [-o out.hmap] input...\n");
+        printf("       tile sizes are multiples of 16 up to 256, -o takes a single input\n");
+        return 1;
+    }
+
+    JobSystem jobs(threads);
+    bool ok = true;
+    for (size_t i = 0; i < inputs.size(); i++)
+        ok = convert(jobs, inputs[i], output.empty() ? heightmapPathFor(inputs[i]) : output, sixteenBit, rawWidth,
+                     rawHeight, rawFormat, tileSize) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+// Micro-benchmark of the job system against spawning std::threads directly.
+//
+// usage: job_bench [iterations]
+//
+// Every workload splits N units of work into tasks and runs the whole batch to completion, the way frame
+// preparation and loading use the job system. Reported times are the average per batch in microseconds.
+
+#include <job_system.h>
+
+#include "bench.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+static volatile float sink;
+
+// roughly a microsecond of arithmetic per unit
+static void work(size_t units)
+{
+    float acc = 0.0f;
+    for (size_t u = 0; u < units; u++)
+        for (int i = 0; i < 200; i++)
+            acc += std::sqrt((float)(i + u));
+    sink = acc;
+}
+
+// one std::thread per task
+static double threadPerTask(size_t tasks, size_t unitsPerTask, int iterations)
+{
+    Clock::time_point start = Clock::now();
+    for (int it = 0; it < iterations; it++)
+    {
+        std::vector<std::thread> threads;
+        threads.reserve(tasks);
+        for (size_t t = 0; t < tasks; t++)
+            threads.push_back(std::thread(work, unitsPerTask));
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+    }
+    return millisecondsSince(start) * 1000.0 / iterations;
+}
+
+// one std::thread per hardware thread per batch, tasks split into contiguous chunks
+static double threadPerCore(size_t tasks, size_t unitsPerTask, int iterations, unsigned int numThreads)
+{
+    Clock::time_point start = Clock::now();
+    for (int it = 0; it < iterations; it++)
+    {
+        std::vector<std::thread> threads;
+        size_t chunk = (tasks + numThreads - 1) / numThreads;
+        for (size_t first = 0; first < tasks; first += chunk)
+        {
+            size_t last = first + chunk < tasks ? first + chunk : tasks;
+            threads.push_back(std::thread([first, last, unitsPerTask]()
+            {
+                for (size_t t = first; t < last; t++)
+                    work(unitsPerTask);
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); t++)
+            threads[t].join();
+    }
+    return millisecondsSince(start) * 1000.0 / iterations;
+}
+
+static double jobSystemRun(JobSystem &jobs, size_t tasks, size_t unitsPerTask, int iterations)
+{
+    Clock::time_point start = Clock::now();
+    for (int it = 0; it < iterations; it++)
+    {
+        JobCounter counter;
+        for (size_t t = 0; t < tasks; t++)
+            jobs.Run([unitsPerTask]() { work(unitsPerTask); }, &counter);
+        jobs.Wait(counter);
+    }
+    return millisecondsSince(start) * 1000.0 / iterations;
+}
+
+static double jobSystemParallelFor(JobSystem &jobs, size_t tasks, size_t unitsPerTask, int iterations)
+{
+    size_t grain = tasks / (jobs.NumThreads() * 4);
+    Clock::time_point start = Clock::now();
+    for (int it = 0; it < iterations; it++)
+    {
+        jobs.ParallelFor(0, tasks, grain > 0 ? grain : 1, [unitsPerTask](size_t first, size_t last)
+        {
+            for (size_t t = first; t < last; t++)
+                work(unitsPerTask);
+        });
+    }
+    return millisecondsSince(start) * 1000.0 / iterations;
+}
+
+static double serial(size_t tasks, size_t unitsPerTask, int iterations)
+{
+    Clock::time_point start = Clock::now();
+    for (int it = 0; it < iterations; it++)
+        for (size_t t = 0; t < tasks; t++)
+            work(unitsPerTask);
+    return millisecondsSince(start) * 1000.0 / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    if (iterations < 1)
+        iterations = 1;
+
+    unsigned int hardwareThreads = std::thread::hardware_concurrency();
+    if (hardwareThreads == 0)
+        hardwareThreads = 1;
+    JobSystem jobs(hardwareThreads - 1);
+
+    printf("threads: %u, iterations: %d, times in microseconds per batch\n\n", jobs.NumThreads(), iterations);
+    printf("%8s %8s %12s %14s %14s %12s %14s\n", "tasks", "units", "serial", "thread/task", "thread/core", "job Run", "ParallelFor");
+
+    const size_t taskCounts[] = { 16, 256, 4096, 65536 };
+    const size_t unitCounts[] = { 1, 16 };
+    for (size_t u = 0; u < sizeof(unitCounts) / sizeof(unitCounts[0]); u++)
+    {
+        for (size_t t = 0; t < sizeof(taskCounts) / sizeof(taskCounts[0]); t++)
+        {
+            size_t tasks = taskCounts[t];
+            size_t units = unitCounts[u];
+            // keep the total amount of work per row in the same ballpark
+            int rowIterations = tasks * units > 16384 ? (iterations + 9) / 10 : iterations;
+
+            double serialTime = serial(tasks, units, rowIterations);
+            double perTask = tasks <= 4096 ? threadPerTask(tasks, units, rowIterations) : -1.0;
+            double perCore = threadPerCore(tasks, units, rowIterations, hardwareThreads);
+            double run = jobSystemRun(jobs, tasks, units, rowIterations);
+            double parallelFor = jobSystemParallelFor(jobs, tasks, units, rowIterations);
+
+            printf("%8zu %8zu %12.1f ", tasks, units, serialTime);
+            if (perTask >= 0.0)
+                printf("%14.1f ", perTask);
+            else
+                printf("%14s ", "-");
+            printf("%14.1f %12.1f %14.1f\n", perCore, run, parallelFor);
+        }
+    }
+    return 0;
+}
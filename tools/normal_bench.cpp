@@ -0,0 +1,132 @@
+// Measures TerrainNormalBaker: the Sobel normals on the calling thread alone and over the job system, a cold bake
+// (normals, mip chain and BC5) and a warm one from the cache, and checks the normals against a double precision
+// reference and against HeightField::NormalAt().
+//
+// usage: normal_bench [--iterations N] [--threads N] [--baked FILE] [file.terrain]
+//
+// Without a dataset a 3840 x 1910 field of summed sine waves, the size of the bundled terrain, is used. The baked
+// file (./cache/normal_bench.bake by default) is removed first so that the cold bake is cold.
+// Every measurement runs N times and the fastest run is reported.
+
+#include <terrain_normals.h>
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double heightOf(const HeightField &field, int x, int y)
+{
+    return field.HeightOffset() + field.Sample(x, y) * (field.HeightScale() / 65535.0);
+}
+
+// the Sobel normal of sample (x, y) in doubles
+static void referenceNormal(const HeightField &field, int x, int y, double n[3])
+{
+    double gx = 0.0, gz = 0.0;
+    const double weights[3] = { 1.0, 2.0, 1.0 };
+    for (int k = -1; k <= 1; k++)
+    {
+        gx += weights[k + 1] * (heightOf(field, x + 1, y + k) - heightOf(field, x - 1, y + k));
+        gz += weights[k + 1] * (heightOf(field, x + k, y + 1) - heightOf(field, x + k, y - 1));
+    }
+    n[0] = -gx;
+    n[1] = 8.0 * field.TexelSize();
+    n[2] = -gz;
+    double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    for (int c = 0; c < 3; c++)
+        n[c] /= length;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 3;
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    std::string baked = "./cache/normal_bench.bake";
+    std::string path;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = (unsigned int)std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--baked") == 0 && i + 1 < argc)
+            baked = argv[++i];
+        else if (argv[i][0] != '-' && path.empty())
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--iterations N] [--threads N] [--baked FILE] [file.terrain]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    HeightField field;
+    if (!loadOrSynthesizeField(path, field))
+        return 1;
+    int width = field.Width(), height = field.Height();
+    printf("%d x %d samples, %s\n", width, height, TerrainNormalBaker::SimdPath());
+
+    JobSystem jobs(threads);
+    std::vector<unsigned char> serial((size_t)width * height * 4), rgba(serial.size());
+    double alone = best(iterations, [&]() { TerrainNormalBaker::Normals(field, 0, 0, width, height, &serial[0]); });
+    double parallel = best(iterations, [&]() { TerrainNormalBaker::Normals(field, 0, 0, width, height, &rgba[0], &jobs); });
+    printf("normals\n");
+    printf("  calling thread        %8.2f ms, %.1f Msamples/s\n", alone, (double)width * height / (alone * 1000.0));
+    printf("  %2u workers            %8.2f ms, %s\n", jobs.NumWorkers(), parallel,
+           memcmp(&serial[0], &rgba[0], rgba.size()) == 0 ? "same normals" : "NORMALS DIFFER");
+
+    // a rectangle inside the field has to come out as the same part of the whole
+    int rx0 = width / 3, ry0 = height / 3, rx1 = rx0 + 333, ry1 = ry0 + 77;
+    std::vector<unsigned char> part((size_t)(rx1 - rx0) * (ry1 - ry0) * 4);
+    TerrainNormalBaker::Normals(field, rx0, ry0, rx1, ry1, &part[0], &jobs);
+    bool samePart = true;
+    for (int y = ry0; y < ry1; y++)
+        samePart = samePart && memcmp(&part[(size_t)(y - ry0) * (rx1 - rx0) * 4], &rgba[((size_t)y * width + rx0) * 4],
+                                      (size_t)(rx1 - rx0) * 4) == 0;
+    printf("  %d x %d rectangle    %s\n", rx1 - rx0, ry1 - ry0, samePart ? "same normals" : "NORMALS DIFFER");
+
+    // every 13th sample against the reference and against the central differences of NormalAt()
+    int worst = 0;
+    double angleSum = 0.0, angleMax = 0.0;
+    size_t checked = 0;
+    for (size_t i = 0; i < (size_t)width * height; i += 13)
+    {
+        int x = (int)(i % width), y = (int)(i / width);
+        double n[3];
+        referenceNormal(field, x, y, n);
+        for (int c = 0; c < 3; c++)
+            worst = std::max(worst, std::abs((int)rgba[i * 4 + c] - (int)std::floor(std::min(n[c] * 127.5 + 128.0, 255.0))));
+        glm::vec3 central = field.NormalAt((x + 0.5f - width * 0.5f) * field.TexelSize(),
+                                           (y + 0.5f - height * 0.5f) * field.TexelSize());
+        double cosine = std::min(n[0] * central.x + n[1] * central.y + n[2] * central.z, 1.0);
+        double angle = std::acos(cosine) * 180.0 / 3.14159265358979;
+        angleSum += angle;
+        angleMax = std::max(angleMax, angle);
+        checked++;
+    }
+    printf("against doubles on %u samples: off by at most %d\n", (unsigned int)checked, worst);
+    printf("against NormalAt(): %.3f degrees apart on average, %.2f at most\n", angleSum / checked, angleMax);
+
+    // the bake of this field is thrown away first, then baked and read back
+    TerrainNormalBaker baker(baked);
+    baker.Bake(field, &jobs);
+    remove(baker.Path().c_str());
+    Clock::time_point start = Clock::now();
+    baker.Bake(field, &jobs);
+    double cold = millisecondsSince(start);
+    printf("cold bake %8.2f ms: hash %.2f, normals %.2f, mips and BC5 %.2f, %u levels, %.1f MiB\n", cold,
+           baker.hashMs, baker.normalsMs, baker.compressMs, baker.Levels(), baker.Bytes() / (1024.0 * 1024.0));
+    size_t bytes = baker.Bytes();
+    double warm = best(iterations, [&]() { baker.Bake(field, &jobs); });
+    printf("warm bake %8.2f ms from %s, %s\n", warm, baker.Path().c_str(),
+           baker.fromCache && baker.Bytes() == bytes ? "cache hit" : "CACHE MISSED");
+    return 0;
+}
@@ -0,0 +1,233 @@
+// Measures TerrainPathfinder: building the cluster abstraction on the calling thread and over the job system,
+// updating it after an edit, and answering queries one at a time and batched over the job system, against A* over
+// every sample of the field, which also gives how much dearer the hierarchical paths are than the cheapest.
+//
+// usage: path_bench [--queries N] [--iterations N] [--threads N] [--cluster N] [--blend map.png] [file.terrain]
+//
+// Without a dataset a 3840 x 1910 field of summed sine waves, the size of the bundled terrain, is used, and
+// without a blend map only the slopes count. Queries go between random points of the middle of the terrain up to
+// a quarter of it apart. Every measurement runs N times and the fastest run is reported; the flat A* reference
+// runs once, on a sixteenth of the queries.
+
+#include <raster_reader.h>
+#include <terrain_paths.h>
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A* over all of the samples with the moves and costs of TerrainPathfinder, in its world units; negative if the
+// goal cannot be reached. cheapest is the lowest cost of an open sample.
+static double flatSearch(const TerrainPathfinder &paths, int width, int height, float texelSize, uint64_t cheapest,
+                         const glm::vec2 &from, const glm::vec2 &to)
+{
+    int sx = (int)std::floor(from.x / texelSize + width * 0.5f), sy = (int)std::floor(from.y / texelSize + height * 0.5f);
+    int gx = (int)std::floor(to.x / texelSize + width * 0.5f), gy = (int)std::floor(to.y / texelSize + height * 0.5f);
+    if (paths.Cost(sx, sy) == 0 || paths.Cost(gx, gy) == 0)
+        return -1.0;
+    auto estimate = [&](int x, int y) -> uint64_t
+    {
+        uint64_t dx = (uint64_t)std::abs(x - gx), dy = (uint64_t)std::abs(y - gy);
+        return (std::max(dx, dy) * PATH_STRAIGHT + std::min(dx, dy) * (PATH_DIAGONAL - PATH_STRAIGHT)) * 2 * cheapest;
+    };
+    static const int DX[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+    static const int DY[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+    std::vector<uint64_t> g((size_t)width * height, ~(uint64_t)0);
+    typedef std::pair<uint64_t, int> Entry;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > open;
+    g[(size_t)sy * width + sx] = 0;
+    open.push(Entry(estimate(sx, sy), sy * width + sx));
+    while (!open.empty())
+    {
+        Entry entry = open.top();
+        open.pop();
+        int x = entry.second % width, y = entry.second / width;
+        if (entry.first != g[entry.second] + estimate(x, y))
+            continue;
+        if (x == gx && y == gy)
+            return g[entry.second] * (texelSize / (32.0 * PATH_STRAIGHT));
+        for (int d = 0; d < 8; d++)
+        {
+            int nx = x + DX[d], ny = y + DY[d];
+            if (nx < 0 || ny < 0 || nx >= width || ny >= height || paths.Cost(nx, ny) == 0)
+                continue;
+            if (d >= 4 && (paths.Cost(nx, y) == 0 || paths.Cost(x, ny) == 0))
+                continue;
+            uint64_t total = g[entry.second] + (uint64_t)(paths.Cost(x, y) + paths.Cost(nx, ny)) *
+                                               (d >= 4 ? PATH_DIAGONAL : PATH_STRAIGHT);
+            if (total < g[(size_t)ny * width + nx])
+            {
+                g[(size_t)ny * width + nx] = total;
+                open.push(Entry(total + estimate(nx, ny), ny * width + nx));
+            }
+        }
+    }
+    return -1.0;
+}
+
+int main(int argc, char **argv)
+{
+    int queryCount = 256;
+    int iterations = 3;
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    int clusterSize = 64;
+    std::string path, blendPath;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc)
+            queryCount = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = (unsigned int)std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--cluster") == 0 && i + 1 < argc)
+            clusterSize = std::max(atoi(argv[++i]), 8);
+        else if (strcmp(argv[i], "--blend") == 0 && i + 1 < argc)
+            blendPath = argv[++i];
+        else if (argv[i][0] != '-' && path.empty())
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--queries N] [--iterations N] [--threads N] [--cluster N] [--blend map.png] "
+                    "[file.terrain]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    HeightField field;
+    if (!loadOrSynthesizeField(path, field))
+        return 1;
+
+    std::vector<uint8_t> blend;
+    int blendChannels = 0;
+    if (!blendPath.empty())
+    {
+        RasterReader reader;
+        if (!reader.Open(blendPath) || reader.Info().type != RASTER_U8 || reader.Info().width != field.Width() ||
+            reader.Info().height != field.Height())
+        {
+            fprintf(stderr, "%s is not an 8 bit map the size of the terrain\n", blendPath.c_str());
+            return 1;
+        }
+        blendChannels = reader.Info().channels;
+        blend.resize(reader.Info().RowBytes() * reader.Info().height);
+        size_t rowBytes = reader.Info().RowBytes();
+        if (!reader.Read([&](const unsigned char *row, int y) { memcpy(&blend[(size_t)y * rowBytes], row, rowBytes); }))
+        {
+            fprintf(stderr, "cannot read %s: %s\n", blendPath.c_str(), reader.Error());
+            return 1;
+        }
+    }
+    const uint8_t *blendData = blend.empty() ? nullptr : &blend[0];
+
+    JobSystem jobs(threads);
+    PathCostSettings settings;
+    TerrainPathfinder serial(field, blendData, blendChannels, settings, nullptr, clusterSize);
+    TerrainPathfinder paths(field, blendData, blendChannels, settings, &jobs, clusterSize);
+    size_t open = 0;
+    uint64_t cheapest = 255;
+    for (int y = 0; y < field.Height(); y++)
+        for (int x = 0; x < field.Width(); x++)
+            if (paths.Cost(x, y) != 0)
+            {
+                open++;
+                cheapest = std::min(cheapest, (uint64_t)paths.Cost(x, y));
+            }
+    printf("%d x %d samples, %.1f%% open, %d x %d clusters of %d, %u nodes, %u edges, %.1f MiB\n", field.Width(),
+           field.Height(), 100.0 * open / ((size_t)field.Width() * field.Height()), paths.ClustersX(), paths.ClustersY(),
+           clusterSize, (unsigned int)paths.Nodes(), (unsigned int)paths.Edges(), paths.Bytes() / (1024.0 * 1024.0));
+    printf("  build, calling thread        %9.1f ms\n", serial.buildMs);
+    printf("  build, %2u workers            %9.1f ms\n", jobs.NumWorkers(), paths.buildMs);
+
+    // an edit of 32 x 32 samples in the middle, nothing changes so the abstraction comes out the same
+    int cx = field.Width() / 2, cy = field.Height() / 2;
+    double updateMs = best(iterations, [&]() { paths.Update(cx - 16, cy - 16, cx + 15, cy + 15, &jobs); });
+    printf("  update of 32 x 32 samples    %9.2f ms, %u clusters rebuilt, %u nodes\n", updateMs, paths.clustersRebuilt,
+           (unsigned int)paths.Nodes());
+
+    // queries between open samples, up to a quarter of the terrain apart
+    float extentX = field.Width() * field.TexelSize() * 0.45f, extentZ = field.Height() * field.TexelSize() * 0.45f;
+    float reach = std::min(extentX, extentZ) * 0.5f;
+    uint32_t state = 12345u;
+    auto random = [&state]() -> float
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / 16777216.0f;
+    };
+    auto openAt = [&](const glm::vec2 &p) -> bool
+    {
+        int x = (int)std::floor(p.x / field.TexelSize() + field.Width() * 0.5f);
+        int y = (int)std::floor(p.y / field.TexelSize() + field.Height() * 0.5f);
+        return x >= 0 && y >= 0 && x < field.Width() && y < field.Height() && paths.Cost(x, y) != 0;
+    };
+    std::vector<PathQuery> queries;
+    for (int attempt = 0; (int)queries.size() < queryCount && attempt < queryCount * 1000; attempt++)
+    {
+        PathQuery query;
+        query.from = glm::vec2((random() * 2.0f - 1.0f) * extentX, (random() * 2.0f - 1.0f) * extentZ);
+        query.to = query.from + glm::vec2((random() * 2.0f - 1.0f) * reach, (random() * 2.0f - 1.0f) * reach);
+        query.to.x = std::min(std::max(query.to.x, -extentX), extentX);
+        query.to.y = std::min(std::max(query.to.y, -extentZ), extentZ);
+        if (openAt(query.from) && openAt(query.to))
+            queries.push_back(query);
+    }
+    if (queries.empty())
+    {
+        printf("no open samples to find paths between\n");
+        return 0;
+    }
+
+    std::vector<TerrainPath> results(queries.size()), batched(queries.size());
+    printf("%u queries\n", (unsigned int)queries.size());
+    double alone = best(iterations, [&]()
+    {
+        for (size_t i = 0; i < queries.size(); i++)
+            paths.FindPath(queries[i].from, queries[i].to, results[i]);
+    });
+    double parallel = best(iterations, [&]() { paths.FindPaths(&queries[0], queries.size(), &batched[0], &jobs); });
+    size_t found = 0, differences = 0, points = 0;
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        found += results[i].found;
+        points += results[i].points.size();
+        differences += results[i].found != batched[i].found || results[i].cost != batched[i].cost;
+    }
+    printf("  FindPath, calling thread     %9.2f ms %8.3f ms a path\n", alone, alone / queries.size());
+    printf("  FindPaths, %2u workers        %9.2f ms %8.3f ms a path, batched differs on %u\n", jobs.NumWorkers(),
+           parallel, parallel / queries.size(), (unsigned int)differences);
+    printf("  %.1f%% found, %.0f samples a path\n", 100.0 * found / queries.size(), found ? (double)points / found : 0.0);
+
+    // A* over every sample for a sixteenth of the queries
+    size_t checked = 0, agree = 0, compared = 0;
+    double flatMs = 0.0, excess = 0.0, worst = 0.0;
+    for (size_t i = 0; i < queries.size(); i += 16)
+    {
+        Clock::time_point start = Clock::now();
+        double lowest = flatSearch(paths, field.Width(), field.Height(), field.TexelSize(), cheapest, queries[i].from,
+                                   queries[i].to);
+        flatMs += millisecondsSince(start);
+        checked++;
+        agree += (lowest >= 0.0) == results[i].found;
+        if (lowest > 0.0 && results[i].found)
+        {
+            double over = results[i].cost / lowest - 1.0;
+            excess += over;
+            worst = std::max(worst, over);
+            compared++;
+        }
+    }
+    printf("  A* over every sample         %9.2f ms a path\n", flatMs / checked);
+    printf("against it on %u queries: %u agree on finding a path, %.2f%% dearer on average, %.2f%% at most\n",
+           (unsigned int)checked, (unsigned int)agree, compared ? 100.0 * excess / compared : 0.0, 100.0 * worst);
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Compares the streaming PNG decoder against stb_image on time and peak memory.
+//
+// usage: png_stream_bench [--stb] [--channels N] [--no-mips] [--verify] image.png...
+//
+// Every image is decoded with its mip chain into one staging buffer, allocated and touched before the baseline
+// is taken, the way the AssetLoader decodes into the persistently mapped upload ring. The streaming path feeds
+// rows through a MipChainWriter straight into the staging buffer, --stb loads the whole image with stbi_load()
+// and builds the chain with writeMipChain(), which is what the loader did before. Peak resident memory only
+// ever grows, so run each mode in its own process to compare them.
+//
+// --verify decodes every image both ways and compares the base levels.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <png_stream.h>
+#include <process_memory.h>
+#include <texture_upload.h>
+
+#include "bench.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static double mebibytes(size_t bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+static bool decodeStreaming(const std::string &path, int desiredChannels, bool mipmaps, std::vector<unsigned char> &staging,
+                            int &width, int &height, int &channels)
+{
+    PngStreamDecoder png;
+    if (!png.Open(path) || !png.Supported())
+    {
+        std::printf("%s: not streamable (%s)\n", path.c_str(), png.Error() ? png.Error() : "format");
+        return false;
+    }
+    width = png.Info().width;
+    height = png.Info().height;
+    channels = desiredChannels ? desiredChannels : png.Info().channels;
+    unsigned int levels = mipmaps ? mipLevelCount(width, height) : 1;
+    size_t size = mipChainSize(width, height, channels, levels);
+    if (size > staging.size())
+        staging.resize(size);
+
+    MipChainWriter writer(width, height, channels, levels, &staging[0]);
+    if (!png.Decode(desiredChannels, [&writer](const unsigned char *row, int) { writer.AddRow(row); }))
+    {
+        std::printf("%s: %s\n", path.c_str(), png.Error());
+        return false;
+    }
+    return true;
+}
+
+static bool decodeStb(const std::string &path, int desiredChannels, bool mipmaps, std::vector<unsigned char> &staging,
+                      int &width, int &height, int &channels)
+{
+    int fileChannels;
+    unsigned char *pixels = stbi_load(path.c_str(), &width, &height, &fileChannels, desiredChannels);
+    if (!pixels)
+    {
+        std::printf("%s: %s\n", path.c_str(), stbi_failure_reason());
+        return false;
+    }
+    channels = desiredChannels ? desiredChannels : fileChannels;
+    unsigned int levels = mipmaps ? mipLevelCount(width, height) : 1;
+    size_t size = mipChainSize(width, height, channels, levels);
+    if (size > staging.size())
+        staging.resize(size);
+    writeMipChain(pixels, width, height, channels, levels, &staging[0]);
+    stbi_image_free(pixels);
+    return true;
+}
+
+static bool verify(const std::string &path, int desiredChannels)
+{
+    std::vector<unsigned char> streamed;
+    int width, height, channels;
+    if (!decodeStreaming(path, desiredChannels, false, streamed, width, height, channels))
+        return false;
+
+    int stbWidth, stbHeight, fileChannels;
+    unsigned char *pixels = stbi_load(path.c_str(), &stbWidth, &stbHeight, &fileChannels, channels);
+    if (!pixels)
+    {
+        std::printf("%s: %s\n", path.c_str(), stbi_failure_reason());
+        return false;
+    }
+    size_t size = (size_t)width * height * channels;
+    size_t mismatches = 0;
+    if (stbWidth != width || stbHeight != height)
+        mismatches = size;
+    else
+        for (size_t i = 0; i < size; i++)
+            if (pixels[i] != streamed[i])
+                mismatches++;
+    stbi_image_free(pixels);
+    std::printf("%s: %s (%zu of %zu bytes differ)\n", path.c_str(), mismatches == 0 ? "identical" : "MISMATCH",
+                mismatches, size);
+    return mismatches == 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool useStb = false;
+    bool mipmaps = true;
+    bool check = false;
+    int desiredChannels = 0;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--stb")
+            useStb = true;
+        else if (arg == "--no-mips")
+            mipmaps = false;
+        else if (arg == "--verify")
+            check = true;
+        else if (arg == "--channels" && i + 1 < argc)
+            desiredChannels = std::atoi(argv[++i]);
+        else
+            paths.push_back(arg);
+    }
+    if (paths.empty() || desiredChannels < 0 || desiredChannels > 4)
+    {
+        std::printf("usage: png_stream_bench [--stb] [--channels N] [--no-mips] [--verify] image.png...\n");
+        return 1;
+    }
+
+    if (check)
+    {
+        bool ok = true;
+        for (size_t i = 0; i < paths.size(); i++)
+            ok = verify(paths[i], desiredChannels) && ok;
+        return ok ? 0 : 1;
+    }
+
+    // stands in for the upload ring, which is resident before any image is decoded
+    std::vector<unsigned char> staging(64 << 20, 1);
+    size_t baseline = peakResidentBytes();
+
+    std::printf("%s decoder, %s\n", useStb ? "stb_image" : "streaming", mipmaps ? "with mip chains" : "base level only");
+    double total = 0.0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        int width = 0, height = 0, channels = 0;
+        Clock::time_point start = Clock::now();
+        bool ok = useStb ? decodeStb(paths[i], desiredChannels, mipmaps, staging, width, height, channels)
+                         : decodeStreaming(paths[i], desiredChannels, mipmaps, staging, width, height, channels);
+        double ms = millisecondsSince(start);
+        if (!ok)
+            continue;
+        total += ms;
+        std::printf("  %-40s %5dx%-5d %d ch %8.1f ms %8.1f MB/s\n", paths[i].c_str(), width, height, channels, ms,
+                    (double)width * height * channels / 1e3 / ms);
+    }
+
+    size_t peak = peakResidentBytes();
+    std::printf("total %.1f ms, staging %.1f MiB, peak resident memory %.1f MiB above the baseline\n", total,
+                mebibytes(staging.size()), mebibytes(peak > baseline ? peak - baseline : 0));
+    return 0;
+}
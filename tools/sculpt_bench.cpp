@@ -0,0 +1,294 @@
+// Measures sculpting with TerrainSculptor: strokes of dabs at random places, each dab followed by the updates a
+// frame makes after it on the CPU (the ray casting pyramid and the normal map blocks), on maps of different
+// sizes, to show that the cost of a dab depends on the brush and not on the map. A stroke is reported as a whole
+// too: its dabs and what ends it on the main thread, and the exact tile bounds a worker computes after it.
+// Afterwards the incremental
+// results are checked against rebuilding everything from the edited heights: a dataset built from them has to
+// have the sculptor's levels and tile bounds, and the normal map and ray casting pyramid have to be the ones
+// baked and built from scratch.
+//
+// usage: sculpt_bench [--dabs N] [--radius R] [--threads N] [file.terrain]
+//
+// Without a dataset, fields of summed sine waves of 1024 x 1024 and 4096 x 4096 samples are made into datasets
+// next to the working directory and removed again. The brush radius is in texels.
+
+#include <height_ray.h>
+#include <terrain_normals.h>
+#include <terrain_sculpt.h>
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Timing {
+    double total, slowest;
+
+    Timing() : total(0.0), slowest(0.0)
+    {
+    }
+
+    void Add(double ms)
+    {
+        total += ms;
+        slowest = std::max(slowest, ms);
+    }
+};
+
+static void report(const char *name, const Timing &timing, int count)
+{
+    printf("  %-30s %8.3f ms mean %8.3f ms slowest\n", name, timing.total / std::max(count, 1), timing.slowest);
+}
+
+static bool readAll(const std::string &path, std::vector<unsigned char> &bytes)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    unsigned char buffer[65536];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer + read);
+    fclose(file);
+    return true;
+}
+
+static bool sameFiles(const std::string &a, const std::string &b)
+{
+    std::vector<unsigned char> first, second;
+    return readAll(a, first) && readAll(b, second) && first == second;
+}
+
+// a dataset of a single height layer of summed sine waves
+static bool makeDataset(const std::string &path, int size, JobSystem &jobs)
+{
+    std::vector<uint16_t> samples;
+    synthesizeHeights(size, size, samples);
+    TerrainDatasetDesc desc;
+    desc.width = desc.height = size;
+    desc.heightOffset = -16.0f;
+    desc.heightScale = 64.0f;
+    TerrainLayerDesc layer;
+    layer.name = "height";
+    layer.format = TERRAIN_R16;
+    desc.layers.push_back(layer);
+    return buildTerrainDataset(path, desc, std::vector<const void*>(1, &samples[0]), &jobs);
+}
+
+// the edited field as a dataset of its own, whose levels and bounds the sculptor's have to be
+static bool checkAgainstRebuild(const HeightField &field, const TerrainDataset &dataset, const TerrainSculptor &sculptor,
+                                const std::string &path, JobSystem &jobs)
+{
+    const TerrainFileHeader &header = dataset.Header();
+    std::vector<uint16_t> samples((size_t)field.Width() * field.Height());
+    for (int y = 0; y < field.Height(); y++)
+        for (int x = 0; x < field.Width(); x++)
+            samples[(size_t)y * field.Width() + x] = field.Sample(x, y);
+    TerrainDatasetDesc desc;
+    desc.width = (int)header.width;
+    desc.height = (int)header.height;
+    desc.tileSize = (int)header.tileSize;
+    desc.border = (int)header.border;
+    desc.heightOffset = header.heightOffset;
+    desc.heightScale = header.heightScale;
+    desc.texelSize = header.texelSize;
+    TerrainLayerDesc layer;
+    layer.name = "height";
+    layer.format = TERRAIN_R16;
+    desc.layers.push_back(layer);
+    TerrainDataset rebuilt;
+    if (!buildTerrainDataset(path, desc, std::vector<const void*>(1, &samples[0]), &jobs) || !rebuilt.Open(path))
+        return false;
+
+    size_t texelDifferences = 0, boundDifferences = 0;
+    std::vector<unsigned char> level;
+    std::vector<uint16_t> read;
+    for (int l = 0; l < rebuilt.Levels(); l++)
+    {
+        const TerrainLevelRecord &record = rebuilt.Level(l);
+        rebuilt.ReadLevel(l, 0, level);
+        read.resize((size_t)record.width * record.height);
+        sculptor.Read(l, 0, 0, (int)record.width, (int)record.height, &read[0]);
+        texelDifferences += memcmp(&level[0], &read[0], read.size() * sizeof(uint16_t)) != 0;
+        for (uint32_t ty = 0; ty < record.tilesY; ty++)
+            for (uint32_t tx = 0; tx < record.tilesX; tx++)
+            {
+                float low = 0.0f, high = 0.0f, expectedLow = 0.0f, expectedHigh = 0.0f;
+                sculptor.TileBounds(l, (int)tx, (int)ty, low, high);
+                rebuilt.TileBounds(l, (int)tx, (int)ty, expectedLow, expectedHigh);
+                boundDifferences += low != expectedLow || high != expectedHigh;
+            }
+    }
+    rebuilt.Close();
+    remove(path.c_str());
+    printf("  rebuilt dataset: %u of %d levels differ, %u tile bounds differ\n", (unsigned int)texelDifferences,
+           dataset.Levels(), (unsigned int)boundDifferences);
+    return texelDifferences == 0 && boundDifferences == 0;
+}
+
+static bool measure(const std::string &path, int dabs, float radius, JobSystem &jobs)
+{
+    TerrainDataset dataset;
+    HeightField field;
+    int layer = -1;
+    if (!dataset.Open(path) || (layer = dataset.FindLayer("height")) < 0 || !field.Load(dataset, layer))
+    {
+        fprintf(stderr, "cannot load the heights of %s\n", path.c_str());
+        return false;
+    }
+    Clock::time_point start = Clock::now();
+    TerrainSculptor sculptor(field, dataset, layer, &jobs);
+    double setupMs = millisecondsSince(start);
+    HeightRayCaster rays(field, &jobs);
+    TerrainNormalBaker normals(bakedPathFor(path, "sculpt_bench_normals"));
+    normals.Bake(field, &jobs);
+    start = Clock::now();
+    normals.Refresh(field, 0, 0, 0, 0, &jobs);
+    double keepMs = millisecondsSince(start);
+    printf("%s: %d x %d samples, %d levels, sculptor set up in %.1f ms with %.1f MiB, normal levels kept in %.1f ms\n",
+           path.c_str(), field.Width(), field.Height(), sculptor.Levels(), setupMs, sculptor.Bytes() / (1024.0 * 1024.0),
+           keepMs);
+
+    uint32_t state = 12345u;
+    auto random = [&state]() -> float
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / 16777216.0f;
+    };
+    // strokes of a second at 60 frames a second, each a straight line over a few brush radii in one mode
+    Timing dab, ray, normal, total, end, exact, apply, stroke;
+    int strokes = 0;
+    float extentX = field.Width() * field.TexelSize() * 0.5f, extentZ = field.Height() * field.TexelSize() * 0.5f;
+    SculptBrush brush;
+    brush.radius = radius * field.TexelSize();
+    for (int i = 0; i < dabs; i += 60, strokes++)
+    {
+        brush.mode = (SculptMode)(strokes % 4);
+        glm::vec2 from((random() * 2.0f - 1.0f) * extentX, (random() * 2.0f - 1.0f) * extentZ);
+        glm::vec2 to = from + glm::vec2(random() * 2.0f - 1.0f, random() * 2.0f - 1.0f) * brush.radius * 4.0f;
+        brush.target = field.HeightAt(from.x, from.y);
+        double strokeMs = 0.0;
+        for (int d = i; d < std::min(i + 60, dabs); d++)
+        {
+            glm::vec2 centre = from + (to - from) * ((d - i) / 60.0f);
+            Clock::time_point dabStart = Clock::now();
+            TerrainRect rect = sculptor.Dab(brush, centre, 1.0f / 60.0f);
+            dab.Add(millisecondsSince(dabStart));
+            start = Clock::now();
+            rays.Update(rect.x0, rect.y0, rect.x1, rect.y1);
+            ray.Add(millisecondsSince(start));
+            start = Clock::now();
+            normals.Refresh(field, rect.x0, rect.y0, rect.x1, rect.y1);
+            normal.Add(millisecondsSince(start));
+            double dabMs = millisecondsSince(dabStart);
+            total.Add(dabMs);
+            strokeMs += dabMs;
+        }
+        start = Clock::now();
+        TerrainRect rect = sculptor.EndStroke();
+        double endMs = millisecondsSince(start);
+        end.Add(endMs);
+        start = Clock::now();
+        std::vector<TerrainSculptor::TileRange> tiles = sculptor.ExactBounds(rect);
+        exact.Add(millisecondsSince(start));
+        start = Clock::now();
+        sculptor.SetBounds(tiles);
+        double applyMs = millisecondsSince(start);
+        apply.Add(applyMs);
+        stroke.Add(strokeMs + endMs + applyMs);
+    }
+    printf("  %d dabs of radius %.0f texels in %d strokes\n", dabs, radius, strokes);
+    report("Dab", dab, dabs);
+    report("HeightRayCaster::Update", ray, dabs);
+    report("TerrainNormalBaker::Refresh", normal, dabs);
+    report("per dab", total, dabs);
+    report("EndStroke", end, strokes);
+    report("SetBounds", apply, strokes);
+    report("whole stroke, main thread", stroke, strokes);
+    report("ExactBounds, on a worker", exact, strokes);
+    printf("  %u level 0 tiles edited\n", (unsigned int)sculptor.EditedTiles());
+
+    // the edits as delta tiles, applied to the heights they were made on they give the same heights
+    std::string edits = bakedPathFor(path, "sculpt_bench_edits");
+    start = Clock::now();
+    bool saved = sculptor.Save(edits);
+    double saveMs = millisecondsSince(start);
+    HeightField reloaded;
+    reloaded.Load(dataset, layer);
+    TerrainSculptor again(reloaded, dataset, layer);
+    start = Clock::now();
+    TerrainRect applied = again.Load(edits);
+    double loadMs = millisecondsSince(start);
+    bool sameHeights = saved && !applied.Empty() && reloaded.ContentHash() == field.ContentHash();
+    printf("  edits saved in %.1f ms, loaded in %.1f ms, %s\n", saveMs, loadMs,
+           sameHeights ? "same heights" : "DIFFERENT HEIGHTS");
+    remove(edits.c_str());
+
+    bool ok = checkAgainstRebuild(field, dataset, sculptor, bakedPathFor(path, "sculpt_bench", ".terrain"), jobs);
+    TerrainNormalBaker baked(bakedPathFor(path, "sculpt_bench_rebaked"));
+    baked.Bake(field, &jobs);
+    HeightRayCaster built(field, &jobs);
+    std::string raysA = bakedPathFor(path, "sculpt_bench_rays_a"), raysB = bakedPathFor(path, "sculpt_bench_rays_b");
+    rays.Write(raysA);
+    built.Write(raysB);
+    bool sameRays = sameFiles(raysA, raysB);
+    printf("  ray casting pyramid %s the one built from scratch\n", sameRays ? "is" : "IS NOT");
+    unsigned int normalDifferences = 0;
+    for (unsigned int level = 0; level < baked.Levels(); level++)
+        normalDifferences += normals.Level(level) != baked.Level(level);
+    printf("  normal map: %u of %u levels differ from the one baked from scratch\n", normalDifferences, baked.Levels());
+    remove(raysA.c_str());
+    remove(raysB.c_str());
+    remove(normals.Path().c_str());
+    remove(baked.Path().c_str());
+    return ok && sameHeights && sameRays && normalDifferences == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int dabs = 600;
+    float radius = 24.0f;
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    std::string path;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--dabs") == 0 && i + 1 < argc)
+            dabs = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+            radius = (float)std::max(atof(argv[++i]), 1.0);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = (unsigned int)std::max(atoi(argv[++i]), 1);
+        else if (argv[i][0] != '-' && path.empty())
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--dabs N] [--radius R] [--threads N] [file.terrain]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    JobSystem jobs(threads);
+    if (!path.empty())
+        return measure(path, dabs, radius, jobs) ? 0 : 1;
+    bool ok = true;
+    const int sizes[] = { 1024, 4096 };
+    for (int i = 0; i < 2; i++)
+    {
+        std::string synthetic = "sculpt_bench_" + std::to_string(sizes[i]) + ".terrain";
+        if (!makeDataset(synthetic, sizes[i], jobs))
+        {
+            fprintf(stderr, "cannot write %s\n", synthetic.c_str());
+            return 1;
+        }
+        ok = measure(synthetic, dabs, radius, jobs) && ok;
+        remove(synthetic.c_str());
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,338 @@
+// Bakes everything the viewer derives from the terrain maps and textures, so that it starts by reading files:
+//   dataset    the heightmap, texture blend map and specular map as a terrain dataset (tiles, mip pyramid,
+//              per tile height bounds), see terrain_dataset.h
+//   normals    the BC5 normal map of the heights, see terrain_normals.h
+//   rays       the maximum mipmap for picking, see height_ray.h
+//   paths      the pathfinder's clusters and abstract graph, costed by the heights and blend map, see terrain_paths.h
+//   textures   BC7 terrain textures and BC1 skybox faces as .ktx next to the images, see texture_compress
+//
+// usage: terrain_bake [--terrain out.terrain] [--force] [--no-textures] [--threads N]
+//
+// Run from the project directory, the build runs it there (the bake_terrain target). The derived files go next to
+// the dataset (./cache/terrain.terrain by default) and are named by bakedPathFor(). The steps form a BakeGraph
+// with a manifest next to the dataset, so a run only rebuilds what depends on a source that changed and a run
+// without changes only checks the sizes and times of the files. The normals, rays and paths depend on stamps of
+// the dataset layers they read, so editing the specular map only reimports the dataset. --force rebuilds everything.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <bake_graph.h>
+#include <baked_file.h>
+#include <content_hash.h>
+#include <height_field.h>
+#include <height_ray.h>
+#include <job_system.h>
+#include <ktx_file.h>
+#include <raster_reader.h>
+#include <terrain_dataset.h>
+#include <terrain_normals.h>
+#include <terrain_paths.h>
+#include <texture_compression.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// the sources of the dataset and how they are imported, the viewer's shaders expect heights from -16 to 48
+static const char *const TERRAIN_MAPS[] = { "./src/terrainmaps/heightmap.png", "./src/terrainmaps/textureblendmap.png",
+                                            "./src/terrainmaps/specularmap.png" };
+static const char *const LAYER_NAMES[] = { "height", "blend", "specular" };
+static const TerrainLayerFormat LAYER_FORMATS[] = { TERRAIN_R16, TERRAIN_RGBA8, TERRAIN_R8 };
+static const float HEIGHT_OFFSET = -16.0f;
+static const float HEIGHT_SCALE = 64.0f;
+static const int PATH_CLUSTER_SIZE = 64;
+
+// the images the viewer loads, compressed as texture_compress does by default
+static const char *const TEXTURES[] = { "./src/textures/texture3.jpg", "./src/textures/texture4.jpg",
+                                        "./src/textures/texture5.jpg", "./src/textures/texture6.jpg" };
+static const char *const SKYBOX[] = { "./src/skybox/skyrender0001.bmp", "./src/skybox/skyrender0002.bmp",
+                                      "./src/skybox/skyrender0003.bmp", "./src/skybox/skyrender0004.bmp",
+                                      "./src/skybox/skyrender0005.bmp" };
+
+// The file next to the dataset that holds the hash of a layer's base level and the import parameters. The steps
+// that derive from a layer read its stamp instead of the whole dataset, so they are only rebuilt when that layer
+// changes and not when another map is edited.
+static std::string layerStampPath(const std::string &path, int layer)
+{
+    return bakedPathFor(path, std::string(LAYER_NAMES[layer]) + "_stamp", ".txt");
+}
+
+// the first channel of 8 or 16 bit heights to 16 bit, material channels to 8 bit, alpha opaque where missing,
+// and the layer stamps of the result
+static bool importDataset(const std::string &path, const std::string &parameters, JobSystem &jobs)
+{
+    RasterReader readers[3];
+    TerrainDatasetDesc desc;
+    desc.heightOffset = HEIGHT_OFFSET;
+    desc.heightScale = HEIGHT_SCALE;
+    for (int i = 0; i < 3; i++)
+    {
+        if (!readers[i].Open(TERRAIN_MAPS[i]) || (i > 0 && (readers[i].Info().width != desc.width ||
+                                                            readers[i].Info().height != desc.height)))
+        {
+            printf("cannot import %s: %s\n", TERRAIN_MAPS[i], readers[i].Error() ? readers[i].Error() : "size differs");
+            return false;
+        }
+        desc.width = readers[i].Info().width;
+        desc.height = readers[i].Info().height;
+        TerrainLayerDesc layer;
+        layer.name = LAYER_NAMES[i];
+        layer.format = LAYER_FORMATS[i];
+        desc.layers.push_back(layer);
+    }
+
+    TerrainDatasetWriter writer;
+    if (!writer.Create(path, desc))
+        return false;
+    bool ok = true;
+    uint64_t hashes[3] = { 0, 0, 0 };
+    for (int i = 0; i < 3 && ok; i++)
+    {
+        const RasterInfo &info = readers[i].Info();
+        int channels = terrainFormatChannels(LAYER_FORMATS[i]);
+        std::vector<unsigned char> out((size_t)info.width * terrainTexelBytes(LAYER_FORMATS[i]));
+        TerrainPyramidBuilder builder(writer, i, 4, &jobs);
+        ok = readers[i].Read([&](const unsigned char *row, int)
+        {
+            for (int x = 0; x < info.width; x++)
+                for (int c = 0; c < channels; c++)
+                {
+                    int source = std::min(c, info.channels - 1);
+                    unsigned int value = info.type == RASTER_U16 ? ((const uint16_t*)row)[(size_t)x * info.channels + source]
+                                                                 : row[(size_t)x * info.channels + source] * 257u;
+                    if (LAYER_FORMATS[i] == TERRAIN_R16)
+                        ((uint16_t*)&out[0])[x] = (uint16_t)value;
+                    else
+                        out[(size_t)x * channels + c] = c == 3 && info.channels < 4 ? 255 : (unsigned char)(value >> 8);
+                }
+            builder.AddRow(&out[0]);
+            hashes[i] = hashBytes(&out[0], out.size(), hashes[i]);
+        }) && builder.Done();
+    }
+    if (!writer.Finish() || !ok)
+        return false;
+    for (int i = 0; i < 3; i++)
+    {
+        std::ofstream stamp(layerStampPath(path, i).c_str(), std::ios::trunc);
+        stamp << LAYER_NAMES[i] << " " << std::hex << hashes[i] << std::dec << " " << desc.width << "x"
+              << desc.height << " " << parameters << "\n";
+        if (!stamp)
+            return false;
+    }
+    return true;
+}
+
+// The heights and blend map of the baked dataset, loaded by the first step that needs them. Those steps run after
+// the dataset step, so they see the dataset it wrote.
+class BakedGround
+{
+public:
+    HeightField field;
+    std::vector<uint8_t> blend;  // RGBA, the size of the field
+
+    explicit BakedGround(const std::string &path) : path(path), loaded(false), ok(false)
+    {
+    }
+
+    bool Load()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!loaded)
+        {
+            loaded = true;
+            ok = dataset.Open(path) && field.Load(dataset, dataset.FindLayer("height")) &&
+                 dataset.ReadLevel(0, dataset.FindLayer("blend"), blend);
+            if (!ok)
+                printf("cannot load the heights and blend map of %s\n", path.c_str());
+        }
+        return ok;
+    }
+
+private:
+    std::string path;
+    std::mutex mutex;
+    bool loaded, ok;
+    TerrainDataset dataset;
+};
+
+static bool compressTexture(JobSystem &jobs, const std::string &path, GLenum format, bool mipmaps)
+{
+    int width, height, channels;
+    unsigned char *pixels = stbi_load(path.c_str(), &width, &height, &channels, 4);
+    if (!pixels)
+    {
+        printf("%s: failed to load (%s)\n", path.c_str(), stbi_failure_reason());
+        return false;
+    }
+    std::vector<std::vector<unsigned char> > levels;
+    compressImageLevels(jobs, format, pixels, width, height, mipmaps, levels);
+    stbi_image_free(pixels);
+    return writeKtx(ktxPathFor(path), format, width, height, levels);
+}
+
+static std::string settingsText(const PathCostSettings &settings)
+{
+    std::ostringstream text;
+    text << "slope " << settings.maxSlope << " " << settings.slopeCost << " water " << settings.maxWater
+         << " materials";
+    for (int i = 0; i < 4; i++)
+        text << " " << settings.materialCost[i];
+    return text.str();
+}
+
+static const char *stateName(BakeState state)
+{
+    switch (state)
+    {
+    case BAKE_UP_TO_DATE:
+        return "up to date";
+    case BAKE_BUILT:
+        return "built";
+    case BAKE_FAILED:
+        return "FAILED";
+    case BAKE_SKIPPED:
+        return "skipped";
+    default:
+        return "pending";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string terrainPath = "./cache/terrain.terrain";
+    bool force = false, textures = true;
+    unsigned int threads = JobSystem::DefaultWorkerCount();
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--terrain") == 0 && i + 1 < argc)
+            terrainPath = argv[++i];
+        else if (strcmp(argv[i], "--force") == 0)
+            force = true;
+        else if (strcmp(argv[i], "--no-textures") == 0)
+            textures = false;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = (unsigned int)atoi(argv[++i]);
+        else
+        {
+            printf("usage: %s [--terrain out.terrain] [--force] [--no-textures] [--threads N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (terrainPath.find_last_of("/\\") != std::string::npos &&
+        !makeDirectory(terrainPath.substr(0, terrainPath.find_last_of("/\\"))))
+    {
+        printf("cannot create the directory of %s\n", terrainPath.c_str());
+        return 1;
+    }
+
+    JobSystem jobs(threads);
+    BakedGround ground(terrainPath);
+    PathCostSettings pathSettings;
+    BakeGraph graph(bakedPathFor(terrainPath, "manifest", ".txt"));
+
+    BakeStep dataset;
+    dataset.name = "dataset";
+    dataset.inputs.assign(TERRAIN_MAPS, TERRAIN_MAPS + 3);
+    dataset.outputs.push_back(terrainPath);
+    for (int i = 0; i < 3; i++)
+        dataset.outputs.push_back(layerStampPath(terrainPath, i));
+    std::ostringstream datasetParameters;
+    datasetParameters << "version " << TERRAIN_VERSION << " tile 256 border 2 heights " << HEIGHT_OFFSET << " "
+                      << HEIGHT_SCALE;
+    dataset.parameters = datasetParameters.str();
+    dataset.run = [&]() { return importDataset(terrainPath, dataset.parameters, jobs); };
+    graph.Add(dataset);
+
+    std::string normalsPath = bakedPathFor(terrainPath, "normals");
+    BakeStep normals;
+    normals.name = "normals";
+    normals.inputs.push_back(layerStampPath(terrainPath, 0));
+    normals.outputs.push_back(normalsPath);
+    normals.parameters = "version " + std::to_string(TerrainNormalBaker::VERSION);
+    normals.run = [&]()
+    {
+        TerrainNormalBaker baker(normalsPath);
+        return ground.Load() && baker.Bake(ground.field, &jobs) && fileExists(normalsPath);
+    };
+    graph.Add(normals);
+
+    std::string raysPath = bakedPathFor(terrainPath, "rays");
+    BakeStep rays;
+    rays.name = "rays";
+    rays.inputs.push_back(layerStampPath(terrainPath, 0));
+    rays.outputs.push_back(raysPath);
+    rays.parameters = "version " + std::to_string(HeightRayCaster::VERSION);
+    rays.run = [&]()
+    {
+        if (!ground.Load())
+            return false;
+        HeightRayCaster caster(ground.field, &jobs);
+        return caster.Write(raysPath);
+    };
+    graph.Add(rays);
+
+    std::string pathsPath = bakedPathFor(terrainPath, "paths");
+    BakeStep paths;
+    paths.name = "paths";
+    paths.inputs.push_back(layerStampPath(terrainPath, 0));
+    paths.inputs.push_back(layerStampPath(terrainPath, 1));
+    paths.outputs.push_back(pathsPath);
+    paths.parameters = "version " + std::to_string(TerrainPathfinder::VERSION) + " cluster " +
+                       std::to_string(PATH_CLUSTER_SIZE) + " " + settingsText(pathSettings);
+    paths.run = [&]()
+    {
+        if (!ground.Load())
+            return false;
+        TerrainPathfinder pathfinder(ground.field, &ground.blend[0], 4, pathSettings, &jobs, PATH_CLUSTER_SIZE);
+        return pathfinder.Write(pathsPath);
+    };
+    graph.Add(paths);
+
+    if (textures)
+    {
+        std::vector<std::pair<std::string, bool> > images;  // path and whether it has mipmaps, as the viewer loads it
+        for (size_t i = 0; i < sizeof(TEXTURES) / sizeof(TEXTURES[0]); i++)
+            images.push_back(std::make_pair(std::string(TEXTURES[i]), true));
+        for (size_t i = 0; i < sizeof(SKYBOX) / sizeof(SKYBOX[0]); i++)
+            images.push_back(std::make_pair(std::string(SKYBOX[i]), false));
+        for (size_t i = 0; i < images.size(); i++)
+        {
+            std::string image = images[i].first;
+            bool mipmaps = images[i].second;
+            GLenum format = compressedFormatForPath(image);
+            BakeStep texture;
+            texture.name = "texture " + image;
+            texture.inputs.push_back(image);
+            texture.outputs.push_back(ktxPathFor(image));
+            texture.parameters = std::string(compressedFormatName(format)) + (mipmaps ? " mipmaps" : "");
+            texture.run = [&jobs, image, format, mipmaps]() { return compressTexture(jobs, image, format, mipmaps); };
+            graph.Add(texture);
+        }
+    }
+
+    if (force)
+        for (size_t i = 0; i < graph.Steps(); i++)
+            for (size_t o = 0; o < graph.Step(i).outputs.size(); o++)
+                remove(graph.Step(i).outputs[o].c_str());
+
+    bool ok = graph.Run(jobs, force);
+    for (size_t i = 0; i < graph.Steps(); i++)
+    {
+        const BakeResult &result = graph.Result(i);
+        printf("%-40s %-10s", graph.Step(i).name.c_str(), stateName(result.state));
+        if (result.state == BAKE_BUILT)
+            printf(" %9.1f ms, %s", result.ms, result.reason.c_str());
+        else if (result.state != BAKE_UP_TO_DATE)
+            printf(" %s", result.reason.c_str());
+        printf("\n");
+    }
+    printf("%u built, %u up to date, %u failed, %u skipped in %.1f ms with %u threads\n", graph.built, graph.upToDate,
+           graph.failed, graph.skipped, graph.runMs, jobs.NumThreads());
+    return ok ? 0 : 1;
+}
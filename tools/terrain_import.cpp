@@ -0,0 +1,332 @@
+// Imports heightmaps and material maps of any size into a terrain dataset (see terrain_dataset.h) with bounded
+// memory, for DEMs far too large to decode in one piece.
+//
+// usage: terrain_import [options] heights.png|tif|raw -o out.terrain
+//   --raw WxH u8|u16|i16|f32       the heights are headerless samples, little endian unless --big-endian
+//   --layer NAME r8|rg8|rgba8 IMAGE adds a material layer, the image has the size of the heights
+//   --tile N --border N             tile size (256) and border texels (2)
+//   --height-offset H --height-scale S --texel-size S
+//                                   world height of sample 0 and of the full range, world units per texel.
+//                                   i16 and f32 heights are world heights, their range is measured unless given.
+//   --memory MB                     cap on the pyramid buffers and read strips (256)
+//   --threads N                     job system workers
+//
+// Rows are read in strips and fed to a TerrainPyramidBuilder per layer, which writes each band of tiles as soon
+// as it is complete and downsamples it into the next level on the job system. Only the rows the next bands need
+// stay in memory, so the cap only has to cover a few hundred rows of the widest level.
+
+#include <job_system.h>
+#include <process_memory.h>
+#include <raster_reader.h>
+#include <terrain_dataset.h>
+
+#include "bench.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static double mebibytes(uint64_t bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+struct LayerSource {
+    TerrainLayerDesc desc;
+    std::string path;
+};
+
+// first sample of texel x of a row as a double, for the height conversion
+static double sampleAt(const unsigned char *row, const RasterInfo &info, int x)
+{
+    size_t index = (size_t)x * info.channels;
+    switch (info.type)
+    {
+    case RASTER_U8:
+        return row[index];
+    case RASTER_U16:
+        return ((const uint16_t*)row)[index];
+    case RASTER_I16:
+        return ((const int16_t*)row)[index];
+    default:
+        return ((const float*)row)[index];
+    }
+}
+
+// lowest and highest finite height of a raster, a pass over the whole file
+static bool measureRange(RasterReader &reader, double &low, double &high)
+{
+    low = 1e300;
+    high = -1e300;
+    const RasterInfo &info = reader.Info();
+    bool ok = reader.Read([&](const unsigned char *row, int)
+    {
+        for (int x = 0; x < info.width; x++)
+        {
+            double value = sampleAt(row, info, x);
+            if (std::isfinite(value))
+            {
+                low = std::min(low, value);
+                high = std::max(high, value);
+            }
+        }
+    });
+    return ok && low <= high;
+}
+
+// heights of the first channel as 16 bit samples; 8 and 16 bit samples are taken as they are, world heights are
+// mapped from [offset, offset + scale], missing (NaN) heights become the lowest
+static void convertHeights(const unsigned char *row, const RasterInfo &info, double offset, double scale, uint16_t *out)
+{
+    for (int x = 0; x < info.width; x++)
+    {
+        double value = sampleAt(row, info, x);
+        if (info.type == RASTER_U8)
+            out[x] = (uint16_t)(value * 257.0);
+        else if (info.type == RASTER_U16)
+            out[x] = (uint16_t)value;
+        else
+        {
+            double normalised = std::isfinite(value) ? (value - offset) / scale : 0.0;
+            out[x] = (uint16_t)(std::min(std::max(normalised, 0.0), 1.0) * 65535.0 + 0.5);
+        }
+    }
+}
+
+// 8 or 16 bit texels to the channels of a material layer, grey fills red, green and blue, alpha defaults to opaque
+static void convertMaterial(const unsigned char *row, const RasterInfo &info, int channels, unsigned char *out)
+{
+    for (int x = 0; x < info.width; x++)
+        for (int c = 0; c < channels; c++)
+        {
+            int source = c < info.channels ? c : (c < 3 && info.channels < 3 ? 0 : -1);
+            unsigned char value = 255;
+            if (source >= 0 && info.type == RASTER_U8)
+                value = row[(size_t)x * info.channels + source];
+            else if (source >= 0)
+                value = (unsigned char)(((const uint16_t*)row)[(size_t)x * info.channels + source] >> 8);
+            out[(size_t)x * channels + c] = value;
+        }
+}
+
+static bool parseType(const std::string &name, RasterSampleType &type)
+{
+    static const char *names[] = { "u8", "u16", "i16", "f32" };
+    for (int i = 0; i < 4; i++)
+        if (name == names[i])
+        {
+            type = (RasterSampleType)i;
+            return true;
+        }
+    return false;
+}
+
+static bool parseFormat(const std::string &name, TerrainLayerFormat &format)
+{
+    if (name == "r8")
+        format = TERRAIN_R8;
+    else if (name == "rg8")
+        format = TERRAIN_RG8;
+    else if (name == "rgba8")
+        format = TERRAIN_RGBA8;
+    else
+        return false;
+    return true;
+}
+
+static void usage()
+{
+    printf("usage: terrain_import [--raw WxH u8|u16|i16|f32] [--big-endian] [--layer NAME r8|rg8|rgba8 IMAGE]...\n"
+           "                      [--tile N] [--border N] [--height-offset H] [--height-scale S] [--texel-size S]\n"
+           "                      [--memory MB] [--threads N] heights.png|tif|raw -o out.terrain\n");
+}
+
+int main(int argc, char **argv)
+{
+    TerrainDatasetDesc desc;
+    std::vector<LayerSource> sources(1);
+    sources[0].desc.name = "height";
+    sources[0].desc.format = TERRAIN_R16;
+    std::string output;
+    int rawWidth = 0, rawHeight = 0;
+    RasterSampleType rawType = RASTER_U16;
+    bool bigEndian = false;
+    bool haveOffset = false, haveScale = false;
+    size_t memoryCap = (size_t)256 << 20;
+    unsigned int threads = JobSystem::DefaultWorkerCount();
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--raw" && i + 2 < argc)
+        {
+            valid = sscanf(argv[i + 1], "%dx%d", &rawWidth, &rawHeight) == 2 && rawWidth > 0 && rawHeight > 0 &&
+                    parseType(argv[i + 2], rawType);
+            i += 2;
+        }
+        else if (arg == "--big-endian")
+            bigEndian = true;
+        else if (arg == "--layer" && i + 3 < argc)
+        {
+            LayerSource layer;
+            layer.desc.name = argv[i + 1];
+            layer.path = argv[i + 3];
+            valid = parseFormat(argv[i + 2], layer.desc.format);
+            sources.push_back(layer);
+            i += 3;
+        }
+        else if (arg == "--tile" && i + 1 < argc)
+            desc.tileSize = atoi(argv[++i]);
+        else if (arg == "--border" && i + 1 < argc)
+            desc.border = atoi(argv[++i]);
+        else if (arg == "--height-offset" && i + 1 < argc)
+        {
+            desc.heightOffset = (float)atof(argv[++i]);
+            haveOffset = true;
+        }
+        else if (arg == "--height-scale" && i + 1 < argc)
+        {
+            desc.heightScale = (float)atof(argv[++i]);
+            haveScale = true;
+        }
+        else if (arg == "--texel-size" && i + 1 < argc)
+            desc.texelSize = (float)atof(argv[++i]);
+        else if (arg == "--memory" && i + 1 < argc)
+            memoryCap = (size_t)atoi(argv[++i]) << 20;
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = (unsigned int)atoi(argv[++i]);
+        else if (arg == "-o" && i + 1 < argc)
+            output = argv[++i];
+        else if (sources[0].path.empty() && arg[0] != '-')
+            sources[0].path = arg;
+        else
+            valid = false;
+    }
+    if (!valid || sources[0].path.empty() || output.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    Clock::time_point start = Clock::now();
+    size_t baseline = peakResidentBytes();
+    std::vector<RasterReader> readers(sources.size());
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        bool opened = i == 0 && rawWidth > 0 ? readers[i].OpenRaw(sources[i].path, rawWidth, rawHeight, rawType, bigEndian)
+                                             : readers[i].Open(sources[i].path);
+        if (!opened)
+        {
+            printf("%s: %s\n", sources[i].path.c_str(), readers[i].Error());
+            return 1;
+        }
+        const RasterInfo &info = readers[i].Info();
+        if (i > 0 && (info.width != readers[0].Info().width || info.height != readers[0].Info().height ||
+                      (info.type != RASTER_U8 && info.type != RASTER_U16)))
+        {
+            printf("%s: material layers need 8 or 16 bit samples and the size of the heights\n", sources[i].path.c_str());
+            return 1;
+        }
+    }
+    const RasterInfo &heights = readers[0].Info();
+    desc.width = heights.width;
+    desc.height = heights.height;
+
+    // world heights are mapped onto the 16 bit range, measured first unless it is given
+    if ((heights.type == RASTER_I16 || heights.type == RASTER_F32) && !(haveOffset && haveScale))
+    {
+        double low, high;
+        if (!measureRange(readers[0], low, high))
+        {
+            printf("%s: %s\n", sources[0].path.c_str(), readers[0].Error() ? readers[0].Error() : "no finite heights");
+            return 1;
+        }
+        if (!haveOffset)
+            desc.heightOffset = (float)low;
+        if (!haveScale)
+            desc.heightScale = (float)std::max(high - desc.heightOffset, 1e-6);
+        printf("heights %.3f to %.3f\n", low, high);
+    }
+    for (size_t i = 0; i < sources.size(); i++)
+        desc.layers.push_back(sources[i].desc);
+
+    TerrainDatasetWriter writer;
+    if (!writer.Create(output, desc))
+    {
+        printf("%s: cannot create a %dx%d dataset with %d texel tiles\n", output.c_str(), desc.width, desc.height,
+               desc.tileSize);
+        return 1;
+    }
+    const TerrainFileHeader &header = writer.Header();
+    printf("%dx%d, %u levels, %llu tiles of %ux%u texels, %zu layers\n", header.width, header.height, header.levels,
+           (unsigned long long)header.tileCount, header.TileDim(), header.TileDim(), sources.size());
+
+    // as many tile rows per band as fit, then the read strip gets what is left, up to 1024 rows
+    std::vector<int> batches(sources.size(), 1);
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        const RasterInfo &info = readers[i].Info();
+        size_t fixed = (size_t)header.width * terrainTexelBytes(header.layer[i].format) + 64 * info.RowBytes();
+        int &batch = batches[i];
+        while (batch < (int)header.level[0].tilesY &&
+               TerrainPyramidBuilder::MemoryFor(header, (int)i, batch * 2, threads + 1) + fixed <= memoryCap)
+            batch *= 2;
+        size_t needed = TerrainPyramidBuilder::MemoryFor(header, (int)i, batch, threads + 1) + fixed;
+        if (needed > memoryCap)
+        {
+            printf("%s: needs at least %.0f MiB of memory, raise --memory\n", sources[i].path.c_str(), mebibytes(needed) + 1);
+            return 1;
+        }
+        readers[i].SetStripRows((int)std::min((memoryCap - needed) / info.RowBytes() + 64, (size_t)1024));
+    }
+
+    JobSystem jobs(threads);
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        RasterReader &reader = readers[i];
+        const RasterInfo &info = reader.Info();
+        size_t rowBytes = (size_t)header.width * terrainTexelBytes(header.layer[i].format);
+        int batch = batches[i];
+        TerrainPyramidBuilder builder(writer, (int)i, batch, &jobs);
+        std::vector<unsigned char> converted(rowBytes);
+        int channels = terrainFormatChannels(header.layer[i].format);
+        double offset = desc.heightOffset, scale = desc.heightScale;
+        Clock::time_point layerStart = Clock::now();
+        bool ok = reader.Read([&](const unsigned char *row, int)
+        {
+            if (i == 0)
+                convertHeights(row, info, offset, scale, (uint16_t*)&converted[0]);
+            else
+                convertMaterial(row, info, channels, &converted[0]);
+            builder.AddRow(&converted[0]);
+        });
+        if (!ok || !builder.Done())
+        {
+            printf("%s: %s\n", sources[i].path.c_str(), !ok ? reader.Error() : "cannot write the dataset");
+            return 1;
+        }
+        printf("  %-10s %-40s %d tile rows per band, %.1f s\n", header.layer[i].name, sources[i].path.c_str(), batch,
+               millisecondsSince(layerStart) / 1000.0);
+    }
+    if (!writer.Finish())
+    {
+        printf("%s: cannot write the dataset\n", output.c_str());
+        return 1;
+    }
+
+    double seconds = millisecondsSince(start) / 1000.0;
+    uint64_t bytesIn = 0;
+    for (size_t i = 0; i < readers.size(); i++)
+        bytesIn += readers[i].BytesRead();
+    int64_t modified, bytesOut = 0;
+    fileStatus(output, modified, bytesOut);
+    size_t peak = peakResidentBytes();
+    printf("read %.1f MiB, wrote %.1f MiB in %.2f s: %.1f MB/s in, %.1f MB/s out\n", mebibytes(bytesIn),
+           mebibytes(bytesOut), seconds, bytesIn / 1e6 / seconds, bytesOut / 1e6 / seconds);
+    printf("peak resident memory %.1f MiB (%.1f MiB above the start), cap %.0f MiB\n", mebibytes(peak),
+           mebibytes(peak > baseline ? peak - baseline : 0), mebibytes(memoryCap));
+    return 0;
+}
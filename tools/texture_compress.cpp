@@ -0,0 +1,121 @@
+// Offline block compression of textures. Every image is written as a .ktx file next to it (see ktxPathFor()),
+// with its full mip chain; the TextureRegistry and the AssetLoader pick those up instead of the image.
+//
+// usage: texture_compress [--format auto|bc1|bc4|bc5|bc7] [--no-mips] [--threads N] image...
+//
+// auto picks the format from the file name:
+//   *height*, *specular*   BC4, red channel
+//   *normal*               BC5, red and blue channel (x and z of the normal map, the shader rebuilds y)
+//   *sky*                  BC1
+//   anything else          BC7
+//
+// Blocks are encoded in parallel by rows on the job system. The error of the base level is measured by decoding
+// the result again.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <job_system.h>
+#include <ktx_file.h>
+#include <texture_compression.h>
+#include <texture_upload.h>
+
+#include "bench.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static GLenum formatFromName(const std::string &name)
+{
+    if (name == "bc1")
+        return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    if (name == "bc4")
+        return GL_COMPRESSED_RED_RGTC1;
+    if (name == "bc5")
+        return GL_COMPRESSED_RG_RGTC2;
+    if (name == "bc7")
+        return GL_COMPRESSED_RGBA_BPTC_UNORM;
+    return 0;
+}
+
+static bool compressImage(JobSystem &jobs, const std::string &path, GLenum format, bool mipmaps)
+{
+    Clock::time_point start = Clock::now();
+    int width, height, channels;
+    unsigned char *pixels = stbi_load(path.c_str(), &width, &height, &channels, 4);
+    if (!pixels)
+    {
+        printf("%s: failed to load (%s)\n", path.c_str(), stbi_failure_reason());
+        return false;
+    }
+    if (format == 0)
+        format = compressedFormatForPath(path);
+
+    std::vector<std::vector<unsigned char> > encoded;
+    double baseError = compressImageLevels(jobs, format, pixels, width, height, mipmaps, encoded);
+    stbi_image_free(pixels);
+    unsigned int levels = (unsigned int)encoded.size();
+
+    std::string outPath = ktxPathFor(path);
+    if (!writeKtx(outPath, format, width, height, encoded))
+    {
+        printf("%s: failed to write %s\n", path.c_str(), outPath.c_str());
+        return false;
+    }
+
+    size_t sourceBytes = mipChainSize(width, height, compressedChannels(format), levels);
+    size_t compressedBytes = 0;
+    for (unsigned int l = 0; l < levels; l++)
+        compressedBytes += encoded[l].size();
+    double ms = millisecondsSince(start);
+    double rmse = std::sqrt(baseError);
+    printf("%s -> %s\n  %s %dx%d, %u levels, %.1f MiB -> %.1f MiB, rmse %.2f (psnr %.1f dB), %.0f ms, %.1f Mpixel/s\n",
+           path.c_str(), outPath.c_str(), compressedFormatName(format), width, height, levels,
+           sourceBytes / (1024.0 * 1024.0), compressedBytes / (1024.0 * 1024.0), rmse,
+           rmse > 0.0 ? 20.0 * std::log10(255.0 / rmse) : 99.0, ms, (double)width * height / (ms * 1000.0));
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    GLenum format = 0;
+    bool mipmaps = true;
+    unsigned int threads = JobSystem::DefaultWorkerCount();
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            format = formatFromName(name);
+            if (format == 0 && name != "auto")
+            {
+                printf("unknown format %s\n", name.c_str());
+                return 1;
+            }
+        }
+        else if (arg == "--no-mips")
+            mipmaps = false;
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = (unsigned int)atoi(argv[++i]);
+        else
+            inputs.push_back(arg);
+    }
+    if (inputs.empty())
+    {
+        printf("usage: texture_compress [--format auto|bc1|bc4|bc5|bc7] [--no-mips] [--threads N] image...\n");
+        return 1;
+    }
+
+    JobSystem jobs(threads);
+    int failed = 0;
+    for (size_t i = 0; i < inputs.size(); i++)
+        if (!compressImage(jobs, inputs[i], format, mipmaps))
+            failed++;
+    return failed == 0 ? 0 : 1;
+}
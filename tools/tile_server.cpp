@@ -0,0 +1,260 @@
+// A small HTTP/1.1 file server standing in for the tile server, so that fetching terrain and textures over
+// HTTP (TileFetcher with an http:// source) can be tried and measured without one.
+//
+// usage: tile_server [options]
+//   --root DIR          directory served, the repository root by default (.)
+//   --port N            port to listen on (8080)
+//   --bind ADDRESS      IPv4 address to listen on, 127.0.0.1 by default so that only this machine is served;
+//                       0.0.0.0 serves the root to every host that can reach this one
+//   --latency MS        delay before each response, a stand-in for the distance to a real server
+//   --bandwidth MB/s    cap on the response rate of each connection
+//
+// GET and HEAD with at most one byte range ("Range: bytes=first-last", "first-" or "-suffix") answered 206,
+// anything else about ranges 200 with the whole file. Connections are kept alive and served on a thread each.
+// Run the engine with --source http://localhost:8080/ to fetch everything through it.
+
+#include <mapped_file.h>
+#include <tile_fetch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#endif
+
+struct ServerOptions {
+    std::string root;
+    std::string bind;
+    int port;
+    int latencyMs;
+    double bandwidth;   // bytes per second, 0 is unlimited
+};
+
+static std::atomic<uint64_t> requestsServed(0);
+static std::atomic<uint64_t> bytesServed(0);
+
+static bool sendAll(SocketHandle socket, const char *data, size_t size, double bandwidth)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    Clock::time_point start = Clock::now();
+    size_t total = size;
+    while (size > 0)
+    {
+        // 64 KiB at a time, throttled to the bandwidth
+        int sent = (int)send(socket, data, (int)std::min(size, (size_t)65536), SOCKET_SEND_FLAGS);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        size -= (size_t)sent;
+        if (bandwidth > 0.0)
+        {
+            std::chrono::duration<double> due((total - size) / bandwidth);
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(due));
+        }
+    }
+    return true;
+}
+
+static bool respond(SocketHandle socket, int status, const char *reason, const std::string &extra,
+                    const unsigned char *body, uint64_t size, bool head, bool keepAlive, double bandwidth)
+{
+    char header[512];
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %d %s\r\nContent-Length: %llu\r\nAccept-Ranges: bytes\r\n%sConnection: %s\r\n\r\n",
+                          status, reason, (unsigned long long)size, extra.c_str(), keepAlive ? "keep-alive" : "close");
+    if (!sendAll(socket, header, (size_t)length, 0.0))
+        return false;
+    requestsServed++;
+    if (head || size == 0)
+        return true;
+    bytesServed += size;
+    return sendAll(socket, (const char*)body, (size_t)size, bandwidth);
+}
+
+// bytes=first-last, bytes=first- or bytes=-suffix against a file of size bytes, false if not satisfiable
+static bool parseRange(const std::string &value, uint64_t size, uint64_t &first, uint64_t &last)
+{
+    if (value.compare(0, 6, "bytes=") != 0 || value.find(',') != std::string::npos)
+        return false;
+    const char *text = value.c_str() + 6;
+    char *end = 0;
+    if (*text == '-')
+    {
+        uint64_t suffix = strtoull(text + 1, &end, 10);
+        if (suffix == 0 || size == 0)
+            return false;
+        first = size - std::min(suffix, size);
+        last = size - 1;
+        return true;
+    }
+    first = strtoull(text, &end, 10);
+    if (end == text || *end != '-')
+        return false;
+    const char *rest = end + 1;
+    last = *rest ? strtoull(rest, &end, 10) : size - 1;
+    last = std::min(last, size - 1);
+    return size > 0 && first <= last;
+}
+
+static std::string headerValue(const std::string &lowerHeaders, const std::string &headers, const char *name)
+{
+    size_t field = lowerHeaders.find(std::string("\r\n") + name + ":");
+    if (field == std::string::npos)
+        return std::string();
+    size_t begin = field + strlen(name) + 3;
+    size_t end = headers.find("\r\n", begin);
+    while (begin < end && headers[begin] == ' ')
+        begin++;
+    return headers.substr(begin, end - begin);
+}
+
+static void serveConnection(SocketHandle socket, const ServerOptions &options)
+{
+    std::string pending;
+    char buffer[8192];
+    for (;;)
+    {
+        size_t headerEnd;
+        while ((headerEnd = pending.find("\r\n\r\n")) == std::string::npos)
+        {
+            int received = (int)recv(socket, buffer, sizeof(buffer), 0);
+            if (received <= 0 || pending.size() > 65536)
+            {
+                closeSocket(socket);
+                return;
+            }
+            pending.append(buffer, (size_t)received);
+        }
+        std::string headers = pending.substr(0, headerEnd + 2);
+        pending.erase(0, headerEnd + 4);
+        std::string lower(headers);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+        char method[16], target[2048], version[16];
+        if (sscanf(headers.c_str(), "%15s %2047s HTTP/%15s", method, target, version) != 3)
+            break;
+        bool keepAlive = strcmp(version, "1.0") != 0 && headerValue(lower, lower, "connection") != "close";
+        bool head = strcmp(method, "HEAD") == 0;
+        if (options.latencyMs > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.latencyMs));
+
+        std::string path(target);
+        size_t query = path.find('?');
+        if (query != std::string::npos)
+            path.erase(query);
+        bool ok;
+        MappedFile file;
+        if (!head && strcmp(method, "GET") != 0)
+            ok = respond(socket, 405, "Method Not Allowed", "", 0, 0, false, keepAlive, 0.0);
+        else if (path.empty() || path[0] != '/' || path.find("..") != std::string::npos ||
+                 path.find('\\') != std::string::npos ||
+                 !file.Open(options.root + path))
+            ok = respond(socket, 404, "Not Found", "", 0, 0, head, keepAlive, 0.0);
+        else
+        {
+            std::string range = headerValue(lower, headers, "range");
+            uint64_t first = 0, last = 0;
+            if (range.empty())
+                ok = respond(socket, 200, "OK", "", file.Data(), file.Size(), head, keepAlive, options.bandwidth);
+            else if (parseRange(range, file.Size(), first, last))
+            {
+                char contentRange[128];
+                snprintf(contentRange, sizeof(contentRange), "Content-Range: bytes %llu-%llu/%llu\r\n",
+                         (unsigned long long)first, (unsigned long long)last, (unsigned long long)file.Size());
+                ok = respond(socket, 206, "Partial Content", contentRange, file.Data() + first, last - first + 1,
+                             head, keepAlive, options.bandwidth);
+            }
+            else
+            {
+                char contentRange[128];
+                snprintf(contentRange, sizeof(contentRange), "Content-Range: bytes */%llu\r\n",
+                         (unsigned long long)file.Size());
+                ok = respond(socket, 416, "Range Not Satisfiable", contentRange, 0, 0, head, keepAlive, 0.0);
+            }
+        }
+        if (!ok || !keepAlive)
+            break;
+    }
+    closeSocket(socket);
+}
+
+int main(int argc, char **argv)
+{
+    ServerOptions options;
+    options.root = ".";
+    options.bind = "127.0.0.1";
+    options.port = 8080;
+    options.latencyMs = 0;
+    options.bandwidth = 0.0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--root") == 0 && i + 1 < argc)
+            options.root = argv[++i];
+        else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc)
+            options.bind = argv[++i];
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+            options.port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+            options.latencyMs = std::max(atoi(argv[++i]), 0);
+        else if (strcmp(argv[i], "--bandwidth") == 0 && i + 1 < argc)
+            options.bandwidth = std::max(atof(argv[++i]), 0.0) * 1024.0 * 1024.0;
+        else
+        {
+            fprintf(stderr, "usage: %s [--root DIR] [--port N] [--bind ADDRESS] [--latency MS] [--bandwidth MB/s]\n", argv[0]);
+            return 1;
+        }
+    }
+    while (options.root.size() > 1 && options.root[options.root.size() - 1] == '/')
+        options.root.erase(options.root.size() - 1);
+
+#ifdef _WIN32
+    WSADATA data;
+    WSAStartup(MAKEWORD(2, 2), &data);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    SocketHandle listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)options.port);
+    if (inet_pton(AF_INET, options.bind.c_str(), &address.sin_addr) != 1)
+    {
+        fprintf(stderr, "cannot bind to %s, not an IPv4 address\n", options.bind.c_str());
+        return 1;
+    }
+    if (listener == INVALID_SOCKET_HANDLE || bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 64) != 0)
+    {
+        fprintf(stderr, "cannot listen on %s port %d\n", options.bind.c_str(), options.port);
+        return 1;
+    }
+    printf("serving %s on http://%s:%d/ (latency %d ms, bandwidth %s)\n", options.root.c_str(), options.bind.c_str(),
+           options.port, options.latencyMs, options.bandwidth > 0.0 ? "capped" : "unlimited");
+    fflush(stdout);
+
+    unsigned int connections = 0;
+    for (;;)
+    {
+        SocketHandle client = accept(listener, 0, 0);
+        if (client == INVALID_SOCKET_HANDLE)
+            continue;
+        int noDelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+        std::thread(serveConnection, client, options).detach();
+        if (++connections % 16 == 0)
+            printf("%u connections, %llu requests, %.1f MiB served\n", connections,
+                   (unsigned long long)requestsServed.load(), bytesServed.load() / (1024.0 * 1024.0));
+    }
+}
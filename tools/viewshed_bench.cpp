@@ -0,0 +1,152 @@
+// Measures Viewshed: one and many observers spread over the terrain, on the calling thread alone and over the job
+// system, and checks the ring sweep against exact R3 line of sight (every sample crossing on the way, interpolated)
+// for a sample of the terrain around the first observer.
+//
+// usage: viewshed_bench [--observers N] [--iterations N] [--threads N] [--radius R] [file.terrain]
+//
+// Without a dataset a 3840 x 1910 field of summed sine waves, the size of the bundled terrain, is used. Observers
+// stand two units above the ground and look for targets on it; --radius limits how far they see, in world units.
+// Every measurement runs N times and the fastest run is reported.
+
+#include <viewshed.h>
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+static float heightOf(const HeightField &field, int x, int y)
+{
+    return field.HeightOffset() + field.Sample(x, y) * (field.HeightScale() / 65535.0f);
+}
+
+// R3: the steepest slope over every crossing of the line of sight with a row or column of samples on the major axis,
+// the height there interpolated between the two samples it passes
+static bool seenExactly(const HeightField &field, int ox, int oy, float eye, int tx, int ty, float target)
+{
+    int dx = tx - ox, dy = ty - oy;
+    int steps = std::max(std::abs(dx), std::abs(dy));
+    if (steps == 0)
+        return true;
+    double horizon = -1e30;
+    for (int k = 1; k < steps; k++)
+    {
+        double x = ox + (double)dx * k / steps, y = oy + (double)dy * k / steps;
+        double h;
+        if (std::abs(dx) >= std::abs(dy))
+        {
+            int y0 = (int)std::floor(y);
+            double f = y - y0;
+            h = heightOf(field, (int)std::lround(x), y0) * (1.0 - f) + heightOf(field, (int)std::lround(x), y0 + 1) * f;
+        }
+        else
+        {
+            int x0 = (int)std::floor(x);
+            double f = x - x0;
+            h = heightOf(field, x0, (int)std::lround(y)) * (1.0 - f) + heightOf(field, x0 + 1, (int)std::lround(y)) * f;
+        }
+        horizon = std::max(horizon, (h - eye) / std::sqrt((x - ox) * (x - ox) + (y - oy) * (y - oy)));
+    }
+    return (heightOf(field, tx, ty) + target - eye) / std::sqrt((double)dx * dx + (double)dy * dy) >= horizon;
+}
+
+int main(int argc, char **argv)
+{
+    int observerCount = 32;
+    int iterations = 3;
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    float radius = 0.0f;
+    std::string path;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--observers") == 0 && i + 1 < argc)
+            observerCount = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = (unsigned int)std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+            radius = (float)std::max(atof(argv[++i]), 0.0);
+        else if (argv[i][0] != '-' && path.empty())
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--observers N] [--iterations N] [--threads N] [--radius R] [file.terrain]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    HeightField field;
+    if (!loadOrSynthesizeField(path, field))
+        return 1;
+
+    JobSystem jobs(threads);
+    Clock::time_point start = Clock::now();
+    Viewshed viewshed(field, &jobs);
+    printf("%d x %d samples, %s, heights copied in %.1f ms\n", field.Width(), field.Height(), Viewshed::SimdPath(),
+           millisecondsSince(start));
+
+    // observers scattered over the middle of the terrain
+    float extentX = field.Width() * field.TexelSize() * 0.4f, extentZ = field.Height() * field.TexelSize() * 0.4f;
+    std::vector<ViewshedObserver> all(observerCount);
+    uint32_t state = 12345u;
+    for (int i = 0; i < observerCount; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        all[i].position.x = ((state >> 8) / 16777216.0f * 2.0f - 1.0f) * extentX;
+        state = state * 1664525u + 1013904223u;
+        all[i].position.y = ((state >> 8) / 16777216.0f * 2.0f - 1.0f) * extentZ;
+        all[i].height = 2.0f;
+        all[i].radius = radius;
+    }
+
+    std::vector<ViewshedObserver> one(1, all[0]);
+    std::vector<uint8_t> serial;
+    const int counts[] = { 1, observerCount };
+    for (int c = 0; c < (observerCount > 1 ? 2 : 1); c++)
+    {
+        std::vector<ViewshedObserver> observers(all.begin(), all.begin() + counts[c]);
+        printf("%d observer%s\n", counts[c], counts[c] > 1 ? "s" : "");
+        double alone = best(iterations, [&]() { viewshed.Compute(observers, 0.0f); });
+        serial.assign(viewshed.Raster(), viewshed.Raster() + (size_t)field.Width() * field.Height());
+        double parallel = best(iterations, [&]() { viewshed.Compute(observers, 0.0f, &jobs); });
+        bool same = memcmp(&serial[0], viewshed.Raster(), serial.size()) == 0;
+        printf("  calling thread        %8.2f ms\n", alone);
+        printf("  %2u workers            %8.2f ms, %s\n", jobs.NumWorkers(), parallel,
+               same ? "same raster" : "RASTER DIFFERS");
+        printf("  %.1f%% of the terrain seen, %.1f MiB\n", 100.0 * viewshed.visibleSamples / serial.size(),
+               viewshed.Bytes() / (1024.0 * 1024.0));
+    }
+
+    // exact line of sight for every 37th sample within reach of the first observer
+    viewshed.Compute(one, 0.0f, &jobs);
+    float invTexel = 1.0f / field.TexelSize();
+    int ox = (int)std::floor(one[0].position.x * invTexel + field.Width() * 0.5f);
+    int oy = (int)std::floor(one[0].position.y * invTexel + field.Height() * 0.5f);
+    float eye = heightOf(field, ox, oy) + one[0].height;
+    float reach = radius > 0.0f ? radius * invTexel : 1e30f;
+    size_t checked = 0, agree = 0, falseVisible = 0;
+    for (size_t i = 0; i < serial.size(); i += 37)
+    {
+        int x = (int)(i % field.Width()), y = (int)(i / field.Width());
+        if ((float)((x - ox) * (x - ox) + (y - oy) * (y - oy)) > reach * reach)
+            continue;
+        bool exact = seenExactly(field, ox, oy, eye, x, y, 0.0f);
+        bool swept = viewshed.Raster()[i] != 0;
+        checked++;
+        agree += exact == swept;
+        falseVisible += swept && !exact;
+    }
+    printf("against R3 on %u samples: %.2f%% agree, %.2f%% wrongly visible, %.2f%% wrongly hidden\n",
+           (unsigned int)checked, 100.0 * agree / checked, 100.0 * falseVisible / checked,
+           100.0 * (checked - agree - falseVisible) / checked);
+    return 0;
+}